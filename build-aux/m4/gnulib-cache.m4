@@ -27,7 +27,7 @@
 
 
 # Specification in the form of a command-line invocation:
-#   gnulib-tool --import --local-dir=build-aux/gl --lib=libgnu --source-base=m4/gnu --m4-base=build-aux/m4 --doc-base=doc --tests-base=tests/gnu --aux-dir=build-aux --with-tests --with-c++-tests --no-conditional-dependencies --libtool --macro-prefix=M4 assert autobuild avltree-oset binary-io bitrotate clean-temp cloexec close-stream closein config-h configmake dirname error execute fclose fdl-1.3 fflush filenamecat flexmember fopen fopen-safer freadptr freadseek fseeko gendocs gettext git-version-gen gitlog-to-changelog gnumakefile gnupload gpl-3.0 intprops inttypes maintainer-makefile manywarnings memchr2 memcmp2 memmem mkstemp obstack obstack-printf-posix progname propername quote regex regexprops-generic rename setenv sigpipe snprintf-posix spawn-pipe sprintf-posix stdbool stdlib-safer strnlen strtod tempname unlocked-io unsetenv update-copyright vasnprintf-posix verify verror wait-process xalloc xalloc-die xmemdup0 xoset xprintf-posix xstrndup xvasprintf-posix
+#   gnulib-tool --import --local-dir=build-aux/gl --lib=libgnu --source-base=m4/gnu --m4-base=build-aux/m4 --doc-base=doc --tests-base=tests/gnu --aux-dir=build-aux --with-tests --with-c++-tests --no-conditional-dependencies --libtool --macro-prefix=M4 assert autobuild avltree-oset binary-io bitrotate clean-temp cloexec close-stream closedir closein config-h configmake dirent dirname environ error execute fclose fdl-1.3 fflush filenamecat flexmember fopen fopen-safer freadptr freadseek fseeko full-read full-write gendocs gethrxtime gettext git-version-gen gitlog-to-changelog gnumakefile gnupload gpl-3.0 intprops inttypes maintainer-makefile manywarnings memchr2 memcmp2 memmem mkstemp obstack obstack-printf-posix opendir progname propername quote readdir regex regexprops-generic rename setenv sigpipe snprintf-posix spawn-pipe sprintf-posix stat-time stdbool stdlib-safer strnlen strtod tempname unlocked-io unsetenv update-copyright vasnprintf-posix verify verror wait-process xalloc xalloc-die xmemdup0 xoset xprintf-posix xstrndup xvasprintf-posix
 
 # Specification in the form of a few gnulib-tool.m4 macro invocations:
 gl_LOCAL_DIR([build-aux/gl])
@@ -40,10 +40,13 @@ gl_MODULES([
   clean-temp
   cloexec
   close-stream
+  closedir
   closein
   config-h
   configmake
+  dirent
   dirname
+  environ
   error
   execute
   fclose
@@ -56,7 +59,10 @@ gl_MODULES([
   freadptr
   freadseek
   fseeko
+  full-read
+  full-write
   gendocs
+  gethrxtime
   gettext
   git-version-gen
   gitlog-to-changelog
@@ -65,6 +71,7 @@ gl_MODULES([
   gpl-3.0
   intprops
   inttypes
+  lock
   maintainer-makefile
   manywarnings
   memchr2
@@ -73,9 +80,12 @@ gl_MODULES([
   mkstemp
   obstack
   obstack-printf-posix
+  opendir
+  poll
   progname
   propername
   quote
+  readdir
   regex
   regexprops-generic
   rename
@@ -84,11 +94,14 @@ gl_MODULES([
   snprintf-posix
   spawn-pipe
   sprintf-posix
+  stat-time
   stdbool
   stdlib-safer
   strnlen
   strtod
   tempname
+  thread
+  tls
   unlocked-io
   unsetenv
   update-copyright
@@ -25,6 +25,8 @@
 
 #include "m4private.h"
 #include "close-stream.h"
+#include "gethrxtime.h"
+#include "quotearg.h"
 
 static void set_debug_file (m4 *, const m4_call_info *, FILE *);
 
@@ -114,6 +116,10 @@ m4_debug_decode (m4 *context, const char *opts, size_t len)
                level |= M4_DEBUG_TRACE_OUTPUT_DUMPDEF;
                break;
 
+            case 'r':
+              level |= M4_DEBUG_TRACE_REGEXP;
+              break;
+
             case 'V':
               level |= M4_DEBUG_TRACE_VERBOSE;
               break;
@@ -207,6 +213,7 @@ m4_debug_set_output (m4 *context, const m4_call_info *caller, const char *name)
       fp = fopen (name, "a");
       if (fp == NULL)
         return false;
+      m4_path_cache_flush (context);
 
       if (set_cloexec_flag (fileno (fp), true) != 0)
         m4_warn (context, errno, caller,
@@ -258,3 +265,460 @@ m4_debug_message (m4 *context, int mode, const char *format, ...)
       putc ('\n', m4_get_debug_file (context));
     }
 }
+
+
+
+/* The profiler started by --profile keeps one entry per macro name,
+   updated by expand_macro around each call.  A call is timed from the
+   start of argument collection until the macro has produced its
+   expansion; rescanning that expansion happens after the call
+   returns, and is charged to whichever call is collecting arguments
+   at the time.  Exclusive time omits the calls nested within
+   argument collection, and inclusive time of a recursive macro is
+   only counted for its outermost active call.  For the folded
+   format, each distinct stack of active calls also gets a node,
+   which accumulates the exclusive time spent with that stack.  */
+
+typedef struct profile_entry profile_entry;
+typedef struct profile_node profile_node;
+typedef struct profile_frame profile_frame;
+
+struct profile_entry
+{
+  m4_string name;               /* Macro name, also the hash key.  */
+  size_t calls;                 /* Number of calls.  */
+  size_t active;                /* Number of calls in progress.  */
+  xtime_t inclusive;            /* Time including nested calls.  */
+  xtime_t exclusive;            /* Time excluding nested calls.  */
+  uintmax_t arg_bytes;          /* Total length of collected arguments.  */
+  uintmax_t expansion_bytes;    /* Total length of expansions.  */
+};
+
+struct profile_node
+{
+  profile_node *parent;         /* Caller's node, or NULL at top level.  */
+  profile_entry *entry;         /* Macro called with this stack.  */
+  xtime_t exclusive;            /* Time spent with exactly this stack.  */
+};
+
+struct profile_frame
+{
+  profile_entry *entry;         /* Macro being called.  */
+  profile_node *node;           /* Stack of the call, or NULL.  */
+  xtime_t start;                /* When the call started.  */
+  xtime_t nested;               /* Time spent in nested calls so far.  */
+};
+
+struct m4__profile
+{
+  char *file;                   /* Report destination, or NULL.  */
+  bool folded;                  /* True for folded stack output.  */
+  m4_hash *entries;             /* Maps names to profile_entry.  */
+  m4_hash *nodes;               /* Maps profile_node to itself.  */
+  profile_frame *stack;         /* Calls in progress.  */
+  size_t depth;                 /* Number of calls in progress.  */
+  size_t alloc;                 /* Allocated length of stack.  */
+};
+
+static size_t
+profile_node_hash (const void *key)
+{
+  const profile_node *node = (const profile_node *) key;
+  return (size_t) node->parent * 31 + (size_t) node->entry;
+}
+
+static int
+profile_node_cmp (const void *key, const void *try)
+{
+  const profile_node *a = (const profile_node *) key;
+  const profile_node *b = (const profile_node *) try;
+  return !(a->parent == b->parent && a->entry == b->entry);
+}
+
+/* Start profiling macro calls in CONTEXT, to be reported by
+   m4_profile_finish to FILE, or to stderr if FILE is NULL.  If
+   FOLDED, write one line per distinct call stack in the folded format
+   read by flame graph tools, rather than a table sorted by time.  */
+void
+m4_profile_start (m4 *context, const char *file, bool folded)
+{
+  m4__profile *profile = (m4__profile *) xzalloc (sizeof *profile);
+
+  assert (!context->profile);
+  profile->file = file ? xstrdup (file) : NULL;
+  profile->folded = folded;
+  profile->entries = m4_hash_new (0, m4_hash_string_hash,
+                                  m4_hash_string_cmp);
+  if (folded)
+    profile->nodes = m4_hash_new (0, profile_node_hash, profile_node_cmp);
+  context->profile = profile;
+}
+
+/* Record the start of a call to the macro NAME of length LEN.  */
+void
+m4__profile_enter (m4 *context, const char *name, size_t len)
+{
+  m4__profile *profile = context->profile;
+  profile_frame *frame;
+  profile_entry *entry;
+  m4_string key;
+  void **slot;
+
+  key.str = (char *) name;
+  key.len = len;
+  slot = m4_hash_lookup (profile->entries, &key);
+  if (slot)
+    entry = (profile_entry *) *slot;
+  else
+    {
+      entry = (profile_entry *) xzalloc (sizeof *entry);
+      entry->name.str = xmemdup0 (name, len);
+      entry->name.len = len;
+      m4_hash_insert (profile->entries, &entry->name, entry);
+    }
+  entry->calls++;
+  entry->active++;
+
+  if (profile->depth == profile->alloc)
+    profile->stack = (profile_frame *) x2nrealloc (profile->stack,
+                                                   &profile->alloc,
+                                                   sizeof *profile->stack);
+  frame = &profile->stack[profile->depth++];
+  frame->entry = entry;
+  frame->node = NULL;
+  frame->nested = 0;
+  if (profile->nodes)
+    {
+      profile_node probe;
+      probe.parent = profile->depth < 2 ? NULL : frame[-1].node;
+      probe.entry = entry;
+      slot = m4_hash_lookup (profile->nodes, &probe);
+      if (slot)
+        frame->node = (profile_node *) *slot;
+      else
+        {
+          frame->node = (profile_node *) xmemdup (&probe, sizeof probe);
+          frame->node->exclusive = 0;
+          m4_hash_insert (profile->nodes, frame->node, frame->node);
+        }
+    }
+  frame->start = gethrxtime ();
+}
+
+/* Record the end of the most recent call still in progress, which
+   collected ARG_BYTES bytes of arguments and produced EXPANSION_BYTES
+   bytes of expansion.  */
+void
+m4__profile_leave (m4 *context, size_t arg_bytes, size_t expansion_bytes)
+{
+  m4__profile *profile = context->profile;
+  xtime_t now = gethrxtime ();
+  profile_frame *frame;
+  xtime_t elapsed;
+
+  assert (profile->depth);
+  frame = &profile->stack[--profile->depth];
+  elapsed = now - frame->start;
+  frame->entry->exclusive += elapsed - frame->nested;
+  if (!--frame->entry->active)
+    frame->entry->inclusive += elapsed;
+  frame->entry->arg_bytes += arg_bytes;
+  frame->entry->expansion_bytes += expansion_bytes;
+  if (frame->node)
+    frame->node->exclusive += elapsed - frame->nested;
+  if (profile->depth)
+    frame[-1].nested += elapsed;
+}
+
+/* Append NAME of length LEN to OBS, escaping backslash and control
+   characters, and for the folded format also the stack separator and
+   space, so that every name is read back as a single frame.  */
+static void
+profile_grow_name (m4_obstack *obs, const char *name, size_t len,
+                   bool folded)
+{
+  for ( ; len--; name++)
+    {
+      unsigned char ch = *name;
+      if (ch == '\\' || ch < ' ' || ch == 0x7f
+          || (folded && (ch == ';' || ch == ' ')))
+        obstack_printf (obs, "\\%03o", ch);
+      else
+        obstack_1grow (obs, ch);
+    }
+}
+
+static void
+profile_grow_node (m4_obstack *obs, const profile_node *node)
+{
+  if (node->parent)
+    {
+      profile_grow_node (obs, node->parent);
+      obstack_1grow (obs, ';');
+    }
+  profile_grow_name (obs, node->entry->name.str, node->entry->name.len,
+                     true);
+}
+
+/* Order report lines by decreasing exclusive time, then by name.  */
+static int
+profile_entry_cmp (const void *a, const void *b)
+{
+  const profile_entry *x = *(const profile_entry *const *) a;
+  const profile_entry *y = *(const profile_entry *const *) b;
+  if (x->exclusive != y->exclusive)
+    return x->exclusive < y->exclusive ? 1 : -1;
+  return m4_hash_string_cmp (&x->name, &y->name);
+}
+
+static int
+profile_line_cmp (const void *a, const void *b)
+{
+  return strcmp (*(char *const *) a, *(char *const *) b);
+}
+
+/* Write the report of the profile started by m4_profile_start, if
+   any, and stop profiling.  Calls still in progress, as when m4exit
+   is used, are ended first.  Return false after reporting an error
+   if the report could not be written.  */
+bool
+m4_profile_finish (m4 *context)
+{
+  m4__profile *profile = context->profile;
+  m4_hash_iterator *place = NULL;
+  m4_obstack obs;
+  void **lines;
+  size_t count = 0;
+  size_t i;
+  FILE *fp;
+  bool result = true;
+
+  if (!profile)
+    return true;
+  while (profile->depth)
+    m4__profile_leave (context, 0, 0);
+
+  obstack_init (&obs);
+  if (profile->folded)
+    {
+      lines = XNMALLOC (m4_get_hash_length (profile->nodes), void *);
+      while ((place = m4_get_hash_iterator_next (profile->nodes, place)))
+        {
+          const profile_node *node
+            = (profile_node *) m4_get_hash_iterator_value (place);
+          profile_grow_node (&obs, node);
+          obstack_printf (&obs, " %jd", (intmax_t) (node->exclusive / 1000));
+          obstack_1grow (&obs, '\0');
+          lines[count++] = obstack_finish (&obs);
+        }
+      qsort (lines, count, sizeof *lines, profile_line_cmp);
+    }
+  else
+    {
+      lines = XNMALLOC (m4_get_hash_length (profile->entries), void *);
+      while ((place = m4_get_hash_iterator_next (profile->entries, place)))
+        lines[count++] = m4_get_hash_iterator_value (place);
+      qsort (lines, count, sizeof *lines, profile_entry_cmp);
+      for (i = 0; i < count; i++)
+        {
+          const profile_entry *entry = (profile_entry *) lines[i];
+          obstack_printf (&obs, "%10zu %11.3f %11.3f %11ju %11ju  ",
+                          entry->calls, entry->inclusive / 1e6,
+                          entry->exclusive / 1e6, entry->arg_bytes,
+                          entry->expansion_bytes);
+          profile_grow_name (&obs, entry->name.str, entry->name.len, false);
+          obstack_1grow (&obs, '\0');
+          lines[i] = obstack_finish (&obs);
+        }
+    }
+
+  fp = profile->file ? fopen (profile->file, "w") : stderr;
+  if (!fp)
+    {
+      m4_error (context, 0, errno, NULL, _("cannot open profile file %s"),
+                quotearg_style (locale_quoting_style, profile->file));
+      result = false;
+    }
+  else
+    {
+      if (!profile->folded)
+        fprintf (fp, "%10s %11s %11s %11s %11s  %s\n", _("calls"),
+                 _("incl ms"), _("excl ms"), _("arg bytes"),
+                 _("exp bytes"), _("macro"));
+      for (i = 0; i < count; i++)
+        fprintf (fp, "%s\n", (char *) lines[i]);
+      if (fp == stderr ? fflush (fp) != 0 : close_stream (fp) != 0)
+        {
+          m4_error (context, 0, errno, NULL,
+                    _("error writing profile file %s"),
+                    quotearg_style (locale_quoting_style,
+                                    profile->file ? profile->file
+                                    : _("stderr")));
+          result = false;
+        }
+    }
+
+  free (lines);
+  obstack_free (&obs, NULL);
+  m4__profile_delete (profile);
+  context->profile = NULL;
+  return result;
+}
+
+static void *
+profile_entry_destroy_CB (m4_hash *hash, const void *key, void *value,
+                          void *ignored M4_GNUC_UNUSED)
+{
+  profile_entry *entry = (profile_entry *) value;
+
+  m4_hash_remove (hash, key);
+  free (entry->name.str);
+  free (entry);
+  return NULL;
+}
+
+static void *
+profile_node_destroy_CB (m4_hash *hash, const void *key, void *value,
+                         void *ignored M4_GNUC_UNUSED)
+{
+  m4_hash_remove (hash, key);
+  free (value);
+  return NULL;
+}
+
+/* Free the memory used by PROFILE, without reporting it.  */
+void
+m4__profile_delete (m4__profile *profile)
+{
+  m4_hash_apply (profile->entries, profile_entry_destroy_CB, NULL);
+  m4_hash_delete (profile->entries);
+  if (profile->nodes)
+    {
+      m4_hash_apply (profile->nodes, profile_node_destroy_CB, NULL);
+      m4_hash_delete (profile->nodes);
+    }
+  free (profile->stack);
+  free (profile->file);
+  free (profile);
+}
+
+
+
+/* The counters of --stats and m4stats are cheap enough to be kept
+   unconditionally: most are bumped where the event they count is
+   already being paid for, such as a chunk allocation or a diversion
+   spilled to disk.  A report gathers them into one m4__stats, and
+   names them after this table.  */
+
+static const struct
+{
+  const char *name;
+  size_t offset;
+} stats_fields[] =
+{
+  { "macro_calls",              offsetof (m4__stats, macro_calls) },
+  { "expansion_peak",           offsetof (m4__stats, expansion_peak) },
+  { "argv_refs",                offsetof (m4__stats, argv_refs) },
+  { "argv_ref_reuses",          offsetof (m4__stats, argv_ref_reuses) },
+  { "argv_flattens",            offsetof (m4__stats, argv_flattens) },
+  { "argv_compactions",         offsetof (m4__stats, argv_compactions) },
+  { "symtab_size",              offsetof (m4__stats, symtab.size) },
+  { "symtab_entries",           offsetof (m4__stats, symtab.length) },
+  { "symtab_load",              offsetof (m4__stats, symtab_load) },
+  { "symtab_lookups",           offsetof (m4__stats, symtab.lookups) },
+  { "symtab_probes",            offsetof (m4__stats, symtab.probes) },
+  { "symtab_longest_probe",     offsetof (m4__stats, symtab.longest_probe) },
+  { "regexp_hits",              offsetof (m4__stats, regexp_hits) },
+  { "regexp_misses",            offsetof (m4__stats, regexp_misses) },
+  { "diversion_spills",         offsetof (m4__stats, diversion_spills) },
+  { "diversion_reloads",        offsetof (m4__stats, diversion_reloads) },
+  { "obstack_chunks",           offsetof (m4__stats, obstack_chunks) },
+  { "obstack_reused",           offsetof (m4__stats, obstack_reused) },
+  { "obstack_peak",             offsetof (m4__stats, obstack_peak) },
+};
+
+#define STATS_VALUE(stats, i)                                           \
+  (*(const size_t *) ((const char *) (stats) + stats_fields[i].offset))
+
+/* Fill STATS with the current value of every counter of CONTEXT.  */
+static void
+stats_collect (m4 *context, m4__stats *stats)
+{
+  *stats = context->stats;
+  m4__macro_stats (context, stats);
+  m4__regexp_cache_stats (context->regexp_cache_table, stats);
+  m4__symtab_stats (context->symtab, &stats->symtab);
+  stats->symtab_load = stats->symtab.length * 100 / stats->symtab.size;
+}
+
+/* Return the name of counter N, or NULL if there are not that many,
+   so that callers can list them all.  */
+const char *
+m4_stats_name (size_t n)
+{
+  return n < sizeof stats_fields / sizeof *stats_fields
+    ? stats_fields[n].name : NULL;
+}
+
+/* Store the current value of the counter NAME of length LEN into
+   *VALUE, and return true; return false if there is no such
+   counter.  */
+bool
+m4_stats_get (m4 *context, const char *name, size_t len, size_t *value)
+{
+  m4__stats stats;
+  size_t i;
+
+  for (i = 0; i < sizeof stats_fields / sizeof *stats_fields; i++)
+    if (strlen (stats_fields[i].name) == len
+        && memcmp (stats_fields[i].name, name, len) == 0)
+      {
+        stats_collect (context, &stats);
+        *value = STATS_VALUE (&stats, i);
+        return true;
+      }
+  return false;
+}
+
+/* Arrange for m4_stats_finish to report the counters to stderr, as a
+   JSON object if JSON, or else as a table of names and values.  */
+void
+m4_stats_start (m4 *context, bool json)
+{
+  context->stats_report = true;
+  context->stats_json = json;
+}
+
+/* Write the report requested by m4_stats_start, if any, once.
+   Return false after reporting an error if it could not be
+   written.  */
+bool
+m4_stats_finish (m4 *context)
+{
+  m4__stats stats;
+  size_t count = sizeof stats_fields / sizeof *stats_fields;
+  size_t i;
+
+  if (!context->stats_report)
+    return true;
+  context->stats_report = false;
+  stats_collect (context, &stats);
+
+  if (context->stats_json)
+    fputs ("{\n", stderr);
+  for (i = 0; i < count; i++)
+    if (context->stats_json)
+      xfprintf (stderr, "  \"%s\": %zu%s\n", stats_fields[i].name,
+                STATS_VALUE (&stats, i), i + 1 < count ? "," : "");
+    else
+      xfprintf (stderr, "%-22s %zu\n", stats_fields[i].name,
+                STATS_VALUE (&stats, i));
+  if (context->stats_json)
+    fputs ("}\n", stderr);
+  if (fflush (stderr) != 0)
+    {
+      m4_error (context, 0, errno, NULL, _("error writing statistics"));
+      return false;
+    }
+  return true;
+}
@@ -20,7 +20,6 @@
 */
 
 /* TODO:
-   - Use an obstack to manage the node memory.
    - Implement the macroized magic values with the API.
  */
 
@@ -32,63 +31,84 @@
 #include "bitrotate.h"
 #include <limits.h>
 
-typedef struct hash_node hash_node;
+/* The table is a flat array of slots, probed linearly from the slot
+   selected by the low bits of the hash value.  Each slot caches the
+   full hash value of its key, so that most mismatches are rejected
+   without calling out to cmp_func, and no memory is allocated per
+   entry.  A slot with a NULL key is free: HASH_SLOT_EMPTY terminates
+   a probe sequence, while HASH_SLOT_DELETED marks a removed entry
+   that later probes must skip over.  Deleted slots are never moved
+   or reused while an iterator is active, so removing the entry an
+   iterator is visiting is safe.  */
+
+typedef struct hash_slot hash_slot;
 
 struct m4_hash
 {
-  size_t size;                  /* number of buckets allocated */
+  size_t size;                  /* number of slots allocated */
   size_t length;                /* number of elements inserted */
+  size_t deleted;               /* number of deleted slots */
+  size_t lookups;               /* number of lookups by key */
+  size_t probes;                /* slots visited by those lookups */
+  size_t longest_probe;         /* most slots visited by one lookup */
   m4_hash_hash_func *hash_func;
   m4_hash_cmp_func *cmp_func;
-  hash_node **buckets;
+  hash_slot *slots;
 #ifndef NDEBUG
   m4_hash_iterator *iter;       /* current iterator */
 #endif
 };
 
-struct hash_node
+struct hash_slot
 {
-  hash_node *next;
-  const void *key;
+  size_t hash;                  /* cached hash_func of key, or slot state */
+  const void *key;              /* NULL if the slot is free */
   void *value;
 };
 
+/* States of a slot with a NULL key.  */
+#define HASH_SLOT_EMPTY         0
+#define HASH_SLOT_DELETED       1
+
 
 struct m4_hash_iterator
 {
-  const m4_hash *hash;          /* contains the buckets */
-  hash_node *   place;          /* the node we are about to return */
-  hash_node *   next;           /* the next node, incase PLACE is removed */
-  size_t        next_bucket;    /* the next bucket index following NEXT */
+  const m4_hash *hash;          /* contains the slots */
+  size_t        place;          /* the slot we are about to return */
+  size_t        next;           /* the slot index following PLACE */
 #ifndef NDEBUG
   m4_hash_iterator *chain;      /* multiple iterators visiting one hash */
 #endif
 };
 
-
+
 #define HASH_SIZE(hash)         ((hash)->size)
 #define HASH_LENGTH(hash)       ((hash)->length)
-#define HASH_BUCKETS(hash)      ((hash)->buckets)
+#define HASH_DELETED(hash)      ((hash)->deleted)
+#define HASH_LOOKUPS(hash)      ((hash)->lookups)
+#define HASH_PROBES(hash)       ((hash)->probes)
+#define HASH_LONGEST_PROBE(hash) ((hash)->longest_probe)
+#define HASH_SLOTS(hash)        ((hash)->slots)
 #define HASH_HASH_FUNC(hash)    ((hash)->hash_func)
 #define HASH_CMP_FUNC(hash)     ((hash)->cmp_func)
 
-#define NODE_NEXT(node)         ((node)->next)
-#define NODE_KEY(node)          ((node)->key)
-#define NODE_VALUE(node)        ((node)->value)
+#define SLOT_HASH(slot)         ((slot)->hash)
+#define SLOT_KEY(slot)          ((slot)->key)
+#define SLOT_VALUE(slot)        ((slot)->value)
 
 #define ITERATOR_HASH(i)        ((i)->hash)
 #define ITERATOR_PLACE(i)       ((i)->place)
 #define ITERATOR_NEXT(i)        ((i)->next)
-#define ITERATOR_NEXT_BUCKET(i) ((i)->next_bucket)
-
-/*#define ITERATOR_NEXT_NEXT(i)   NODE_NEXT (ITERATOR_PLACE (i))*/
 
-/* Helper macros. */
-#define BUCKET_NTH(hash, n)     (HASH_BUCKETS (hash)[n])
-#define BUCKET_COUNT(hash, key)                                 \
-        ((*HASH_HASH_FUNC (hash))(key) % HASH_SIZE (hash))
-#define BUCKET_KEY(hash, key)                                   \
-        (BUCKET_NTH ((hash), BUCKET_COUNT ((hash), (key))))
+/* Helper macros.  HASH sizes are always a power of 2.  */
+#define SLOT_NTH(hash, n)       (&HASH_SLOTS (hash)[n])
+#define SLOT_MASK(hash)         (HASH_SIZE (hash) - 1)
+#define SLOT_FREE_P(slot)       (SLOT_KEY (slot) == NULL)
+#define SLOT_EMPTY_P(slot)                                      \
+        (SLOT_FREE_P (slot) && SLOT_HASH (slot) == HASH_SLOT_EMPTY)
+#define SLOT_MATCH_P(hash, slot, h, key)                        \
+        (SLOT_HASH (slot) == (h) && !SLOT_FREE_P (slot)         \
+         && (*HASH_CMP_FUNC (hash)) (SLOT_KEY (slot), (key)) == 0)
 
 /* Debugging macros.  */
 #ifdef NDEBUG
@@ -99,24 +119,36 @@ struct m4_hash_iterator
 # define ITER_CHAIN(iter)       ((iter)->chain)
 #endif
 
-
-static void             bucket_insert   (m4_hash *hash, hash_node *bucket);
-static void             bucket_delete   (m4_hash *hash, size_t i);
-static hash_node *      node_new        (const void *key, void *value);
-static void             node_insert     (m4_hash *hash, hash_node *node);
-static hash_node *      node_lookup     (m4_hash *hash, const void *key);
-static void             node_delete     (m4_hash *hash, hash_node *node);
+
+static size_t           slot_count      (size_t size);
+static hash_slot *      slot_lookup     (m4_hash *hash, const void *key);
+static void             slot_insert     (m4_hash *hash, size_t h,
+                                         const void *key, void *value);
 static void             maybe_grow      (m4_hash *hash);
+static void             rehash          (m4_hash *hash, size_t size);
 
 
-
-static hash_node *free_list = NULL;
 
+/* Return the smallest power of 2 strictly greater than SIZE, so that
+   the traditional sizes of 1 less than a power of 2 map exactly onto
+   a table of SIZE + 1 slots.  */
+static size_t M4_GNUC_CONST
+slot_count (size_t size)
+{
+  size_t count = 8;
+
+  while (count <= size)
+    {
+      assert (count < SIZE_MAX / 2);
+      count *= 2;
+    }
+  return count;
+}
 
-
 /* Allocate and return a new, unpopulated but initialised m4_hash with
-   SIZE buckets, where HASH_FUNC will be used to generate bucket numbers
-   and CMP_FUNC will be called to compare keys.  */
+   room for about SIZE entries, where HASH_FUNC will be used to
+   generate slot numbers and CMP_FUNC will be called to compare
+   keys.  */
 m4_hash *
 m4_hash_new (size_t size, m4_hash_hash_func *hash_func,
              m4_hash_cmp_func *cmp_func)
@@ -130,10 +162,14 @@ m4_hash_new (size_t size, m4_hash_hash_func *hash_func,
     size = M4_HASH_DEFAULT_SIZE;
 
   hash                  = (m4_hash *) xmalloc (sizeof *hash);
-  HASH_SIZE (hash)      = size;
+  HASH_SIZE (hash)      = slot_count (size);
   HASH_LENGTH (hash)    = 0;
-  HASH_BUCKETS (hash)   = (hash_node **) xcalloc (size,
-                                                  sizeof *HASH_BUCKETS (hash));
+  HASH_DELETED (hash)   = 0;
+  HASH_LOOKUPS (hash)   = 0;
+  HASH_PROBES (hash)    = 0;
+  HASH_LONGEST_PROBE (hash) = 0;
+  HASH_SLOTS (hash)     = (hash_slot *) xcalloc (HASH_SIZE (hash),
+                                                 sizeof *HASH_SLOTS (hash));
   HASH_HASH_FUNC (hash) = hash_func;
   HASH_CMP_FUNC (hash)  = cmp_func;
 #ifndef NDEBUG
@@ -151,7 +187,7 @@ m4_hash_dup (m4_hash *src, m4_hash_copy_func *copy)
   assert (src);
   assert (copy);
 
-  dest = m4_hash_new (HASH_SIZE (src), HASH_HASH_FUNC (src),
+  dest = m4_hash_new (HASH_SIZE (src) - 1, HASH_HASH_FUNC (src),
                       HASH_CMP_FUNC (src));
 
   m4_hash_apply (src, (m4_hash_apply_func *) copy, dest);
@@ -159,212 +195,178 @@ m4_hash_dup (m4_hash *src, m4_hash_copy_func *copy)
   return dest;
 }
 
-/* Recycle each of the nodes in HASH onto the free list, and release
-   the rest of the memory used by the table.  Memory addressed by the
-   recycled nodes is _NOT_ freed: this needs to be done manually to
-   prevent memory leaks.  This is not safe to call while HASH is being
-   iterated.  */
+/* Release the memory used by the table.  Memory addressed by the keys
+   and values of HASH is _NOT_ freed: this needs to be done manually
+   to prevent memory leaks, by removing each entry first.  This is not
+   safe to call while HASH is being iterated.  */
 void
 m4_hash_delete (m4_hash *hash)
 {
-  size_t i;
-
   assert (hash);
   assert (!HASH_ITER (hash));
+  assert (HASH_LENGTH (hash) == 0);
 
-  for (i = 0; i < HASH_SIZE (hash); ++i)
-    if (BUCKET_NTH (hash, i))
-      bucket_delete (hash, i);
-  free (HASH_BUCKETS (hash));
+  free (HASH_SLOTS (hash));
   free (hash);
 }
 
-/* Check that the nodes in bucket I have been cleared, and recycle
-   each of the nodes in the bucket to the free list.  Bucket I must
-   not be empty when this function is called.  */
-static void
-bucket_delete (m4_hash *hash, size_t i)
-{
-  hash_node *node;
-
-  assert (hash);
-  assert (BUCKET_NTH (hash, i));
-  assert (i < HASH_SIZE (hash));
-
-  for (node = BUCKET_NTH (hash, i); node->next; node = NODE_NEXT (node))
-    {
-      assert (NODE_KEY (node) == NULL);
-      --HASH_LENGTH (hash);
-    }
-
-  assert (NODE_KEY (node) == NULL);
-  --HASH_LENGTH (hash);
-
-  NODE_NEXT (node)      = free_list;
-  free_list             = BUCKET_NTH (hash, i);
-  BUCKET_NTH (hash, i)  = NULL;
-}
-
-/* Create and initialise a new node with KEY and VALUE, by reusing a
-   node from the free list if possible.  */
-static hash_node *
-node_new (const void *key, void *value)
-{
-  hash_node *node = NULL;
-
-  if (free_list)
-    {
-      node = free_list;
-      free_list = NODE_NEXT (free_list);
-    }
-  else
-    node = (hash_node *) xmalloc (sizeof *node);
-
-  assert (node);
-
-  NODE_NEXT  (node)     = NULL;
-  NODE_KEY   (node)     = key;
-  NODE_VALUE (node)     = value;
-
-  return node;
-}
-
-/* Check that NODE has been cleared, and recycle it to the free list.  */
-static void
-node_delete (m4_hash *hash, hash_node *node)
-{
-  assert (node);
-  assert (NODE_KEY (node) == NULL);
-
-  NODE_NEXT (node)      = free_list;
-  free_list             = node;
-
-  --HASH_LENGTH (hash);
-}
-
-/* Create a new entry in HASH with KEY and VALUE, making use of nodes
-   in the free list if possible, and potentially growing the size of
-   the table if node density is too high.  This is not safe to call
-   while HASH is being iterated.  Currently, it is not safe to call
-   this if another entry already matches KEY.  */
+/* Create a new entry in HASH with KEY and VALUE, potentially growing
+   the size of the table if slot density is too high.  If another
+   entry already matches KEY, the new entry shadows it until removed.
+   This is not safe to call while HASH is being iterated.  */
 const void *
 m4_hash_insert (m4_hash *hash, const void *key, void *value)
 {
-  hash_node *node;
-
   assert (hash);
+  assert (key);
   assert (!HASH_ITER (hash));
 
-  node = node_new (key, value);
-  node_insert (hash, node);
+  slot_insert (hash, (*HASH_HASH_FUNC (hash)) (key), key, value);
   maybe_grow (hash);
 
   return key;
 }
 
-/* Push the unconnected NODE on to the front of the appropriate
-   bucket, effectively preventing retrieval of other nodes with
-   the same key (where "sameness" is determined by HASH's
-   cmp_func).  */
+/* Store KEY, with hash value H, and VALUE in HASH, effectively
+   preventing retrieval of other entries with the same key (where
+   "sameness" is determined by HASH's cmp_func).  Entries with equal
+   keys are kept in probe order youngest first, so the new entry
+   displaces the youngest existing match, which in turn displaces the
+   next match, and the oldest lands in the first free slot past
+   them.  */
 static void
-node_insert (m4_hash *hash, hash_node *node)
+slot_insert (m4_hash *hash, size_t h, const void *key, void *value)
 {
-  size_t n;
+  size_t mask = SLOT_MASK (hash);
+  size_t n = h & mask;
+  hash_slot *reuse = NULL;
+  hash_slot *slot;
 
-  assert (hash);
-  assert (node);
-  assert (NODE_NEXT (node) == NULL);
+  assert (HASH_LENGTH (hash) + HASH_DELETED (hash) < HASH_SIZE (hash));
+
+  for (slot = SLOT_NTH (hash, n); !SLOT_EMPTY_P (slot);
+       n = (n + 1) & mask, slot = SLOT_NTH (hash, n))
+    {
+      if (SLOT_FREE_P (slot))
+        {
+          if (!reuse)
+            reuse = slot;
+        }
+      else if (SLOT_MATCH_P (hash, slot, h, key))
+        {
+          const void *old_key = SLOT_KEY (slot);
+          void *old_value = SLOT_VALUE (slot);
+
+          SLOT_KEY (slot)       = key;
+          SLOT_VALUE (slot)     = value;
+          key                   = old_key;
+          value                 = old_value;
+          /* Only a free slot beyond the displaced entry will do.  */
+          reuse                 = NULL;
+        }
+    }
 
-  n = BUCKET_COUNT (hash, NODE_KEY (node));
-  NODE_NEXT (node)      = BUCKET_NTH (hash, n);
-  BUCKET_NTH (hash, n)  = node;
+  if (reuse)
+    {
+      slot = reuse;
+      --HASH_DELETED (hash);
+    }
+  SLOT_HASH (slot)      = h;
+  SLOT_KEY (slot)       = key;
+  SLOT_VALUE (slot)     = value;
 
   ++HASH_LENGTH (hash);
 }
 
-/* Remove from HASH, the first node with key KEY; comparing keys with
-   HASH's cmp_func.  Any nodes with the same KEY previously hidden by
-   the removed node will become visible again.  The key field of the
-   removed node is returned, or NULL if there was no match.  This is
-   unsafe if multiple iterators are visiting HASH, or when a lone
+/* Remove from HASH, the first entry with key KEY; comparing keys with
+   HASH's cmp_func.  Any entries with the same KEY previously hidden
+   by the removed entry will become visible again.  The key field of
+   the removed entry is returned, or NULL if there was no match.  This
+   is unsafe if multiple iterators are visiting HASH, or when a lone
    iterator is visiting on a different key.  */
 void *
 m4_hash_remove (m4_hash *hash, const void *key)
 {
-  size_t n;
-  hash_node *node = NULL;
+  hash_slot *slot;
 
 #ifndef NDEBUG
   m4_hash_iterator *iter = HASH_ITER (hash);
 
   assert (hash);
   if (HASH_ITER (hash))
-    {
-      assert (!ITER_CHAIN (iter));
-      assert (ITERATOR_PLACE (iter));
-    }
+    assert (!ITER_CHAIN (iter));
 #endif
 
-  n = BUCKET_COUNT (hash, key);
-  do
-    {
-      hash_node *next = node ? NODE_NEXT (node) : BUCKET_NTH (hash, n);
-
-      if (next && ((*HASH_CMP_FUNC (hash)) (NODE_KEY (next), key) == 0))
-        {
-          if (node)
-            NODE_NEXT (node) = NODE_NEXT (next);
-          else
-            BUCKET_NTH (hash, n) = NODE_NEXT (next);
+  slot = slot_lookup (hash, key);
+  if (!slot)
+    return NULL;
 
-          key = NODE_KEY (next);
 #ifndef NDEBUG
-          if (iter)
-            assert (ITERATOR_PLACE (iter) == next);
-          NODE_KEY (next) = NULL;
+  if (iter)
+    assert (SLOT_NTH ((m4_hash *) ITERATOR_HASH (iter),
+                      ITERATOR_PLACE (iter)) == slot);
 #endif
-          node_delete (hash, next);
-          return (void *) key; /* Cast away const.  */
-        }
-      node = next;
-    }
-  while (node);
 
-  return NULL;
+  /* Leave the value in place, so that callers holding the address
+     returned by m4_hash_lookup can still read it until the next
+     insertion.  */
+  key                   = SLOT_KEY (slot);
+  SLOT_KEY (slot)       = NULL;
+  SLOT_HASH (slot)      = HASH_SLOT_DELETED;
+  --HASH_LENGTH (hash);
+  ++HASH_DELETED (hash);
+
+  return (void *) key; /* Cast away const.  */
 }
 
-/* Return the address of the value field of the first node in HASH
+/* Return the address of the value field of the first entry in HASH
    that has a matching KEY.  The address is returned so that an
    explicit NULL value can be distinguished from a failed lookup (also
    NULL).  Fortuitously for M4, this also means that the value field
-   can be changed `in situ' to implement a value stack.  Safe to call
+   can be changed `in situ' to implement a value stack.  The address
+   remains valid until the next insertion into HASH.  Safe to call
    even when an iterator is in force.  */
 void **
 m4_hash_lookup (m4_hash *hash, const void *key)
 {
-  hash_node *node;
+  hash_slot *slot;
 
   assert (hash);
 
-  node = node_lookup (hash, key);
+  slot = slot_lookup (hash, key);
 
-  return node ? &NODE_VALUE (node) : NULL;
+  return slot ? &SLOT_VALUE (slot) : NULL;
 }
 
-/* Return the first node in HASH that has a matching KEY.  */
-static hash_node *
-node_lookup (m4_hash *hash, const void *key)
+/* Return the first slot in HASH that has a matching KEY.  */
+static hash_slot *
+slot_lookup (m4_hash *hash, const void *key)
 {
-  hash_node *node;
+  size_t h;
+  size_t mask;
+  size_t n;
+  size_t probes;
+  hash_slot *slot;
 
   assert (hash);
-
-  node = BUCKET_KEY (hash, key);
-
-  while (node && (*HASH_CMP_FUNC (hash)) (NODE_KEY (node), key))
-    node = NODE_NEXT (node);
-
-  return node;
+  assert (key);
+
+  h = (*HASH_HASH_FUNC (hash)) (key);
+  mask = SLOT_MASK (hash);
+  for (n = h & mask, slot = SLOT_NTH (hash, n); !SLOT_EMPTY_P (slot);
+       n = (n + 1) & mask, slot = SLOT_NTH (hash, n))
+    if (SLOT_MATCH_P (hash, slot, h, key))
+      break;
+
+  /* The distance from the home slot, wrapped by the mask, measures
+     the probe; an empty or matching slot ends it.  */
+  probes = ((n - h) & mask) + 1;
+  ++HASH_LOOKUPS (hash);
+  HASH_PROBES (hash) += probes;
+  if (HASH_LONGEST_PROBE (hash) < probes)
+    HASH_LONGEST_PROBE (hash) = probes;
+
+  return SLOT_EMPTY_P (slot) ? NULL : slot;
 }
 
 /* How many entries are currently contained by HASH.  Safe to call
@@ -377,113 +379,89 @@ m4_get_hash_length (m4_hash *hash)
   return HASH_LENGTH (hash);
 }
 
-#if 0
-/* Force the number of buckets to be the given value.  You probably ought
-   not to be using this function once the table has been in use, since
-   the maximum density algorithm will grow the number of buckets back to
-   what was there before if you try to shrink the table.  It is useful
-   to set a smaller or larger initial size if you know in advance what
-   order of magnitude of entries will be in the table.  Be aware that
-   the efficiency of the lookup and grow features require that the size
-   always be 1 less than a power of 2.  Unsafe if HASH is being visited
-   by an iterator.  */
+/* Fill STATS with the size and occupancy of HASH, and with the
+   probe lengths of the lookups made so far.  Safe to call even
+   during an iteration.  */
 void
-m4_hash_resize (m4_hash *hash, size_t size)
+m4_get_hash_stats (m4_hash *hash, m4_hash_stats *stats)
 {
-  hash_node **original_buckets;
-  size_t original_size;
-
   assert (hash);
-  assert (!HASH_ITER (hash));
-
-  original_size         = HASH_SIZE (hash);
-  original_buckets      = HASH_BUCKETS (hash);
 
-  HASH_SIZE (hash)      = size;
-  HASH_BUCKETS (hash)   = (hash_node **) xcalloc (size,
-                                                  sizeof *HASH_BUCKETS (hash));
-
-  {
-    size_t i;
-    for (i = 0; i < original_size; ++i)
-      if (original_buckets[i])
-        bucket_insert (hash, original_buckets[i]);
-  }
-
-  free (original_buckets);
+  stats->size           = HASH_SIZE (hash);
+  stats->length         = HASH_LENGTH (hash);
+  stats->lookups        = HASH_LOOKUPS (hash);
+  stats->probes         = HASH_PROBES (hash);
+  stats->longest_probe  = HASH_LONGEST_PROBE (hash);
 }
-#endif
 
-/* If the node density breaks the threshold, increase the size of
-   HASH and repopulate with the original nodes.  */
+/* If the slot density breaks the threshold, repopulate HASH with the
+   original entries, purging deleted slots, and doubling the size of
+   the table if the live entries alone are too dense.  */
 static void
 maybe_grow (m4_hash *hash)
 {
-  float nodes_per_bucket;
+  double limit;
 
   assert (hash);
 
-  nodes_per_bucket = (float) HASH_LENGTH (hash) / (float) HASH_SIZE (hash);
+  limit = (double) HASH_SIZE (hash) * M4_HASH_MAXIMUM_DENSITY;
 
-  if (nodes_per_bucket > (float) M4_HASH_MAXIMUM_DENSITY)
+  if ((double) (HASH_LENGTH (hash) + HASH_DELETED (hash)) > limit)
     {
-      size_t original_size = HASH_SIZE (hash);
-      hash_node **original_buckets = HASH_BUCKETS (hash);
-
-      /* HASH sizes are always 1 less than a power of 2.  */
-      HASH_SIZE (hash)    = (2 * (1 + original_size)) -1;
-      HASH_BUCKETS (hash) =
-        (hash_node **) xcalloc (HASH_SIZE (hash), sizeof *HASH_BUCKETS (hash));
-
-      {
-        size_t i;
-        for (i = 0; i < original_size; ++i)
-          if (original_buckets[i])
-            bucket_insert (hash, original_buckets[i]);
-      }
-
-      free (original_buckets);
+      size_t size = HASH_SIZE (hash);
+
+      if ((double) HASH_LENGTH (hash) * 2 > limit)
+        {
+          assert (size < SIZE_MAX / 2);
+          size *= 2;
+        }
+      rehash (hash, size);
     }
 }
 
-/* Insert each node in BUCKET into HASH.  Relative ordering of nodes
-   is not preserved.  This would need to change if we were to
-   guarantee relative ordering within a bucket for identical keys.  */
+/* Move every entry of HASH into a fresh array of SIZE slots.  Slots
+   are visited backwards from an empty slot, so that entries with
+   equal keys are reinserted oldest first, and slot_insert restores
+   their relative order.  */
 static void
-bucket_insert (m4_hash *hash, hash_node *bucket)
+rehash (m4_hash *hash, size_t size)
 {
-  assert (hash);
-  assert (bucket);
+  size_t original_size = HASH_SIZE (hash);
+  hash_slot *original_slots = HASH_SLOTS (hash);
+  size_t start;
+  size_t i;
 
-  do
-    {
-      hash_node *next = NODE_NEXT (bucket);
+  for (start = 0; !SLOT_EMPTY_P (&original_slots[start]); ++start)
+    assert (start < original_size - 1);
 
-      /* Break link to rest of the bucket before reinserting.  */
-      NODE_NEXT (bucket) = NULL;
-      node_insert (hash, bucket);
+  HASH_SIZE (hash)      = size;
+  HASH_LENGTH (hash)    = 0;
+  HASH_DELETED (hash)   = 0;
+  HASH_SLOTS (hash)     = (hash_slot *) xcalloc (size,
+                                                 sizeof *HASH_SLOTS (hash));
 
-      bucket = next;
+  for (i = 1; i <= original_size; ++i)
+    {
+      hash_slot *slot = &original_slots[(start + original_size - i)
+                                        & (original_size - 1)];
+      if (!SLOT_FREE_P (slot))
+        slot_insert (hash, SLOT_HASH (slot), SLOT_KEY (slot),
+                     SLOT_VALUE (slot));
     }
-  while (bucket);
+
+  free (original_slots);
 }
 
-/* Reclaim all memory used by free nodes.  Safe to call at any time,
-   although only worth calling at program shutdown to verify no
-   leaks.  */
+/* Historically, reclaimed all memory used by free nodes.  Entries now
+   live in the table itself, so there is nothing left to reclaim, but
+   this is still safe to call at any time.  */
 void
 m4_hash_exit (void)
 {
-  while (free_list)
-    {
-      hash_node *stale = free_list;
-      free_list = NODE_NEXT (stale);
-      free (stale);
-    }
 }
 
 
-
+
 /* Iterate over a given HASH.  Start with PLACE being NULL, then
    repeat with PLACE being the previous return value.  The return
    value is the current location of the iterator, or NULL when the
@@ -495,6 +473,8 @@ m4_hash_exit (void)
 m4_hash_iterator *
 m4_get_hash_iterator_next (const m4_hash *hash, m4_hash_iterator *place)
 {
+  size_t n;
+
   assert (hash);
   assert (!place || (ITERATOR_HASH (place) == hash));
 
@@ -509,49 +489,21 @@ m4_get_hash_iterator_next (const m4_hash *hash, m4_hash_iterator *place)
 #endif
     }
 
- next:
-  ITERATOR_PLACE (place) = ITERATOR_NEXT (place);
-
-  /* If there is another node in the current bucket, select it.  */
-  if (ITERATOR_NEXT (place) && NODE_NEXT (ITERATOR_NEXT (place)))
-    {
-      ITERATOR_NEXT (place) = NODE_NEXT (ITERATOR_NEXT (place));
-    }
-  else
-    {
-      /* Find the next non-empty bucket.  */
-      while ((ITERATOR_NEXT_BUCKET (place) < HASH_SIZE (hash))
-         && (BUCKET_NTH (hash, ITERATOR_NEXT_BUCKET (place)) == NULL))
-        {
-          ++ITERATOR_NEXT_BUCKET (place);
-        }
-
-      /* Select the first node in the new bucket.  */
-      if (ITERATOR_NEXT_BUCKET (place) < HASH_SIZE (hash))
-        {
-          ITERATOR_NEXT (place)
-            = BUCKET_NTH (hash, ITERATOR_NEXT_BUCKET (place));
-        }
-      else
-        ITERATOR_NEXT (place) = NULL;
-
-      /* Advance the `next' reference.  */
-      ++ITERATOR_NEXT_BUCKET (place);
-    }
+  /* Find the next occupied slot.  */
+  for (n = ITERATOR_NEXT (place); n < HASH_SIZE (hash); ++n)
+    if (!SLOT_FREE_P (SLOT_NTH ((m4_hash *) hash, n)))
+      break;
 
-  /* If there are no more nodes to return, recycle the iterator memory.  */
-  if (! (ITERATOR_PLACE (place) || ITERATOR_NEXT (place)))
+  /* If there are no more entries to return, recycle the iterator
+     memory.  */
+  if (n == HASH_SIZE (hash))
     {
       m4_free_hash_iterator (hash, place);
       return NULL;
     }
 
-  /* On the first call we need to put the 1st node in PLACE and
-     the 2nd node in NEXT.  */
-  if (ITERATOR_NEXT (place) && !ITERATOR_PLACE (place))
-    goto next;
-
-  assert (place && ITERATOR_PLACE (place));
+  ITERATOR_PLACE (place) = n;
+  ITERATOR_NEXT (place) = n + 1;
 
   return place;
 }
@@ -593,7 +545,8 @@ m4_get_hash_iterator_key (m4_hash_iterator *place)
 {
   assert (place);
 
-  return NODE_KEY (ITERATOR_PLACE (place));
+  return SLOT_KEY (SLOT_NTH ((m4_hash *) ITERATOR_HASH (place),
+                            ITERATOR_PLACE (place)));
 }
 
 /* Return the value being visited by the iterator PLACE.  */
@@ -602,7 +555,8 @@ m4_get_hash_iterator_value (m4_hash_iterator *place)
 {
   assert (place);
 
-  return NODE_VALUE (ITERATOR_PLACE (place));
+  return SLOT_VALUE (SLOT_NTH ((m4_hash *) ITERATOR_HASH (place),
+                              ITERATOR_PLACE (place)));
 }
 
 /* The following function is used for the cases where we want to do
@@ -641,21 +595,60 @@ m4_hash_apply (m4_hash *hash, m4_hash_apply_func *func, void *userdata)
    enough that we provide implementations here for use in client hash
    table routines.  */
 
-/* Return a hash value for a string, similar to gnulib's hash module,
-   but with length factored in.  */
+/* Return a hash value for LEN bytes at STR, similar to gnulib's hash
+   module, but with the length factored in.  */
 size_t M4_GNUC_PURE
-m4_hash_string_hash (const void *ptr)
+m4__hash_mem_bytewise (const char *str, size_t len)
 {
-  const m4_string *key = (const m4_string *) ptr;
-  const char *s = key->str;
-  size_t len = key->len;
   size_t val = len;
 
   while (len--)
-    val = rotl_sz (val, 7) + to_uchar (*s++);
+    val = rotl_sz (val, 7) + to_uchar (*str++);
   return val;
 }
 
+/* Return a hash value for LEN bytes at STR, consuming eight bytes at
+   a time with a multiply and xor-shift mix (after MurmurHash64A).
+   Bytes are loaded in host order, so values vary between platforms
+   and must not be saved anywhere.  */
+size_t M4_GNUC_PURE
+m4__hash_mem_wordwise (const char *str, size_t len)
+{
+  const uint_fast64_t mul = 0xc6a4a7935bd1e995ULL;
+  uint_fast64_t val = 0x9e3779b97f4a7c15ULL ^ (len * mul);
+  uint64_t word;
+
+  for (; len >= sizeof word; str += sizeof word, len -= sizeof word)
+    {
+      memcpy (&word, str, sizeof word);
+      word *= mul;
+      word ^= word >> 47;
+      word *= mul;
+      val = (val ^ word) * mul;
+    }
+  if (len)
+    {
+      word = 0;
+      memcpy (&word, str, len);
+      val = (val ^ word) * mul;
+    }
+
+  val ^= val >> 47;
+  val *= mul;
+  val ^= val >> 47;
+  return (size_t) val;
+}
+
+/* Return a hash value for an m4_string, using the hash function
+   selected by M4_HASH_WORDWISE.  */
+size_t M4_GNUC_PURE
+m4_hash_string_hash (const void *ptr)
+{
+  const m4_string *key = (const m4_string *) ptr;
+
+  return m4__hash_mem (key->str, key->len);
+}
+
 /* Comparison function for hash keys -- used by the underlying
    hash table ADT when searching for a key match during name lookup.  */
 int M4_GNUC_PURE
@@ -24,18 +24,29 @@
 
 #include <m4/system.h>
 
-/* Must be 1 less than a power of 2 for the resize algorithm to
-   be efficient.  */
+/* Table sizes are rounded up to the next power of 2 slots, so 1 less
+   than a power of 2 wastes no space.  */
 #define M4_HASH_DEFAULT_SIZE    511
 
-/* When the average number of values per bucket breaks this value
-   the table will be grown to reduce the density accordingly.  */
-#define M4_HASH_MAXIMUM_DENSITY 3.0
+/* When the fraction of slots occupied by values (or by the remains of
+   removed values) breaks this value the table will be rebuilt, and
+   grown if necessary, to reduce the density accordingly.  */
+#define M4_HASH_MAXIMUM_DENSITY 0.75
 
 BEGIN_C_DECLS
 
 typedef struct m4_hash m4_hash;
 
+/* Occupancy of a table, and the lookups made in it.  */
+typedef struct
+{
+  size_t size;                  /* number of slots allocated */
+  size_t length;                /* number of elements inserted */
+  size_t lookups;               /* number of lookups by key */
+  size_t probes;                /* slots visited by those lookups */
+  size_t longest_probe;         /* most slots visited by one lookup */
+} m4_hash_stats;
+
 typedef size_t  m4_hash_hash_func (const void *key);
 typedef int     m4_hash_cmp_func  (const void *key, const void *try);
 typedef void *  m4_hash_copy_func (m4_hash *src, const void *key, void *value,
@@ -48,6 +59,7 @@ extern void     m4_hash_delete  (m4_hash *hash);
 extern void     m4_hash_exit    (void);
 
 extern size_t   m4_get_hash_length      (m4_hash *hash);
+extern void     m4_get_hash_stats       (m4_hash *hash, m4_hash_stats *stats);
 
 extern void **          m4_hash_lookup  (m4_hash *hash, const void *key);
 extern void *           m4_hash_remove  (m4_hash *hash, const void *key);
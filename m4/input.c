@@ -26,11 +26,19 @@
 
 #include "freadptr.h"
 #include "freadseek.h"
+#include "intprops.h"
 #include "memchr2.h"
+#include "stat-time.h"
+
+#if HAVE_SYS_MMAN_H && HAVE_MMAP
+# include <sys/mman.h>
+#endif
 
 /* Define this to see runtime debug info.  Implied by DEBUG.  */
 /*#define DEBUG_INPUT */
 
+typedef struct file_cache_entry file_cache_entry;
+
 /* Maximum number of bytes where it is more efficient to inline the
    reference as a string than it is to track reference bookkeeping for
    those bytes.  */
@@ -103,17 +111,26 @@ typedef struct m4_input_block m4_input_block;
 static  int             file_peek       (m4_input_block *, m4 *, bool);
 static  int             file_read       (m4_input_block *, m4 *, bool, bool,
                                          bool);
-static  void            file_unget      (m4_input_block *, int);
+static  void            file_unget      (m4_input_block *, m4 *, int);
 static  bool            file_clean      (m4_input_block *, m4 *, bool);
 static  void            file_print      (m4_input_block *, m4 *, m4_obstack *,
                                          int);
 static  const char *    file_buffer     (m4_input_block *, m4 *, size_t *,
                                          bool);
 static  void            file_consume    (m4_input_block *, m4 *, size_t);
+static  int             mapped_peek     (m4_input_block *, m4 *, bool);
+static  int             mapped_read     (m4_input_block *, m4 *, bool, bool,
+                                         bool);
+static  void            mapped_unget    (m4_input_block *, m4 *, int);
+static  bool            mapped_clean    (m4_input_block *, m4 *, bool);
+static  const char *    mapped_buffer   (m4_input_block *, m4 *, size_t *,
+                                         bool);
+static  void            mapped_consume  (m4_input_block *, m4 *, size_t);
 static  int             string_peek     (m4_input_block *, m4 *, bool);
 static  int             string_read     (m4_input_block *, m4 *, bool, bool,
                                          bool);
-static  void            string_unget    (m4_input_block *, int);
+static  void            string_unget    (m4_input_block *, m4 *, int);
+static  bool            string_clean    (m4_input_block *, m4 *, bool);
 static  void            string_print    (m4_input_block *, m4 *, m4_obstack *,
                                          int);
 static  const char *    string_buffer   (m4_input_block *, m4 *, size_t *,
@@ -122,7 +139,7 @@ static  void            string_consume  (m4_input_block *, m4 *, size_t);
 static  int             composite_peek  (m4_input_block *, m4 *, bool);
 static  int             composite_read  (m4_input_block *, m4 *, bool, bool,
                                          bool);
-static  void            composite_unget (m4_input_block *, int);
+static  void            composite_unget (m4_input_block *, m4 *, int);
 static  bool            composite_clean (m4_input_block *, m4 *, bool);
 static  void            composite_print (m4_input_block *, m4 *, m4_obstack *,
                                          int);
@@ -132,7 +149,7 @@ static  void            composite_consume (m4_input_block *, m4 *, size_t);
 static  int             eof_peek        (m4_input_block *, m4 *, bool);
 static  int             eof_read        (m4_input_block *, m4 *, bool, bool,
                                          bool);
-static  void            eof_unget       (m4_input_block *, int);
+static  void            eof_unget       (m4_input_block *, m4 *, int);
 static  const char *    eof_buffer      (m4_input_block *, m4 *, size_t *,
                                          bool);
 
@@ -144,10 +161,18 @@ static  bool    match_input             (m4 *, const char *, size_t, bool);
 static  int     next_char               (m4 *, bool, bool, bool);
 static  int     peek_char               (m4 *, bool);
 static  bool    pop_input               (m4 *, bool);
-static  void    unget_input             (int);
+static  void    unget_input             (m4 *, int);
 static  const char * next_buffer        (m4 *, size_t *, bool);
+static  const char * current_buffer     (m4 *, size_t *, bool);
 static  void    consume_buffer          (m4 *, size_t);
-static  bool    consume_syntax          (m4 *, m4_obstack *, unsigned int);
+static  void    consume_lines           (m4_input_block *, m4 *,
+                                         const char *, size_t);
+static  bool    loop_next               (m4 *, m4__loop *);
+static  void    push_loop_body          (m4 *, m4_input_block *, m4__loop *);
+static  bool    consume_syntax          (m4 *, m4_obstack *, unsigned int,
+                                         bool, bool);
+static  bool    word_cache_start        (m4 *, int);
+static  void    word_cache_finish       (m4 *, size_t);
 
 #ifdef DEBUG_INPUT
 # include "quotearg.h"
@@ -174,7 +199,7 @@ struct input_funcs
 
   /* Unread a single unsigned character or CHAR_BUILTIN, must be the
      same character previously read by read_func.  */
-  void  (*unget_func)   (m4_input_block *, int);
+  void  (*unget_func)   (m4_input_block *, m4 *, int);
 
   /* Optional function to perform cleanup at end of input.  If
      CLEANUP, it is safe to perform non-recoverable cleanup actions.
@@ -214,6 +239,10 @@ struct m4_input_block
         {
           char *str;            /* String value.  */
           size_t len;           /* Remaining length.  */
+          m4__word_cache *words;        /* Cache for prefix, or NULL.  */
+          const char *base;     /* Start of string, for cache offsets.  */
+          size_t prefix;        /* Length copied verbatim from a macro.  */
+          size_t word;          /* Likely index of next cached word.  */
         }
       u_s;      /* See string_funcs.  */
       struct
@@ -224,6 +253,19 @@ struct m4_input_block
           bool_bitfield line_start : 1; /* Saved start_of_input_line state.  */
         }
       u_f;      /* See file_funcs.  */
+      struct
+        {
+          const char *str;              /* Next unread byte.  */
+          size_t len;                   /* Remaining length.  */
+          char *base;                   /* Entire file contents.  */
+          size_t size;                  /* Length of base.  */
+          FILE *fp;                     /* Input file handle.  */
+          file_cache_entry *cached;     /* Owner of base, or NULL.  */
+          bool_bitfield mapped : 1;     /* True if base is from mmap.  */
+          bool_bitfield close : 1;      /* True to close file on pop.  */
+          bool_bitfield line_start : 1; /* Saved start_of_input_line state.  */
+        }
+      u_m;      /* See mapped_funcs.  */
       struct
         {
           m4__symbol_chain *chain;      /* Current link in chain.  */
@@ -235,36 +277,97 @@ struct m4_input_block
 };
 
 
-/* Obstack for storing individual tokens.  */
-static m4_obstack token_stack;
 
-/* Obstack for storing input file names.  */
-static m4_obstack file_names;
+/* Words of a macro expansion that recur at the same offset each time
+   the macro is expanded can skip both lexing and the symbol table
+   lookup.  A string block whose leading bytes were copied verbatim
+   from a macro definition shares that definition's cache of the
+   words found within those bytes, recording the token length and
+   the symbol table entry (or NULL, for a word that named nothing).
+   Only words whose terminating byte also lies within the copied
+   bytes are cached, since the expansion text beyond that point can
+   differ between calls.  The cache is emptied when the lexical age
+   changes, its misses are forgotten when any name is added to the
+   symbol table, and its hits are forgotten when any name is
+   removed.  */
+typedef struct
+{
+  size_t offset;                /* Offset of token within definition.  */
+  size_t len;                   /* Length of token, including escape.  */
+  m4_symbol *symbol;            /* Symbol table entry, or NULL.  */
+} word_entry;
 
-/* Wrapup input stack.  */
-static m4_obstack *wrapup_stack;
+struct m4__word_cache
+{
+  size_t refcount;              /* Owning definition plus input blocks.  */
+  const char *text;             /* Definition text the offsets apply to.  */
+  unsigned int lex_age;         /* Lexical age of entries.  */
+  size_t added;                 /* Names added when misses were valid.  */
+  size_t removed;               /* Names removed when hits were valid.  */
+  size_t count;                 /* Number of entries in use.  */
+  size_t alloc;                 /* Number of entries allocated.  */
+  word_entry *entries;          /* Entries sorted by offset.  */
+};
 
-/* Current stack, from input or wrapup.  */
-static m4_obstack *current_input;
+/* The state of the input engine of one context.  */
+struct m4__input
+{
+  /* Obstack for storing individual tokens.  */
+  m4_obstack token_stack;
 
-/* Bottom of token_stack, for obstack_free.  */
-static void *token_bottom;
+  /* Obstack for storing input file names.  */
+  m4_obstack file_names;
 
-/* Pointer to top of current_input, never NULL.  */
-static m4_input_block *isp;
+  /* Wrapup input stack.  */
+  m4_obstack *wrapup_stack;
 
-/* Pointer to top of wrapup_stack, never NULL.  */
-static m4_input_block *wsp;
+  /* Current stack, from input or wrapup.  */
+  m4_obstack *current_input;
 
-/* Auxiliary for handling split m4_push_string (), NULL when not
-   pushing text for rescanning.  */
-static m4_input_block *next;
+  /* Bottom of token_stack, for obstack_free.  */
+  void *token_bottom;
 
-/* Flag for next_char () to increment current_line.  */
-static bool start_of_input_line;
+  /* Pointer to top of current_input, never NULL.  */
+  m4_input_block *isp;
 
-/* Flag for next_char () to recognize change in input block.  */
-static bool input_change;
+  /* Pointer to top of wrapup_stack, never NULL.  */
+  m4_input_block *wsp;
+
+  /* Auxiliary for handling split m4_push_string (), NULL when not
+     pushing text for rescanning.  */
+  m4_input_block *next;
+
+  /* Flag for next_char () to increment current_line.  */
+  bool start_of_input_line;
+
+  /* Flag for next_char () to recognize change in input block.  */
+  bool input_change;
+
+  /* Macro definition whose text begins the expansion started by
+     m4_push_string_init (), and how many bytes of it were copied
+     verbatim, or NULL.  */
+  m4_symbol_value *next_origin;
+  size_t next_origin_len;
+
+  /* Depth of m4wrap recursion, for tracing.  */
+  size_t wrapup_level;
+
+  /* The newline counting kernel this processor supports, or NULL.  */
+  size_t (*newline_kernel) (const char *, size_t, size_t *);
+
+  /* The most recent word token from m4__next_token (), when it
+     started within the cached prefix of a string block, so that
+     m4__lookup_word () can consult or update the cache.  */
+  struct
+  {
+    m4__word_cache *cache;      /* Cache for the token, or NULL.  */
+    m4_input_block *block;      /* Block that supplied the token.  */
+    size_t offset;              /* Offset of token within block.  */
+    size_t len;                 /* Length of token, including escape.  */
+    bool hit;                   /* True if symbol came from the cache.  */
+    m4_symbol *symbol;          /* Cached lookup result, if hit.  */
+  } word_hint;
+};
 
 /* Vtable for handling input from files.  */
 static struct input_funcs file_funcs = {
@@ -272,10 +375,16 @@ static struct input_funcs file_funcs = {
   file_consume
 };
 
+/* Vtable for handling input from regular files held in memory.  */
+static struct input_funcs mapped_funcs = {
+  mapped_peek, mapped_read, mapped_unget, mapped_clean, file_print,
+  mapped_buffer, mapped_consume
+};
+
 /* Vtable for handling input from strings.  */
 static struct input_funcs string_funcs = {
-  string_peek, string_read, string_unget, NULL, string_print, string_buffer,
-  string_consume
+  string_peek, string_read, string_unget, string_clean, string_print,
+  string_buffer, string_consume
 };
 
 /* Vtable for handling input from composite chains.  */
@@ -295,6 +404,133 @@ static m4_input_block input_eof = { NULL, &eof_funcs, "", 0 };
 /* Marker for buffer_func when current block has no more data.  */
 static const char buffer_retry[1];
 
+
+/* Counting newlines.  Line numbers of input and sync lines of output
+   are kept up to date for whole spans of text at once, which only
+   needs the number of newlines in each span.  A kernel counts them in
+   whole blocks of LEN bytes at BUF, and stores the length of the
+   blocks it scanned in *SCANNED; the caller counts the rest a word at
+   a time.  */
+typedef size_t newline_func (const char *, size_t, size_t *);
+
+/* Shorter spans are not worth handing to a kernel.  */
+#define NEWLINE_MIN 32
+
+#if (defined __x86_64__ || defined __i386__) \
+    && (defined __clang__ || 4 < __GNUC__ + (9 <= __GNUC_MINOR__))
+# define NEWLINE_X86 1
+# include <immintrin.h>
+
+__attribute__ ((__target__ ("sse2")))
+static size_t
+newlines_sse2 (const char *buf, size_t len, size_t *scanned)
+{
+  const __m128i newline = _mm_set1_epi8 ('\n');
+  size_t count = 0;
+  size_t i;
+
+  for (i = 0; i + 16 <= len; i += 16)
+    {
+      __m128i v = _mm_loadu_si128 ((const __m128i *) (buf + i));
+      count += __builtin_popcount (_mm_movemask_epi8
+                                   (_mm_cmpeq_epi8 (v, newline)));
+    }
+  *scanned = i;
+  return count;
+}
+
+__attribute__ ((__target__ ("avx2,popcnt")))
+static size_t
+newlines_avx2 (const char *buf, size_t len, size_t *scanned)
+{
+  const __m256i newline = _mm256_set1_epi8 ('\n');
+  size_t count = 0;
+  size_t i;
+
+  for (i = 0; i + 32 <= len; i += 32)
+    {
+      __m256i v = _mm256_loadu_si256 ((const __m256i *) (buf + i));
+      count += __builtin_popcount ((unsigned int) _mm256_movemask_epi8
+                                   (_mm256_cmpeq_epi8 (v, newline)));
+    }
+  *scanned = i;
+  return count;
+}
+#endif /* NEWLINE_X86 */
+
+#if defined __aarch64__ && defined __ARM_NEON
+# define NEWLINE_NEON 1
+# include <arm_neon.h>
+
+static size_t
+newlines_neon (const char *buf, size_t len, size_t *scanned)
+{
+  const uint8x16_t newline = vdupq_n_u8 ('\n');
+  size_t count = 0;
+  size_t i;
+
+  for (i = 0; i + 16 <= len; i += 16)
+    {
+      uint8x16_t v = vld1q_u8 ((const uint8_t *) buf + i);
+      count += vaddvq_u8 (vshrq_n_u8 (vceqq_u8 (v, newline), 7));
+    }
+  *scanned = i;
+  return count;
+}
+#endif /* NEWLINE_NEON */
+
+/* Return the best kernel this processor supports, or NULL for
+   none.  */
+static newline_func *
+newline_pick (void)
+{
+#ifdef NEWLINE_X86
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("avx2") && __builtin_cpu_supports ("popcnt"))
+    return newlines_avx2;
+  if (__builtin_cpu_supports ("sse2"))
+    return newlines_sse2;
+#elif defined NEWLINE_NEON
+  return newlines_neon;
+#endif
+  return NULL;
+}
+
+/* Return the number of newlines in BUF, of length LEN.  */
+size_t
+m4__count_newlines (m4 *context, const char *buf, size_t len)
+{
+  m4__input *input = context->input;
+  newline_func *kernel = input->newline_kernel;
+  const uint_fast64_t ones = 0x0101010101010101ULL;
+  const uint_fast64_t low = 0x7f7f7f7f7f7f7f7fULL;
+  size_t count = 0;
+  uint64_t word;
+
+  if (kernel && NEWLINE_MIN <= len)
+    {
+      size_t scanned;
+      count = kernel (buf, len, &scanned);
+      buf += scanned;
+      len -= scanned;
+    }
+
+  /* After the xor, a byte has its high bit clear after the addition
+     and or exactly when it was a newline; the multiplication sums
+     those bits into the top byte.  */
+  for (; len >= sizeof word; buf += sizeof word, len -= sizeof word)
+    {
+      uint_fast64_t x;
+      memcpy (&word, buf, sizeof word);
+      x = word ^ (ones * '\n');
+      x = ((x & low) + low) | x;
+      count += (((~x >> 7) & ones) * ones) >> 56 & 0xff;
+    }
+  for (; len; len--)
+    count += *buf++ == '\n';
+  return count;
+}
+
 
 /* Input files, from command line or [s]include.  */
 static int
@@ -318,11 +554,12 @@ static int
 file_read (m4_input_block *me, m4 *context, bool allow_quote M4_GNUC_UNUSED,
            bool allow_argv M4_GNUC_UNUSED, bool allow_unget M4_GNUC_UNUSED)
 {
+  m4__input *input = context->input;
   int ch;
 
-  if (start_of_input_line)
+  if (input->start_of_input_line)
     {
-      start_of_input_line = false;
+      input->start_of_input_line = false;
       m4_set_current_line (context, ++me->line);
     }
 
@@ -336,13 +573,15 @@ file_read (m4_input_block *me, m4 *context, bool allow_quote M4_GNUC_UNUSED,
     }
 
   if (ch == '\n')
-    start_of_input_line = true;
+    input->start_of_input_line = true;
   return ch;
 }
 
 static void
-file_unget (m4_input_block *me, int ch)
+file_unget (m4_input_block *me, m4 *context, int ch)
 {
+  m4__input *input = context->input;
+
   assert (ch < CHAR_EOF);
   if (ungetc (ch, me->u.u_f.fp) < 0)
     {
@@ -351,12 +590,14 @@ file_unget (m4_input_block *me, int ch)
     }
   me->u.u_f.end = false;
   if (ch == '\n')
-    start_of_input_line = false;
+    input->start_of_input_line = false;
 }
 
 static bool
 file_clean (m4_input_block *me, m4 *context, bool cleanup)
 {
+  m4__input *input = context->input;
+
   if (!cleanup)
     return false;
   if (me->prev != &input_eof)
@@ -376,7 +617,7 @@ file_clean (m4_input_block *me, m4 *context, bool cleanup)
   else if (me->u.u_f.close && fclose (me->u.u_f.fp) == EOF)
     m4_error (context, 0, errno, NULL, _("error reading %s"),
               quotearg_style (locale_quoting_style, me->file));
-  start_of_input_line = me->u.u_f.line_start;
+  input->start_of_input_line = me->u.u_f.line_start;
   m4_set_output_line (context, -1);
   return true;
 }
@@ -385,8 +626,9 @@ static void
 file_print (m4_input_block *me, m4 *context M4_GNUC_UNUSED, m4_obstack *obs,
             int debug_level M4_GNUC_UNUSED)
 {
+  m4__input *input = context->input;
   const char *text = me->file;
-  assert (obstack_object_size (current_input) == 0);
+  assert (obstack_object_size (input->current_input) == 0);
   obstack_grow (obs, "<file: ", strlen ("<file: "));
   obstack_grow (obs, text, strlen (text));
   obstack_1grow (obs, '>');
@@ -396,79 +638,488 @@ static const char *
 file_buffer (m4_input_block *me, m4 *context M4_GNUC_UNUSED, size_t *len,
              bool allow_quote M4_GNUC_UNUSED)
 {
-  if (start_of_input_line)
+  m4__input *input = context->input;
+
+  if (input->start_of_input_line)
     {
-      start_of_input_line = false;
+      input->start_of_input_line = false;
       m4_set_current_line (context, ++me->line);
     }
   if (me->u.u_f.end)
     return buffer_retry;
-  return freadptr (isp->u.u_f.fp, len);
+  return freadptr (input->isp->u.u_f.fp, len);
+}
+
+/* Account for the lines of BUF, of length LEN, being consumed from
+   the file ME.  A newline that ends BUF only marks the start of the
+   next line, which is counted once it is read.  */
+static void
+consume_lines (m4_input_block *me, m4 *context, const char *buf, size_t len)
+{
+  m4__input *input = context->input;
+  size_t lines;
+
+  if (!len)
+    return;
+  lines = m4__count_newlines (context, buf, len);
+  if (buf[len - 1] == '\n')
+    {
+      input->start_of_input_line = true;
+      lines--;
+    }
+  if (lines)
+    {
+      me->line += lines;
+      m4_set_current_line (context, me->line);
+    }
 }
 
 static void
 file_consume (m4_input_block *me, m4 *context, size_t len)
 {
+  m4__input *input = context->input;
   const char *buf;
-  const char *p;
   size_t buf_len;
-  assert (!start_of_input_line);
+  assert (!input->start_of_input_line);
   buf = freadptr (me->u.u_f.fp, &buf_len);
   assert (buf && len <= buf_len);
-  buf_len = 0;
-  while ((p = (char *) memchr (buf + buf_len, '\n', len - buf_len)))
+  consume_lines (me, context, buf, len);
+  if (freadseek (input->isp->u.u_f.fp, len) != 0)
+    assert (false);
+}
+
+/* Regular files, other than stdin, that have not been read from yet
+   are instead mapped into memory, or read into memory in one go when
+   mapping is not possible, so that the whole file is a single buffer
+   for next_buffer () and needs no stdio calls per character.  The
+   line number handling mirrors that of file_read ().  */
+
+/* Size of each read when a file cannot be mapped.  */
+#define MAPPED_READ_SIZE (1024 * 1024)
+
+static int
+mapped_peek (m4_input_block *me, m4 *context M4_GNUC_UNUSED,
+             bool allow_argv M4_GNUC_UNUSED)
+{
+  return me->u.u_m.len ? to_uchar (*me->u.u_m.str) : CHAR_RETRY;
+}
+
+static int
+mapped_read (m4_input_block *me, m4 *context, bool allow_quote M4_GNUC_UNUSED,
+             bool allow_argv M4_GNUC_UNUSED, bool allow_unget M4_GNUC_UNUSED)
+{
+  m4__input *input = context->input;
+  int ch;
+
+  if (input->start_of_input_line)
+    {
+      input->start_of_input_line = false;
+      m4_set_current_line (context, ++me->line);
+    }
+  if (!me->u.u_m.len)
+    return CHAR_RETRY;
+  me->u.u_m.len--;
+  ch = to_uchar (*me->u.u_m.str++);
+  if (ch == '\n')
+    input->start_of_input_line = true;
+  return ch;
+}
+
+static void
+mapped_unget (m4_input_block *me, m4 *context, int ch)
+{
+  m4__input *input = context->input;
+
+  assert (ch < CHAR_EOF && to_uchar (me->u.u_m.str[-1]) == ch);
+  me->u.u_m.str--;
+  me->u.u_m.len++;
+  if (ch == '\n')
+    input->start_of_input_line = false;
+}
+
+/* Release file contents BASE of length SIZE, as loaded by map_file
+   (), with MAPPED telling how.  */
+static void
+release_contents (char *base, size_t size M4_GNUC_UNUSED, bool mapped)
+{
+#if HAVE_SYS_MMAN_H && HAVE_MMAP
+  if (mapped)
+    munmap (base, size);
+  else
+#endif
+    free (base);
+}
+
+static void file_cache_unref (file_cache_entry *);
+
+static bool
+mapped_clean (m4_input_block *me, m4 *context, bool cleanup)
+{
+  m4__input *input = context->input;
+
+  if (!cleanup)
+    return false;
+  if (me->prev != &input_eof)
+    m4_debug_message (context, M4_DEBUG_TRACE_INPUT,
+                      _("input reverted to %s, line %d"),
+                      me->prev->file, me->prev->line);
+  else
+    m4_debug_message (context, M4_DEBUG_TRACE_INPUT, _("input exhausted"));
+
+  if (me->u.u_m.cached)
+    file_cache_unref (me->u.u_m.cached);
+  else
+    release_contents (me->u.u_m.base, me->u.u_m.size, me->u.u_m.mapped);
+  if (me->u.u_m.close && fclose (me->u.u_m.fp) == EOF)
+    m4_error (context, 0, errno, NULL, _("error reading %s"),
+              quotearg_style (locale_quoting_style, me->file));
+  input->start_of_input_line = me->u.u_m.line_start;
+  m4_set_output_line (context, -1);
+  return true;
+}
+
+static const char *
+mapped_buffer (m4_input_block *me, m4 *context, size_t *len,
+               bool allow_quote M4_GNUC_UNUSED)
+{
+  m4__input *input = context->input;
+
+  if (input->start_of_input_line)
     {
-      if (p == buf + len - 1)
-        start_of_input_line = true;
+      input->start_of_input_line = false;
+      m4_set_current_line (context, ++me->line);
+    }
+  if (!me->u.u_m.len)
+    return buffer_retry;
+  *len = me->u.u_m.len;
+  return me->u.u_m.str;
+}
+
+static void
+mapped_consume (m4_input_block *me, m4 *context, size_t len)
+{
+  m4__input *input = context->input;
+
+  assert (!input->start_of_input_line && len <= me->u.u_m.len);
+  consume_lines (me, context, me->u.u_m.str, len);
+  me->u.u_m.str += len;
+  me->u.u_m.len -= len;
+}
+
+/* Try to load the contents of FP, which must not have been read yet,
+   into the input block ME, and describe FP in *ST.  Return false,
+   with FP untouched, if FP is not a regular file or it cannot be
+   loaded.  A read error that leaves FP unusable is reported on behalf
+   of CONTEXT, and what was read before it becomes the contents.  */
+static bool
+map_file (m4 *context, m4_input_block *me, FILE *fp, struct stat *st)
+{
+  int fd = fileno (fp);
+  char *base = NULL;
+  size_t size = 0;
+  size_t alloc = 0;
+  bool mapped = false;
+
+  if (fd < 0 || fstat (fd, st) != 0 || !S_ISREG (st->st_mode)
+      || SIZE_MAX < (uintmax_t) st->st_size || lseek (fd, 0, SEEK_CUR) != 0)
+    return false;
+
+#if HAVE_SYS_MMAN_H && HAVE_MMAP
+  if (st->st_size)
+    {
+      base = (char *) mmap (NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (base == MAP_FAILED)
+        base = NULL;
       else
-        m4_set_current_line (context, ++me->line);
-      buf_len = p - buf + 1;
+        {
+          mapped = true;
+          size = st->st_size;
+# if defined POSIX_MADV_SEQUENTIAL
+          posix_madvise (base, size, POSIX_MADV_SEQUENTIAL);
+# endif
+        }
     }
-  if (freadseek (isp->u.u_f.fp, len) != 0)
-    assert (false);
+#endif
+
+  if (!mapped)
+    {
+      /* Read in large chunks until end of file, in case the file
+         grows while we read it.  */
+      ssize_t n;
+      alloc = st->st_size + 1;
+      base = (char *) xmalloc (alloc);
+      while (0 < (n = read (fd, base + size,
+                            (alloc - size < MAPPED_READ_SIZE
+                             ? alloc - size : MAPPED_READ_SIZE))))
+        {
+          size += n;
+          if (size == alloc)
+            base = (char *) x2realloc (base, &alloc);
+        }
+      if (n < 0)
+        {
+          int read_errno = errno;
+          if (lseek (fd, 0, SEEK_SET) == 0)
+            {
+              free (base);
+              return false;
+            }
+          /* The stdio reader cannot start over either, so report the
+             error now, as file_clean () would have.  */
+          m4_error (context, 0, read_errno, NULL, _("error reading %s"),
+                    quotearg_style (locale_quoting_style, me->file));
+        }
+    }
+
+  me->funcs = &mapped_funcs;
+  me->u.u_m.str = me->u.u_m.base = base;
+  me->u.u_m.len = me->u.u_m.size = size;
+  me->u.u_m.fp = fp;
+  me->u.u_m.cached = NULL;
+  me->u.u_m.mapped = mapped;
+  return true;
 }
 
-/* m4_push_file () pushes an input file FP with name TITLE on the
-  input stack, saving the current file name and line number.  If next
-  is non-NULL, this push invalidates a call to m4_push_string_init (),
-  whose storage is consequently released.  If CLOSE, then close FP at
-  end of file.
+/* With --cache-includes, the contents that map_file () loads are kept
+   after the file is popped, keyed by device and inode number, and a
+   later include of the same file pushes them again without opening
+   it, for as long as stat () reports the size and modification time
+   seen when the contents were loaded.  */
+struct file_cache_entry
+{
+  dev_t dev;                    /* Device of file.  */
+  ino_t ino;                    /* Inode number of file.  */
+  off_t st_size;                /* Size of file when loaded.  */
+  struct timespec mtime;        /* Modification time when loaded.  */
+  char *base;                   /* Contents, as from map_file ().  */
+  size_t size;                  /* Length of contents.  */
+  bool mapped;                  /* True if base is from mmap.  */
+  size_t refcount;              /* Cache membership plus input blocks.  */
+};
 
-  file_read () manages line numbers for error messages, so they do not
-  get wrong due to lookahead.  The token consisting of a newline
-  alone is taken as belonging to the line it ends, and the current
-  line number is not incremented until the next character is read.  */
+struct m4__file_cache
+{
+  m4_hash *files;               /* Maps file_cache_entry to itself.  */
+};
+
+static size_t
+file_cache_hash (const void *key)
+{
+  const file_cache_entry *entry = (const file_cache_entry *) key;
+
+  return (size_t) entry->ino * 31 + (size_t) entry->dev;
+}
+
+static int
+file_cache_cmp (const void *key, const void *try)
+{
+  const file_cache_entry *a = (const file_cache_entry *) key;
+  const file_cache_entry *b = (const file_cache_entry *) try;
+
+  return a->ino != b->ino || a->dev != b->dev;
+}
+
+static void
+file_cache_unref (file_cache_entry *entry)
+{
+  assert (entry->refcount);
+  if (--entry->refcount == 0)
+    {
+      release_contents (entry->base, entry->size, entry->mapped);
+      free (entry);
+    }
+}
+
+/* Return the cached entry of CONTEXT for the file described by ST, or
+   NULL.  An entry whose file has changed since it was loaded is
+   discarded.  */
+static file_cache_entry *
+file_cache_lookup (m4 *context, const struct stat *st)
+{
+  file_cache_entry key;
+  file_cache_entry *entry;
+  struct timespec mtime = get_stat_mtime (st);
+  void **slot;
+
+  if (!context->file_cache)
+    return NULL;
+  key.dev = st->st_dev;
+  key.ino = st->st_ino;
+  slot = m4_hash_lookup (context->file_cache->files, &key);
+  if (!slot)
+    return NULL;
+  entry = (file_cache_entry *) *slot;
+  if (entry->st_size == st->st_size && entry->mtime.tv_sec == mtime.tv_sec
+      && entry->mtime.tv_nsec == mtime.tv_nsec)
+    return entry;
+  m4_hash_remove (context->file_cache->files, entry);
+  file_cache_unref (entry);
+  return NULL;
+}
+
+/* Hand the contents just loaded into the input block ME, for the file
+   described by ST, over to the cache of CONTEXT.  */
+static void
+file_cache_add (m4 *context, m4_input_block *me, const struct stat *st)
+{
+  file_cache_entry *entry = file_cache_lookup (context, st);
+
+  if (entry)
+    {
+      /* Something other than m4_load_filename () loaded the file
+         again, so the new contents replace the old.  */
+      m4_hash_remove (context->file_cache->files, entry);
+      file_cache_unref (entry);
+    }
+  if (!context->file_cache)
+    {
+      context->file_cache =
+        (m4__file_cache *) xmalloc (sizeof *context->file_cache);
+      context->file_cache->files = m4_hash_new (0, file_cache_hash,
+                                                file_cache_cmp);
+    }
+
+  entry = (file_cache_entry *) xmalloc (sizeof *entry);
+  entry->dev = st->st_dev;
+  entry->ino = st->st_ino;
+  entry->st_size = st->st_size;
+  entry->mtime = get_stat_mtime (st);
+  entry->base = me->u.u_m.base;
+  entry->size = me->u.u_m.size;
+  entry->mapped = me->u.u_m.mapped;
+  entry->refcount = 2;
+  m4_hash_insert (context->file_cache->files, entry, entry);
+  me->u.u_m.cached = entry;
+}
+
+static void *
+file_cache_delete_CB (m4_hash *hash, const void *key, void *value,
+                      void *ignored M4_GNUC_UNUSED)
+{
+  m4_hash_remove (hash, key);
+  file_cache_unref ((file_cache_entry *) value);
+  return NULL;
+}
+
+/* Free the memory used by CACHE, once no input blocks remain.  */
 void
-m4_push_file (m4 *context, FILE *fp, const char *title, bool close_file)
+m4__file_cache_delete (m4__file_cache *cache)
 {
+  m4_hash_apply (cache->files, file_cache_delete_CB, NULL);
+  m4_hash_delete (cache->files);
+  free (cache);
+}
+
+/* Begin a file input block for TITLE, for m4_push_file () and
+   m4__push_cached_file ().  */
+static m4_input_block *
+push_file_init (m4 *context, const char *title)
+{
+  m4__input *input = context->input;
   m4_input_block *i;
 
-  if (next != NULL)
+  if (input->next != NULL)
     {
-      obstack_free (current_input, next);
-      next = NULL;
+      obstack_free (input->current_input, input->next);
+      input->next = NULL;
     }
 
-  m4_debug_message (context, M4_DEBUG_TRACE_INPUT, _("input read from %s"),
-                    quotearg_style (locale_quoting_style, title));
+  if (m4_is_debug_bit (context, M4_DEBUG_TRACE_INPUT))
+    m4_debug_message (context, M4_DEBUG_TRACE_INPUT, _("input read from %s"),
+                      quotearg_style (locale_quoting_style, title));
 
-  i = (m4_input_block *) obstack_alloc (current_input, sizeof *i);
+  i = (m4_input_block *) obstack_alloc (input->current_input, sizeof *i);
   i->funcs = &file_funcs;
   /* Save title on a separate obstack, so that wrapped text can refer
      to it even after the file is popped.  */
-  i->file = obstack_copy0 (&file_names, title, strlen (title));
+  i->file = obstack_copy0 (&input->file_names, title, strlen (title));
   i->line = 1;
+  return i;
+}
 
-  i->u.u_f.fp = fp;
-  i->u.u_f.end = false;
-  i->u.u_f.close = close_file;
-  i->u.u_f.line_start = start_of_input_line;
+/* Make the file input block I the current input.  */
+static void
+push_file_finish (m4 *context, m4_input_block *i)
+{
+  m4__input *input = context->input;
 
   m4_set_output_line (context, -1);
 
-  i->prev = isp;
-  isp = i;
-  input_change = true;
+  i->prev = input->isp;
+  input->isp = i;
+  input->input_change = true;
+}
+
+/* If --cache-includes is in effect and the contents of the regular
+   file FILEPATH are cached and still current, push them as with
+   m4_push_file () and return true.  Otherwise return false, and the
+   caller should open FILEPATH itself.  */
+bool
+m4__push_cached_file (m4 *context, const char *filepath)
+{
+  m4__input *input = context->input;
+  file_cache_entry *entry;
+  m4_input_block *i;
+  struct stat st;
+
+  if (!context->file_cache || !m4_get_cache_includes_opt (context)
+      || m4_get_interactive_opt (context)
+      || stat (filepath, &st) != 0 || !S_ISREG (st.st_mode))
+    return false;
+  entry = file_cache_lookup (context, &st);
+  if (!entry)
+    return false;
+
+  i = push_file_init (context, filepath);
+  i->funcs = &mapped_funcs;
+  i->u.u_m.str = i->u.u_m.base = entry->base;
+  i->u.u_m.len = i->u.u_m.size = entry->size;
+  i->u.u_m.fp = NULL;
+  i->u.u_m.cached = entry;
+  i->u.u_m.mapped = entry->mapped;
+  i->u.u_m.close = false;
+  i->u.u_m.line_start = input->start_of_input_line;
+  entry->refcount++;
+  push_file_finish (context, i);
+  return true;
+}
+
+/* m4_push_file () pushes an input file FP with name TITLE on the
+  input stack, saving the current file name and line number.  If next
+  is non-NULL, this push invalidates a call to m4_push_string_init (),
+  whose storage is consequently released.  If CLOSE, then close FP at
+  end of file.  Regular files other than stdin are loaded into memory
+  in their entirety, unless in interactive mode, and with
+  --cache-includes their contents are kept for m4__push_cached_file ().
+
+  file_read () manages line numbers for error messages, so they do not
+  get wrong due to lookahead.  The token consisting of a newline
+  alone is taken as belonging to the line it ends, and the current
+  line number is not incremented until the next character is read.  */
+void
+m4_push_file (m4 *context, FILE *fp, const char *title, bool close_file)
+{
+  m4__input *input = context->input;
+  m4_input_block *i = push_file_init (context, title);
+  struct stat st;
+
+  if (fp != stdin && !m4_get_interactive_opt (context)
+      && map_file (context, i, fp, &st))
+    {
+      i->u.u_m.close = close_file;
+      i->u.u_m.line_start = input->start_of_input_line;
+      if (m4_get_cache_includes_opt (context))
+        file_cache_add (context, i, &st);
+    }
+  else
+    {
+      i->u.u_f.fp = fp;
+      i->u.u_f.end = false;
+      i->u.u_f.close = close_file;
+      i->u.u_f.line_start = input->start_of_input_line;
+    }
+
+  push_file_finish (context, i);
 }
 
 
@@ -492,23 +1143,38 @@ string_read (m4_input_block *me, m4 *context M4_GNUC_UNUSED,
 }
 
 static void
-string_unget (m4_input_block *me, int ch)
+string_unget (m4_input_block *me, m4 *context M4_GNUC_UNUSED, int ch)
 {
   assert (ch < CHAR_EOF && to_uchar (me->u.u_s.str[-1]) == ch);
   me->u.u_s.str--;
   me->u.u_s.len++;
 }
 
+static bool
+string_clean (m4_input_block *me, m4 *context M4_GNUC_UNUSED,
+              bool cleanup M4_GNUC_UNUSED)
+{
+  if (me->u.u_s.len)
+    return false;
+  if (me->u.u_s.words)
+    {
+      m4__word_cache_unref (me->u.u_s.words);
+      me->u.u_s.words = NULL;
+    }
+  return true;
+}
+
 static void
 string_print (m4_input_block *me, m4 *context, m4_obstack *obs,
               int debug_level)
 {
+  m4__input *input = context->input;
   bool quote = (debug_level & M4_DEBUG_TRACE_QUOTE) != 0;
   size_t arg_length = m4_get_max_debug_arg_length_opt (context);
 
   assert (!me->u.u_s.len);
-  m4_shipout_string_trunc (obs, (char *) obstack_base (current_input),
-                           obstack_object_size (current_input),
+  m4_shipout_string_trunc (obs, (char *) obstack_base (input->current_input),
+                           obstack_object_size (input->current_input),
                            quote ? m4_get_syntax_quotes (M4SYNTAX) : NULL,
                            &arg_length);
 }
@@ -539,18 +1205,79 @@ string_consume (m4_input_block *me, m4 *context M4_GNUC_UNUSED, size_t len)
 m4_obstack *
 m4_push_string_init (m4 *context, const char *file, int line)
 {
+  m4__input *input = context->input;
+
   /* Free any memory occupied by completely parsed input.  */
-  assert (!next);
+  assert (!input->next);
   while (pop_input (context, false));
 
   /* Reserve the next location on the obstack.  */
-  next = (m4_input_block *) obstack_alloc (current_input, sizeof *next);
-  next->funcs = &string_funcs;
-  next->file = file;
-  next->line = line;
-  next->u.u_s.len = 0;
+  input->next = (m4_input_block *) obstack_alloc (input->current_input,
+                                                  sizeof *input->next);
+  input->next->funcs = &string_funcs;
+  input->next->file = file;
+  input->next->line = line;
+  input->next->u.u_s.len = 0;
+  input->next_origin = NULL;
+
+  return input->current_input;
+}
 
-  return current_input;
+/* Note that the expansion text being collected on OBS will start
+   with the first LEN bytes of the text of VALUE, so that words found
+   in those bytes can be cached across expansions of VALUE.  This has
+   no effect unless OBS came from m4_push_string_init () and nothing
+   has been added to it yet.  */
+void
+m4__push_string_origin (m4 *context, m4_obstack *obs, m4_symbol_value *value,
+                        size_t len)
+{
+  m4__input *input = context->input;
+
+  assert (m4_is_symbol_value_text (value)
+          && len <= m4_get_symbol_value_len (value));
+  if (input->next && obs == input->current_input
+      && input->next->funcs == &string_funcs
+      && !obstack_object_size (obs) && len > 1)
+    {
+      input->next_origin = value;
+      input->next_origin_len = len;
+    }
+}
+
+/* Return the number of bytes of expansion collected so far since
+   m4_push_string_init, including text held in links.  A $@ reference
+   counts the text it will produce when read with its quotes.  */
+size_t
+m4__push_string_size (m4 *context)
+{
+  m4__input *input = context->input;
+  size_t len = obstack_object_size (input->current_input);
+  m4__symbol_chain *chain;
+  size_t i;
+
+  if (!input->next || input->next->funcs != &composite_funcs)
+    return len;
+  for (chain = input->next->u.u_c.chain; chain; chain = chain->next)
+    switch (chain->type)
+      {
+      case M4__CHAIN_STR:
+        len += chain->u.u_s.len;
+        break;
+      case M4__CHAIN_ARGV:
+        for (i = chain->u.u_a.index; i < m4_arg_argc (chain->u.u_a.argv); i++)
+          {
+            len += m4_arg_len (context, chain->u.u_a.argv, i,
+                               chain->u.u_a.flatten);
+            if (chain->u.u_a.quotes)
+              len += chain->u.u_a.quotes->len1 + chain->u.u_a.quotes->len2;
+            len += i > chain->u.u_a.index || chain->u.u_a.comma;
+          }
+        break;
+      default:
+        break;
+      }
+  return len;
 }
 
 /* This function allows gathering input from multiple locations,
@@ -578,10 +1305,11 @@ m4_push_string_init (m4 *context, const char *file, int line)
 bool
 m4__push_symbol (m4 *context, m4_symbol_value *value, size_t level, bool inuse)
 {
+  m4__input *input = context->input;
   m4__symbol_chain *src_chain = NULL;
   m4__symbol_chain *chain;
 
-  assert (next);
+  assert (input->next);
 
   /* Speed consideration - for short enough symbols, the speed and
      memory overhead of parsing another INPUT_CHAIN link outweighs the
@@ -592,20 +1320,20 @@ m4__push_symbol (m4 *context, m4_symbol_value *value, size_t level, bool inuse)
       assert (level < SIZE_MAX);
       if (m4_get_symbol_value_len (value) <= INPUT_INLINE_THRESHOLD)
         {
-          obstack_grow (current_input, m4_get_symbol_value_text (value),
+          obstack_grow (input->current_input, m4_get_symbol_value_text (value),
                         m4_get_symbol_value_len (value));
           return false;
         }
     }
   else if (m4_is_symbol_value_func (value))
     {
-      if (next->funcs == &string_funcs)
+      if (input->next->funcs == &string_funcs)
         {
-          next->funcs = &composite_funcs;
-          next->u.u_c.chain = next->u.u_c.end = NULL;
+          input->next->funcs = &composite_funcs;
+          input->next->u.u_c.chain = input->next->u.u_c.end = NULL;
         }
-      m4__append_builtin (current_input, value->u.builtin, &next->u.u_c.chain,
-                          &next->u.u_c.end);
+      m4__append_builtin (input->current_input, value->u.builtin,
+                          &input->next->u.u_c.chain, &input->next->u.u_c.end);
       return false;
     }
   else
@@ -623,7 +1351,7 @@ m4__push_symbol (m4 *context, m4_symbol_value *value, size_t level, bool inuse)
              && (src_chain->u.u_s.len <= INPUT_INLINE_THRESHOLD
                  || (!inuse && src_chain->u.u_s.level == SIZE_MAX)))
         {
-          obstack_grow (current_input, src_chain->u.u_s.str,
+          obstack_grow (input->current_input, src_chain->u.u_s.str,
                         src_chain->u.u_s.len);
           src_chain = src_chain->next;
         }
@@ -631,21 +1359,22 @@ m4__push_symbol (m4 *context, m4_symbol_value *value, size_t level, bool inuse)
         return false;
     }
 
-  if (next->funcs == &string_funcs)
+  if (input->next->funcs == &string_funcs)
     {
-      next->funcs = &composite_funcs;
-      next->u.u_c.chain = next->u.u_c.end = NULL;
+      input->next->funcs = &composite_funcs;
+      input->next->u.u_c.chain = input->next->u.u_c.end = NULL;
     }
-  m4__make_text_link (current_input, &next->u.u_c.chain, &next->u.u_c.end);
+  m4__make_text_link (input->current_input, &input->next->u.u_c.chain,
+                      &input->next->u.u_c.end);
   if (m4_is_symbol_value_text (value))
     {
-      chain = (m4__symbol_chain *) obstack_alloc (current_input,
+      chain = (m4__symbol_chain *) obstack_alloc (input->current_input,
                                                   sizeof *chain);
-      if (next->u.u_c.end)
-        next->u.u_c.end->next = chain;
+      if (input->next->u.u_c.end)
+        input->next->u.u_c.end->next = chain;
       else
-        next->u.u_c.chain = chain;
-      next->u.u_c.end = chain;
+        input->next->u.u_c.chain = chain;
+      input->next->u.u_c.end = chain;
       chain->next = NULL;
       chain->type = M4__CHAIN_STR;
       chain->quote_age = m4_get_symbol_value_quote_age (value);
@@ -659,8 +1388,9 @@ m4__push_symbol (m4 *context, m4_symbol_value *value, size_t level, bool inuse)
     {
       if (src_chain->type == M4__CHAIN_FUNC)
         {
-          m4__append_builtin (current_input, src_chain->u.builtin,
-                              &next->u.u_c.chain, &next->u.u_c.end);
+          m4__append_builtin (input->current_input, src_chain->u.builtin,
+                              &input->next->u.u_c.chain,
+                              &input->next->u.u_c.end);
           src_chain = src_chain->next;
           continue;
         }
@@ -678,19 +1408,19 @@ m4__push_symbol (m4 *context, m4_symbol_value *value, size_t level, bool inuse)
               && (src_chain->u.u_s.len <= INPUT_INLINE_THRESHOLD
                   || (!inuse && src_chain->u.u_s.level == SIZE_MAX)))
             {
-              obstack_grow (current_input, src_chain->u.u_s.str,
+              obstack_grow (input->current_input, src_chain->u.u_s.str,
                             src_chain->u.u_s.len);
               break;
             }
           /* We must clone each link in the chain, since next_char
              destructively modifies the chain it is parsing.  */
-          chain = (m4__symbol_chain *) obstack_copy (current_input, src_chain,
-                                                     sizeof *chain);
+          chain = (m4__symbol_chain *) obstack_copy (input->current_input,
+                                                     src_chain, sizeof *chain);
           chain->next = NULL;
           if (chain->type == M4__CHAIN_STR && chain->u.u_s.level == SIZE_MAX)
             {
               if (chain->u.u_s.len <= INPUT_INLINE_THRESHOLD || !inuse)
-                chain->u.u_s.str = (char *) obstack_copy (current_input,
+                chain->u.u_s.str = (char *) obstack_copy (input->current_input,
                                                           chain->u.u_s.str,
                                                           chain->u.u_s.len);
               else
@@ -700,11 +1430,11 @@ m4__push_symbol (m4 *context, m4_symbol_value *value, size_t level, bool inuse)
                 }
             }
         }
-      if (next->u.u_c.end)
-        next->u.u_c.end->next = chain;
+      if (input->next->u.u_c.end)
+        input->next->u.u_c.end->next = chain;
       else
-        next->u.u_c.chain = chain;
-      next->u.u_c.end = chain;
+        input->next->u.u_c.chain = chain;
+      input->next->u.u_c.end = chain;
       if (chain->type == M4__CHAIN_ARGV)
         {
           assert (!chain->u.u_a.comma && !chain->u.u_a.skip_last);
@@ -723,33 +1453,57 @@ m4__push_symbol (m4 *context, m4_symbol_value *value, size_t level, bool inuse)
    from push_string_init is collected into the input stack.  If the
    new object is empty, we do not push it.  */
 void
-m4_push_string_finish (void)
+m4_push_string_finish (m4 *context)
 {
-  size_t len = obstack_object_size (current_input);
+  m4__input *input = context->input;
+  size_t len = obstack_object_size (input->current_input);
 
-  if (next == NULL)
+  if (input->next == NULL)
     {
       assert (!len);
       return;
     }
 
-  if (len || next->funcs == &composite_funcs)
+  if (len || input->next->funcs == &composite_funcs)
     {
-      if (next->funcs == &string_funcs)
+      if (input->next->funcs == &string_funcs)
         {
-          next->u.u_s.str = (char *) obstack_finish (current_input);
-          next->u.u_s.len = len;
+          input->next->u.u_s.str
+            = (char *) obstack_finish (input->current_input);
+          input->next->u.u_s.len = len;
+          input->next->u.u_s.words = NULL;
+          if (input->next_origin)
+            {
+              m4__word_cache *cache = VALUE_WORDS (input->next_origin);
+              if (!cache)
+                {
+                  cache = (m4__word_cache *) xzalloc (sizeof *cache);
+                  cache->refcount = 1;
+                  VALUE_WORDS (input->next_origin) = cache;
+                }
+              if (cache->text != m4_get_symbol_value_text (input->next_origin))
+                {
+                  cache->text = m4_get_symbol_value_text (input->next_origin);
+                  cache->count = 0;
+                }
+              cache->refcount++;
+              input->next->u.u_s.words = cache;
+              input->next->u.u_s.base = input->next->u.u_s.str;
+              input->next->u.u_s.prefix = input->next_origin_len;
+              input->next->u.u_s.word = 0;
+            }
         }
       else
-        m4__make_text_link (current_input, &next->u.u_c.chain,
-                            &next->u.u_c.end);
-      next->prev = isp;
-      isp = next;
-      input_change = true;
+        m4__make_text_link (input->current_input, &input->next->u.u_c.chain,
+                            &input->next->u.u_c.end);
+      input->next->prev = input->isp;
+      input->isp = input->next;
+      input->input_change = true;
     }
   else
-    obstack_free (current_input, next);
-  next = NULL;
+    obstack_free (input->current_input, input->next);
+  input->next = NULL;
+  input->next_origin = NULL;
 }
 
 
@@ -759,6 +1513,7 @@ m4_push_string_finish (void)
 static int
 composite_peek (m4_input_block *me, m4 *context, bool allow_argv)
 {
+  m4__input *input = context->input;
   m4__symbol_chain *chain = me->u.u_c.chain;
   size_t argc;
 
@@ -789,17 +1544,21 @@ composite_peek (m4_input_block *me, m4 *context, bool allow_argv)
              input block containing the next unparsed argument from
              argv.  */
           m4_push_string_init (context, me->file, me->line);
-          m4__push_arg_quote (context, current_input, chain->u.u_a.argv,
+          m4__push_arg_quote (context, input->current_input, chain->u.u_a.argv,
                               chain->u.u_a.index,
                               m4__quote_cache (M4SYNTAX, NULL,
                                                chain->quote_age,
                                                chain->u.u_a.quotes));
           chain->u.u_a.index++;
           chain->u.u_a.comma = true;
-          m4_push_string_finish ();
+          m4_push_string_finish (context);
           return peek_char (context, allow_argv);
         case M4__CHAIN_LOC:
           break;
+        case M4__CHAIN_LOOP:
+          /* Like a builtin, the boundary between iterations can
+             neither extend a word nor start an argument list.  */
+          return CHAR_BUILTIN;
         default:
           assert (!"composite_peek");
           abort ();
@@ -813,6 +1572,7 @@ static int
 composite_read (m4_input_block *me, m4 *context, bool allow_quote,
                 bool allow_argv, bool allow_unget)
 {
+  m4__input *input = context->input;
   m4__symbol_chain *chain = me->u.u_c.chain;
   size_t argc;
   while (chain)
@@ -857,21 +1617,34 @@ composite_read (m4_input_block *me, m4 *context, bool allow_quote,
              input block containing the next unparsed argument from
              argv.  */
           m4_push_string_init (context, me->file, me->line);
-          m4__push_arg_quote (context, current_input, chain->u.u_a.argv,
+          m4__push_arg_quote (context, input->current_input, chain->u.u_a.argv,
                               chain->u.u_a.index,
                               m4__quote_cache (M4SYNTAX, NULL,
                                                chain->quote_age,
                                                chain->u.u_a.quotes));
           chain->u.u_a.index++;
           chain->u.u_a.comma = true;
-          m4_push_string_finish ();
+          m4_push_string_finish (context);
           return next_char (context, allow_quote, allow_argv, allow_unget);
         case M4__CHAIN_LOC:
           me->file = chain->u.u_l.file;
           me->line = chain->u.u_l.line;
-          input_change = true;
+          input->input_change = true;
           me->u.u_c.chain = chain->next;
           return next_char (context, allow_quote, allow_argv, allow_unget);
+        case M4__CHAIN_LOOP:
+          /* Starting the next iteration changes the input stack, so
+             leave it for a read that need not be undone.  */
+          if (allow_unget)
+            return CHAR_RETRY;
+          while (loop_next (context, chain->u.loop))
+            if (chain->u.loop->body_len)
+              {
+                push_loop_body (context, me, chain->u.loop);
+                return next_char (context, allow_quote, allow_argv,
+                                  allow_unget);
+              }
+          break;
         default:
           assert (!"composite_read");
           abort ();
@@ -882,7 +1655,7 @@ composite_read (m4_input_block *me, m4 *context, bool allow_quote,
 }
 
 static void
-composite_unget (m4_input_block *me, int ch)
+composite_unget (m4_input_block *me, m4 *context M4_GNUC_UNUSED, int ch)
 {
   m4__symbol_chain *chain = me->u.u_c.chain;
   switch (chain->type)
@@ -937,6 +1710,7 @@ composite_clean (m4_input_block *me, m4 *context, bool cleanup)
           m4__arg_adjust_refcount (context, chain->u.u_a.argv, false);
           break;
         case M4__CHAIN_LOC:
+        case M4__CHAIN_LOOP:
           return false;
         default:
           assert (!"composite_clean");
@@ -951,13 +1725,14 @@ static void
 composite_print (m4_input_block *me, m4 *context, m4_obstack *obs,
                  int debug_level)
 {
+  m4__input *input = context->input;
   bool quote = (debug_level & M4_DEBUG_TRACE_QUOTE) != 0;
   size_t maxlen = m4_get_max_debug_arg_length_opt (context);
   m4__symbol_chain *chain = me->u.u_c.chain;
   const m4_string_pair *quotes = m4_get_syntax_quotes (M4SYNTAX);
   bool module = (debug_level & M4_DEBUG_TRACE_MODULE) != 0;
   bool done = false;
-  size_t len = obstack_object_size (current_input);
+  size_t len = obstack_object_size (input->current_input);
 
   if (quote)
     m4_shipout_string (context, obs, quotes->str1, quotes->len1, false);
@@ -983,6 +1758,8 @@ composite_print (m4_input_block *me, m4 *context, m4_obstack *obs,
                              module))
             done = true;
           break;
+        case M4__CHAIN_LOOP:
+          break;
         default:
           assert (!"composite_print");
           abort ();
@@ -990,8 +1767,8 @@ composite_print (m4_input_block *me, m4 *context, m4_obstack *obs,
       chain = chain->next;
     }
   if (len)
-    m4_shipout_string_trunc (obs, (char *) obstack_base (current_input), len,
-                             NULL, &maxlen);
+    m4_shipout_string_trunc (obs, (char *) obstack_base (input->current_input),
+                             len, NULL, &maxlen);
   if (quote)
     m4_shipout_string (context, obs, quotes->str2, quotes->len2, false);
 }
@@ -1000,6 +1777,7 @@ static const char *
 composite_buffer (m4_input_block *me, m4 *context, size_t *len,
                   bool allow_quote)
 {
+  m4__input *input = context->input;
   m4__symbol_chain *chain = me->u.u_c.chain;
   while (chain)
     {
@@ -1030,9 +1808,11 @@ composite_buffer (m4_input_block *me, m4 *context, size_t *len,
         case M4__CHAIN_LOC:
           me->file = chain->u.u_l.file;
           me->line = chain->u.u_l.line;
-          input_change = true;
+          input->input_change = true;
           me->u.u_c.chain = chain->next;
           return next_buffer (context, len, allow_quote);
+        case M4__CHAIN_LOOP:
+          return NULL; /* Iterations are started by composite_read.  */
         default:
           assert (!"composite_buffer");
           abort ();
@@ -1111,7 +1891,8 @@ m4__append_builtin (m4_obstack *obs, const m4__builtin *func,
 void
 m4_push_builtin (m4 *context, m4_obstack *obs, m4_symbol_value *token)
 {
-  m4_input_block *i = (obs == current_input ? next : wsp);
+  m4__input *input = context->input;
+  m4_input_block *i = (obs == input->current_input ? input->next : input->wsp);
   assert (i);
   if (i->funcs == &string_funcs)
     {
@@ -1123,6 +1904,247 @@ m4_push_builtin (m4 *context, m4_obstack *obs, m4_symbol_value *token)
   m4__append_builtin (obs, token->u.builtin, &i->u.u_c.chain, &i->u.u_c.end);
 }
 
+/* Convert the block being built on OBS, which must be the obstack
+   returned by push_string_init, into a composite block, and append a
+   link for a loop that binds NAME of length LEN while expanding BODY
+   of length BODY_LEN.  Return the new loop state, to be completed by
+   the caller.  */
+static m4__loop *
+append_loop (m4 *context, m4_obstack *obs, const char *name, size_t len,
+             const char *body, size_t body_len)
+{
+  m4__input *input = context->input;
+  m4_input_block *i = input->next;
+  m4__symbol_chain *chain;
+  m4__loop *loop;
+
+  assert (i && obs == input->current_input);
+  if (i->funcs == &string_funcs)
+    {
+      i->funcs = &composite_funcs;
+      i->u.u_c.chain = i->u.u_c.end = NULL;
+    }
+  else
+    assert (i->funcs == &composite_funcs);
+  m4__make_text_link (obs, &i->u.u_c.chain, &i->u.u_c.end);
+
+  loop = (m4__loop *) obstack_alloc (obs, sizeof *loop);
+  loop->name = (char *) obstack_copy0 (obs, name, len);
+  loop->len = len;
+  loop->body = (char *) obstack_copy (obs, body, body_len);
+  loop->body_len = body_len;
+  loop->list = NULL;
+  loop->count = loop->index = 0;
+  loop->value = loop->end = 0;
+  loop->started = false;
+  loop->done = false;
+
+  chain = (m4__symbol_chain *) obstack_alloc (obs, sizeof *chain);
+  if (i->u.u_c.end)
+    i->u.u_c.end->next = chain;
+  else
+    i->u.u_c.chain = chain;
+  i->u.u_c.end = chain;
+  chain->next = NULL;
+  chain->type = M4__CHAIN_LOOP;
+  chain->quote_age = 0;
+  chain->u.loop = loop;
+  return loop;
+}
+
+/* Push onto OBS, the obstack returned by push_string_init, a loop
+   that defines NAME of length LEN to each integer from START to END
+   in turn and expands BODY of length BODY_LEN after each definition.
+   Nothing is expanded if START is greater than END.  */
+void
+m4_push_forloop (m4 *context M4_GNUC_UNUSED, m4_obstack *obs,
+                 const char *name, size_t len, int start, int end,
+                 const char *body, size_t body_len)
+{
+  m4__loop *loop = append_loop (context, obs, name, len, body, body_len);
+  loop->value = start;
+  loop->end = end;
+  loop->done = end < start;
+}
+
+/* Return the length of the delimiter STR of length LEN if it starts
+   the LEFT bytes at P, otherwise 0.  */
+static size_t
+match_delim (const char *p, size_t left, const char *str, size_t len)
+{
+  return len && len <= left && memcmp (p, str, len) == 0 ? len : 0;
+}
+
+/* Push onto OBS, the obstack returned by push_string_init, a loop
+   that defines NAME of length LEN to each element of LIST, of length
+   LIST_LEN, in turn and expands BODY of length BODY_LEN after each
+   definition.  LIST is split like the arguments of a macro call,
+   using the current syntax: at commas outside quotes, comments and
+   nested parentheses, skipping leading whitespace and removing one
+   level of quotes from each element.  It is not rescanned.  If
+   PAREN, LIST must be enclosed in parentheses that are removed, and
+   a single empty element means an empty list; otherwise return false
+   without pushing anything.  When not PAREN, an empty LIST has no
+   elements.  */
+bool
+m4_push_foreach (m4 *context, m4_obstack *obs, const char *name, size_t len,
+                 const char *list, size_t list_len, bool paren,
+                 const char *body, size_t body_len)
+{
+  const m4_string_pair *quotes = m4_get_syntax_quotes (M4SYNTAX);
+  const m4_string_pair *comments = m4_get_syntax_comments (M4SYNTAX);
+  const char *end = list + list_len;
+  m4_string *elts = NULL;
+  size_t count = 0;
+  size_t alloc = 0;
+  m4__loop *loop;
+
+  if (paren)
+    {
+      if (list_len < 2
+          || !m4_has_syntax (M4SYNTAX, *list, M4_SYNTAX_OPEN)
+          || !m4_has_syntax (M4SYNTAX, end[-1], M4_SYNTAX_CLOSE))
+        return false;
+      list++;
+      end--;
+    }
+  else if (!list_len)
+    end = NULL;
+
+  loop = append_loop (context, obs, name, len, body, body_len);
+  while (end)
+    {
+      const char *p = list;
+      size_t depth = 0;
+      size_t n;
+
+      while (p < end && m4_has_syntax (M4SYNTAX, *p, M4_SYNTAX_SPACE))
+        p++;
+      while (p < end)
+        {
+          if ((n = match_delim (p, end - p, quotes->str1, quotes->len1)))
+            {
+              size_t level = 1;
+              p += n;
+              while (p < end)
+                {
+                  if ((n = match_delim (p, end - p, quotes->str2,
+                                        quotes->len2))
+                      && !--level)
+                    break;
+                  if (!n && (n = match_delim (p, end - p, quotes->str1,
+                                              quotes->len1)))
+                    level++;
+                  n = n ? n : 1;
+                  obstack_grow (obs, p, n);
+                  p += n;
+                }
+              if (p < end)
+                p += n;
+            }
+          else if ((n = match_delim (p, end - p, comments->str1,
+                                     comments->len1)))
+            {
+              const char *q = p + n;
+              while (q < end && !(n = match_delim (q, end - q, comments->str2,
+                                                   comments->len2)))
+                q++;
+              q = q < end ? q + n : end;
+              obstack_grow (obs, p, q - p);
+              p = q;
+            }
+          else if (!depth && m4_has_syntax (M4SYNTAX, *p, M4_SYNTAX_COMMA))
+            break;
+          else
+            {
+              if (m4_has_syntax (M4SYNTAX, *p, M4_SYNTAX_OPEN))
+                depth++;
+              else if (depth && m4_has_syntax (M4SYNTAX, *p,
+                                               M4_SYNTAX_CLOSE))
+                depth--;
+              obstack_1grow (obs, *p++);
+            }
+        }
+      if (count == alloc)
+        elts = x2nrealloc (elts, &alloc, sizeof *elts);
+      elts[count].len = obstack_object_size (obs);
+      obstack_1grow (obs, '\0');
+      elts[count++].str = (char *) obstack_finish (obs);
+      list = p + 1;
+      if (p >= end)
+        end = NULL;
+    }
+  if (paren && count == 1 && !elts[0].len)
+    count = 0;
+  loop->list = (m4_string *) obstack_alloc (obs, count * sizeof *elts);
+  if (count)
+    memcpy (loop->list, elts, count * sizeof *elts);
+  loop->count = count;
+  free (elts);
+  return true;
+}
+
+/* Bind the macro of LOOP to its next value and return true, or once
+   all values are used, remove the binding and return false.  The
+   first value is pushed, and later ones replace it, matching the
+   forloop and foreach macros of the manual.  */
+static bool
+loop_next (m4 *context, m4__loop *loop)
+{
+  char buf[INT_BUFSIZE_BOUND (int)];
+  m4_symbol_value *value;
+  const char *text;
+  size_t len;
+
+  if (loop->list ? loop->index == loop->count : loop->done)
+    {
+      if (loop->started && m4_symbol_lookup (M4SYMTAB, loop->name, loop->len))
+        m4_symbol_popdef (M4SYMTAB, loop->name, loop->len);
+      loop->started = false;
+      return false;
+    }
+  if (loop->list)
+    {
+      text = loop->list[loop->index].str;
+      len = loop->list[loop->index++].len;
+    }
+  else
+    {
+      len = sprintf (buf, "%d", loop->value);
+      text = buf;
+      if (loop->value == loop->end)
+        loop->done = true;
+      else
+        loop->value++;
+    }
+  value = m4_symbol_value_create ();
+  m4_set_symbol_value_text (value, xmemdup0 (text, len), len, 0);
+  if (loop->started)
+    m4_symbol_define (M4SYMTAB, loop->name, loop->len, value);
+  else
+    m4_symbol_pushdef (M4SYMTAB, loop->name, loop->len, value);
+  loop->started = true;
+  return true;
+}
+
+/* Push the body of LOOP, read from the composite block ME, as a new
+   string block.  The text already lives on the input stack beneath
+   the new block, so it is referenced rather than copied.  */
+static void
+push_loop_body (m4 *context, m4_input_block *me, m4__loop *loop)
+{
+  m4__input *input = context->input;
+
+  m4_push_string_init (context, me->file, me->line);
+  input->next->u.u_s.str = loop->body;
+  input->next->u.u_s.len = loop->body_len;
+  input->next->u.u_s.words = NULL;
+  input->next->prev = input->isp;
+  input->isp = input->next;
+  input->input_change = true;
+  input->next = NULL;
+}
+
 
 /* End of input optimization.  By providing these dummy callback
    functions, we guarantee that the input stack is never NULL, and
@@ -1145,7 +2167,8 @@ eof_read (m4_input_block *me, m4 *context M4_GNUC_UNUSED,
 }
 
 static void
-eof_unget (m4_input_block *me M4_GNUC_UNUSED, int ch)
+eof_unget (m4_input_block *me M4_GNUC_UNUSED, m4 *context M4_GNUC_UNUSED,
+           int ch)
 {
   assert (ch == CHAR_EOF);
 }
@@ -1165,7 +2188,8 @@ eof_buffer (m4_input_block *me M4_GNUC_UNUSED, m4 *context M4_GNUC_UNUSED,
 void
 m4_input_print (m4 *context, m4_obstack *obs, int debug_level)
 {
-  m4_input_block *block = next ? next : isp;
+  m4__input *input = context->input;
+  m4_input_block *block = input->next ? input->next : input->isp;
   assert (context && obs && (debug_level & M4_DEBUG_TRACE_EXPANSION));
   assert (block->funcs->print_func);
   block->funcs->print_func (block, context, obs, debug_level);
@@ -1179,27 +2203,29 @@ m4_obstack *
 m4__push_wrapup_init (m4 *context, const m4_call_info *caller,
                       m4__symbol_chain ***end)
 {
+  m4__input *input = context->input;
   m4_input_block *i;
   m4__symbol_chain *chain;
 
-  assert (obstack_object_size (wrapup_stack) == 0);
-  if (wsp != &input_eof)
+  assert (obstack_object_size (input->wrapup_stack) == 0);
+  if (input->wsp != &input_eof)
     {
-      i = wsp;
+      i = input->wsp;
       assert (i->funcs == &composite_funcs && i->u.u_c.end
               && i->u.u_c.end->type != M4__CHAIN_LOC);
     }
   else
     {
-      i = (m4_input_block *) obstack_alloc (wrapup_stack, sizeof *i);
-      i->prev = wsp;
+      i = (m4_input_block *) obstack_alloc (input->wrapup_stack, sizeof *i);
+      i->prev = input->wsp;
       i->funcs = &composite_funcs;
       i->file = caller->file;
       i->line = caller->line;
       i->u.u_c.chain = i->u.u_c.end = NULL;
-      wsp = i;
+      input->wsp = i;
     }
-  chain = (m4__symbol_chain *) obstack_alloc (wrapup_stack, sizeof *chain);
+  chain = (m4__symbol_chain *) obstack_alloc (input->wrapup_stack,
+                                              sizeof *chain);
   if (i->u.u_c.end)
     i->u.u_c.end->next = chain;
   else
@@ -1211,15 +2237,18 @@ m4__push_wrapup_init (m4 *context, const m4_call_info *caller,
   chain->u.u_l.file = caller->file;
   chain->u.u_l.line = caller->line;
   *end = &i->u.u_c.end;
-  return wrapup_stack;
+  return input->wrapup_stack;
 }
 
 /* After pushing wrapup text, this completes the bookkeeping.  */
 void
-m4__push_wrapup_finish (void)
+m4__push_wrapup_finish (m4 *context)
 {
-  m4__make_text_link (wrapup_stack, &wsp->u.u_c.chain, &wsp->u.u_c.end);
-  assert (wsp->u.u_c.end->type != M4__CHAIN_LOC);
+  m4__input *input = context->input;
+
+  m4__make_text_link (input->wrapup_stack, &input->wsp->u.u_c.chain,
+                      &input->wsp->u.u_c.end);
+  assert (input->wsp->u.u_c.end->type != M4__CHAIN_LOC);
 }
 
 
@@ -1230,20 +2259,22 @@ m4__push_wrapup_finish (void)
 static bool
 pop_input (m4 *context, bool cleanup)
 {
-  m4_input_block *tmp = isp->prev;
-
-  assert (isp);
-  if (isp->funcs->clean_func
-      ? !isp->funcs->clean_func (isp, context, cleanup)
-      : (isp->funcs->peek_func (isp, context, true) != CHAR_RETRY))
+  m4__input *input = context->input;
+  m4_input_block *tmp = input->isp->prev;
+
+  assert (input->isp);
+  if (input->isp->funcs->clean_func
+      ? !input->isp->funcs->clean_func (input->isp, context, cleanup)
+      : (input->isp->funcs->peek_func (input->isp, context, true)
+         != CHAR_RETRY))
     return false;
 
-  obstack_free (current_input, isp);
+  obstack_free (input->current_input, input->isp);
   m4__quote_uncache (M4SYNTAX);
-  next = NULL; /* might be set in m4_push_string_init () */
+  input->next = NULL; /* might be set in m4_push_string_init () */
 
-  isp = tmp;
-  input_change = true;
+  input->isp = tmp;
+  input->input_change = true;
   return true;
 }
 
@@ -1253,34 +2284,35 @@ pop_input (m4 *context, bool cleanup)
 bool
 m4_pop_wrapup (m4 *context)
 {
-  static size_t level = 0;
+  m4__input *input = context->input;
 
-  next = NULL;
-  obstack_free (current_input, NULL);
-  free (current_input);
+  input->next = NULL;
+  obstack_free (input->current_input, NULL);
+  free (input->current_input);
 
-  if (wsp == &input_eof)
+  if (input->wsp == &input_eof)
     {
-      obstack_free (wrapup_stack, NULL);
+      obstack_free (input->wrapup_stack, NULL);
       m4_set_current_file (context, NULL);
       m4_set_current_line (context, 0);
       m4_debug_message (context, M4_DEBUG_TRACE_INPUT,
                        _("input from m4wrap exhausted"));
-      current_input = NULL;
-      DELETE (wrapup_stack);
+      input->current_input = NULL;
+      DELETE (input->wrapup_stack);
       return false;
     }
 
   m4_debug_message (context, M4_DEBUG_TRACE_INPUT,
-                    _("input from m4wrap recursion level %zu"), ++level);
+                    _("input from m4wrap recursion level %zu"),
+                    ++input->wrapup_level);
 
-  current_input = wrapup_stack;
-  wrapup_stack = (m4_obstack *) xmalloc (sizeof *wrapup_stack);
-  obstack_init (wrapup_stack);
+  input->current_input = input->wrapup_stack;
+  input->wrapup_stack = (m4_obstack *) xmalloc (sizeof *input->wrapup_stack);
+  m4__arena_obstack_init (context, input->wrapup_stack);
 
-  isp = wsp;
-  wsp = &input_eof;
-  input_change = true;
+  input->isp = input->wsp;
+  input->wsp = &input_eof;
+  input->input_change = true;
 
   return true;
 }
@@ -1292,9 +2324,10 @@ m4_pop_wrapup (m4 *context)
 static void
 init_builtin_token (m4 *context, m4_obstack *obs, m4_symbol_value *token)
 {
+  m4__input *input = context->input;
   m4__symbol_chain *chain;
-  assert (isp->funcs == &composite_funcs);
-  chain = isp->u.u_c.chain;
+  assert (input->isp->funcs == &composite_funcs);
+  chain = input->isp->u.u_c.chain;
   assert (!chain->quote_age && chain->type == M4__CHAIN_FUNC
           && chain->u.builtin);
   if (obs)
@@ -1326,10 +2359,12 @@ init_builtin_token (m4 *context, m4_obstack *obs, m4_symbol_value *token)
 static void
 append_quote_token (m4 *context, m4_obstack *obs, m4_symbol_value *value)
 {
-  m4__symbol_chain *src_chain = isp->u.u_c.chain;
+  m4__input *input = context->input;
+  m4__symbol_chain *src_chain = input->isp->u.u_c.chain;
   m4__symbol_chain *chain;
-  assert (isp->funcs == &composite_funcs && obs && m4__quote_age (M4SYNTAX));
-  isp->u.u_c.chain = src_chain->next;
+  assert (input->isp->funcs == &composite_funcs && obs
+          && m4__quote_age (M4SYNTAX));
+  input->isp->u.u_c.chain = src_chain->next;
 
   /* Speed consideration - for short enough symbols, the speed and
      memory overhead of parsing another INPUT_CHAIN link outweighs the
@@ -1368,17 +2403,19 @@ append_quote_token (m4 *context, m4_obstack *obs, m4_symbol_value *value)
 static void
 init_argv_symbol (m4 *context, m4_obstack *obs, m4_symbol_value *value)
 {
+  m4__input *input = context->input;
   m4__symbol_chain *src_chain;
   m4__symbol_chain *chain;
   int ch;
   const m4_string_pair *comments = m4_get_syntax_comments (M4SYNTAX);
 
-  assert (value->type == M4_SYMBOL_VOID && isp->funcs == &composite_funcs
-          && isp->u.u_c.chain->type == M4__CHAIN_ARGV
+  assert (value->type == M4_SYMBOL_VOID
+          && input->isp->funcs == &composite_funcs
+          && input->isp->u.u_c.chain->type == M4__CHAIN_ARGV
           && obs && obstack_object_size (obs) == 0);
 
-  src_chain = isp->u.u_c.chain;
-  isp->u.u_c.chain = src_chain->next;
+  src_chain = input->isp->u.u_c.chain;
+  input->isp->u.u_c.chain = src_chain->next;
   value->type = M4_SYMBOL_COMP;
   /* Clone the link, since the input will be discarded soon.  */
   chain = (m4__symbol_chain *) obstack_copy (obs, src_chain, sizeof *chain);
@@ -1414,7 +2451,7 @@ init_argv_symbol (m4 *context, m4_obstack *obs, m4_symbol_value *value)
   ch = peek_char (context, true);
   if (!m4_has_syntax (M4SYNTAX, ch, M4_SYNTAX_COMMA | M4_SYNTAX_CLOSE))
     {
-      isp->u.u_c.chain = src_chain;
+      input->isp->u.u_c.chain = src_chain;
       src_chain->u.u_a.index = m4_arg_argc (chain->u.u_a.argv) - 1;
       src_chain->u.u_a.comma = true;
       chain->u.u_a.skip_last = true;
@@ -1435,20 +2472,22 @@ init_argv_symbol (m4 *context, m4_obstack *obs, m4_symbol_value *value)
 static int
 next_char (m4 *context, bool allow_quote, bool allow_argv, bool allow_unget)
 {
+  m4__input *input = context->input;
   int ch;
 
   while (1)
     {
-      if (input_change)
+      if (input->input_change)
         {
-          m4_set_current_file (context, isp->file);
-          m4_set_current_line (context, isp->line);
-          input_change = false;
+          m4_set_current_file (context, input->isp->file);
+          m4_set_current_line (context, input->isp->line);
+          input->input_change = false;
         }
 
-      assert (isp->funcs->read_func);
-      while (((ch = isp->funcs->read_func (isp, context, allow_quote,
-                                           allow_argv, allow_unget))
+      assert (input->isp->funcs->read_func);
+      while (((ch = input->isp->funcs->read_func (input->isp, context,
+                                                  allow_quote, allow_argv,
+                                                  allow_unget))
               != CHAR_RETRY)
              || allow_unget)
         {
@@ -1468,8 +2507,9 @@ next_char (m4 *context, bool allow_quote, bool allow_argv, bool allow_unget)
 static int
 peek_char (m4 *context, bool allow_argv)
 {
+  m4__input *input = context->input;
   int ch;
-  m4_input_block *block = isp;
+  m4_input_block *block = input->isp;
 
   while (1)
     {
@@ -1490,10 +2530,12 @@ peek_char (m4 *context, bool allow_argv)
    stack, using an existing input_block if possible.  This is not safe
    to call except immediately after next_char(context, aq, aa, true).  */
 static void
-unget_input (int ch)
+unget_input (m4 *context, int ch)
 {
-  assert (isp->funcs->unget_func != NULL);
-  isp->funcs->unget_func (isp, ch);
+  m4__input *input = context->input;
+
+  assert (input->isp->funcs->unget_func != NULL);
+  input->isp->funcs->unget_func (input->isp, context, ch);
 }
 
 /* Return a pointer to the available bytes of the current input block,
@@ -1506,19 +2548,21 @@ unget_input (int ch)
 static const char *
 next_buffer (m4 *context, size_t *len, bool allow_quote)
 {
+  m4__input *input = context->input;
   const char *buf;
   while (1)
     {
-      assert (isp);
-      if (input_change)
+      assert (input->isp);
+      if (input->input_change)
         {
-          m4_set_current_file (context, isp->file);
-          m4_set_current_line (context, isp->line);
-          input_change = false;
+          m4_set_current_file (context, input->isp->file);
+          m4_set_current_line (context, input->isp->line);
+          input->input_change = false;
         }
 
-      assert (isp->funcs->buffer_func);
-      buf = isp->funcs->buffer_func (isp, context, len, allow_quote);
+      assert (input->isp->funcs->buffer_func);
+      buf = input->isp->funcs->buffer_func (input->isp, context, len,
+                                            allow_quote);
       if (buf != buffer_retry)
         return buf;
       /* End of input source --- pop one level.  */
@@ -1526,17 +2570,34 @@ next_buffer (m4 *context, size_t *len, bool allow_quote)
     }
 }
 
+/* Like next_buffer (), but return NULL rather than move on to the next
+   input block once the current one is exhausted.  */
+static const char *
+current_buffer (m4 *context, size_t *len, bool allow_quote)
+{
+  m4__input *input = context->input;
+  const char *buf;
+
+  assert (input->isp);
+  if (input->input_change)
+    return NULL;
+  buf = input->isp->funcs->buffer_func (input->isp, context, len, allow_quote);
+  return buf == buffer_retry ? NULL : buf;
+}
+
 /* Consume LEN bytes from the current input block, as though by LEN
    calls to next_char().  LEN must be less than or equal to the
    previous length returned by a successful call to next_buffer().  */
 static void
 consume_buffer (m4 *context, size_t len)
 {
-  assert (isp && !input_change);
+  m4__input *input = context->input;
+
+  assert (input->isp && !input->input_change);
   if (len)
     {
-      assert (isp->funcs->consume_func);
-      isp->funcs->consume_func (isp, context, len);
+      assert (input->isp->funcs->consume_func);
+      input->isp->funcs->consume_func (input->isp, context, len);
     }
 }
 
@@ -1642,7 +2703,7 @@ match_input (m4 *context, const char *s, size_t len, bool consume)
   st = m4_push_string_init (context, m4_get_current_file (context),
                             m4_get_current_line (context));
   obstack_grow (st, t, n);
-  m4_push_string_finish ();
+  m4_push_string_finish (context);
   return result;
 }
 
@@ -1662,39 +2723,94 @@ match_input (m4 *context, const char *s, size_t len, bool consume)
    || (to_uchar ((s)[0]) == (ch)                                        \
        && ((len) >> 1 ? match_input (C, s, len, consume) : (len))))
 
+/* Return true if CH is the first byte of the start quote, end quote
+   or begin comment delimiter, or has M4_SYNTAX_RQUOTE.  When quotes
+   are not safe, a token that coalesces several bytes must not contain
+   such a byte: the bytes from there on might form a delimiter, in
+   this context or when the token is rescanned.  */
+static bool
+is_delim_start (m4 *context, int ch)
+{
+  const m4_string_pair *quote = &context->syntax->quote;
+  const m4_string_pair *comm = &context->syntax->comm;
+
+  return ((quote->len1 && ch == to_uchar (*quote->str1))
+          || (quote->len2 && ch == to_uchar (*quote->str2))
+          || (comm->len1 && ch == to_uchar (*comm->str1))
+          || m4_has_syntax (M4SYNTAX, ch, M4_SYNTAX_RQUOTE));
+}
+
+/* Return the length of the longest prefix of BUF, of length LEN, that
+   contains no byte satisfying is_delim_start.  BUF must not contain
+   bytes with M4_SYNTAX_LQUOTE.  */
+static size_t
+delim_cspan (m4 *context, const char *buf, size_t len)
+{
+  const m4_string_pair *quote = &context->syntax->quote;
+  const m4_string_pair *comm = &context->syntax->comm;
+  const char *p;
+
+  len = m4__syntax_cspan (M4SYNTAX, buf, len,
+                          M4_SYNTAX_LQUOTE | M4_SYNTAX_RQUOTE);
+  if (quote->len1)
+    {
+      p = (char *) memchr2 (buf, *quote->str1, *quote->str2, len);
+      if (p)
+        len = p - buf;
+    }
+  if (comm->len1)
+    {
+      p = (char *) memchr (buf, *comm->str1, len);
+      if (p)
+        len = p - buf;
+    }
+  return len;
+}
+
 /* While the current input character has the given SYNTAX, append it
-   to OBS.  Take care not to pop input source unless the next source
-   would continue the chain.  Return true if the chain ended with
-   CHAR_EOF.  */
+   to OBS.  If DELIMS, also stop short of any byte that might begin a
+   delimiter, which lets runs of text be coalesced even when quotes
+   are not safe.  If ONE_LINE, also stop right after the first newline,
+   and at the end of the current buffer without moving on to the next
+   input block, so that the current line is still that of the run when
+   it is output.  Take care not to pop input
+   source unless the next source would continue the chain.  Return
+   true if the chain ended with CHAR_EOF.  */
 static bool
-consume_syntax (m4 *context, m4_obstack *obs, unsigned int syntax)
+consume_syntax (m4 *context, m4_obstack *obs, unsigned int syntax,
+                bool delims, bool one_line)
 {
   int ch;
   bool allow = m4__safe_quotes (M4SYNTAX);
   assert (syntax);
+  delims = delims && !allow;
   while (1)
     {
       /* Start with a buffer search.  */
       size_t len;
-      const char *buffer = next_buffer (context, &len, allow);
+      const char *buffer = (one_line ? current_buffer (context, &len, allow)
+                            : next_buffer (context, &len, allow));
       if (buffer)
         {
-          const char *p = buffer;
-          while (len && m4_has_syntax (M4SYNTAX, *p, syntax))
-            {
-              len--;
-              p++;
-            }
-          obstack_grow (obs, buffer, p - buffer);
-          consume_buffer (context, p - buffer);
-          if (len)
+          size_t span = m4__syntax_span (M4SYNTAX, buffer, len, syntax);
+          const char *eol = NULL;
+          if (delims)
+            span = delim_cspan (context, buffer, span);
+          if (one_line && (eol = (char *) memchr (buffer, '\n', span)))
+            span = eol - buffer + 1;
+          obstack_grow (obs, buffer, span);
+          consume_buffer (context, span);
+          if (eol || span < len)
             return false;
         }
+      if (one_line)
+        return false;
       /* Fall back to byte-wise search.  It is safe to call next_char
          without first checking peek_char, except at input source
          boundaries, which we detect by CHAR_RETRY.  */
       ch = next_char (context, allow, allow, true);
-      if (ch < CHAR_EOF && m4_has_syntax (M4SYNTAX, ch, syntax))
+      if (ch < CHAR_EOF && m4_has_syntax (M4SYNTAX, ch, syntax)
+          && !(delims && is_delim_start (context, ch)))
         {
           obstack_1grow (obs, ch);
           continue;
@@ -1705,7 +2821,8 @@ consume_syntax (m4 *context, m4_obstack *obs, unsigned int syntax)
           /* We exploit the fact that CHAR_EOF, CHAR_BUILTIN,
              CHAR_QUOTE, and CHAR_ARGV do not satisfy any syntax
              categories.  */
-          if (m4_has_syntax (M4SYNTAX, ch, syntax))
+          if (m4_has_syntax (M4SYNTAX, ch, syntax)
+              && !(delims && is_delim_start (context, ch)))
             {
               assert (ch < CHAR_EOF);
               obstack_1grow (obs, ch);
@@ -1714,46 +2831,221 @@ consume_syntax (m4 *context, m4_obstack *obs, unsigned int syntax)
             }
           return ch == CHAR_EOF;
         }
-      unget_input (ch);
+      unget_input (context, ch);
       return false;
     }
 }
 
+
+/* Release one reference to the word cache CACHE.  */
+void
+m4__word_cache_unref (m4__word_cache *cache)
+{
+  assert (cache->refcount);
+  if (!--cache->refcount)
+    {
+      free (cache->entries);
+      free (cache);
+    }
+}
+
+/* Discard any entries of CACHE that changes to the syntax or symbol
+   table since they were recorded have made inaccurate.  */
+static void
+word_cache_validate (m4 *context, m4__word_cache *cache)
+{
+  unsigned int age = m4__lex_age (M4SYNTAX);
+  size_t added = m4__symtab_added (M4SYMTAB);
+  size_t removed = m4__symtab_removed (M4SYMTAB);
+
+  if (cache->lex_age != age)
+    cache->count = 0;
+  else if (cache->added != added || cache->removed != removed)
+    {
+      /* A new name can only turn a miss into a hit, and only removing
+         a name can invalidate a hit.  */
+      bool keep_misses = cache->added == added;
+      bool keep_hits = cache->removed == removed;
+      size_t i;
+      size_t j = 0;
+
+      for (i = 0; i < cache->count; i++)
+        if (cache->entries[i].symbol ? keep_hits : keep_misses)
+          cache->entries[j++] = cache->entries[i];
+      cache->count = j;
+    }
+  cache->lex_age = age;
+  cache->added = added;
+  cache->removed = removed;
+}
+
+/* Return the index of the first entry of CACHE at OFFSET or later,
+   trying HINT first.  */
+static size_t
+word_cache_search (m4__word_cache *cache, size_t offset, size_t hint)
+{
+  size_t lo = 0;
+  size_t hi = cache->count;
+
+  if (hint < hi && cache->entries[hint].offset == offset)
+    return hint;
+  while (lo < hi)
+    {
+      size_t mid = lo + (hi - lo) / 2;
+      if (cache->entries[mid].offset < offset)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  return lo;
+}
+
+/* The byte CH, which starts a word, was just read.  If it came from
+   the cached prefix of a string block, and the cache knows the word
+   at this offset, collect the word onto token_stack, consume the
+   rest of it from the block, and return true.  Otherwise, prepare
+   word_hint so that the lookup of the word can be remembered.  */
+static bool
+word_cache_start (m4 *context, int ch)
+{
+  m4__input *input = context->input;
+  m4_input_block *me = input->isp;
+  m4__word_cache *cache;
+  size_t offset;
+  size_t i;
+
+  if (me->funcs != &string_funcs || !me->u.u_s.words)
+    return false;
+  offset = me->u.u_s.str - 1 - me->u.u_s.base;
+  if (me->u.u_s.prefix <= offset + 1)
+    return false;
+  assert (to_uchar (me->u.u_s.str[-1]) == ch);
+
+  cache = me->u.u_s.words;
+  word_cache_validate (context, cache);
+  i = word_cache_search (cache, offset, me->u.u_s.word);
+  input->word_hint.cache = cache;
+  input->word_hint.block = me;
+  input->word_hint.offset = offset;
+  if (i < cache->count && cache->entries[i].offset == offset)
+    {
+      size_t len = cache->entries[i].len;
+      assert (len <= me->u.u_s.len + 1);
+      obstack_grow (&input->token_stack, me->u.u_s.str - 1, len);
+      string_consume (me, context, len - 1);
+      me->u.u_s.word = i + 1;
+      input->word_hint.len = len;
+      input->word_hint.hit = true;
+      input->word_hint.symbol = cache->entries[i].symbol;
+      return true;
+    }
+  me->u.u_s.word = i;
+  input->word_hint.hit = false;
+  return false;
+}
+
+/* A word of length LEN was just lexed after word_cache_start ()
+   found no entry for it.  Keep word_hint only if both the word and
+   the byte that ended it came from the cached prefix.  */
+static void
+word_cache_finish (m4 *context, size_t len)
+{
+  m4__input *input = context->input;
+  m4_input_block *me = input->word_hint.block;
+
+  if (!input->word_hint.cache)
+    return;
+  if (input->isp != me
+      || me->u.u_s.str - me->u.u_s.base != input->word_hint.offset + len
+      || me->u.u_s.prefix <= input->word_hint.offset + len)
+    input->word_hint.cache = NULL;
+  else
+    input->word_hint.len = len;
+}
+
+/* Return the symbol named NAME of length LEN, or NULL if it is not
+   defined, as m4_symbol_lookup () would.  NAME must be the word most
+   recently returned by m4__next_token (), less any escape character,
+   so that the result can come from, or be remembered in, the word
+   cache of the input block that supplied it.  */
+m4_symbol *
+m4__lookup_word (m4 *context, const char *name, size_t len)
+{
+  m4__input *input = context->input;
+  m4__word_cache *cache = input->word_hint.cache;
+  m4_symbol *symbol;
+
+  input->word_hint.cache = NULL;
+  if (!cache)
+    return m4_symbol_lookup (M4SYMTAB, name, len);
+  if (input->word_hint.hit)
+    symbol = input->word_hint.symbol;
+  else
+    {
+      m4_input_block *me = input->word_hint.block;
+      size_t i;
+
+      symbol = m4__symtab_entry (M4SYMTAB, name, len);
+      word_cache_validate (context, cache);
+      i = word_cache_search (cache, input->word_hint.offset, me->u.u_s.word);
+      assert (i == cache->count
+              || cache->entries[i].offset != input->word_hint.offset);
+      if (cache->count == cache->alloc)
+        cache->entries = (word_entry *) x2nrealloc (cache->entries,
+                                                    &cache->alloc,
+                                                    sizeof *cache->entries);
+      memmove (&cache->entries[i + 1], &cache->entries[i],
+               (cache->count - i) * sizeof *cache->entries);
+      cache->entries[i].offset = input->word_hint.offset;
+      cache->entries[i].len = input->word_hint.len;
+      cache->entries[i].symbol = symbol;
+      cache->count++;
+      me->u.u_s.word = i + 1;
+    }
+  return symbol && m4_get_symbol_value (symbol) ? symbol : NULL;
+}
+
 
 /* Initialize input stacks.  */
 void
 m4_input_init (m4 *context)
 {
-  obstack_init (&file_names);
+  m4__input *input = (m4__input *) xzalloc (sizeof *input);
+
+  assert (!context->input);
+  context->input = input;
+  obstack_init (&input->file_names);
   m4_set_current_file (context, NULL);
   m4_set_current_line (context, 0);
 
-  current_input = (m4_obstack *) xmalloc (sizeof *current_input);
-  obstack_init (current_input);
-  wrapup_stack = (m4_obstack *) xmalloc (sizeof *wrapup_stack);
-  obstack_init (wrapup_stack);
+  input->current_input = (m4_obstack *) xmalloc (sizeof (m4_obstack));
+  m4__arena_obstack_init (context, input->current_input);
+  input->wrapup_stack = (m4_obstack *) xmalloc (sizeof (m4_obstack));
+  m4__arena_obstack_init (context, input->wrapup_stack);
 
   /* Allocate an object in the current chunk, so that obstack_free
      will always work even if the first token parsed spills to a new
      chunk.  */
-  obstack_init (&token_stack);
-  token_bottom = obstack_finish (&token_stack);
-
-  isp = &input_eof;
-  wsp = &input_eof;
-  next = NULL;
+  m4__arena_obstack_init (context, &input->token_stack);
+  input->token_bottom = obstack_finish (&input->token_stack);
 
-  start_of_input_line = false;
+  input->isp = &input_eof;
+  input->wsp = &input_eof;
+  input->newline_kernel = newline_pick ();
 }
 
 /* Free memory used by the input engine.  */
 void
-m4_input_exit (void)
+m4_input_exit (m4 *context)
 {
-  assert (!current_input && isp == &input_eof);
-  assert (!wrapup_stack && wsp == &input_eof);
-  obstack_free (&file_names, NULL);
-  obstack_free (&token_stack, NULL);
+  m4__input *input = context->input;
+
+  assert (!input->current_input && input->isp == &input_eof);
+  assert (!input->wrapup_stack && input->wsp == &input_eof);
+  obstack_free (&input->file_names, NULL);
+  obstack_free (&input->token_stack, NULL);
+  free (input);
+  context->input = NULL;
 }
 
 
@@ -1776,6 +3068,7 @@ m4__token_type
 m4__next_token (m4 *context, m4_symbol_value *token, int *line,
                 m4_obstack *obs, bool allow_argv, const m4_call_info *caller)
 {
+  m4__input *input = context->input;
   int ch;
   int quote_level;
   m4__token_type type;
@@ -1785,12 +3078,13 @@ m4__next_token (m4 *context, m4_symbol_value *token, int *line,
      for tokens where argument collection might not use the literal
      token.  But for comments and strings, we can output directly into
      the argument collection obstack OBS, if provided.  */
-  m4_obstack *obs_safe = &token_stack;
+  m4_obstack *obs_safe = &input->token_stack;
 
-  assert (next == NULL);
+  assert (input->next == NULL);
   memset (token, '\0', sizeof *token);
+  input->word_hint.cache = NULL;
   do {
-    obstack_free (&token_stack, token_bottom);
+    obstack_free (&input->token_stack, input->token_bottom);
 
     /* Must consume an input character.  */
     ch = next_char (context, false, allow_argv && m4__quote_age (M4SYNTAX),
@@ -1827,17 +3121,28 @@ m4__next_token (m4 *context, m4_symbol_value *token, int *line,
 
     if (m4_has_syntax (M4SYNTAX, ch, M4_SYNTAX_ESCAPE))
       { /* ESCAPED WORD */
-        obstack_1grow (&token_stack, ch);
-        if ((ch = next_char (context, false, false, false)) < CHAR_EOF)
+        if (word_cache_start (context, ch))
+          type = M4_TOKEN_WORD;
+        else
           {
-            obstack_1grow (&token_stack, ch);
-            if (m4_has_syntax (M4SYNTAX, ch, M4_SYNTAX_ALPHA))
-              consume_syntax (context, &token_stack,
-                              M4_SYNTAX_ALPHA | M4_SYNTAX_NUM);
-            type = M4_TOKEN_WORD;
+            obstack_1grow (&input->token_stack, ch);
+            if ((ch = next_char (context, false, false, false)) < CHAR_EOF)
+              {
+                obstack_1grow (&input->token_stack, ch);
+                if (m4_has_syntax (M4SYNTAX, ch, M4_SYNTAX_ALPHA))
+                  consume_syntax (context, &input->token_stack,
+                                  M4_SYNTAX_ALPHA | M4_SYNTAX_NUM, false,
+                                  false);
+                type = M4_TOKEN_WORD;
+                word_cache_finish (context,
+                                   obstack_object_size (&input->token_stack));
+              }
+            else
+              {
+                type = M4_TOKEN_SIMPLE; /* escape before eof */
+                input->word_hint.cache = NULL;
+              }
           }
-        else
-          type = M4_TOKEN_SIMPLE; /* escape before eof */
       }
     else if (m4_has_syntax (M4SYNTAX, ch, M4_SYNTAX_ALPHA))
       {
@@ -1845,8 +3150,15 @@ m4__next_token (m4 *context, m4_symbol_value *token, int *line,
                 ? M4_TOKEN_STRING : M4_TOKEN_WORD);
         if (type == M4_TOKEN_STRING && obs)
           obs_safe = obs;
-        obstack_1grow (obs_safe, ch);
-        consume_syntax (context, obs_safe, M4_SYNTAX_ALPHA | M4_SYNTAX_NUM);
+        if (type != M4_TOKEN_WORD || !word_cache_start (context, ch))
+          {
+            obstack_1grow (obs_safe, ch);
+            consume_syntax (context, obs_safe,
+                            M4_SYNTAX_ALPHA | M4_SYNTAX_NUM, false, false);
+            if (type == M4_TOKEN_WORD)
+              word_cache_finish (context,
+                                 obstack_object_size (&input->token_stack));
+          }
       }
     else if (MATCH (context, ch, M4_SYNTAX_LQUOTE,
                     context->syntax->quote.str1,
@@ -1864,8 +3176,56 @@ m4__next_token (m4 *context, m4_symbol_value *token, int *line,
                                               obs && m4__quote_age (M4SYNTAX));
             if (buffer)
               {
+                const m4_string_pair *quote = &context->syntax->quote;
                 const char *p = buffer;
-                if (m4_is_syntax_single_quotes (M4SYNTAX))
+                if (m4_is_syntax_single_quotes (M4SYNTAX)
+                    && (1 < quote->len1 || 1 < quote->len2))
+                  {
+                    /* Check each candidate for a multi-byte delimiter
+                       in place, leaving one that might straddle the
+                       end of the buffer, or that has a delimiter
+                       category of its own, to the MATCH below.  */
+                    const char *end = buffer + len;
+                    while ((p = (char *) memchr2 (p, *quote->str1,
+                                                  *quote->str2, end - p)))
+                      {
+                        if (m4_has_syntax (M4SYNTAX, *p,
+                                           (M4_SYNTAX_LQUOTE
+                                            | M4_SYNTAX_RQUOTE)))
+                          break;
+                        if (*p == *quote->str2)
+                          {
+                            if ((size_t) (end - p) < quote->len2)
+                              break;
+                            if (memcmp (p, quote->str2, quote->len2) == 0)
+                              {
+                                if (--quote_level == 0)
+                                  break;
+                                p += quote->len2;
+                                continue;
+                              }
+                          }
+                        if (*p == *quote->str1)
+                          {
+                            if ((size_t) (end - p) < quote->len1)
+                              break;
+                            if (memcmp (p, quote->str1, quote->len1) == 0)
+                              {
+                                quote_level++;
+                                p += quote->len1;
+                                continue;
+                              }
+                          }
+                        p++;
+                      }
+                    if (!quote_level)
+                      {
+                        obstack_grow (obs_safe, buffer, p - buffer);
+                        consume_buffer (context, p - buffer + quote->len2);
+                        break;
+                      }
+                  }
+                else if (m4_is_syntax_single_quotes (M4SYNTAX))
                   do
                     {
                       p = (char *) memchr2 (p, *context->syntax->quote.str1,
@@ -1877,17 +3237,12 @@ m4__next_token (m4 *context, m4_symbol_value *token, int *line,
                              ? --quote_level : ++quote_level));
                 else
                   {
-                    size_t remaining = len;
                     assert (context->syntax->quote.len1 == 1
                             && context->syntax->quote.len2 == 1);
-                    while (remaining && !m4_has_syntax (M4SYNTAX, *p,
-                                                        (M4_SYNTAX_LQUOTE
-                                                         | M4_SYNTAX_RQUOTE)))
-                      {
-                        p++;
-                        remaining--;
-                      }
-                    if (!remaining)
+                    p += m4__syntax_cspan (M4SYNTAX, buffer, len,
+                                           (M4_SYNTAX_LQUOTE
+                                            | M4_SYNTAX_RQUOTE));
+                    if (p == buffer + len)
                       p = NULL;
                   }
                 if (p)
@@ -1978,20 +3333,33 @@ m4__next_token (m4 *context, m4_symbol_value *token, int *line,
               {
                 const char *p;
                 if (m4_is_syntax_single_comments (M4SYNTAX))
-                  p = (char *) memchr (buffer, *context->syntax->comm.str2,
-                                       len);
-                else
                   {
-                    size_t remaining = len;
-                    assert (context->syntax->comm.len2 == 1);
+                    const m4_string_pair *comm = &context->syntax->comm;
+                    const char *end = buffer + len;
                     p = buffer;
-                    while (remaining
-                           && !m4_has_syntax (M4SYNTAX, *p, M4_SYNTAX_ECOMM))
+                    while ((p = (char *) memchr (p, *comm->str2, end - p))
+                           && 1 < comm->len2
+                           && comm->len2 <= (size_t) (end - p)
+                           && !m4_has_syntax (M4SYNTAX, *p, M4_SYNTAX_ECOMM)
+                           && memcmp (p, comm->str2, comm->len2) != 0)
+                      p++;
+                    if (p && 1 < comm->len2
+                        && comm->len2 <= (size_t) (end - p)
+                        && !m4_has_syntax (M4SYNTAX, *p, M4_SYNTAX_ECOMM))
                       {
-                        p++;
-                        remaining--;
+                        /* The whole end delimiter is in the buffer.  */
+                        obstack_grow (obs_safe, buffer,
+                                      p - buffer + comm->len2);
+                        consume_buffer (context, p - buffer + comm->len2);
+                        break;
                       }
-                    if (!remaining)
+                  }
+                else
+                  {
+                    assert (context->syntax->comm.len2 == 1);
+                    p = buffer + m4__syntax_cspan (M4SYNTAX, buffer, len,
+                                                   M4_SYNTAX_ECOMM);
+                    if (p == buffer + len)
                       p = NULL;
                   }
                 if (p)
@@ -2045,28 +3413,28 @@ m4__next_token (m4 *context, m4_symbol_value *token, int *line,
       }
     else if (m4_has_syntax (M4SYNTAX, ch, M4_SYNTAX_ACTIVE))
       { /* ACTIVE CHARACTER */
-        obstack_1grow (&token_stack, ch);
+        obstack_1grow (&input->token_stack, ch);
         type = M4_TOKEN_WORD;
       }
     else if (m4_has_syntax (M4SYNTAX, ch, M4_SYNTAX_OPEN))
       { /* OPEN PARENTHESIS */
-        obstack_1grow (&token_stack, ch);
+        obstack_1grow (&input->token_stack, ch);
         type = M4_TOKEN_OPEN;
       }
     else if (m4_has_syntax (M4SYNTAX, ch, M4_SYNTAX_COMMA))
       { /* COMMA */
-        obstack_1grow (&token_stack, ch);
+        obstack_1grow (&input->token_stack, ch);
         type = M4_TOKEN_COMMA;
       }
     else if (m4_has_syntax (M4SYNTAX, ch, M4_SYNTAX_CLOSE))
       { /* CLOSE PARENTHESIS */
-        obstack_1grow (&token_stack, ch);
+        obstack_1grow (&input->token_stack, ch);
         type = M4_TOKEN_CLOSE;
       }
     else
       { /* EVERYTHING ELSE */
         assert (ch < CHAR_EOF);
-        obstack_1grow (&token_stack, ch);
+        obstack_1grow (&input->token_stack, ch);
         if (m4_has_syntax (M4SYNTAX, ch, M4_SYNTAX_OTHER | M4_SYNTAX_NUM))
           {
             if (obs)
@@ -2074,19 +3442,23 @@ m4__next_token (m4 *context, m4_symbol_value *token, int *line,
                 obs_safe = obs;
                 obstack_1grow (obs, ch);
               }
-            if (m4__safe_quotes (M4SYNTAX))
+            if (m4__safe_quotes (M4SYNTAX) || !is_delim_start (context, ch))
               consume_syntax (context, obs_safe,
-                              M4_SYNTAX_OTHER | M4_SYNTAX_NUM);
+                              M4_SYNTAX_OTHER | M4_SYNTAX_NUM, true, false);
             type = M4_TOKEN_STRING;
           }
         else if (m4_has_syntax (M4SYNTAX, ch, M4_SYNTAX_SPACE))
           {
-            /* Coalescing newlines when interactive or when synclines
-               are enabled is wrong.  */
-            if (!m4_get_interactive_opt (context)
-                && !m4_get_syncoutput_opt (context)
-                && m4__safe_quotes (M4SYNTAX))
-              consume_syntax (context, &token_stack, M4_SYNTAX_SPACE);
+            /* Coalescing newlines when interactive is wrong.  When
+               synclines are enabled, each line may need a syncline
+               of its own, so a run of space only extends to the end
+               of the line it starts on.  */
+            bool sync = m4_get_syncoutput_opt (context);
+            if (!m4_get_interactive_opt (context) && !(sync && ch == '\n')
+                && (m4__safe_quotes (M4SYNTAX)
+                    || !is_delim_start (context, ch)))
+              consume_syntax (context, &input->token_stack, M4_SYNTAX_SPACE,
+                              true, sync);
             type = M4_TOKEN_SPACE;
           }
         else
@@ -2098,11 +3470,12 @@ m4__next_token (m4 *context, m4_symbol_value *token, int *line,
     {
       if (obs_safe != obs)
         {
-          len = obstack_object_size (&token_stack);
-          obstack_1grow (&token_stack, '\0');
+          len = obstack_object_size (&input->token_stack);
+          obstack_1grow (&input->token_stack, '\0');
 
-          m4_set_symbol_value_text (token, obstack_finish (&token_stack), len,
-                                    m4__quote_age (M4SYNTAX));
+          m4_set_symbol_value_text (token,
+                                    obstack_finish (&input->token_stack),
+                                    len, m4__quote_age (M4SYNTAX));
         }
       else
         assert (type == M4_TOKEN_STRING || type == M4_TOKEN_COMMENT);
@@ -2115,11 +3488,11 @@ m4__next_token (m4 *context, m4_symbol_value *token, int *line,
 #ifdef DEBUG_INPUT
   if (token->type == M4_SYMBOL_VOID)
     {
-      len = obstack_object_size (&token_stack);
-      obstack_1grow (&token_stack, '\0');
+      len = obstack_object_size (&input->token_stack);
+      obstack_1grow (&input->token_stack, '\0');
 
-      m4_set_symbol_value_text (token, obstack_finish (&token_stack), len,
-                                m4__quote_age (M4SYNTAX));
+      m4_set_symbol_value_text (token, obstack_finish (&input->token_stack),
+                                len, m4__quote_age (M4SYNTAX));
     }
 
   m4_print_token (context, "next_token", type, token);
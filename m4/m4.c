@@ -20,20 +20,21 @@
 
 #include <config.h>
 
-#include "bitrotate.h"
 #include "m4private.h"
 
+#include "glthread/lock.h"
+#include "glthread/tls.h"
+
 #define DEFAULT_NESTING_LIMIT	1024
+#define DEFAULT_DIVERSION_MEMORY (512 * 1024)
+#define DEFAULT_REGEXP_CACHE    64
 #define DEFAULT_NAMEMAP_SIZE    61
 
 static size_t
 hashfn (const void *ptr)
 {
   const char *s = (const char *) ptr;
-  size_t val = DEFAULT_NAMEMAP_SIZE;
-  while (*s)
-    val = rotl_sz (val, 7) + to_uchar (*s++);
-  return val;
+  return m4__hash_mem (s, strlen (s));
 }
 
 
@@ -54,6 +55,8 @@ m4_create (void)
   context->nesting_limit = DEFAULT_NESTING_LIMIT;
   context->debug_level = M4_DEBUG_TRACE_INITIAL;
   context->max_debug_arg_length = SIZE_MAX;
+  context->diversion_memory = DEFAULT_DIVERSION_MEMORY;
+  context->regexp_cache = DEFAULT_REGEXP_CACHE;
 
   context->search_path =
     (m4__search_path_info *) xzalloc (sizeof *context->search_path);
@@ -65,9 +68,16 @@ m4_create (void)
 void
 m4_delete (m4 *context)
 {
+  m4_module *module;
   size_t i;
   assert (context);
 
+  /* Module data may refer to anything else in the context, so
+     release it first.  */
+  for (module = context->modules; module; module = module->next)
+    if (module->data_free)
+      module->data_free (context, module->data);
+
   if (context->symtab)
     m4_symtab_delete (context->symtab);
 
@@ -81,19 +91,7 @@ m4_delete (m4 *context)
   obstack_free (&context->trace_messages, NULL);
 
   if (context->search_path)
-    {
-      m4__search_path *path = context->search_path->list;
-
-      while (path)
-        {
-          m4__search_path *stale = path;
-          path = path->next;
-
-          DELETE (stale->dir); /* Cast away const.  */
-          free (stale);
-        }
-      free (context->search_path);
-    }
+    m4__search_path_delete (context->search_path);
 
   for (i = 0; i < context->stacks_count; i++)
     {
@@ -108,11 +106,71 @@ m4_delete (m4 *context)
         }
     }
   free (context->arg_stacks);
+  m4__arg_arena_delete (context);
+
+  m4__regexp_cache_delete (context->regexp_cache_table);
+
+  if (context->profile)
+    m4__profile_delete (context->profile);
+
+  if (context->file_cache)
+    m4__file_cache_delete (context->file_cache);
 
   free (context);
 }
 
 
+/* The modules keep caches in thread-local storage, which the thread
+   library does not release when a thread exits.  Each thread instead
+   has a list of functions to call on exit, which m4_thread_cleanup
+   adds to.  */
+typedef struct thread_cleanup thread_cleanup;
+struct thread_cleanup
+{
+  void (*func) (void);          /* Function to call.  */
+  thread_cleanup *next;         /* Next function, registered earlier.  */
+};
+
+static gl_tls_key_t thread_cleanup_key;
+gl_once_define (static, thread_cleanup_once)
+
+static void
+thread_cleanup_run (void *list)
+{
+  thread_cleanup *cleanup = (thread_cleanup *) list;
+
+  while (cleanup)
+    {
+      thread_cleanup *next = cleanup->next;
+      cleanup->func ();
+      free (cleanup);
+      cleanup = next;
+    }
+}
+
+static void
+thread_cleanup_init (void)
+{
+  gl_tls_key_init (thread_cleanup_key, thread_cleanup_run);
+}
+
+/* Arrange for FUNC to be called when the calling thread exits, so
+   that it can release what the thread keeps in variables declared
+   with M4_THREAD_LOCAL.  Callers register each function once per
+   thread.  Nothing is called for the initial thread, since its
+   storage lasts until the process exits.  */
+void
+m4_thread_cleanup (void (*func) (void))
+{
+  thread_cleanup *cleanup = (thread_cleanup *) xmalloc (sizeof *cleanup);
+
+  gl_once (thread_cleanup_once, thread_cleanup_init);
+  cleanup->func = func;
+  cleanup->next = (thread_cleanup *) gl_tls_get (thread_cleanup_key);
+  gl_tls_set (thread_cleanup_key, cleanup);
+}
+
+
 
 /* Use the preprocessor to generate the repetitive bit twiddling functions
    for us.  Note the additional paretheses around the expanded function
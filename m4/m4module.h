@@ -31,6 +31,7 @@ BEGIN_C_DECLS
 /* --- MODULE AUTHOR DECLARATIONS --- */
 
 typedef struct m4               m4;
+typedef struct m4_arg_iter      m4_arg_iter;
 typedef struct m4_builtin       m4_builtin;
 typedef struct m4_call_info     m4_call_info;
 typedef struct m4_macro         m4_macro;
@@ -172,6 +173,7 @@ typedef struct m4_symbol_table  m4_symbol_table;
 
 extern m4 *             m4_create       (void);
 extern void             m4_delete       (m4 *);
+extern void             m4_thread_cleanup (void (*) (void));
 
 #define m4_context_field_table                                          \
         M4FIELD(m4_symbol_table *, symbol_table,   symtab)              \
@@ -182,11 +184,14 @@ extern void             m4_delete       (m4 *);
         M4FIELD(FILE *,            debug_file,     debug_file)          \
         M4FIELD(m4_obstack,        trace_messages, trace_messages)      \
         M4FIELD(int,               exit_status,    exit_status)         \
+        M4FIELD(int,               sysval,         sysval)              \
         M4FIELD(int,    current_diversion,         current_diversion)   \
         M4FIELD(size_t, nesting_limit_opt,         nesting_limit)       \
         M4FIELD(int,    debug_level_opt,           debug_level)         \
         M4FIELD(size_t, max_debug_arg_length_opt,  max_debug_arg_length)\
         M4FIELD(int,    regexp_syntax_opt,         regexp_syntax)       \
+        M4FIELD(size_t, diversion_memory_opt,      diversion_memory)    \
+        M4FIELD(size_t, regexp_cache_opt,          regexp_cache)        \
 
 
 #define m4_context_opt_bit_table                                        \
@@ -199,6 +204,7 @@ extern void             m4_delete       (m4 *);
         M4OPT_BIT(M4_OPT_FATAL_WARN_BIT,        fatal_warnings_opt)     \
         M4OPT_BIT(M4_OPT_WARN_EXIT_BIT,         warnings_exit_opt)      \
         M4OPT_BIT(M4_OPT_SAFER_BIT,             safer_opt)              \
+        M4OPT_BIT(M4_OPT_CACHE_INCLUDES_BIT,    cache_includes_opt)     \
 
 
 #define M4FIELD(type, base, field)                                      \
@@ -221,6 +227,22 @@ m4_context_opt_bit_table
 /* --- MODULE MANAGEMENT --- */
 
 typedef void m4_module_init_func   (m4 *, m4_module *, m4_obstack *);
+typedef void m4_module_data_free_func (m4 *, void *);
+
+/* Describe a symbol exported by a module that is linked into the
+   executable, for use by m4_module_import.  */
+typedef struct {
+  const char *          name;           /* Name of the symbol.  */
+  void *                address;        /* Its address.  */
+} m4_static_symbol;
+
+/* Describe a module that is linked into the executable, so that
+   loading it needs no dlopen.  */
+typedef struct {
+  const char *          name;           /* Name of the module.  */
+  m4_module_init_func * init_func;      /* Its include_NAME entry point.  */
+  const m4_static_symbol *symbols;      /* Exports, ending in NULL name.  */
+} m4_static_module;
 
 extern m4_module *  m4_module_load     (m4 *, const char *, m4_obstack *);
 extern void *       m4_module_import   (m4 *, const char *, const char *,
@@ -232,6 +254,12 @@ extern void         m4_install_macros   (m4*, m4_module *, const m4_macro*);
 extern const char * m4_get_module_name (const m4_module *);
 extern m4_module *  m4_module_next     (m4*, m4_module *);
 
+extern void *       m4_get_module_data (m4 *, const char *);
+extern void         m4_set_module_data (m4_module *, void *,
+                                        m4_module_data_free_func *);
+
+extern void         m4_set_static_modules (m4 *, const m4_static_module *);
+
 
 
 /* --- SYMBOL TABLE MANAGEMENT --- */
@@ -315,6 +343,17 @@ extern void             m4_set_symbol_value_text  (m4_symbol_value *,
 extern void             m4_set_symbol_value_placeholder (m4_symbol_value *,
                                                          const char *);
 
+/* A builtin may attach data derived from a symbol value to it, to be
+   released with FREE_FUNC as soon as the value is deleted or
+   overwritten.  The data is identified by FREE_FUNC, so that only the
+   builtin that attached it finds it again.  */
+typedef void m4_symbol_value_cache_free_func (void *);
+
+extern void *           m4_get_symbol_value_cache (m4_symbol_value *,
+                                        m4_symbol_value_cache_free_func *);
+extern void             m4_set_symbol_value_cache (m4_symbol_value *, void *,
+                                        m4_symbol_value_cache_free_func *);
+
 
 
 /* --- BUILTIN MANAGEMENT --- */
@@ -341,6 +380,11 @@ extern bool     m4_arg_equal            (m4 *, m4_macro_args *, size_t,
                                          size_t);
 extern bool     m4_arg_empty            (m4_macro_args *, size_t);
 extern size_t   m4_arg_len              (m4 *, m4_macro_args *, size_t, bool);
+extern m4_arg_iter *m4_arg_iter_start   (m4 *, m4_macro_args *, size_t, bool);
+extern bool     m4_arg_iter_next        (m4_arg_iter *, const char **,
+                                         size_t *);
+extern void     m4_arg_grow             (m4 *, m4_obstack *, m4_macro_args *,
+                                         size_t, size_t, size_t);
 extern m4_builtin_func *m4_arg_func     (m4_macro_args *, size_t);
 extern m4_obstack *m4_arg_scratch       (m4 *);
 extern m4_macro_args *m4_make_argv_ref  (m4 *, m4_macro_args *, const char *,
@@ -384,9 +428,11 @@ enum {
   M4_DEBUG_TRACE_DEREF          = (1 << 12),
   /* o: output dumpdef to stderr, not debug file */
   M4_DEBUG_TRACE_OUTPUT_DUMPDEF = (1 << 13),
+  /* r: trace regexp compilation and cache statistics */
+  M4_DEBUG_TRACE_REGEXP         = (1 << 14),
 
   /* V: very verbose --  print everything */
-  M4_DEBUG_TRACE_VERBOSE        = ((1 << 14) - 1)
+  M4_DEBUG_TRACE_VERBOSE        = ((1 << 15) - 1)
 };
 
 /* initial flags, used if no -d or -E -- equiv: d */
@@ -409,6 +455,15 @@ extern void     m4_debug_message        (m4 *, int, const char *, ...)
 extern void     m4_trace_prepare        (m4 *, const m4_call_info *,
                                          m4_symbol_value *);
 
+extern void     m4_profile_start        (m4 *, const char *, bool);
+extern bool     m4_profile_finish       (m4 *);
+
+extern void     m4_stats_start          (m4 *, bool);
+extern bool     m4_stats_finish         (m4 *);
+extern const char *m4_stats_name        (size_t);
+extern bool     m4_stats_get            (m4 *, const char *, size_t,
+                                         size_t *);
+
 
 /* --- REGEXP SYNTAX --- */
 
@@ -416,6 +471,36 @@ extern const char *     m4_regexp_syntax_decode (int);
 extern int              m4_regexp_syntax_encode (const char *);
 
 
+
+/* --- REGULAR EXPRESSIONS --- */
+
+/* Patterns simple enough to be matched without the regex engine.  */
+enum {
+  M4_PATTERN_REGEX,     /* needs re_search */
+  M4_PATTERN_LITERAL,   /* text from lit, possibly anchored at a line */
+  M4_PATTERN_CLASS      /* a single byte for which map is set */
+};
+
+/* A compiled regex, as handed out by the context's regexp cache.  The
+   buffer stays valid until the next call to m4_regexp_compile.  */
+typedef struct {
+  int resyntax;                         /* flavor of regex */
+  size_t len;                           /* length of string */
+  char *str;                            /* copy of compiled string */
+  struct re_pattern_buffer *pat;        /* compiled regex, allocated */
+  struct re_registers regs;             /* match registers, reused */
+  int kind;                             /* M4_PATTERN_* classification */
+  const char *lit;                      /* literal text, within str */
+  size_t lit_len;                       /* length of lit */
+  bool bol;                             /* literal must start a line */
+  bool eol;                             /* literal must end a line */
+  char *map;                            /* bytes matched by a class */
+} m4_pattern_buffer;
+
+extern m4_pattern_buffer *m4_regexp_compile (m4 *, const m4_call_info *,
+                                             const char *, size_t, int);
+
+
 
 /* --- SYNTAX TABLE DEFINITIONS --- */
 
@@ -493,7 +578,7 @@ extern void     m4_reset_syntax (m4_syntax_table *);
 /* --- INPUT TOKENIZATION --- */
 
 extern  void    m4_input_init   (m4 *context);
-extern  void    m4_input_exit   (void);
+extern  void    m4_input_exit   (m4 *context);
 extern  void    m4_skip_line    (m4 *context, const m4_call_info *);
 
 /* push back input */
@@ -501,7 +586,12 @@ extern  void    m4_skip_line    (m4 *context, const m4_call_info *);
 extern  void    m4_push_file    (m4 *, FILE *, const char *, bool);
 extern  void    m4_push_builtin (m4 *, m4_obstack *, m4_symbol_value *);
 extern  m4_obstack      *m4_push_string_init    (m4 *, const char *, int);
-extern  void    m4_push_string_finish   (void);
+extern  void    m4_push_string_finish   (m4 *);
+extern  void    m4_push_forloop (m4 *, m4_obstack *, const char *, size_t,
+                                 int, int, const char *, size_t);
+extern  bool    m4_push_foreach (m4 *, m4_obstack *, const char *, size_t,
+                                 const char *, size_t, bool, const char *,
+                                 size_t);
 extern  bool    m4_pop_wrapup   (m4 *);
 extern  void    m4_input_print  (m4 *, m4_obstack *, int);
 
@@ -510,7 +600,8 @@ extern  void    m4_input_print  (m4 *, m4_obstack *, int);
 /* --- OUTPUT MANAGEMENT --- */
 
 extern void     m4_output_init          (m4 *);
-extern void     m4_output_exit          (void);
+extern void     m4_output_exit          (m4 *);
+extern void     m4_output_detach        (m4 *);
 extern void     m4_output_text          (m4 *, const char *, size_t);
 extern void     m4_divert_text          (m4 *, m4_obstack *, const char *,
                                          size_t, int);
@@ -523,7 +614,7 @@ extern bool     m4_shipout_string_trunc (m4_obstack *, const char *, size_t,
 extern void     m4_make_diversion    (m4 *, int);
 extern void     m4_insert_diversion  (m4 *, int);
 extern void     m4_insert_file       (m4 *, FILE *);
-extern void     m4_freeze_diversions (m4 *, FILE *);
+extern void     m4_freeze_diversions (m4 *, FILE *, bool);
 extern void     m4_undivert_all      (m4 *);
 
 
@@ -534,6 +625,7 @@ extern void	m4_add_include_directory (m4 *, const char *, bool);
 extern bool	m4_load_filename	 (m4 *, const m4_call_info *,
 					  const char *, m4_obstack *, bool);
 extern char *   m4_path_search		 (m4 *, const char *, const char **);
+extern void	m4_path_cache_flush	 (m4 *);
 extern FILE *	m4_fopen		 (m4 *, const char *, const char *);
 
 
@@ -29,7 +29,15 @@
 
 typedef struct m4__search_path_info m4__search_path_info;
 typedef struct m4__macro_arg_stacks m4__macro_arg_stacks;
+typedef struct m4__arg_arena m4__arg_arena;
 typedef struct m4__symbol_chain m4__symbol_chain;
+typedef struct m4__loop m4__loop;
+typedef struct m4__word_cache m4__word_cache;
+typedef struct m4__regexp_cache m4__regexp_cache;
+typedef struct m4__profile m4__profile;
+typedef struct m4__file_cache m4__file_cache;
+typedef struct m4__input m4__input;
+typedef struct m4__output m4__output;
 
 typedef enum {
   M4_SYMBOL_VOID,               /* Traced but undefined, u is invalid.  */
@@ -55,11 +63,36 @@ typedef unsigned int bool_bitfield;
 
 /* --- CONTEXT MANAGEMENT --- */
 
+/* Counters reported by --stats and the m4stats builtin.  Those in
+   the first group are kept in the context as events happen; the rest
+   are copied from the structures that own them when a report is
+   made.  */
+typedef struct
+{
+  size_t expansion_peak;        /* Deepest nesting of macro calls.  */
+  size_t argv_refs;             /* $@ references made.  */
+  size_t argv_ref_reuses;       /* Wrappers skipped to reuse a $@ ref.  */
+  size_t argv_flattens;         /* References copied into plain text.  */
+  size_t argv_compactions;      /* Argument stacks cleared under a call.  */
+  size_t diversion_spills;      /* Diversion buffers written to disk.  */
+  size_t diversion_reloads;     /* Spilled diversions reopened.  */
+
+  size_t macro_calls;           /* Calls of expand_macro.  */
+  m4_hash_stats symtab;         /* Occupancy of the symbol table.  */
+  size_t symtab_load;           /* Percentage of its slots used.  */
+  size_t regexp_hits;           /* Regexps found compiled in the cache.  */
+  size_t regexp_misses;         /* Regexps compiled.  */
+  size_t obstack_chunks;        /* Chunks requested from the arena.  */
+  size_t obstack_reused;        /* Those served from its free lists.  */
+  size_t obstack_peak;          /* Most bytes of chunks in use at once.  */
+} m4__stats;
+
 struct m4 {
   m4_symbol_table *     symtab;
   m4_syntax_table *     syntax;
   m4_module *           modules;
   m4_hash *             namemap;
+  const m4_static_module *static_modules; /* Modules linked into m4.  */
 
   const char *          current_file;   /* Current input file.  */
   int                   current_line;   /* Current input line.  */
@@ -68,6 +101,7 @@ struct m4 {
   FILE *        debug_file;             /* File for debugging output.  */
   m4_obstack    trace_messages;
   int           exit_status;            /* Cumulative exit status.  */
+  int           sysval;                 /* Status of the last syscmd.  */
   int           current_diversion;      /* Current output diversion.  */
 
   /* Option flags  (set in src/main.c).  */
@@ -75,13 +109,25 @@ struct m4 {
   int           debug_level;                    /* -d */
   size_t        max_debug_arg_length;           /* -l */
   int           regexp_syntax;                  /* -r */
+  size_t        diversion_memory;               /* --diversion-memory */
+  size_t        regexp_cache;                   /* --regexp-cache */
   int           opt_flags;
 
   /* __PRIVATE__: */
   m4__search_path_info  *search_path;   /* The list of path directories. */
   m4__macro_arg_stacks  *arg_stacks;    /* Array of current argv refs.  */
   size_t                stacks_count;   /* Size of arg_stacks.  */
+  m4__arg_arena         *arg_arena;     /* Chunks recycled by arg_stacks.  */
   size_t                expansion_level;/* Macro call nesting level.  */
+  m4__regexp_cache      *regexp_cache_table; /* Compiled regexps.  */
+  m4__profile           *profile;       /* Macro call profile, or NULL.  */
+  m4__file_cache        *file_cache;    /* Included file contents.  */
+  m4__input             *input;         /* State of the input engine.  */
+  m4__output            *output;        /* State of the output engine.  */
+  size_t                macro_call_id;  /* Sequence number of last call.  */
+  m4__stats             stats;          /* Runtime counters.  */
+  bool                  stats_report;   /* Report the counters at exit.  */
+  bool                  stats_json;     /* Report them as JSON.  */
 };
 
 #define M4_OPT_PREFIX_BUILTINS_BIT      (1 << 0) /* -P */
@@ -93,6 +139,7 @@ struct m4 {
 #define M4_OPT_FATAL_WARN_BIT           (1 << 6) /* -E once */
 #define M4_OPT_WARN_EXIT_BIT            (1 << 7) /* -E twice */
 #define M4_OPT_SAFER_BIT                (1 << 8) /* --safer */
+#define M4_OPT_CACHE_INCLUDES_BIT       (1 << 9) /* --cache-includes */
 
 /* Fast macro versions of accessor functions for public fields of m4,
    that also have an identically named function exported in m4module.h.  */
@@ -113,6 +160,8 @@ struct m4 {
 #  define m4_set_trace_messages(C, V)           ((C)->trace_messages = (V))
 #  define m4_get_exit_status(C)                 ((C)->exit_status)
 #  define m4_set_exit_status(C, V)              ((C)->exit_status = (V))
+#  define m4_get_sysval(C)                      ((C)->sysval)
+#  define m4_set_sysval(C, V)                   ((C)->sysval = (V))
 #  define m4_get_current_diversion(C)           ((C)->current_diversion)
 #  define m4_set_current_diversion(C, V)        ((C)->current_diversion = (V))
 #  define m4_get_nesting_limit_opt(C)           ((C)->nesting_limit)
@@ -123,6 +172,10 @@ struct m4 {
 #  define m4_set_max_debug_arg_length_opt(C, V) ((C)->max_debug_arg_length=(V))
 #  define m4_get_regexp_syntax_opt(C)           ((C)->regexp_syntax)
 #  define m4_set_regexp_syntax_opt(C, V)        ((C)->regexp_syntax = (V))
+#  define m4_get_diversion_memory_opt(C)        ((C)->diversion_memory)
+#  define m4_set_diversion_memory_opt(C, V)     ((C)->diversion_memory = (V))
+#  define m4_get_regexp_cache_opt(C)            ((C)->regexp_cache)
+#  define m4_set_regexp_cache_opt(C, V)         ((C)->regexp_cache = (V))
 
 #  define m4_get_prefix_builtins_opt(C)                                 \
                 (BIT_TEST((C)->opt_flags, M4_OPT_PREFIX_BUILTINS_BIT))
@@ -142,6 +195,8 @@ struct m4 {
                 (BIT_TEST((C)->opt_flags, M4_OPT_WARN_EXIT_BIT))
 #  define m4_get_safer_opt(C)                                           \
                 (BIT_TEST((C)->opt_flags, M4_OPT_SAFER_BIT))
+#  define m4_get_cache_includes_opt(C)                                  \
+                (BIT_TEST((C)->opt_flags, M4_OPT_CACHE_INCLUDES_BIT))
 
 /* No fast opt bit set macros, as they would need to evaluate their
    arguments more than once, which would subtly change their semantics.  */
@@ -179,15 +234,20 @@ struct m4_module
 {
   const char *name;             /* Name of the module.  */
   void *handle;                 /* System module handle.  */
+  const m4_static_module *linked; /* Registry entry if linked in.  */
   m4__builtin *builtins;        /* Sorted array of builtins.  */
   m4_macro *macros;		/* Unsorted array of macros.  */
   size_t builtins_len;          /* Number of builtins.  */
+  void *data;                   /* Per-context state of the module.  */
+  m4_module_data_free_func *data_free; /* Releases data, or NULL.  */
   m4_module *next;
 };
 
 extern m4_module *  m4__module_open (m4 *context, const char *name,
                                      m4_obstack *obs);
 extern m4_module *  m4__module_find (m4 *context, const char *name);
+extern const m4_static_module *m4__static_module_find (m4 *context,
+                                                      const char *name);
 
 
 /* --- SYMBOL TABLE MANAGEMENT --- */
@@ -196,6 +256,7 @@ struct m4_symbol
 {
   bool traced;                  /* True if this symbol is traced.  */
   m4_symbol_value *value;       /* Linked list of pushdef'd values.  */
+  const void *deferred;         /* Entry for the loader, if not loaded.  */
 };
 
 /* Type of a link in a symbol chain.  */
@@ -204,7 +265,8 @@ enum m4__symbol_chain_type
   M4__CHAIN_STR,        /* Link contains a string, u.u_s is valid.  */
   M4__CHAIN_FUNC,       /* Link contains builtin token, u.builtin is valid.  */
   M4__CHAIN_ARGV,       /* Link contains a $@ reference, u.u_a is valid.  */
-  M4__CHAIN_LOC         /* Link contains m4wrap location, u.u_l is valid.  */
+  M4__CHAIN_LOC,        /* Link contains m4wrap location, u.u_l is valid.  */
+  M4__CHAIN_LOOP        /* Link contains a native loop, u.loop is valid.  */
 };
 
 /* Composite symbols are built of a linked list of chain objects.  */
@@ -237,9 +299,29 @@ struct m4__symbol_chain
       const char *file; /* File where subsequent links originate.  */
       int line;         /* Line where subsequent links originate.  */
     } u_l;                      /* M4__CHAIN_LOC.  */
+    m4__loop *loop;             /* M4__CHAIN_LOOP.  */
   } u;
 };
 
+/* State of a forloop or foreach being run by the input engine.  Each
+   iteration binds the macro NAME and pushes BODY as a separate input
+   block, so the loop costs neither nesting depth nor argument
+   copies.  */
+struct m4__loop
+{
+  const char *name;             /* Name of the iteration macro.  */
+  size_t len;                   /* Length of name.  */
+  char *body;                   /* Text to expand on each iteration.  */
+  size_t body_len;              /* Length of body.  */
+  m4_string *list;              /* Values for foreach, or NULL.  */
+  size_t count;                 /* Number of elements in list.  */
+  size_t index;                 /* Index of next element of list.  */
+  int value;                    /* Next value for forloop.  */
+  int end;                      /* Last value for forloop.  */
+  bool_bitfield started : 1;    /* True once name has been pushdef'd.  */
+  bool_bitfield done : 1;       /* True once forloop has used end.  */
+};
+
 /* A symbol value is used both for values associated with a macro
    name, and for arguments to a macro invocation.  */
 struct m4_symbol_value
@@ -249,6 +331,9 @@ struct m4_symbol_value
   unsigned int          flags;
 
   m4_hash *             arg_signature;
+  m4__word_cache *      words;  /* Lookups of words in the text, or NULL.  */
+  void *                cache;  /* Data attached by a builtin, or NULL.  */
+  m4_symbol_value_cache_free_func *cache_free; /* Releases cache.  */
   size_t                min_args;
   size_t                max_args;
   size_t                pending_expansions;
@@ -311,6 +396,31 @@ struct m4_macro_args
   m4_symbol_value *array[FLEXIBLE_ARRAY_MEMBER];
 };
 
+/* One chain or $@ reference being walked by m4_arg_iter_next.  */
+typedef struct m4__arg_frame m4__arg_frame;
+struct m4__arg_frame
+{
+  m4__arg_frame *up;            /* Enclosing frame, or next spare one.  */
+  m4__symbol_chain *chain;      /* Next link, if walking a chain.  */
+  m4_macro_args *argv;          /* Referenced argv, or NULL for a chain.  */
+  size_t index;                 /* Argument of argv being walked.  */
+  size_t end;                   /* One past the last argument to walk.  */
+  const m4_string_pair *quotes; /* Quotes around each argument, or NULL.  */
+  bool flatten;                 /* True to skip builtins.  */
+  int step;                     /* Part of the argument still to visit.  */
+};
+
+/* Position within the text of an argument, for m4_arg_iter_next.  */
+struct m4_arg_iter
+{
+  m4 *context;                  /* Context owning the argument.  */
+  const char *text;             /* Segment waiting to be returned.  */
+  size_t len;                   /* Its length, or 0 if none.  */
+  m4__arg_frame *frame;         /* Innermost frame being walked.  */
+  m4__arg_frame *spare;         /* Popped frames, for reuse.  */
+  bool func;                    /* True if stopped at a builtin.  */
+};
+
 /* Internal structure for managing multiple argv references.  See
    macro.c for a much more detailed comment on usage.  */
 struct m4__macro_arg_stacks
@@ -323,6 +433,10 @@ struct m4__macro_arg_stacks
   void *argv_base;      /* Location for clearing the argv obstack.  */
 };
 
+extern void m4__arena_obstack_init (m4 *, m4_obstack *);
+extern void m4__arg_arena_delete (m4 *);
+extern void m4__macro_stats (m4 *, m4__stats *);
+
 /* Opaque structure for managing call context information.  Contains
    the context used in tracing and error messages that was valid at
    the start of the macro expansion, even if argument collection
@@ -351,6 +465,9 @@ extern bool     m4__arg_print           (m4 *, m4_obstack *, m4_macro_args *,
 #define VALUE_MODULE(T)         ((T)->module)
 #define VALUE_FLAGS(T)          ((T)->flags)
 #define VALUE_ARG_SIGNATURE(T)  ((T)->arg_signature)
+#define VALUE_WORDS(T)          ((T)->words)
+#define VALUE_CACHE(T)          ((T)->cache)
+#define VALUE_CACHE_FREE(T)     ((T)->cache_free)
 #define VALUE_MIN_ARGS(T)       ((T)->min_args)
 #define VALUE_MAX_ARGS(T)       ((T)->max_args)
 #define VALUE_PENDING(T)        ((T)->pending_expansions)
@@ -434,6 +551,46 @@ extern bool m4__symbol_value_print (m4 *, m4_symbol_value *, m4_obstack *,
                                     const m4_string_pair *, bool,
                                     m4__symbol_chain **, size_t *, bool);
 
+/* Counters of names added to and removed from a symbol table, which
+   tell whether a remembered lookup result is still accurate.  */
+extern size_t     m4__symtab_added      (m4_symbol_table *);
+extern size_t     m4__symtab_removed    (m4_symbol_table *);
+extern m4_symbol *m4__symtab_entry      (m4_symbol_table *, const char *,
+                                         size_t);
+extern void       m4__symtab_stats      (m4_symbol_table *, m4_hash_stats *);
+
+/* The value stack of a symbol can be deferred until the symbol is
+   first used, such as when reloading a frozen file.  The loader is
+   called with the entry given to m4__symbol_defer, and returns the
+   complete value stack, most recent value first.  Once no deferred
+   stacks remain, it is called once with a NULL entry, and may then
+   release its resources.  */
+typedef m4_symbol_value *m4__symbol_loader (void *, const void *);
+
+extern bool m4__symbol_defer      (m4_symbol_table *, const char *, size_t,
+                                   const void *);
+extern void m4__symtab_set_loader (m4_symbol_table *, m4__symbol_loader *,
+                                   void *);
+extern void m4__symtab_load       (m4_symbol_table *);
+
+
+/* Hash functions shared by the symbol table and the module name map.
+   The word-at-a-time function reads eight bytes per step, and is the
+   default; build with -DM4_HASH_WORDWISE=0 to select the traditional
+   byte-at-a-time rotate-and-add function instead.  Both are exported
+   so that tests/hashbench can compare them.  */
+#ifndef M4_HASH_WORDWISE
+# define M4_HASH_WORDWISE 1
+#endif
+
+extern size_t m4__hash_mem_bytewise (const char *, size_t) M4_GNUC_PURE;
+extern size_t m4__hash_mem_wordwise (const char *, size_t) M4_GNUC_PURE;
+
+#if M4_HASH_WORDWISE
+# define m4__hash_mem   m4__hash_mem_wordwise
+#else
+# define m4__hash_mem   m4__hash_mem_bytewise
+#endif
 
 
 /* --- SYNTAX TABLE MANAGEMENT --- */
@@ -451,6 +608,17 @@ extern bool m4__symbol_value_print (m4 *, m4_symbol_value *, m4_obstack *,
 #define DEF_BCOMM       "#"     /* Default begin comment delimiter.  */
 #define DEF_ECOMM       "\n"    /* Default end comment delimiter.  */
 
+/* Number of sets of syntax categories that m4__syntax_span and
+   m4__syntax_cspan can search for many bytes at a time.  */
+#define M4__SPAN_SETS   6
+
+/* Number of recently used syntax schemes remembered by each syntax
+   table, so that changequote, changecom and changesyntax can switch
+   back to one of them without recomputing it.  */
+#define M4__SYNTAX_SCHEMES 8
+
+typedef struct m4__syntax_scheme m4__syntax_scheme;
+
 struct m4_syntax_table {
   /* Please read the comment at the top of input.c for details.  table
      holds the current syntax, and orig holds the default syntax.  */
@@ -480,8 +648,7 @@ struct m4_syntax_table {
 
   /* Track the number of changesyntax calls.  This saturates at
      0xffff, so the idea is that most users won't be changing the
-     syntax that frequently; perhaps in the future we will cache
-     frequently used syntax schemes by index.  */
+     syntax that frequently.  */
   unsigned short syntax_age;
 
   /* Track the current quote age, determined by all significant
@@ -490,6 +657,31 @@ struct m4_syntax_table {
      context.  */
   unsigned int quote_age;
 
+  /* Incremented on every change to the syntax table, quotes or
+     comments, whether or not quote_age is affected, since any of
+     these can alter where words start and end.  */
+  unsigned int lex_age;
+
+  /* Bitmaps of the bytes belonging to each category set that the
+     input engine scans for in bulk, kept in step with table.  Byte C
+     is in set S iff bit C / 16 % 8 of span[S][C % 16 + C / 128 * 16]
+     is set, which is the layout the vector kernels in syntax.c can
+     look up sixteen bytes at a time.  */
+  unsigned char span[M4__SPAN_SETS][32];
+
+  /* The kernel that scans span, picked for this processor when the
+     table is created, or NULL to scan byte by byte.  */
+  size_t (*span_kernel) (const unsigned char *, const char *, size_t, bool);
+
+  /* Identify the current contents of table, quote, comm and the
+     flags, so that the result of applying a change to them can be
+     looked up in schemes; two tables with the same scheme number
+     have the same contents.  See find_scheme in syntax.c.  */
+  unsigned int scheme;
+  unsigned int last_scheme;     /* Last scheme number handed out.  */
+  unsigned int scheme_tick;     /* Clock for least recent use.  */
+  m4__syntax_scheme *schemes[M4__SYNTAX_SCHEMES];
+
   /* Track a cached quote pair on the input obstack.  */
   m4_string_pair *cached_quote;
 
@@ -518,6 +710,9 @@ struct m4_syntax_table {
 /* Return the current quote age.  */
 #define m4__quote_age(S)                ((S)->quote_age)
 
+/* Return the current lexical age.  */
+#define m4__lex_age(S)                  ((S)->lex_age)
+
 /* Return true if the current quote age guarantees that parsing the
    current token in the context of a quoted string of the same quote
    age will give the same parse.  */
@@ -531,6 +726,14 @@ extern const m4_string_pair *m4__quote_cache (m4_syntax_table *,
 /* Clear the cached quote.  */
 #define m4__quote_uncache(S)            ((S)->cached_quote = NULL)
 
+/* Return the length of the longest prefix of a buffer whose bytes
+   all have, or for m4__syntax_cspan all lack, one of the given
+   syntax categories.  */
+extern size_t   m4__syntax_span         (m4_syntax_table *, const char *,
+                                         size_t, int);
+extern size_t   m4__syntax_cspan        (m4_syntax_table *, const char *,
+                                         size_t, int);
+
 
 /* --- MACRO MANAGEMENT --- */
 
@@ -559,11 +762,19 @@ extern  bool            m4__push_symbol (m4 *, m4_symbol_value *, size_t,
                                          bool);
 extern  m4_obstack      *m4__push_wrapup_init (m4 *, const m4_call_info *,
                                                m4__symbol_chain ***);
-extern  void            m4__push_wrapup_finish (void);
+extern  void            m4__push_wrapup_finish (m4 *);
 extern  m4__token_type  m4__next_token (m4 *, m4_symbol_value *, int *,
                                         m4_obstack *, bool,
                                         const m4_call_info *);
 extern  bool            m4__next_token_is_open (m4 *);
+extern  void            m4__push_string_origin (m4 *, m4_obstack *,
+                                                m4_symbol_value *, size_t);
+extern  size_t          m4__push_string_size (m4 *);
+extern  size_t          m4__count_newlines (m4 *, const char *, size_t);
+extern  bool            m4__push_cached_file (m4 *, const char *);
+extern  void            m4__file_cache_delete (m4__file_cache *);
+extern  m4_symbol       *m4__lookup_word (m4 *, const char *, size_t);
+extern  void            m4__word_cache_unref (m4__word_cache *);
 
 /* Fast macro versions of macro argv accessor functions,
    that also have an identically named function exported in m4module.h.  */
@@ -578,20 +789,39 @@ extern  bool            m4__next_token_is_open (m4 *);
 /* --- PATH MANAGEMENT --- */
 
 typedef struct m4__search_path m4__search_path;
+typedef struct m4__path_listing m4__path_listing;
 
 struct m4__search_path {
   m4__search_path *next;        /* next directory to search */
   const char *dir;              /* directory */
   int len;
+  m4__path_listing *listing;    /* names read from directory, or NULL */
+  size_t misses;                /* failed probes since directory read */
 };
 
 struct m4__search_path_info {
   m4__search_path *list;        /* the list of path directories */
   m4__search_path *list_end;    /* the end of same */
   int max_length;               /* length of longest directory name */
+  m4_hash *cache;               /* earlier search results, or NULL */
+  unsigned int generation;      /* bumped when results may be stale */
 };
 
 extern void m4__include_init (m4 *);
+extern void m4__search_path_delete (m4__search_path_info *);
+
+
+/* --- REGULAR EXPRESSIONS --- */
+
+extern void m4__regexp_cache_delete (m4__regexp_cache *);
+extern void m4__regexp_cache_stats (m4__regexp_cache *, m4__stats *);
+
+
+/* --- RUNTIME DEBUGGING --- */
+
+extern void m4__profile_enter (m4 *, const char *, size_t);
+extern void m4__profile_leave (m4 *, size_t, size_t);
+extern void m4__profile_delete (m4__profile *);
 
 
 /* Debugging the memory allocator.  */
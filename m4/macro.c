@@ -25,6 +25,8 @@
 
 #include "m4private.h"
 
+#include "glthread/lock.h"
+
 /* Define this to 1 see runtime debug info.  Implied by DEBUG.  */
 /*#define DEBUG_INPUT 1 */
 #ifndef DEBUG_MACRO
@@ -116,17 +118,44 @@
    anything that it added to the obstack if no additional references
    were added at the current expansion level, to reduce the amount of
    memory left on the obstack while waiting for refcounts to drop.
+
+   Clearing an obstack hands all but its first chunk back to the
+   allocator, and a long argument at the same or another level soon
+   asks for them again.  So the obstacks of every level take their
+   chunks from a single arena per context, which keeps released
+   chunks on free lists by size class rather than returning them to
+   malloc.  Bulk release at refcount zero thus costs a few list
+   pushes, and the next expansion, at whatever level, takes its
+   chunks from the lists.
+
+   A macro whose last action is to call itself with part of $@, such
+   as define(`r', `ifelse(`$1', `0', `', `$0(decr(`$1'), shift($@))')'),
+   never lets the refcount of its level drop to zero: the expansion of
+   each call holds a reference to its argv until the next call has
+   collected its own arguments, and those arguments refer back into
+   the previous argv.  Each iteration then leaves another argv on the
+   obstack.  So once expand_macro has collected arguments and the
+   input engine has released the references that are no longer
+   needed, it checks whether its own call is the only user left at
+   that level, apart from references held by its own arguments.  If
+   so, and the arguments amount to a few short texts, it copies them
+   aside, clears the whole level, and rebuilds argv at its base, so
+   that such loops run in constant memory.
 */
 
 static m4_macro_args *collect_arguments (m4 *, m4_call_info *, m4_symbol *,
                                          m4_obstack *, m4_obstack *);
 static void    expand_macro      (m4 *, const char *, size_t, m4_symbol *);
+static m4_macro_args *compact_arg_stack (m4 *, size_t, m4_macro_args *);
+static void *  arena_chunk_alloc (void *, size_t);
+static void    arena_chunk_free  (void *, void *);
 static bool    expand_token      (m4 *, m4_obstack *, m4__token_type,
                                   m4_symbol_value *, int, bool);
 static bool    expand_argument   (m4 *, m4_obstack *, m4_symbol_value *,
                                   const m4_call_info *);
 static void    process_macro     (m4 *, m4_symbol_value *, m4_obstack *, int,
                                   m4_macro_args *);
+static bool    arg_iter_next     (m4_arg_iter *, const char **, size_t *);
 
 static unsigned int trace_pre    (m4 *, m4_macro_args *);
 static void    trace_post        (m4 *, unsigned int, const m4_call_info *);
@@ -134,12 +163,11 @@ static unsigned int trace_header (m4 *, const m4_call_info *);
 static void    trace_flush       (m4 *, unsigned int);
 
 
-/* The number of the current call of expand_macro ().  */
-static size_t macro_call_id = 0;
-
 /* A placeholder symbol value representing the empty string, used to
-   optimize checks for emptiness.  */
+   optimize checks for emptiness.  It is shared by all contexts, so it
+   is filled in only once.  */
 static m4_symbol_value empty_symbol;
+gl_once_define (static, empty_symbol_once)
 
 #if DEBUG_MACRO
 /* True if significant changes to stacks should be printed to the
@@ -152,9 +180,67 @@ static int debug_macro_level;
 #define PRINT_ARGCOUNT_CHANGES  1       /* Any change to argcount > 1.  */
 #define PRINT_REFCOUNT_INCREASE 2       /* Any increase to refcount.  */
 #define PRINT_REFCOUNT_DECREASE 4       /* Any decrease to refcount.  */
+#define PRINT_ARENA_STATS       8       /* Arena counters at exit.  */
+
+/* The smallest chunk size handed out by the argument arena, including
+   the chunk header; the default obstack chunk fits in it.  */
+#define ARENA_CHUNK             4096
+
+/* Number of size classes; class N holds chunks of ARENA_CHUNK << N
+   bytes.  Larger chunks are passed straight to malloc and free.  */
+#define ARENA_CLASSES           8
+
+/* Most bytes kept on the free lists; chunks released beyond that go
+   back to free.  */
+#define ARENA_RETAIN            (2 * 1024 * 1024)
+
+/* Header in front of every chunk of the argument arena.  */
+typedef union arena_header arena_header;
+union arena_header
+{
+  struct
+  {
+    arena_header *next;         /* Next free chunk of the same class.  */
+    size_t size_class;          /* Class, or the byte size if large.  */
+  } h;
+  long double align_d;          /* Align the chunk like malloc would.  */
+  uintmax_t align_i;
+};
+
+/* Storage shared by the argument obstacks of all expansion levels.
+   The counters measure how well chunks are recycled.  */
+struct m4__arg_arena
+{
+  arena_header *free_list[ARENA_CLASSES]; /* Recycled chunks by class.  */
+  size_t cached;                /* Bytes held on the free lists.  */
+  size_t requests;              /* Chunks requested by the obstacks.  */
+  size_t reused;                /* Requests served from a free list.  */
+  size_t allocated;             /* Requests passed on to malloc.  */
+  size_t recycled;              /* Chunks put on a free list.  */
+  size_t released;              /* Chunks passed on to free.  */
+  size_t in_use;                /* Bytes of chunks held by obstacks.  */
+  size_t peak;                  /* Most bytes ever held at once.  */
+};
+
+/* The byte size of a chunk whose header holds SIZE_CLASS.  Large
+   chunks hold their size there instead, which is never mistaken for
+   a class, since it is at least ARENA_CHUNK << ARENA_CLASSES.  */
+#define ARENA_CHUNK_SIZE(size_class)                            \
+  ((size_class) < ARENA_CLASSES ? ARENA_CHUNK << (size_class) : (size_class))
+
+/* Most bytes that compact_arg_stack copies to reclaim a level.  */
+#define COMPACT_LIMIT           ARENA_CHUNK
 
 
 
+/* Fill in empty_symbol, the first time any context expands input.  */
+static void
+empty_symbol_init (void)
+{
+  m4_set_symbol_value_text (&empty_symbol, "", 0, 0);
+  VALUE_MAX_ARGS (&empty_symbol) = -1;
+}
+
 /* This function reads all input, and expands each token, one at a time.  */
 void
 m4_macro_expand_input (m4 *context)
@@ -169,8 +255,7 @@ m4_macro_expand_input (m4 *context)
     debug_macro_level = strtol (s, NULL, 0);
 #endif /* DEBUG_MACRO */
 
-  m4_set_symbol_value_text (&empty_symbol, "", 0, 0);
-  VALUE_MAX_ARGS (&empty_symbol) = -1;
+  gl_once (empty_symbol_once, empty_symbol_init);
 
   while ((type = m4__next_token (context, &token, &line, NULL, false, NULL))
          != M4_TOKEN_EOF)
@@ -261,7 +346,7 @@ expand_token (m4 *context, m4_obstack *obs, m4__token_type type,
             len2--;
           }
 
-        symbol = m4_symbol_lookup (M4SYMTAB, textp, len2);
+        symbol = m4__lookup_word (context, textp, len2);
         assert (!symbol || !m4_is_symbol_void (symbol));
         if (symbol == NULL
             || (symbol->value->type == M4_SYMBOL_FUNC
@@ -454,6 +539,7 @@ expand_macro (m4 *context, const char *name, size_t len, m4_symbol *symbol)
   size_t level;                 /* Expansion level of this macro.  */
   m4__macro_arg_stacks *stack;  /* Storage for this macro.  */
   m4_call_info info;            /* Context of this macro call.  */
+  bool profiled;                /* True if the call is being profiled.  */
 
   /* Obstack preparation.  */
   level = context->expansion_level;
@@ -473,8 +559,8 @@ expand_macro (m4 *context, const char *name, size_t len, m4_symbol *symbol)
       assert (!stack->refcount);
       stack->args = (m4_obstack *) xmalloc (sizeof *stack->args);
       stack->argv = (m4_obstack *) xmalloc (sizeof *stack->argv);
-      obstack_init (stack->args);
-      obstack_init (stack->argv);
+      m4__arena_obstack_init (context, stack->args);
+      m4__arena_obstack_init (context, stack->argv);
       stack->args_base = obstack_finish (stack->args);
       stack->argv_base = obstack_finish (stack->argv);
     }
@@ -491,7 +577,7 @@ expand_macro (m4 *context, const char *name, size_t len, m4_symbol *symbol)
   value = m4_get_symbol_value (symbol);
   info.file = m4_get_current_file (context);
   info.line = m4_get_current_line (context);
-  info.call_id = ++macro_call_id;
+  info.call_id = ++context->macro_call_id;
   info.trace = (m4_is_debug_bit (context, M4_DEBUG_TRACE_ALL)
                 || m4_get_symbol_traced (symbol));
   info.debug_level = m4_get_debug_level_opt (context);
@@ -504,7 +590,12 @@ expand_macro (m4 *context, const char *name, size_t len, m4_symbol *symbol)
     m4_error (context, EXIT_FAILURE, 0, NULL, _("\
 recursion limit of %zu exceeded, use -L<N> to change it"),
               m4_get_nesting_limit_opt (context));
+  if (context->stats.expansion_peak < context->expansion_level)
+    context->stats.expansion_peak = context->expansion_level;
 
+  profiled = context->profile != NULL;
+  if (profiled)
+    m4__profile_enter (context, name, len);
   m4_trace_prepare (context, &info, value);
   argv = collect_arguments (context, &info, symbol, stack->args, stack->argv);
   /* Since collect_arguments can invalidate stack by reallocating
@@ -513,10 +604,29 @@ recursion limit of %zu exceeded, use -L<N> to change it"),
   stack = &context->arg_stacks[level];
   args_scratch = obstack_finish (stack->args);
 
-  /* The actual macro call.  */
+  /* The actual macro call.  Starting the expansion pops exhausted
+     input, which may leave this call as the last user of its level.  */
   expansion = m4_push_string_init (context, info.file, info.line);
+  if (1 < stack->argcount)
+    {
+      argv = compact_arg_stack (context, level, argv);
+      if (stack->argcount == 1)
+        {
+          args_base = stack->args_base;
+          argv_base = stack->argv_base;
+          args_scratch = obstack_finish (stack->args);
+        }
+    }
   m4_macro_call (context, value, expansion, argv);
-  m4_push_string_finish ();
+  if (profiled)
+    {
+      size_t arg_bytes = 0;
+      size_t i;
+      for (i = 1; i < argv->argc; i++)
+        arg_bytes += m4_arg_len (context, argv, i, false);
+      m4__profile_leave (context, arg_bytes, m4__push_string_size (context));
+    }
+  m4_push_string_finish (context);
 
   /* Cleanup.  */
   argv->info = NULL;
@@ -552,6 +662,120 @@ recursion limit of %zu exceeded, use -L<N> to change it"),
     }
 }
 
+/* Return a chunk of at least SIZE bytes for an argument obstack,
+   from the free lists of the arena DATA when possible.  */
+static void *
+arena_chunk_alloc (void *data, size_t size)
+{
+  m4__arg_arena *arena = (m4__arg_arena *) data;
+  arena_header *chunk;
+  size_t size_class = 0;
+
+  arena->requests++;
+  while (size_class < ARENA_CLASSES
+         && (ARENA_CHUNK << size_class) - sizeof *chunk < size)
+    size_class++;
+  if (size_class < ARENA_CLASSES && arena->free_list[size_class])
+    {
+      chunk = arena->free_list[size_class];
+      arena->free_list[size_class] = chunk->h.next;
+      arena->cached -= ARENA_CHUNK << size_class;
+      arena->reused++;
+    }
+  else
+    {
+      if (size_class < ARENA_CLASSES)
+        size = ARENA_CHUNK << size_class;
+      else if (SIZE_MAX - sizeof *chunk < size)
+        xalloc_die ();
+      else
+        size += sizeof *chunk;
+      chunk = (arena_header *) xmalloc (size);
+      chunk->h.size_class = size_class < ARENA_CLASSES ? size_class : size;
+      arena->allocated++;
+    }
+  arena->in_use += ARENA_CHUNK_SIZE (chunk->h.size_class);
+  if (arena->peak < arena->in_use)
+    arena->peak = arena->in_use;
+  return chunk + 1;
+}
+
+/* Give PTR, a chunk from arena_chunk_alloc, back to the arena DATA,
+   keeping it for reuse unless the free lists are full.  */
+static void
+arena_chunk_free (void *data, void *ptr)
+{
+  m4__arg_arena *arena = (m4__arg_arena *) data;
+  arena_header *chunk = (arena_header *) ptr - 1;
+  size_t size_class = chunk->h.size_class;
+
+  arena->in_use -= ARENA_CHUNK_SIZE (size_class);
+  if (size_class < ARENA_CLASSES
+      && arena->cached + (ARENA_CHUNK << size_class) <= ARENA_RETAIN)
+    {
+      chunk->h.next = arena->free_list[size_class];
+      arena->free_list[size_class] = chunk;
+      arena->cached += ARENA_CHUNK << size_class;
+      arena->recycled++;
+    }
+  else
+    {
+      free (chunk);
+      arena->released++;
+    }
+}
+
+/* Initialize OBS to take its chunks from the argument arena of
+   CONTEXT.  Besides the argument stacks, the input engine uses this
+   for the obstacks that hold pushed expansions and references to
+   arguments, since their chunks come and go at the same pace.  */
+void
+m4__arena_obstack_init (m4 *context, m4_obstack *obs)
+{
+  if (!context->arg_arena)
+    context->arg_arena = (m4__arg_arena *) xzalloc (sizeof (m4__arg_arena));
+  obstack_specify_allocation_with_arg (obs, 0, 0, arena_chunk_alloc,
+                                       arena_chunk_free, context->arg_arena);
+}
+
+/* Store the number of macro calls so far, and the chunk counters of
+   the argument arena, into STATS.  */
+void
+m4__macro_stats (m4 *context, m4__stats *stats)
+{
+  m4__arg_arena *arena = context->arg_arena;
+
+  stats->macro_calls = context->macro_call_id;
+  stats->obstack_chunks = arena ? arena->requests : 0;
+  stats->obstack_reused = arena ? arena->reused : 0;
+  stats->obstack_peak = arena ? arena->peak : 0;
+}
+
+/* Free the argument arena of CONTEXT, once no obstack uses it.  */
+void
+m4__arg_arena_delete (m4 *context)
+{
+  m4__arg_arena *arena = context->arg_arena;
+  size_t i;
+
+  if (!arena)
+    return;
+  if (debug_macro_level & PRINT_ARENA_STATS)
+    xfprintf (stderr, "m4debug: arena: %zu expansions, %zu chunk requests, "
+              "%zu reused, %zu allocated, %zu recycled, %zu released\n",
+              context->macro_call_id, arena->requests, arena->reused,
+              arena->allocated, arena->recycled, arena->released);
+  for (i = 0; i < ARENA_CLASSES; i++)
+    while (arena->free_list[i])
+      {
+        arena_header *chunk = arena->free_list[i];
+        arena->free_list[i] = chunk->h.next;
+        free (chunk);
+      }
+  free (arena);
+  context->arg_arena = NULL;
+}
+
 /* Collect all the arguments to a call of the macro SYMBOL, with call
    context INFO.  The arguments are stored on the obstack ARGUMENTS
    and a table of pointers to the arguments on ARGV_STACK.  Return the
@@ -647,6 +871,161 @@ collect_arguments (m4 *context, m4_call_info *info, m4_symbol *symbol,
 }
 
 
+/* Return how many of the references counted at expansion LEVEL are
+   held by ARGV, the way m4__arg_adjust_refcount counts them.  */
+static size_t
+arg_level_refs (m4_macro_args *argv, size_t level)
+{
+  size_t count = argv->level == level;
+  m4__symbol_chain *chain;
+  size_t i;
+
+  if (argv->has_ref)
+    for (i = 0; i < argv->arraylen; i++)
+      if (argv->array[i]->type == M4_SYMBOL_COMP)
+        for (chain = argv->array[i]->u.u_c.chain; chain; chain = chain->next)
+          {
+            if (chain->type == M4__CHAIN_STR)
+              count += chain->u.u_s.level == level;
+            else if (chain->type == M4__CHAIN_ARGV)
+              count += arg_level_refs (chain->u.u_a.argv, level);
+          }
+  return count;
+}
+
+/* Add to *SIZE the bytes needed to hold argument ARG of ARGV as
+   plain text.  Return false if the argument includes a builtin, or
+   as soon as *SIZE exceeds COMPACT_LIMIT.  */
+static bool
+arg_fits (m4 *context, m4_macro_args *argv, size_t arg, size_t *size)
+{
+  m4_symbol_value *value = m4_arg_symbol (argv, arg);
+  m4__symbol_chain *chain;
+  const m4_string_pair *quotes;
+  size_t limit;
+  size_t i;
+
+  *size += sizeof *value;
+  if (m4_is_symbol_value_text (value))
+    *size += m4_get_symbol_value_len (value);
+  else if (value->type != M4_SYMBOL_COMP)
+    return false;
+  else
+    for (chain = value->u.u_c.chain; chain; chain = chain->next)
+      switch (chain->type)
+        {
+        case M4__CHAIN_STR:
+          *size += chain->u.u_s.len;
+          break;
+        case M4__CHAIN_ARGV:
+          i = chain->u.u_a.index;
+          limit = chain->u.u_a.argv->argc - i - chain->u.u_a.skip_last;
+          quotes = m4__quote_cache (M4SYNTAX, NULL, chain->quote_age,
+                                    chain->u.u_a.quotes);
+          *size += limit * (quotes ? quotes->len1 + quotes->len2 + 1 : 1);
+          while (limit--)
+            if (!arg_fits (context, chain->u.u_a.argv, i++, size))
+              return false;
+          break;
+        default:
+          return false;
+        }
+  return *size <= COMPACT_LIMIT;
+}
+
+/* Called when ARGV, just collected by expand_macro at expansion
+   LEVEL, shares the argument stack of LEVEL with earlier calls.  If
+   nothing but ARGV still refers to that stack, and the arguments of
+   ARGV flatten to text that fits in COMPACT_LIMIT bytes, release
+   the references of ARGV, clear the stack, and rebuild a copy of ARGV
+   at its base.  Return the copy, or ARGV if nothing was done.  */
+static m4_macro_args *
+compact_arg_stack (m4 *context, size_t level, m4_macro_args *argv)
+{
+  m4__macro_arg_stacks *stack = &context->arg_stacks[level];
+  m4_macro_args header = *argv;
+  m4_macro_args *new_argv;
+  m4_symbol_value **values;
+  m4_symbol_value *value;
+  m4_obstack save;
+  size_t size = argv->info->name_len;
+  size_t argc = argv->argc;
+  size_t i;
+
+  assert (argv->level == level && !argv->inuse);
+  if (argv->has_func || COMPACT_LIMIT / sizeof *value < argc)
+    return argv;
+  for (i = 1; i < argc; i++)
+    if (!arg_fits (context, argv, i, &size))
+      return argv;
+  if (stack->refcount != arg_level_refs (argv, level))
+    return argv;
+
+  /* Copy the arguments aside; composite arguments, and texts reached
+     through $@ references, become plain text in the copy.  */
+  obstack_init (&save);
+  values = (m4_symbol_value **) obstack_alloc (&save, argc * sizeof *values);
+  values[0] = (m4_symbol_value *) obstack_copy0 (&save, argv->info->name,
+                                                 argv->info->name_len);
+  for (i = 1; i < argc; i++)
+    {
+      size_t len = m4_arg_len (context, argv, i, false);
+      value = m4_arg_symbol (argv, i);
+      if (len)
+        {
+          m4_symbol_value *copy;
+          unsigned int quote_age = 0;
+          copy = (m4_symbol_value *) obstack_copy (&save, value, sizeof *value);
+          if (m4_is_symbol_value_text (value))
+            quote_age = m4_get_symbol_value_quote_age (value);
+          m4_arg_grow (context, &save, argv, i, 0, len);
+          obstack_1grow (&save, '\0');
+          m4_set_symbol_value_text (copy, obstack_finish (&save), len,
+                                    quote_age);
+          if (quote_age != header.quote_age)
+            header.quote_age = 0;
+          value = copy;
+        }
+      else
+        value = &empty_symbol;
+      values[i] = value;
+    }
+
+  /* Dropping every reference of ARGV clears the stack; the copy holds
+     only the reference of the call itself.  */
+  m4__arg_adjust_refcount (context, argv, false);
+  assert (!stack->refcount);
+  m4__adjust_refcount (context, level, true);
+  stack->argcount = 1;
+  context->stats.argv_compactions++;
+
+  header.info->name = (char *) obstack_copy0 (stack->args,
+                                              (char *) values[0],
+                                              header.info->name_len);
+  new_argv = (m4_macro_args *) obstack_alloc (stack->argv,
+                                              (offsetof (m4_macro_args, array)
+                                               + (argc - 1) * sizeof value));
+  memcpy (new_argv, &header, offsetof (m4_macro_args, array));
+  new_argv->wrapper = false;
+  new_argv->has_ref = false;
+  new_argv->arraylen = argc - 1;
+  for (i = 1; i < argc; i++)
+    {
+      value = values[i];
+      if (value != &empty_symbol)
+        {
+          value = (m4_symbol_value *) obstack_copy (stack->args, value,
+                                                    sizeof *value);
+          value->u.u_t.text = (char *) obstack_copy (stack->args,
+                                                     value->u.u_t.text,
+                                                     value->u.u_t.len + 1);
+        }
+      new_argv->array[i - 1] = value;
+    }
+  obstack_free (&save, NULL);
+  return new_argv;
+}
+
 /* The actual call of a macro is handled by m4_macro_call ().
    m4_macro_call () is passed a symbol VALUE, whose type is used to
    call either a builtin function, or the user macro expansion
@@ -706,16 +1085,14 @@ process_macro (m4 *context, m4_symbol_value *value, m4_obstack *obs,
         dollar = (char *) memchr (text, M4SYNTAX->dollar, len);
       else
         {
-          dollar = text;
-          while (dollar != end)
-            {
-              if (m4_has_syntax (M4SYNTAX, *dollar, M4_SYNTAX_DOLLAR))
-                break;
-              dollar++;
-            }
+          dollar = text + m4__syntax_cspan (M4SYNTAX, text, len,
+                                            M4_SYNTAX_DOLLAR);
           if (dollar == end)
             dollar = NULL;
         }
+      if (text == m4_get_symbol_value_text (value))
+        m4__push_string_origin (context, obs, value,
+                                dollar ? dollar - text : len);
       if (!dollar)
         {
           obstack_grow (obs, text, len);
@@ -956,7 +1333,7 @@ m4__adjust_refcount (m4 *context, size_t level, bool increase)
       obstack_free (stack->argv, stack->argv_base);
       if ((debug_macro_level & PRINT_ARGCOUNT_CHANGES) && 1 < stack->argcount)
         xfprintf (stderr, "m4debug: -%zu- freeing %zu args, level=%zu\n",
-                  macro_call_id, stack->argcount, level);
+                  context->macro_call_id, stack->argcount, level);
       stack->argcount = 0;
     }
   if (debug_macro_level
@@ -1082,6 +1459,7 @@ make_argv_ref (m4 *context, m4_symbol_value *value, m4_obstack *obs,
                   && !chain->u.u_a.skip_last);
           argv = chain->u.u_a.argv;
           arg += chain->u.u_a.index - 1;
+          context->stats.argv_ref_reuses++;
         }
       else
         {
@@ -1110,6 +1488,7 @@ make_argv_ref (m4 *context, m4_symbol_value *value, m4_obstack *obs,
   chain->u.u_a.skip_last = false;
   chain->u.u_a.quotes = m4__quote_cache (M4SYNTAX, obs, chain->quote_age,
                                          quotes);
+  context->stats.argv_refs++;
   return value;
 }
 
@@ -1237,6 +1616,7 @@ m4_arg_text (m4 *context, m4_macro_args *argv, size_t arg, bool flatten)
   assert (value->type == M4_SYMBOL_COMP);
   chain = value->u.u_c.chain;
   obs = m4_arg_scratch (context);
+  context->stats.argv_flattens++;
   while (chain)
     {
       switch (chain->type)
@@ -1293,6 +1673,41 @@ m4_arg_equal (m4 *context, m4_macro_args *argv, size_t indexa, size_t indexb)
                        m4_get_symbol_value_text (sb),
                        m4_get_symbol_value_len (sa)) == 0);
 
+  /* Without builtins, compare the text segment by segment, which
+     needs no copy of any $@ reference.  Should a builtin turn up
+     anyway, fall back to comparing chains below.  */
+  if (!argv->has_func)
+    {
+      m4_arg_iter *ia = m4_arg_iter_start (context, argv, indexa, false);
+      m4_arg_iter *ib = m4_arg_iter_start (context, argv, indexb, false);
+      const char *ta;
+      const char *tb;
+      size_t la = 0;
+      size_t lb = 0;
+      size_t len;
+
+      while (true)
+        {
+          if (!la && !arg_iter_next (ia, &ta, &la))
+            {
+              if (!ia->func)
+                return !lb && !arg_iter_next (ib, &tb, &lb) && !ib->func;
+              if (lb)
+                return false;
+              break;
+            }
+          if (!lb && !arg_iter_next (ib, &tb, &lb))
+            return false;
+          len = la < lb ? la : lb;
+          if (memcmp (ta, tb, len) != 0)
+            return false;
+          ta += len;
+          la -= len;
+          tb += len;
+          lb -= len;
+        }
+    }
+
   /* Convert both arguments to chains, if not one already.  */
   switch (sa->type)
     {
@@ -1490,6 +1905,269 @@ m4_arg_len (m4 *context, m4_macro_args *argv, size_t arg, bool flatten)
   return len;
 }
 
+/* Steps of m4__arg_frame when walking an argument of a $@
+   reference.  */
+enum
+{
+  ARG_STEP_SEP,                 /* Comma before the argument.  */
+  ARG_STEP_OPEN,                /* Its opening quote.  */
+  ARG_STEP_TEXT,                /* Its contents.  */
+  ARG_STEP_CLOSE                /* Its closing quote.  */
+};
+
+/* Push a new innermost frame onto ITER, and return it.  */
+static m4__arg_frame *
+arg_iter_push (m4_arg_iter *iter)
+{
+  m4__arg_frame *frame = iter->spare;
+
+  if (frame)
+    iter->spare = frame->up;
+  else
+    frame = (m4__arg_frame *) obstack_alloc (m4_arg_scratch (iter->context),
+                                             sizeof *frame);
+  frame->up = iter->frame;
+  iter->frame = frame;
+  return frame;
+}
+
+/* Push a frame onto ITER that walks CHAIN, skipping builtins if
+   FLATTEN.  */
+static void
+arg_iter_push_chain (m4_arg_iter *iter, m4__symbol_chain *chain,
+                     bool flatten)
+{
+  m4__arg_frame *frame = arg_iter_push (iter);
+
+  frame->chain = chain;
+  frame->argv = NULL;
+  frame->flatten = flatten;
+}
+
+/* Start walking the text of argument ARG of ARGV without copying it,
+   and return the iterator to pass to m4_arg_iter_next.  Abort if the
+   argument is not text and FLATTEN is not true.  The iterator lives
+   in the scratch space of the macro call.  */
+m4_arg_iter *
+m4_arg_iter_start (m4 *context, m4_macro_args *argv, size_t arg, bool flatten)
+{
+  m4_arg_iter *iter;
+  m4_symbol_value *value;
+
+  iter = (m4_arg_iter *) obstack_alloc (m4_arg_scratch (context),
+                                        sizeof *iter);
+  iter->context = context;
+  iter->len = 0;
+  iter->frame = iter->spare = NULL;
+  iter->func = false;
+  if (arg == 0)
+    {
+      assert (argv->info);
+      iter->text = argv->info->name;
+      iter->len = argv->info->name_len;
+      return iter;
+    }
+  if (argv->argc <= arg)
+    return iter;
+  value = arg_symbol (argv, arg, NULL, flatten);
+  if (m4_is_symbol_value_text (value))
+    {
+      iter->text = m4_get_symbol_value_text (value);
+      iter->len = m4_get_symbol_value_len (value);
+    }
+  else
+    {
+      assert (value->type == M4_SYMBOL_COMP);
+      arg_iter_push_chain (iter, value->u.u_c.chain,
+                           flatten || argv->flatten);
+    }
+  return iter;
+}
+
+/* Worker for m4_arg_iter_next.  A builtin that was not flattened
+   away ends the walk early, with ITER->func set; a quoted $@ can hide
+   one from argv->has_func.  */
+static bool
+arg_iter_next (m4_arg_iter *iter, const char **text, size_t *len)
+{
+  m4 *context = iter->context;
+  m4__arg_frame *frame;
+  m4__symbol_chain *chain;
+  m4_symbol_value *value;
+  bool flatten;
+
+  if (iter->len)
+    {
+      *text = iter->text;
+      *len = iter->len;
+      iter->len = 0;
+      return true;
+    }
+  while ((frame = iter->frame))
+    {
+      if (!frame->argv)
+        {
+          chain = frame->chain;
+          if (!chain)
+            {
+              iter->frame = frame->up;
+              frame->up = iter->spare;
+              iter->spare = frame;
+              continue;
+            }
+          frame->chain = chain->next;
+          switch (chain->type)
+            {
+            case M4__CHAIN_STR:
+              if (chain->u.u_s.len)
+                {
+                  *text = chain->u.u_s.str;
+                  *len = chain->u.u_s.len;
+                  return true;
+                }
+              break;
+            case M4__CHAIN_FUNC:
+              if (frame->flatten)
+                break;
+              iter->func = true;
+              iter->frame = NULL;
+              return false;
+            case M4__CHAIN_ARGV:
+              flatten = frame->flatten || chain->u.u_a.flatten;
+              frame = arg_iter_push (iter);
+              frame->chain = NULL;
+              frame->argv = chain->u.u_a.argv;
+              frame->index = chain->u.u_a.index;
+              frame->end = frame->argv->argc - chain->u.u_a.skip_last;
+              frame->quotes = m4__quote_cache (M4SYNTAX, NULL,
+                                               chain->quote_age,
+                                               chain->u.u_a.quotes);
+              frame->flatten = flatten || frame->argv->flatten;
+              frame->step = ARG_STEP_OPEN;
+              assert (frame->index < frame->end);
+              break;
+            default:
+              assert (!"m4_arg_iter_next");
+              abort ();
+            }
+          continue;
+        }
+
+      switch (frame->step)
+        {
+        case ARG_STEP_SEP:
+          if (frame->index == frame->end)
+            {
+              iter->frame = frame->up;
+              frame->up = iter->spare;
+              iter->spare = frame;
+              continue;
+            }
+          frame->step = ARG_STEP_OPEN;
+          /* TODO support M4_SYNTAX_COMMA.  */
+          *text = ",";
+          *len = 1;
+          return true;
+        case ARG_STEP_OPEN:
+          frame->step = ARG_STEP_TEXT;
+          if (frame->quotes && frame->quotes->len1)
+            {
+              *text = frame->quotes->str1;
+              *len = frame->quotes->len1;
+              return true;
+            }
+          break;
+        case ARG_STEP_TEXT:
+          frame->step = ARG_STEP_CLOSE;
+          value = arg_symbol (frame->argv, frame->index, NULL,
+                              frame->flatten);
+          if (m4_is_symbol_value_text (value))
+            {
+              if (m4_get_symbol_value_len (value))
+                {
+                  *text = m4_get_symbol_value_text (value);
+                  *len = m4_get_symbol_value_len (value);
+                  return true;
+                }
+            }
+          else
+            {
+              assert (value->type == M4_SYMBOL_COMP);
+              arg_iter_push_chain (iter, value->u.u_c.chain, frame->flatten);
+            }
+          break;
+        case ARG_STEP_CLOSE:
+          frame->index++;
+          frame->step = ARG_STEP_SEP;
+          if (frame->quotes && frame->quotes->len2)
+            {
+              *text = frame->quotes->str2;
+              *len = frame->quotes->len2;
+              return true;
+            }
+          break;
+        default:
+          assert (!"m4_arg_iter_next");
+          abort ();
+        }
+    }
+  return false;
+}
+
+/* Store the next contiguous segment of the argument walked by ITER in
+   *TEXT and *LEN, and return true; or return false once the whole
+   argument has been seen.  Segments are never empty, and remain valid
+   for the rest of the macro call.  Abort if the argument contains a
+   builtin that the iterator was not started to flatten.  */
+bool
+m4_arg_iter_next (m4_arg_iter *iter, const char **text, size_t *len)
+{
+  if (arg_iter_next (iter, text, len))
+    return true;
+  if (iter->func)
+    {
+      assert (!"m4_arg_iter_next");
+      abort ();
+    }
+  return false;
+}
+
+/* Append LEN bytes of argument ARG of ARGV to OBS, starting OFFSET
+   bytes into it, without first copying the whole argument.  The
+   argument must be text, and at least OFFSET + LEN bytes long.  */
+void
+m4_arg_grow (m4 *context, m4_obstack *obs, m4_macro_args *argv, size_t arg,
+             size_t offset, size_t len)
+{
+  m4_arg_iter *iter;
+  const char *text;
+  size_t seg_len;
+
+  if (!len)
+    return;
+  iter = m4_arg_iter_start (context, argv, arg, false);
+  while (m4_arg_iter_next (iter, &text, &seg_len))
+    {
+      if (seg_len <= offset)
+        {
+          offset -= seg_len;
+          continue;
+        }
+      text += offset;
+      seg_len -= offset;
+      offset = 0;
+      if (len <= seg_len)
+        {
+          obstack_grow (obs, text, len);
+          return;
+        }
+      obstack_grow (obs, text, seg_len);
+      len -= seg_len;
+    }
+  assert (!"m4_arg_grow");
+  abort ();
+}
+
 /* Given ARGV, return the builtin function referenced by argument ARG.
    Abort if it is not a single builtin.  */
 m4_builtin_func *
@@ -1743,7 +2421,7 @@ m4_wrap_args (m4 *context, m4_macro_args *argv)
           abort ();
         }
     }
-  m4__push_wrapup_finish ();
+  m4__push_wrapup_finish (context);
 }
 
 
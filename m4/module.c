@@ -23,6 +23,7 @@
 #include <dlfcn.h>
 
 #include "m4private.h"
+#include "glthread/lock.h"
 #include "xvasprintf.h"
 
 /* Define this to see runtime debug info.  Implied by DEBUG.  */
@@ -63,6 +64,13 @@
  * and macros registered by `mymod_LTX_m4_init_module' are installed
  * into the symbol table using `install_builtin_table' and `install_
  * macro_table' respectively.
+ *
+ * When m4 is configured with --enable-static-modules, the modules
+ * shipped with M4 are linked into the executable instead, and the
+ * front end registers them with `m4_set_static_modules'.  Loading one
+ * of those by name then runs its entry point directly, and
+ * `m4_module_import' finds its exports in the registry, while any
+ * other module is still opened with dlopen(3).
  **/
 
 #define MODULE_SELF_NAME        "!myself!"
@@ -82,6 +90,10 @@ uscore_sym (void *handle, const char *symbol)
 
 static const char * module_dlerror (void);
 
+/* Serializes dlopen with the dlerror that explains its failure, since
+   the message may live in storage shared by all threads.  */
+gl_lock_define_initialized (static, dl_lock)
+
 static void         install_builtin_table (m4*, m4_module *);
 static void         install_macro_table   (m4*, m4_module *);
 
@@ -110,7 +122,19 @@ m4_module_import (m4 *context, const char *module_name,
 
   if (module)
     {
-      symbol_address = dlsym (module->handle, symbol_name);
+      if (module->linked)
+        {
+          const m4_static_symbol *sym;
+
+          for (sym = module->linked->symbols; sym && sym->name; sym++)
+            if (STREQ (sym->name, symbol_name))
+              {
+                symbol_address = sym->address;
+                break;
+              }
+        }
+      else
+        symbol_address = dlsym (module->handle, symbol_name);
 
       if (!symbol_address)
         m4_error (context, 0, 0, NULL,
@@ -130,8 +154,13 @@ m4_install_builtins (m4 *context, m4_module *module, const m4_builtin *bp)
 
   const m4_builtin *tmp;
   m4__builtin *builtin;
+  bool sorted = true;
   for (tmp = bp; tmp->name; tmp++)
-    module->builtins_len++;
+    {
+      if (tmp != bp && strcmp (tmp[-1].name, tmp->name) >= 0)
+        sorted = false;
+      module->builtins_len++;
+    }
   module->builtins = (m4__builtin *) xnmalloc (module->builtins_len,
                                                sizeof *module->builtins);
   for (builtin = module->builtins; bp->name != NULL; bp++, builtin++)
@@ -147,8 +176,11 @@ m4_install_builtins (m4 *context, m4_module *module, const m4_builtin *bp)
       builtin->builtin.name = xstrdup (bp->name);
       builtin->module = module;
     }
-  qsort (module->builtins, module->builtins_len,
-         sizeof *module->builtins, compare_builtin_CB);
+  /* The tables of the modules shipped with M4 are written in sorted
+     order, so only tables from other modules need sorting here.  */
+  if (!sorted)
+    qsort (module->builtins, module->builtins_len,
+           sizeof *module->builtins, compare_builtin_CB);
 }
 
 static void
@@ -249,6 +281,26 @@ m4_module_next (m4 *context, m4_module *module)
   return module ? module->next : context->modules;
 }
 
+/* Return the data that the module called NAME attached to CONTEXT
+   with m4_set_module_data, or NULL if it is not loaded.  */
+void *
+m4_get_module_data (m4 *context, const char *name)
+{
+  m4_module *module = m4__module_find (context, name);
+  return module ? module->data : NULL;
+}
+
+/* Attach DATA to MODULE, normally from its init function.  DATA_FREE,
+   unless NULL, is called with DATA when the context is deleted.  */
+void
+m4_set_module_data (m4_module *module, void *data,
+                    m4_module_data_free_func *data_free)
+{
+  assert (module);
+  module->data = data;
+  module->data_free = data_free;
+}
+
 /* Return the first loaded module that passes the registered interface test
    and is called NAME.  */
 m4_module *
@@ -259,6 +311,29 @@ m4__module_find (m4 *context, const char *name)
 }
 
 
+/* Register TABLE, terminated by an entry with a NULL name, as the
+   modules linked into the executable, to be used in preference to
+   searching the module path for a module of the same name.  */
+void
+m4_set_static_modules (m4 *context, const m4_static_module *table)
+{
+  assert (context);
+  context->static_modules = table;
+}
+
+/* Return the entry for NAME among the modules linked into the
+   executable, or NULL if it must be opened from a file.  */
+const m4_static_module *
+m4__static_module_find (m4 *context, const char *name)
+{
+  const m4_static_module *entry = context->static_modules;
+
+  for (; entry && entry->name; entry++)
+    if (STREQ (entry->name, name))
+      return entry;
+  return NULL;
+}
+
 /* Compare two builtins A and B for sorting, as in qsort.  */
 static int
 compare_builtin_CB (const void *a, const void *b)
@@ -283,25 +358,41 @@ m4__module_open (m4 *context, const char *name, m4_obstack *obs)
 
   assert (context);
 
-  char *filepath = m4_path_search (context, name, suffixes);
+  const m4_static_module *linked = m4__static_module_find (context, name);
   void *handle   = NULL;
+  char *err      = NULL;
 
-  if (filepath)
+  if (!linked)
     {
-      handle = dlopen (filepath, RTLD_NOW|RTLD_GLOBAL);
-      free (filepath);
+      char *filepath = m4_path_search (context, name, suffixes);
+
+      if (filepath)
+        {
+          gl_lock_lock (dl_lock);
+          handle = dlopen (filepath, RTLD_NOW|RTLD_GLOBAL);
+          if (!handle)
+            {
+              const char *msg = dlerror ();
+              if (msg)
+                err = xstrdup (msg);
+            }
+          gl_lock_unlock (dl_lock);
+          free (filepath);
+        }
     }
 
-  if (handle)
+  if (handle || linked)
     {
-      m4_debug_message (context, M4_DEBUG_TRACE_MODULE,
-                        _("module %s: opening file %s"),
-                        name ? name : MODULE_SELF_NAME,
-                        quotearg_style (locale_quoting_style, name));
+      if (m4_is_debug_bit (context, M4_DEBUG_TRACE_MODULE))
+        m4_debug_message (context, M4_DEBUG_TRACE_MODULE,
+                          _("module %s: opening file %s"),
+                          name ? name : MODULE_SELF_NAME,
+                          quotearg_style (locale_quoting_style, name));
 
       module = (m4_module *) xzalloc (sizeof *module);
       module->name   = xstrdup (name);
       module->handle = handle;
+      module->linked = linked;
       module->next   = context->modules;
 
       context->modules = module;
@@ -309,10 +400,15 @@ m4__module_open (m4 *context, const char *name, m4_obstack *obs)
 
       /* Find and run any initializing function in the opened module,
          the first time the module is opened.  */
-      char *entry_point = xasprintf ("include_%s", name);
-      m4_module_init_func *init_func =
-          (m4_module_init_func *) dlsym (handle, entry_point);
-      free (entry_point);
+      m4_module_init_func *init_func;
+      if (linked)
+        init_func = linked->init_func;
+      else
+        {
+          char *entry_point = xasprintf ("include_%s", name);
+          init_func = (m4_module_init_func *) dlsym (handle, entry_point);
+          free (entry_point);
+        }
 
       if (init_func)
         {
@@ -332,12 +428,11 @@ m4__module_open (m4 *context, const char *name, m4_obstack *obs)
     }
   else
     {
-      const char *err = dlerror ();
-      if (!err) err = _("unknown error");
-
       /* Couldn't open the module; diagnose and exit. */
       m4_error (context, EXIT_FAILURE, 0, NULL,
-                _("cannot open module `%s': %s"), name, err);
+                _("cannot open module `%s': %s"), name,
+                err ? err : _("unknown error"));
+      free (err);
     }
 
   return module;
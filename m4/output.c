@@ -21,6 +21,9 @@
 #include <config.h>
 
 #include <sys/stat.h>
+#if HAVE_SYS_SENDFILE_H
+# include <sys/sendfile.h>
+#endif
 
 #include "m4private.h"
 
@@ -29,6 +32,7 @@
 #include "exitfail.h"
 #include "gl_avltree_oset.h"
 #include "gl_xoset.h"
+#include "glthread/lock.h"
 #include "intprops.h"
 #include "quotearg.h"
 #include "xvasprintf.h"
@@ -40,13 +44,13 @@
    would usually fit in.  */
 #define INITIAL_BUFFER_SIZE 512
 
-/* Maximum value for the total of all in-memory buffer sizes for
-   diversions.  */
-#define MAXIMUM_TOTAL_SIZE (512 * 1024)
-
 /* Size of buffer size to use while copying files.  */
 #define COPY_BUFFER_SIZE (32 * 512)
 
+/* Largest single transfer to request from the kernel when copying
+   diversions straight to standard output.  */
+#define DIRECT_COPY_SIZE (1024 * 1024 * 1024)
+
 /* Output functions.  Most of the complexity is for handling cpp like
    sync lines.
 
@@ -77,54 +81,75 @@ struct m4_diversion
     size_t used;                /* Used buffer length, or tmp file exists.  */
   };
 
-/* Sorted set of diversions 1 through INT_MAX.  */
-static gl_oset_t diversion_table;
+/* The state of the output engine of one context.  */
+struct m4__output
+{
+  /* Sorted set of diversions 1 through INT_MAX.  */
+  gl_oset_t diversion_table;
+
+  /* Diversion 0 (not part of diversion_table).  */
+  m4_diversion div0;
+
+  /* Linked list of reclaimed diversion storage.  */
+  m4_diversion *free_list;
+
+  /* Obstack from which diversion storage is allocated.  */
+  m4_obstack diversion_storage;
 
-/* Diversion 0 (not part of diversion_table).  */
-static m4_diversion div0;
+  /* Total size of all in-memory buffer sizes.  */
+  size_t total_buffer_size;
 
-/* Linked list of reclaimed diversion storage.  */
-static m4_diversion *free_list;
+  /* Current output diversion, NULL if output is being currently
+     discarded.  output_diversion->u is guaranteed non-NULL except
+     when the diversion has never been used; use size to determine if
+     it is a malloc'd buffer or a FILE.  output_diversion->used is 0
+     if u.file is stdout, and non-zero if this is a malloc'd buffer or
+     a temporary diversion file.  */
+  m4_diversion *output_diversion;
 
-/* Obstack from which diversion storage is allocated.  */
-static m4_obstack diversion_storage;
+  /* Cache of output_diversion->u.file, only valid when
+     output_diversion->size is 0.  */
+  FILE *output_file;
 
-/* Total size of all in-memory buffer sizes.  */
-static size_t total_buffer_size;
+  /* Cache of output_diversion->u.buffer + output_diversion->used,
+     only valid when output_diversion->size is non-zero.  */
+  char *output_cursor;
 
-/* Current output diversion, NULL if output is being currently
-   discarded.  output_diversion->u is guaranteed non-NULL except when
-   the diversion has never been used; use size to determine if it is a
-   malloc'd buffer or a FILE.  output_diversion->used is 0 if u.file
-   is stdout, and non-zero if this is a malloc'd buffer or a temporary
-   diversion file.  */
-static m4_diversion *output_diversion;
+  /* Cache of output_diversion->size - output_diversion->used, only
+     valid when output_diversion->size is non-zero.  */
+  size_t output_unused;
 
-/* Cache of output_diversion->u.file, only valid when
-   output_diversion->size is 0.  */
-static FILE *output_file;
+  /* True if the next output byte starts a line, for sync lines.  */
+  bool start_of_output_line;
 
-/* Cache of output_diversion->u.buffer + output_diversion->used, only
-   valid when output_diversion->size is non-zero.  */
-static char *output_cursor;
+  /* Temporary directory holding all spilled diversion files.  */
+  m4_temp_dir *output_temp_dir;
 
-/* Cache of output_diversion->size - output_diversion->used, only
-   valid when output_diversion->size is non-zero.  */
-static size_t output_unused;
+  /* Next state in temp_owners, if output_temp_dir was ever set.  */
+  m4__output *temp_next;
 
-/* Temporary directory holding all spilled diversion files.  */
-static m4_temp_dir *output_temp_dir;
+  /* Cache of most recently used spilled diversion files.  */
+  FILE *tmp_file1;
+  FILE *tmp_file2;
 
-/* Cache of most recently used spilled diversion files.  */
-static FILE *tmp_file1;
-static FILE *tmp_file2;
+  /* Diversions that own tmp_file, or 0.  */
+  int tmp_file1_owner;
+  int tmp_file2_owner;
 
-/* Diversions that own tmp_file, or 0.  */
-static int tmp_file1_owner;
-static int tmp_file2_owner;
+  /* True if tmp_file2 is more recently used.  */
+  bool tmp_file2_recent;
 
-/* True if tmp_file2 is more recently used.  */
-static bool tmp_file2_recent;
+  /* Buffer reused by m4_tmpname, and the offset of the diversion
+     number within it.  */
+  char *tmp_name;
+  size_t tmp_name_offset;
+};
+
+/* Every output state that has created a temporary directory, so that
+   cleanup_tmpfile can remove them all at exit, whichever threads
+   created them.  */
+static m4__output *temp_owners;
+gl_lock_define_initialized (static, temp_owners_lock)
 
 
 /* Internal routines.  */
@@ -151,19 +176,17 @@ threshold_diversion_CB (const void *elt, const void *threshold)
   return diversion->divnum >= *(const int *) threshold;
 }
 
-/* Clean up any temporary directory.  Designed for use as an atexit
-   handler, where it is not safe to call exit() recursively; so this
-   calls _exit if a problem is encountered.  */
-static void
-cleanup_tmpfile (void)
+/* Close the open diversions of OUTPUT, and remove its temporary
+   directory.  Return true on success.  */
+static bool
+cleanup_output_temp_dir (m4__output *output)
 {
-  /* Close any open diversions.  */
-  bool fail = false;
+  bool ok = true;
 
-  if (diversion_table)
+  if (output->diversion_table)
     {
       const void *elt;
-      gl_oset_iterator_t iter = gl_oset_iterator (diversion_table);
+      gl_oset_iterator_t iter = gl_oset_iterator (output->diversion_table);
       while (gl_oset_iterator_next (&iter, &elt))
         {
           m4_diversion *diversion = (m4_diversion *) elt;
@@ -172,36 +195,54 @@ cleanup_tmpfile (void)
             {
               error (0, errno,
                      _("cannot clean temporary file for diversion"));
-              fail = true;
+              ok = false;
             }
         }
       gl_oset_iterator_free (&iter);
     }
 
-  /* Clean up the temporary directory.  */
-  if (cleanup_temp_dir (output_temp_dir) != 0)
-    fail = true;
+  if (cleanup_temp_dir (output->output_temp_dir) != 0)
+    ok = false;
+  output->output_temp_dir = NULL;
+  return ok;
+}
+
+/* Clean up any temporary directory.  Designed for use as an atexit
+   handler, where it is not safe to call exit() recursively; so this
+   calls _exit if a problem is encountered.  */
+static void
+cleanup_tmpfile (void)
+{
+  m4__output *output;
+  bool fail = false;
+
+  gl_lock_lock (temp_owners_lock);
+  for (output = temp_owners; output; output = output->temp_next)
+    if (output->output_temp_dir && !cleanup_output_temp_dir (output))
+      fail = true;
+  gl_lock_unlock (temp_owners_lock);
   if (fail)
     _exit (exit_failure);
 }
 
 /* Convert DIVNUM into a temporary file name for use in m4_tmp*.  */
 static const char *
-m4_tmpname (int divnum)
+m4_tmpname (m4__output *output, int divnum)
 {
-  static char *buffer;
-  static size_t offset;
-  if (buffer == NULL)
+  if (output->tmp_name == NULL)
     {
-      obstack_printf (&diversion_storage, "%s/m4-", output_temp_dir->dir_name);
-      offset = obstack_object_size (&diversion_storage);
-      buffer = (char *) obstack_alloc (&diversion_storage,
-                                       INT_BUFSIZE_BOUND (divnum));
+      obstack_printf (&output->diversion_storage, "%s/m4-",
+                      output->output_temp_dir->dir_name);
+      output->tmp_name_offset
+        = obstack_object_size (&output->diversion_storage);
+      output->tmp_name = (char *) obstack_alloc (&output->diversion_storage,
+                                                 INT_BUFSIZE_BOUND (divnum));
     }
   assert (0 < divnum);
-  if (snprintf (&buffer[offset], INT_BUFSIZE_BOUND (divnum), "%d", divnum) < 0)
+  if (snprintf (&output->tmp_name[output->tmp_name_offset],
+                INT_BUFSIZE_BOUND (divnum), "%d", divnum) < 0)
     abort ();
-  return buffer;
+  return output->tmp_name;
 }
 
 /* Create a temporary file for diversion DIVNUM open for reading and
@@ -214,23 +255,34 @@ m4_tmpname (int divnum)
 static FILE *
 m4_tmpfile (m4 *context, int divnum)
 {
+  m4__output *output = context->output;
   const char *name;
   FILE *file;
 
-  if (output_temp_dir == NULL)
+  if (output->output_temp_dir == NULL)
     {
-      output_temp_dir = create_temp_dir ("m4-", NULL, true);
-      if (output_temp_dir == NULL)
+      static bool registered;
+
+      output->output_temp_dir = create_temp_dir ("m4-", NULL, true);
+      if (output->output_temp_dir == NULL)
         m4_error (context, EXIT_FAILURE, errno, NULL,
                   _("cannot create temporary file for diversion"));
-      atexit (cleanup_tmpfile);
+      gl_lock_lock (temp_owners_lock);
+      if (!registered)
+        {
+          atexit (cleanup_tmpfile);
+          registered = true;
+        }
+      output->temp_next = temp_owners;
+      temp_owners = output;
+      gl_lock_unlock (temp_owners_lock);
     }
-  name = m4_tmpname (divnum);
-  register_temp_file (output_temp_dir, name);
+  name = m4_tmpname (output, divnum);
+  register_temp_file (output->output_temp_dir, name);
   file = fopen_temp (name, O_BINARY ? "wb+" : "w+");
   if (file == NULL)
     {
-      unregister_temp_file (output_temp_dir, name);
+      unregister_temp_file (output->output_temp_dir, name);
       m4_error (context, EXIT_FAILURE, errno, NULL,
                 _("cannot create temporary file for diversion"));
     }
@@ -247,26 +299,28 @@ m4_tmpfile (m4 *context, int divnum)
 static FILE *
 m4_tmpopen (m4 *context, int divnum, bool reread)
 {
+  m4__output *output = context->output;
   const char *name;
   FILE *file;
 
-  if (tmp_file1_owner == divnum)
+  if (output->tmp_file1_owner == divnum)
     {
-      if (reread && fseeko (tmp_file1, 0, SEEK_SET) != 0)
+      if (reread && fseeko (output->tmp_file1, 0, SEEK_SET) != 0)
         m4_error (context, EXIT_FAILURE, errno, NULL,
                   _("cannot seek within diversion"));
-      tmp_file2_recent = false;
-      return tmp_file1;
+      output->tmp_file2_recent = false;
+      return output->tmp_file1;
     }
-  else if (tmp_file2_owner == divnum)
+  else if (output->tmp_file2_owner == divnum)
     {
-      if (reread && fseeko (tmp_file2, 0, SEEK_SET) != 0)
+      if (reread && fseeko (output->tmp_file2, 0, SEEK_SET) != 0)
         m4_error (context, EXIT_FAILURE, errno, NULL,
                   _("cannot seek to beginning of diversion"));
-      tmp_file2_recent = true;
-      return tmp_file2;
+      output->tmp_file2_recent = true;
+      return output->tmp_file2;
     }
-  name = m4_tmpname (divnum);
+  name = m4_tmpname (output, divnum);
+  context->stats.diversion_reloads++;
   /* We need update mode, to avoid truncation.  */
   file = fopen_temp (name, O_BINARY ? "rb+" : "r+");
   if (file == NULL)
@@ -288,24 +342,24 @@ m4_tmpopen (m4 *context, int divnum, bool reread)
    On the other hand, keeping every spilled diversion open would run
    into EMFILE limits.  */
 static int
-m4_tmpclose (FILE *file, int divnum)
+m4_tmpclose (m4__output *output, FILE *file, int divnum)
 {
   int result = 0;
-  if (divnum != tmp_file1_owner && divnum != tmp_file2_owner)
+  if (divnum != output->tmp_file1_owner && divnum != output->tmp_file2_owner)
     {
-      if (tmp_file2_recent)
+      if (output->tmp_file2_recent)
         {
-          if (tmp_file1_owner)
-            result = close_stream_temp (tmp_file1);
-          tmp_file1 = file;
-          tmp_file1_owner = divnum;
+          if (output->tmp_file1_owner)
+            result = close_stream_temp (output->tmp_file1);
+          output->tmp_file1 = file;
+          output->tmp_file1_owner = divnum;
         }
       else
         {
-          if (tmp_file2_owner)
-            result = close_stream_temp (tmp_file2);
-          tmp_file2 = file;
-          tmp_file2_owner = divnum;
+          if (output->tmp_file2_owner)
+            result = close_stream_temp (output->tmp_file2);
+          output->tmp_file2 = file;
+          output->tmp_file2_owner = divnum;
         }
     }
   return result;
@@ -313,23 +367,24 @@ m4_tmpclose (FILE *file, int divnum)
 
 /* Delete a closed temporary FILE for diversion DIVNUM.  */
 static int
-m4_tmpremove (int divnum)
+m4_tmpremove (m4__output *output, int divnum)
 {
-  if (divnum == tmp_file1_owner)
+  if (divnum == output->tmp_file1_owner)
     {
-      int result = close_stream_temp (tmp_file1);
+      int result = close_stream_temp (output->tmp_file1);
       if (result)
         return result;
-      tmp_file1_owner = 0;
+      output->tmp_file1_owner = 0;
     }
-  else if (divnum == tmp_file2_owner)
+  else if (divnum == output->tmp_file2_owner)
     {
-      int result = close_stream_temp (tmp_file2);
+      int result = close_stream_temp (output->tmp_file2);
       if (result)
         return result;
-      tmp_file2_owner = 0;
+      output->tmp_file2_owner = 0;
     }
-  return cleanup_temp_file (output_temp_dir, m4_tmpname (divnum));
+  return cleanup_temp_file (output->output_temp_dir,
+                            m4_tmpname (output, divnum));
 }
 
 /* Transfer the temporary file for diversion OLDNUM to the previously
@@ -338,34 +393,36 @@ m4_tmpremove (int divnum)
 static FILE*
 m4_tmprename (m4 *context, int oldnum, int newnum)
 {
+  m4__output *output = context->output;
+
   /* m4_tmpname reuses its return buffer.  */
-  char *oldname = xstrdup (m4_tmpname (oldnum));
-  const char *newname = m4_tmpname (newnum);
-  register_temp_file (output_temp_dir, newname);
-  if (oldnum == tmp_file1_owner)
+  char *oldname = xstrdup (m4_tmpname (output, oldnum));
+  const char *newname = m4_tmpname (output, newnum);
+  register_temp_file (output->output_temp_dir, newname);
+  if (oldnum == output->tmp_file1_owner)
     {
       /* Be careful of mingw, which can't rename an open file.  */
       if (RENAME_OPEN_FILE_WORKS)
-        tmp_file1_owner = newnum;
+        output->tmp_file1_owner = newnum;
       else
         {
-          if (close_stream_temp (tmp_file1))
+          if (close_stream_temp (output->tmp_file1))
             m4_error (context, EXIT_FAILURE, errno, NULL,
                       _("cannot close temporary file for diversion"));
-          tmp_file1_owner = 0;
+          output->tmp_file1_owner = 0;
         }
     }
-  else if (oldnum == tmp_file2_owner)
+  else if (oldnum == output->tmp_file2_owner)
     {
       /* Be careful of mingw, which can't rename an open file.  */
       if (RENAME_OPEN_FILE_WORKS)
-        tmp_file2_owner = newnum;
+        output->tmp_file2_owner = newnum;
       else
         {
-          if (close_stream_temp (tmp_file2))
+          if (close_stream_temp (output->tmp_file2))
             m4_error (context, EXIT_FAILURE, errno, NULL,
                       _("cannot close temporary file for diversion"));
-          tmp_file2_owner = 0;
+          output->tmp_file2_owner = 0;
         }
     }
   /* Either it is safe to rename an open file, or no one should have
@@ -373,7 +430,7 @@ m4_tmprename (m4 *context, int oldnum, int newnum)
   if (rename (oldname, newname))
     m4_error (context, EXIT_FAILURE, errno, NULL,
               _("cannot create temporary file for diversion"));
-  unregister_temp_file (output_temp_dir, oldname);
+  unregister_temp_file (output->output_temp_dir, oldname);
   free (oldname);
   return m4_tmpopen (context, newnum, false);
 }
@@ -385,30 +442,144 @@ m4_tmprename (m4 *context, int oldnum, int newnum)
 void
 m4_output_init (m4 *context)
 {
-  diversion_table = gl_oset_create_empty (GL_AVLTREE_OSET, cmp_diversion_CB,
-                                          NULL);
-  div0.u.file = stdout;
+  m4__output *output = (m4__output *) xzalloc (sizeof *output);
+
+  assert (!context->output);
+  context->output = output;
+  output->diversion_table = gl_oset_create_empty (GL_AVLTREE_OSET,
+                                                  cmp_diversion_CB, NULL);
+  output->div0.u.file = stdout;
   m4_set_current_diversion (context, 0);
-  output_diversion = &div0;
-  output_file = stdout;
-  obstack_init (&diversion_storage);
+  output->output_diversion = &output->div0;
+  output->output_file = stdout;
+  output->start_of_output_line = true;
+  obstack_init (&output->diversion_storage);
 }
 
 /* Clean up memory allocated during use.  */
 void
-m4_output_exit (void)
+m4_output_exit (m4 *context)
 {
-  /* Order is important, since we may have registered cleanup_tmpfile
-     as an atexit handler, and it must not traverse stale memory.  */
-  gl_oset_t table = diversion_table;
-  assert (gl_oset_size (diversion_table) == 0);
-  if (tmp_file1_owner)
-    m4_tmpremove (tmp_file1_owner);
-  if (tmp_file2_owner)
-    m4_tmpremove (tmp_file2_owner);
-  diversion_table = NULL;
-  gl_oset_free (table);
-  obstack_free (&diversion_storage, NULL);
+  m4__output *output = context->output;
+  m4__output **link;
+
+  assert (gl_oset_size (output->diversion_table) == 0);
+  if (output->tmp_file1_owner)
+    m4_tmpremove (output, output->tmp_file1_owner);
+  if (output->tmp_file2_owner)
+    m4_tmpremove (output, output->tmp_file2_owner);
+
+  /* Order is important, since cleanup_tmpfile may be running as an
+     atexit handler in another thread, and it must not traverse stale
+     memory.  */
+  gl_lock_lock (temp_owners_lock);
+  for (link = &temp_owners; *link; link = &(*link)->temp_next)
+    if (*link == output)
+      {
+        *link = output->temp_next;
+        break;
+      }
+  gl_lock_unlock (temp_owners_lock);
+  if (output->output_temp_dir && !cleanup_output_temp_dir (output))
+    m4_set_exit_status (context, EXIT_FAILURE);
+  gl_oset_free (output->diversion_table);
+  obstack_free (&output->diversion_storage, NULL);
+  free (output);
+  context->output = NULL;
+}
+
+/* Copy the spilled diversion file NAME, which belongs to another
+   process, into a new temporary file for diversion DIVNUM.  */
+static void
+m4_tmpcopy (m4 *context, const char *name, int divnum)
+{
+  m4__output *output = context->output;
+  char buffer[COPY_BUFFER_SIZE];
+  FILE *from;
+  FILE *file;
+  size_t length;
+
+  from = fopen (name, O_BINARY ? "rb" : "r");
+  if (from == NULL)
+    m4_error (context, EXIT_FAILURE, errno, NULL,
+              _("cannot create temporary file for diversion"));
+  file = m4_tmpfile (context, divnum);
+  while ((length = fread (buffer, 1, sizeof buffer, from)) != 0)
+    if (fwrite (buffer, 1, length, file) != length)
+      m4_error (context, EXIT_FAILURE, errno, NULL,
+                _("cannot flush diversion to temporary file"));
+  if (ferror (from) || fclose (from) != 0)
+    m4_error (context, EXIT_FAILURE, errno, NULL,
+              _("reading inserted file"));
+  if (m4_tmpclose (output, file, divnum) != 0)
+    m4_error (context, EXIT_FAILURE, errno, NULL,
+              _("cannot close temporary file for diversion"));
+}
+
+/* Give a process just forked from one that may have spilled
+   diversions a temporary directory of its own, holding copies of the
+   spilled diversion files, so that neither process can clobber or
+   delete the files of the other.  The caller must flush all streams
+   before forking.  */
+void
+m4_output_detach (m4 *context)
+{
+  m4__output *output = context->output;
+  char *parent_dir;
+  const void *elt;
+  gl_oset_iterator_t iter;
+  int current = 0;
+
+  if (output->output_temp_dir == NULL)
+    return;
+
+  /* The streams still visiting the parent's files share their offsets
+     with the parent, so drop them without the seek that fclose might
+     perform.  */
+  if (output->output_diversion && output->output_diversion != &output->div0
+      && !output->output_diversion->size && output->output_diversion->u.file)
+    {
+      current = output->output_diversion->divnum;
+      if (output->output_diversion->u.file != output->tmp_file1
+          && output->output_diversion->u.file != output->tmp_file2)
+        close (fileno (output->output_diversion->u.file));
+      output->output_diversion->u.file = NULL;
+      output->output_file = NULL;
+    }
+  if (output->tmp_file1_owner)
+    close (fileno (output->tmp_file1));
+  if (output->tmp_file2_owner)
+    close (fileno (output->tmp_file2));
+  output->tmp_file1_owner = output->tmp_file2_owner = 0;
+
+  /* The parent remains responsible for its own directory, so it is
+     forgotten here rather than cleaned up.  */
+  parent_dir = xstrdup (output->output_temp_dir->dir_name);
+  output->output_temp_dir = create_temp_dir ("m4-", NULL, true);
+  if (output->output_temp_dir == NULL)
+    m4_error (context, EXIT_FAILURE, errno, NULL,
+              _("cannot create temporary file for diversion"));
+  output->tmp_name = NULL;
+
+  iter = gl_oset_iterator (output->diversion_table);
+  while (gl_oset_iterator_next (&iter, &elt))
+    {
+      m4_diversion *diversion = (m4_diversion *) elt;
+      if (!diversion->size && diversion->used)
+        {
+          char *name = xasprintf ("%s/m4-%d", parent_dir, diversion->divnum);
+          m4_tmpcopy (context, name, diversion->divnum);
+          free (name);
+        }
+    }
+  gl_oset_iterator_free (&iter);
+  free (parent_dir);
+
+  if (current)
+    {
+      output->output_diversion->u.file = m4_tmpopen (context, current, false);
+      output->output_file = output->output_diversion->u.file;
+    }
 }
 
 /* Reorganize in-memory diversion buffers so the current diversion can
@@ -420,29 +591,32 @@ m4_output_exit (void)
 static void
 make_room_for (m4 *context, size_t length)
 {
+  m4__output *output = context->output;
+  m4_diversion *current = output->output_diversion;
   size_t wanted_size;
+  size_t maximum_size = m4_get_diversion_memory_opt (context);
   m4_diversion *selected_diversion = NULL;
 
-  assert (!output_file);
-  assert (output_diversion);
-  assert (output_diversion->size || !output_diversion->u.file);
+  assert (!output->output_file);
+  assert (current);
+  assert (current->size || !current->u.file);
 
   /* Compute needed size for in-memory buffer.  Diversions in-memory
      buffers start at 0 bytes, then 512, then keep doubling until it is
      decided to flush them to disk.  */
 
-  output_diversion->used = output_diversion->size - output_unused;
+  current->used = current->size - output->output_unused;
 
-  for (wanted_size = output_diversion->size;
-       wanted_size <= MAXIMUM_TOTAL_SIZE
-         && wanted_size - output_diversion->used < length;
+  for (wanted_size = current->size;
+       wanted_size <= maximum_size
+         && wanted_size - current->used < length;
        wanted_size = wanted_size == 0 ? INITIAL_BUFFER_SIZE : wanted_size * 2)
     ;
 
   /* Check if we are exceeding the maximum amount of buffer memory.  */
 
-  if (total_buffer_size - output_diversion->size + wanted_size
-      > MAXIMUM_TOTAL_SIZE)
+  if (output->total_buffer_size - current->size + wanted_size
+      > maximum_size)
     {
       size_t selected_used;
       char *selected_buffer;
@@ -456,10 +630,10 @@ make_room_for (m4 *context, size_t length)
          projected data, while making the selection.  So, if it is
          selected indeed, we will flush it smaller, before it grows.  */
 
-      selected_diversion = output_diversion;
-      selected_used = output_diversion->used + length;
+      selected_diversion = current;
+      selected_used = current->used + length;
 
-      iter = gl_oset_iterator (diversion_table);
+      iter = gl_oset_iterator (output->diversion_table);
       while (gl_oset_iterator_next (&iter, &elt))
         {
           diversion = (m4_diversion *) elt;
@@ -478,11 +652,12 @@ make_room_for (m4 *context, size_t length)
          a garbage pointer as a file.  */
 
       selected_buffer = selected_diversion->u.buffer;
-      total_buffer_size -= selected_diversion->size;
+      output->total_buffer_size -= selected_diversion->size;
       selected_diversion->size = 0;
       selected_diversion->u.file = NULL;
       selected_diversion->u.file = m4_tmpfile (context,
                                                selected_diversion->divnum);
+      context->stats.diversion_spills++;
 
       if (selected_diversion->used > 0)
         {
@@ -501,13 +676,13 @@ make_room_for (m4 *context, size_t length)
 
   /* Reload output_file, just in case the flushed diversion was current.  */
 
-  if (output_diversion == selected_diversion)
+  if (current == selected_diversion)
     {
       /* The flushed diversion was current indeed.  */
 
-      output_file = output_diversion->u.file;
-      output_cursor = NULL;
-      output_unused = 0;
+      output->output_file = current->u.file;
+      output->output_cursor = NULL;
+      output->output_unused = 0;
     }
   else
     {
@@ -516,7 +691,7 @@ make_room_for (m4 *context, size_t length)
         {
           FILE *file = selected_diversion->u.file;
           selected_diversion->u.file = NULL;
-          if (m4_tmpclose (file, selected_diversion->divnum) != 0)
+          if (m4_tmpclose (output, file, selected_diversion->divnum) != 0)
             m4_error (context, 0, errno, NULL,
                       _("cannot close temporary file for diversion"));
         }
@@ -524,42 +699,45 @@ make_room_for (m4 *context, size_t length)
       /* The current buffer may be safely reallocated.  */
       assert (wanted_size >= length);
       {
-        char *buffer = output_diversion->u.buffer;
-        output_diversion->u.buffer = xcharalloc ((size_t) wanted_size);
-        memcpy (output_diversion->u.buffer, buffer, output_diversion->used);
+        char *buffer = current->u.buffer;
+        current->u.buffer = xcharalloc ((size_t) wanted_size);
+        memcpy (current->u.buffer, buffer, current->used);
         free (buffer);
       }
 
-      total_buffer_size += wanted_size - output_diversion->size;
-      output_diversion->size = wanted_size;
+      output->total_buffer_size += wanted_size - current->size;
+      current->size = wanted_size;
 
-      output_cursor = output_diversion->u.buffer + output_diversion->used;
-      output_unused = wanted_size - output_diversion->used;
+      output->output_cursor = current->u.buffer + current->used;
+      output->output_unused = wanted_size - current->used;
     }
 }
 
 /* Output one character CHAR, when it is known that it goes to a
-   diversion file or an in-memory diversion buffer.  A variable m4
-   *context must be in scope.  */
-#define OUTPUT_CHARACTER(Char)                   \
-  if (output_file)                               \
-    putc ((Char), output_file);                  \
-  else if (output_unused == 0)                   \
-    output_character_helper (context, (Char));   \
-  else                                           \
-    (output_unused--, *output_cursor++ = (Char))
+   diversion file or an in-memory diversion buffer.  Variables m4
+   *context, and m4__output *output holding its output state, must be
+   in scope.  */
+#define OUTPUT_CHARACTER(Char)                          \
+  if (output->output_file)                              \
+    putc ((Char), output->output_file);                 \
+  else if (output->output_unused == 0)                  \
+    output_character_helper (context, (Char));          \
+  else                                                  \
+    (output->output_unused--, *output->output_cursor++ = (Char))
 
 static void
 output_character_helper (m4 *context, int character)
 {
+  m4__output *output = context->output;
+
   make_room_for (context, 1);
 
-  if (output_file)
-    putc (character, output_file);
+  if (output->output_file)
+    putc (character, output->output_file);
   else
     {
-      *output_cursor++ = character;
-      output_unused--;
+      *output->output_cursor++ = character;
+      output->output_unused--;
     }
 }
 
@@ -568,26 +746,27 @@ output_character_helper (m4 *context, int character)
 void
 m4_output_text (m4 *context, const char *text, size_t length)
 {
+  m4__output *output = context->output;
   size_t count;
 
-  if (!output_diversion || !length)
+  if (!output->output_diversion || !length)
     return;
 
-  if (!output_file && length > output_unused)
+  if (!output->output_file && length > output->output_unused)
     make_room_for (context, length);
 
-  if (output_file)
+  if (output->output_file)
     {
-      count = fwrite (text, length, 1, output_file);
+      count = fwrite (text, length, 1, output->output_file);
       if (count != 1)
         m4_error (context, EXIT_FAILURE, errno, NULL,
                   _("copying inserted file"));
     }
   else
     {
-      memcpy (output_cursor, text, length);
-      output_cursor += length;
-      output_unused -= length;
+      memcpy (output->output_cursor, text, length);
+      output->output_cursor += length;
+      output->output_unused -= length;
     }
 }
 
@@ -607,7 +786,7 @@ void
 m4_divert_text (m4 *context, m4_obstack *obs, const char *text, size_t length,
                 int line)
 {
-  static bool start_of_output_line = true;
+  m4__output *output = context->output;
 
   /* If output goes to an obstack, merely add TEXT to it.  */
 
@@ -619,7 +798,7 @@ m4_divert_text (m4 *context, m4_obstack *obs, const char *text, size_t length,
 
   /* Do nothing if TEXT should be discarded.  */
 
-  if (!output_diversion || !length)
+  if (!output->output_diversion || !length)
     return;
 
   /* Output TEXT to a file, or in-memory diversion buffer.  */
@@ -652,9 +831,9 @@ m4_divert_text (m4 *context, m4_obstack *obs, const char *text, size_t length,
          tokens, and tokens that are out of sync but in the middle of
          the line, must wait until the next raw newline triggers a
          syncline.  */
-      if (start_of_output_line)
+      if (output->start_of_output_line)
         {
-          start_of_output_line = false;
+          output->start_of_output_line = false;
           m4_set_output_line (context, m4_get_output_line (context) + 1);
 
 #ifdef DEBUG_OUTPUT
@@ -687,23 +866,36 @@ m4_divert_text (m4 *context, m4_obstack *obs, const char *text, size_t length,
             }
         }
 
-      /* Output the token, and track embedded newlines.  */
-      for (; length-- > 0; text++)
+      /* Output the token, and track embedded newlines.  Each newline
+         followed by more of the token starts another output line; a
+         final newline leaves that to the next token, which may need a
+         syncline first.  As above, short texts go a byte at a time,
+         while longer ones are counted and copied in one piece.  */
+      if (length <= 8)
+        for (; length-- > 0; text++)
+          {
+            if (output->start_of_output_line)
+              {
+                output->start_of_output_line = false;
+                m4_set_output_line (context,
+                                    m4_get_output_line (context) + 1);
+              }
+            OUTPUT_CHARACTER (*text);
+            if (*text == '\n')
+              output->start_of_output_line = true;
+          }
+      else
         {
-          if (start_of_output_line)
-            {
-              start_of_output_line = false;
-              m4_set_output_line (context, m4_get_output_line (context) + 1);
+          size_t lines = m4__count_newlines (context, text, length);
 
-#ifdef DEBUG_OUTPUT
-              xfprintf (stderr, "DEBUG: line %d, cur %lu, cur out %lu\n", line,
-                        (unsigned long int) m4_get_current_line (context),
-                        (unsigned long int) m4_get_output_line (context));
-#endif
+          m4_output_text (context, text, length);
+          if (text[length - 1] == '\n')
+            {
+              output->start_of_output_line = true;
+              lines--;
             }
-          OUTPUT_CHARACTER (*text);
-          if (*text == '\n')
-            start_of_output_line = true;
+          if (lines)
+            m4_set_output_line (context, m4_get_output_line (context) + lines);
         }
     }
 }
@@ -792,38 +984,40 @@ m4_shipout_string_trunc (m4_obstack *obs, const char *s, size_t len,
 void
 m4_make_diversion (m4 *context, int divnum)
 {
+  m4__output *output = context->output;
   m4_diversion *diversion = NULL;
 
   if (m4_get_current_diversion (context) == divnum)
     return;
 
-  if (output_diversion)
+  if (output->output_diversion)
     {
-      assert (!output_file || output_diversion->u.file == output_file);
-      assert (output_diversion->divnum != divnum);
-      if (!output_diversion->size && !output_diversion->u.file)
+      m4_diversion *previous = output->output_diversion;
+      assert (!output->output_file || previous->u.file == output->output_file);
+      assert (previous->divnum != divnum);
+      if (!previous->size && !previous->u.file)
         {
-          assert (!output_diversion->used);
-          if (!gl_oset_remove (diversion_table, output_diversion))
+          assert (!previous->used);
+          if (!gl_oset_remove (output->diversion_table, previous))
             assert (false);
-          output_diversion->u.next = free_list;
-          free_list = output_diversion;
+          previous->u.next = output->free_list;
+          output->free_list = previous;
         }
-      else if (output_diversion->size)
-        output_diversion->used = output_diversion->size - output_unused;
-      else if (output_diversion->used)
+      else if (previous->size)
+        previous->used = previous->size - output->output_unused;
+      else if (previous->used)
         {
-          assert (output_diversion->divnum != 0);
-          FILE *file = output_diversion->u.file;
-          output_diversion->u.file = NULL;
-          if (m4_tmpclose (file, output_diversion->divnum) != 0)
+          assert (previous->divnum != 0);
+          FILE *file = previous->u.file;
+          previous->u.file = NULL;
+          if (m4_tmpclose (output, file, previous->divnum) != 0)
             m4_error (context, 0, errno, NULL,
                       _("cannot close temporary file for diversion"));
         }
-      output_diversion = NULL;
-      output_file = NULL;
-      output_cursor = NULL;
-      output_unused = 0;
+      output->output_diversion = NULL;
+      output->output_file = NULL;
+      output->output_cursor = NULL;
+      output->output_unused = 0;
     }
 
   m4_set_current_diversion (context, divnum);
@@ -832,12 +1026,12 @@ m4_make_diversion (m4 *context, int divnum)
     return;
 
   if (divnum == 0)
-    diversion = &div0;
+    diversion = &output->div0;
   else
     {
       const void *elt;
-      if (gl_oset_search_atleast (diversion_table, threshold_diversion_CB,
-                                  &divnum, &elt))
+      if (gl_oset_search_atleast (output->diversion_table,
+                                  threshold_diversion_CB, &divnum, &elt))
         {
           m4_diversion *temp = (m4_diversion *) elt;
           if (temp->divnum == divnum)
@@ -847,38 +1041,36 @@ m4_make_diversion (m4 *context, int divnum)
   if (diversion == NULL)
     {
       /* First time visiting this diversion.  */
-      if (free_list)
+      if (output->free_list)
         {
-          diversion = free_list;
-          free_list = diversion->u.next;
+          diversion = output->free_list;
+          output->free_list = diversion->u.next;
           assert (!diversion->size && !diversion->used);
         }
       else
         {
-          diversion = (m4_diversion *) obstack_alloc (&diversion_storage,
-                                                      sizeof *diversion);
+          diversion = (m4_diversion *)
+            obstack_alloc (&output->diversion_storage, sizeof *diversion);
           diversion->size = 0;
           diversion->used = 0;
         }
       diversion->u.file = NULL;
       diversion->divnum = divnum;
-      if (!gl_oset_add (diversion_table, diversion))
+      if (!gl_oset_add (output->diversion_table, diversion))
         assert (false);
     }
 
-  output_diversion = diversion;
-  if (output_diversion->size)
+  output->output_diversion = diversion;
+  if (diversion->size)
     {
-      output_cursor = output_diversion->u.buffer + output_diversion->used;
-      output_unused = output_diversion->size - output_diversion->used;
+      output->output_cursor = diversion->u.buffer + diversion->used;
+      output->output_unused = diversion->size - diversion->used;
     }
   else
     {
-      if (!output_diversion->u.file && output_diversion->used)
-        output_diversion->u.file = m4_tmpopen (context,
-                                               output_diversion->divnum,
-                                               false);
-      output_file = output_diversion->u.file;
+      if (!diversion->u.file && diversion->used)
+        diversion->u.file = m4_tmpopen (context, diversion->divnum, false);
+      output->output_file = diversion->u.file;
     }
 
   m4_set_output_line (context, -1);
@@ -890,12 +1082,13 @@ m4_make_diversion (m4 *context, int divnum)
 static void
 insert_file (m4 *context, FILE *file, bool escaped)
 {
-  static char buffer[COPY_BUFFER_SIZE];
+  m4__output *output = context->output;
+  char buffer[COPY_BUFFER_SIZE];
   size_t length;
   char *str = buffer;
   bool first = true;
 
-  assert (output_diversion);
+  assert (output->output_diversion);
   /* Insert output by big chunks.  */
   while (1)
     {
@@ -917,14 +1110,99 @@ insert_file (m4 *context, FILE *file, bool escaped)
     }
 }
 
+/* Return true if the current output is diversion 0, going to a stdio
+   stream whose file descriptor can also be written directly.  */
+static bool
+direct_output_p (m4__output *output)
+{
+  return (output->output_diversion == &output->div0 && output->output_file
+          && output->output_file == output->div0.u.file);
+}
+
+/* Write the LENGTH bytes at TEXT to the file descriptor behind the
+   current output file, after flushing the stream, in as few system
+   calls as possible.  Return the number of bytes written; the caller
+   must output any remainder normally, which also takes care of
+   diagnosing write errors.  */
+static size_t
+output_direct (m4__output *output, const char *text, size_t length)
+{
+  int fd = fileno (output->output_file);
+  size_t done = 0;
+
+  if (fd < 0 || fflush (output->output_file) != 0)
+    return 0;
+  while (done < length)
+    {
+      ssize_t count = write (fd, text + done,
+                             (length - done < DIRECT_COPY_SIZE
+                              ? length - done : DIRECT_COPY_SIZE));
+      if (count < 0 && errno == EINTR)
+        continue;
+      if (count <= 0)
+        break;
+      done += count;
+    }
+  return done;
+}
+
+/* Copy the contents of the spilled diversion FILE, which must be
+   positioned at its start with nothing buffered, to the file
+   descriptor behind the current output file, letting the kernel move
+   the data where it can.  Return true if the entire file was copied;
+   otherwise FILE is left positioned after the part that was copied,
+   and the caller must insert the rest normally.  */
+static bool
+copy_diversion_file (m4 *context, FILE *file)
+{
+  m4__output *output = context->output;
+
+#if HAVE_COPY_FILE_RANGE || HAVE_SENDFILE
+  int in = fileno (file);
+  int out = fileno (output->output_file);
+  struct stat st;
+  off_t offset = 0;
+
+  if (in < 0 || out < 0 || fstat (in, &st) != 0 || !S_ISREG (st.st_mode)
+      || fflush (output->output_file) != 0)
+    return false;
+# if HAVE_COPY_FILE_RANGE
+  /* This fails up front if the two descriptors are on different file
+     systems, or the output is not a regular file.  */
+  while (offset < st.st_size
+         && 0 < copy_file_range (in, &offset, out, NULL,
+                                 (st.st_size - offset < DIRECT_COPY_SIZE
+                                  ? st.st_size - offset : DIRECT_COPY_SIZE),
+                                 0))
+    ;
+# endif
+# if HAVE_SENDFILE
+  /* This works for nearly any output, including pipes.  */
+  while (offset < st.st_size
+         && 0 < sendfile (out, in, &offset,
+                          (st.st_size - offset < DIRECT_COPY_SIZE
+                           ? st.st_size - offset : DIRECT_COPY_SIZE)))
+    ;
+# endif
+  if (offset == st.st_size)
+    return true;
+  if (offset && fseeko (file, offset, SEEK_SET) != 0)
+    m4_error (context, EXIT_FAILURE, errno, NULL,
+              _("cannot seek within diversion"));
+#endif /* HAVE_COPY_FILE_RANGE || HAVE_SENDFILE */
+  return false;
+}
+
 /* Insert a FILE into the current output file, in the same manner
    diversions are handled.  This allows files to be included, without
    having them rescanned by m4.  */
 void
 m4_insert_file (m4 *context, FILE *file)
 {
+  m4__output *output = context->output;
+
   /* Optimize out inserting into a sink.  */
-  if (output_diversion)
+  if (output->output_diversion)
     insert_file (context, file, false);
 }
 
@@ -935,23 +1213,26 @@ m4_insert_file (m4 *context, FILE *file)
 static void
 insert_diversion_helper (m4 *context, m4_diversion *diversion, bool escaped)
 {
+  m4__output *output = context->output;
+  m4_diversion *current = output->output_diversion;
+
   assert (diversion->divnum > 0
           && diversion->divnum != m4_get_current_diversion (context));
   /* Effectively undivert only if an output stream is active.  */
-  if (output_diversion)
+  if (current)
     {
       if (diversion->size)
         {
-          if (!output_diversion->u.file)
+          if (!current->u.file)
             {
               /* Transferring diversion metadata is faster than
                  copying contents.  */
-              assert (!output_diversion->used && output_diversion != &div0
-                      && !output_file);
-              output_diversion->u.buffer = diversion->u.buffer;
-              output_diversion->size = diversion->size;
-              output_cursor = diversion->u.buffer + diversion->used;
-              output_unused = diversion->size - diversion->used;
+              assert (!current->used && current != &output->div0
+                      && !output->output_file);
+              current->u.buffer = diversion->u.buffer;
+              current->size = diversion->size;
+              output->output_cursor = diversion->u.buffer + diversion->used;
+              output->output_unused = diversion->size - diversion->used;
               diversion->u.buffer = NULL;
             }
           else
@@ -961,22 +1242,30 @@ insert_diversion_helper (m4 *context, m4_diversion *diversion, bool escaped)
               /* Avoid double-charging the total in-memory size when
                  transferring from one in-memory diversion to
                  another.  */
-              total_buffer_size -= diversion->size;
+              output->total_buffer_size -= diversion->size;
               if (escaped)
                 str = quotearg_style_mem (escape_quoting_style, str, len);
+              else if (COPY_BUFFER_SIZE <= len && direct_output_p (output))
+                {
+                  /* Large buffers bound for stdout skip the stdio
+                     buffer.  */
+                  size_t done = output_direct (output, str, len);
+                  str += done;
+                  len -= done;
+                }
               m4_output_text (context, str, escaped ? strlen (str) : len);
             }
         }
-      else if (!output_diversion->u.file)
+      else if (!current->u.file)
         {
           /* Transferring diversion metadata is faster than copying
              contents.  */
-          assert (!output_diversion->used && output_diversion != &div0
-                  && !output_file);
-          output_diversion->u.file = m4_tmprename (context, diversion->divnum,
-                                                   output_diversion->divnum);
-          output_diversion->used = 1;
-          output_file = output_diversion->u.file;
+          assert (!current->used && current != &output->div0
+                  && !output->output_file);
+          current->u.file = m4_tmprename (context, diversion->divnum,
+                                          current->divnum);
+          current->used = 1;
+          output->output_file = current->u.file;
           diversion->u.file = NULL;
           diversion->size = 1;
         }
@@ -985,7 +1274,9 @@ insert_diversion_helper (m4 *context, m4_diversion *diversion, bool escaped)
           assert (diversion->used);
           if (!diversion->u.file)
             diversion->u.file = m4_tmpopen (context, diversion->divnum, true);
-          insert_file (context, diversion->u.file, escaped);
+          if (escaped || !direct_output_p (output)
+              || !copy_diversion_file (context, diversion->u.file))
+            insert_file (context, diversion->u.file, escaped);
         }
 
       m4_set_output_line (context, -1);
@@ -994,8 +1285,8 @@ insert_diversion_helper (m4 *context, m4_diversion *diversion, bool escaped)
   /* Return all space used by the diversion.  */
   if (diversion->size)
     {
-      if (!output_diversion)
-        total_buffer_size -= diversion->size;
+      if (!current)
+        output->total_buffer_size -= diversion->size;
       free (diversion->u.buffer);
       diversion->size = 0;
     }
@@ -1005,19 +1296,19 @@ insert_diversion_helper (m4 *context, m4_diversion *diversion, bool escaped)
         {
           FILE *file = diversion->u.file;
           diversion->u.file = NULL;
-          if (m4_tmpclose (file, diversion->divnum) != 0)
+          if (m4_tmpclose (output, file, diversion->divnum) != 0)
             m4_error (context, 0, errno, NULL,
                       _("cannot clean temporary file for diversion"));
         }
-      if (m4_tmpremove (diversion->divnum) != 0)
+      if (m4_tmpremove (output, diversion->divnum) != 0)
         m4_error (context, 0, errno, NULL,
                   _("cannot clean temporary file for diversion"));
     }
   diversion->used = 0;
-  if (!gl_oset_remove (diversion_table, diversion))
+  if (!gl_oset_remove (output->diversion_table, diversion))
     assert (false);
-  diversion->u.next = free_list;
-  free_list = diversion;
+  diversion->u.next = output->free_list;
+  output->free_list = diversion;
 }
 
 /* Insert diversion number DIVNUM into the current output file.  The
@@ -1026,13 +1317,14 @@ insert_diversion_helper (m4 *context, m4_diversion *diversion, bool escaped)
 void
 m4_insert_diversion (m4 *context, int divnum)
 {
+  m4__output *output = context->output;
   const void *elt;
 
   /* Do not care about nonexistent diversions, and undiverting stdout
      or self is a no-op.  */
   if (divnum <= 0 || m4_get_current_diversion (context) == divnum)
     return;
-  if (gl_oset_search_atleast (diversion_table, threshold_diversion_CB,
+  if (gl_oset_search_atleast (output->diversion_table, threshold_diversion_CB,
                               &divnum, &elt))
     {
       m4_diversion *diversion = (m4_diversion *) elt;
@@ -1046,9 +1338,10 @@ m4_insert_diversion (m4 *context, int divnum)
 void
 m4_undivert_all (m4 *context)
 {
+  m4__output *output = context->output;
   int divnum = m4_get_current_diversion (context);
   const void *elt;
-  gl_oset_iterator_t iter = gl_oset_iterator (diversion_table);
+  gl_oset_iterator_t iter = gl_oset_iterator (output->diversion_table);
   while (gl_oset_iterator_next (&iter, &elt))
     {
       m4_diversion *diversion = (m4_diversion *) elt;
@@ -1058,10 +1351,13 @@ m4_undivert_all (m4 *context)
   gl_oset_iterator_free (&iter);
 }
 
-/* Produce all diversion information in frozen format on FILE.  */
+/* Produce all diversion information in frozen format on FILE.  If
+   ESCAPED, the contents are written with escape sequences, as in
+   frozen file format 2; otherwise they are copied verbatim.  */
 void
-m4_freeze_diversions (m4 *context, FILE *file)
+m4_freeze_diversions (m4 *context, FILE *file, bool escaped)
 {
+  m4__output *output = context->output;
   int saved_number;
   int last_inserted;
   gl_oset_iterator_t iter;
@@ -1070,9 +1366,9 @@ m4_freeze_diversions (m4 *context, FILE *file)
   saved_number = m4_get_current_diversion (context);
   last_inserted = 0;
   m4_make_diversion (context, 0);
-  output_file = file; /* kludge in the frozen file */
+  output->output_file = file; /* kludge in the frozen file */
 
-  iter = gl_oset_iterator (diversion_table);
+  iter = gl_oset_iterator (output->diversion_table);
   while (gl_oset_iterator_next (&iter, &elt))
     {
       m4_diversion *diversion = (m4_diversion *) elt;
@@ -1104,7 +1400,7 @@ m4_freeze_diversions (m4 *context, FILE *file)
                         (unsigned long int) file_stat.st_size);
             }
 
-          insert_diversion_helper (context, diversion, true);
+          insert_diversion_helper (context, diversion, escaped);
           putc ('\n', file);
 
           last_inserted = diversion->divnum;
@@ -23,6 +23,7 @@
 
 #include <config.h>
 
+#include <dirent.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
@@ -41,6 +42,32 @@
 /* Define this to see runtime debug info.  Implied by DEBUG.  */
 /*#define DEBUG_INCL */
 
+/* Once this many probes in one directory have failed, read the names
+   in it, so that further names missing from it can be rejected
+   without asking the file system.  */
+#define PATH_LISTING_THRESHOLD  16
+
+/* The names read from one search path directory.  */
+struct m4__path_listing
+{
+  m4_hash *names;               /* Folded names, mapped to themselves.  */
+  m4_obstack obs;               /* Storage for names.  */
+  unsigned int generation;      /* Search path generation when read.  */
+  bool usable;                  /* False if the directory was unreadable.  */
+};
+
+/* The remembered result of one m4_path_search.  The name and
+   suffixes come first, as they form the key.  */
+typedef struct
+{
+  m4_string name;               /* File name searched for.  */
+  const char **suffixes;        /* Suffixes tried, compared by address.  */
+  unsigned int generation;      /* Search path generation of result.  */
+  char *found;                  /* File found, or NULL.  */
+  int error;                    /* Errno from searching `.', if not found.  */
+  bool traced;                  /* True if found without a suffix.  */
+} path_cache_entry;
+
 static const char *FILE_SUFFIXES[] = {
   "",
   ".m4f",
@@ -54,6 +81,9 @@ static const char *NO_SUFFIXES[] = { "", NULL };
 static void search_path_add (m4__search_path_info *, const char *, bool);
 static void search_path_env_init (m4__search_path_info *, char *, bool);
 static void include_env_init (m4 *context);
+static bool path_probe (m4__search_path_info *, m4__search_path *,
+                        const char *, bool);
+static char *path_search (m4 *, const char *, const char **, bool *);
 
 #ifdef DEBUG_INCL
 static void include_dump (m4 *context);
@@ -71,6 +101,11 @@ search_path_add (m4__search_path_info *info, const char *dir, bool prepend)
 
   path->len = strlen (dir);
   path->dir = xstrdup (dir);
+  path->listing = NULL;
+  path->misses = 0;
+
+  /* Earlier searches may have missed a file in this directory.  */
+  info->generation++;
 
   if (path->len > info->max_length) /* remember len of longest directory */
     info->max_length = path->len;
@@ -183,19 +218,183 @@ m4_add_include_directory (m4 *context, const char *dir, bool prepend)
 }
 
 
+/* Search result cache.  Each search is remembered under its file name
+   and suffix list, along with the search path generation, which is
+   bumped whenever the path changes or m4_path_cache_flush is called;
+   a result from an older generation is searched afresh.  Within a
+   directory that has seen enough failed probes, a listing of its
+   names lets most further misses skip the file system entirely.  */
+
+static size_t
+path_cache_hash (const void *key)
+{
+  const path_cache_entry *entry = (const path_cache_entry *) key;
+
+  return (m4__hash_mem (entry->name.str, entry->name.len)
+          ^ ((size_t) entry->suffixes >> 3));
+}
+
+static int
+path_cache_cmp (const void *key, const void *try)
+{
+  const path_cache_entry *a = (const path_cache_entry *) key;
+  const path_cache_entry *b = (const path_cache_entry *) try;
+
+  if (a->suffixes != b->suffixes)
+    return 1;
+  return m4_hash_string_cmp (&a->name, &b->name);
+}
+
+/* Append NAME of length LEN to the growing object on OBS, with ASCII
+   letters folded to lower case, so that a listing errs on the side of
+   a real probe on case-insensitive file systems.  Return false,
+   leaving OBS unchanged, if NAME contains any other byte above ASCII,
+   since a file system might normalize it.  */
+static bool
+fold_name (m4_obstack *obs, const char *name, size_t len)
+{
+  size_t i;
+
+  for (i = 0; i < len; i++)
+    if (to_uchar (name[i]) >= 0x80)
+      return false;
+  for (i = 0; i < len; i++)
+    obstack_1grow (obs, ('A' <= name[i] && name[i] <= 'Z'
+                         ? name[i] - 'A' + 'a' : name[i]));
+  return true;
+}
+
+static void *
+path_listing_remove_CB (m4_hash *hash, const void *key,
+                        void *value M4_GNUC_UNUSED,
+                        void *ignored M4_GNUC_UNUSED)
+{
+  m4_hash_remove (hash, key);
+  return NULL;
+}
+
+/* Read the names in the search path directory PATH, for the current
+   generation of INFO.  A directory that does not exist holds no
+   names; one that cannot be read leaves every name to a real probe.
+   Preserve errno.  */
+static void
+path_listing_read (m4__search_path_info *info, m4__search_path *path)
+{
+  m4__path_listing *listing = path->listing;
+  int saved_errno = errno;
+  DIR *dir;
+
+  if (listing == NULL)
+    {
+      listing = path->listing = (m4__path_listing *) xmalloc (sizeof *listing);
+      listing->names = m4_hash_new (0, m4_hash_string_hash,
+                                    m4_hash_string_cmp);
+    }
+  else
+    {
+      m4_hash_apply (listing->names, path_listing_remove_CB, NULL);
+      obstack_free (&listing->obs, NULL);
+    }
+  obstack_init (&listing->obs);
+  listing->generation = info->generation;
+  listing->usable = true;
+  path->misses = 0;
+
+  dir = opendir (path->len ? path->dir : ".");
+  if (dir == NULL)
+    listing->usable = errno == ENOENT || errno == ENOTDIR;
+  else
+    {
+      while (1)
+        {
+          struct dirent *ent;
+          m4_string *name;
+          char *str;
+          size_t len;
+
+          errno = 0;
+          ent = readdir (dir);
+          if (ent == NULL)
+            break;
+          len = strlen (ent->d_name);
+          if (!fold_name (&listing->obs, ent->d_name, len))
+            continue;
+          str = (char *) obstack_finish (&listing->obs);
+          name = (m4_string *) obstack_alloc (&listing->obs, sizeof *name);
+          name->str = str;
+          name->len = len;
+          m4_hash_insert (listing->names, name, name);
+        }
+      if (errno)
+        listing->usable = false;
+      closedir (dir);
+    }
+
+#ifdef DEBUG_INCL
+  xfprintf (stderr, "path_listing_read (%s) -- %zu names%s\n", path->dir,
+            m4_get_hash_length (listing->names),
+            listing->usable ? "" : ", unusable");
+#endif
+
+  errno = saved_errno;
+}
+
+/* Return true if FILE, built from a directory PATH of the search path
+   of INFO, is readable; otherwise set errno.  If IN_DIR, the last
+   component of FILE names an entry of PATH itself, so a current
+   listing of PATH can rule it out without a system call.  */
+static bool
+path_probe (m4__search_path_info *info, m4__search_path *path,
+            const char *file, bool in_dir)
+{
+  m4__path_listing *listing = path->listing;
+  bool current = listing && listing->generation == info->generation;
+
+  if (in_dir && current && listing->usable)
+    {
+      const char *base = last_component (file);
+      size_t len = strlen (base);
+
+      if (fold_name (&listing->obs, base, len))
+        {
+          m4_string key;
+          bool listed;
+
+          key.len = len;
+          key.str = (char *) obstack_finish (&listing->obs);
+          listed = m4_hash_lookup (listing->names, &key) != NULL;
+          obstack_free (&listing->obs, key.str);
+          if (!listed)
+            {
+              errno = ENOENT;
+              return false;
+            }
+        }
+    }
+
+  if (access (file, R_OK) == 0)
+    return true;
+  if (in_dir && !current && ++path->misses >= PATH_LISTING_THRESHOLD)
+    path_listing_read (info, path);
+  return false;
+}
+
 /* Search for FILENAME according to -B options, `.', -I options, then
    M4PATH environment.  If successful, return the open file, and if
    RESULT is not NULL, set *RESULT to a malloc'd string that
    represents the file found with respect to the current working
    directory.  Otherwise, return NULL, and errno reflects the failure
-   from searching `.' (regardless of what else was searched).  */
+   from searching `.' (regardless of what else was searched).  Results
+   are remembered, so that searching again for the same FILENAME with
+   the same SUFFIXES array is free until the search path changes or
+   m4_path_cache_flush is called.  */
 char *
 m4_path_search (m4 *context, const char *filename, const char **suffixes)
 {
-  m4__search_path *incl;
-  char *filepath;		/* buffer for constructed name */
-  size_t max_suffix_len = 0;
-  int i, e = 0;
+  m4__search_path_info *info = m4__get_search_path (context);
+  path_cache_entry key;
+  path_cache_entry *entry = NULL;
+  void **slot;
 
   /* Reject empty file.  */
   if (*filename == '\0')
@@ -208,6 +407,72 @@ m4_path_search (m4 *context, const char *filename, const char **suffixes)
   if (suffixes == NULL)
     suffixes = NO_SUFFIXES;
 
+  if (info->cache == NULL)
+    info->cache = m4_hash_new (0, path_cache_hash, path_cache_cmp);
+  key.name.str = (char *) filename; /* Cast away const.  */
+  key.name.len = strlen (filename);
+  key.suffixes = suffixes;
+  slot = m4_hash_lookup (info->cache, &key);
+  if (slot)
+    entry = (path_cache_entry *) *slot;
+
+  if (entry == NULL || entry->generation != info->generation)
+    {
+      bool traced = false;
+      char *found = path_search (context, filename, suffixes, &traced);
+      int e = errno;
+
+      if (entry == NULL)
+        {
+          entry = (path_cache_entry *) xzalloc (sizeof *entry);
+          entry->name.str = xmemdup0 (filename, key.name.len);
+          entry->name.len = key.name.len;
+          entry->suffixes = suffixes;
+          m4_hash_insert (info->cache, entry, entry);
+        }
+      free (entry->found);
+      entry->found = found;
+      entry->error = found ? 0 : e;
+      entry->traced = traced;
+      entry->generation = info->generation;
+    }
+
+  if (entry->traced)
+    m4_debug_message (context, M4_DEBUG_TRACE_PATH,
+                      _("path search for %s found %s"),
+                      quotearg_style (locale_quoting_style, filename),
+                      quotearg_n_style (1, locale_quoting_style,
+                                        entry->found));
+  if (entry->found == NULL)
+    {
+      errno = entry->error;
+      return NULL;
+    }
+  return xstrdup (entry->found);
+}
+
+/* Forget all remembered search results of CONTEXT, because something
+   such as a child process may have created or removed files.  */
+void
+m4_path_cache_flush (m4 *context)
+{
+  m4__get_search_path (context)->generation++;
+}
+
+/* Search the file system for FILENAME with each of SUFFIXES, as
+   described for m4_path_search.  Set *TRACED if a search path entry
+   holds FILENAME with no suffix.  */
+static char *
+path_search (m4 *context, const char *filename, const char **suffixes,
+             bool *traced)
+{
+  m4__search_path_info *info = m4__get_search_path (context);
+  m4__search_path *incl;
+  char *filepath;		/* buffer for constructed name */
+  size_t max_suffix_len = 0;
+  bool in_dir = last_component (filename) == filename;
+  int i, e = 0;
+
   /* Find the longest suffix, so that we will always allocate enough
      memory for a filename with suffix.  */
   for (i = 0; suffixes && suffixes[i]; ++i)
@@ -247,8 +512,7 @@ m4_path_search (m4 *context, const char *filename, const char **suffixes)
       return NULL;
     }
 
-  for (incl = m4__get_search_path (context)->list;
-       incl != NULL; incl = incl->next)
+  for (incl = info->list; incl != NULL; incl = incl->next)
     {
       char *pathname = file_name_concat (incl->dir, filename, NULL);
       size_t mem = strlen (pathname);
@@ -257,12 +521,9 @@ m4_path_search (m4 *context, const char *filename, const char **suffixes)
       xfprintf (stderr, "path_search (%s) -- trying %s\n", filename, pathname);
 #endif
 
-      if (access (pathname, R_OK) == 0)
+      if (path_probe (info, incl, pathname, in_dir))
         {
-          m4_debug_message (context, M4_DEBUG_TRACE_PATH,
-                            _("path search for %s found %s"),
-                            quotearg_style (locale_quoting_style, filename),
-                            quotearg_n_style (1, locale_quoting_style, pathname));
+          *traced = true;
           return pathname;
         }
       else if (!incl->len)
@@ -279,7 +540,7 @@ m4_path_search (m4 *context, const char *filename, const char **suffixes)
       for (i = 0; suffixes && suffixes[i]; ++i)
         {
           strcpy (filepath + mem, suffixes[i]);
-          if (access (filepath, R_OK) == 0)
+          if (path_probe (info, incl, filepath, in_dir))
             return filepath;
         }
       free (filepath);
@@ -341,12 +602,16 @@ m4_load_filename (m4 *context, const m4_call_info *caller,
   if (filepath)
     suffix = strrchr (filepath, '.');
 
+  /* A module linked into the executable has no file to find, but can
+     still be loaded by name.  */
   if (!m4_get_posixly_correct_opt (context)
-      && suffix
-      && STREQ (suffix, LT_MODULE_EXT))
+      && ((suffix && STREQ (suffix, LT_MODULE_EXT))
+          || (!filepath && m4__static_module_find (context, filename))))
     {
       m4_module_load (context, filename, obs);
     }
+  else if (filepath && m4__push_cached_file (context, filepath))
+    new_input = true;
   else
     {
       FILE *fp = NULL;
@@ -398,6 +663,50 @@ m4__include_init (m4 *context)
 
 
 
+static void *
+path_cache_remove_CB (m4_hash *hash, const void *key, void *value,
+                      void *ignored M4_GNUC_UNUSED)
+{
+  path_cache_entry *entry = (path_cache_entry *) value;
+
+  m4_hash_remove (hash, key);
+  free (entry->name.str);
+  free (entry->found);
+  free (entry);
+  return NULL;
+}
+
+/* Free INFO, along with its directories and remembered results.  */
+void
+m4__search_path_delete (m4__search_path_info *info)
+{
+  m4__search_path *path = info->list;
+
+  while (path)
+    {
+      m4__search_path *stale = path;
+      path = path->next;
+
+      if (stale->listing)
+        {
+          m4_hash_apply (stale->listing->names, path_listing_remove_CB, NULL);
+          m4_hash_delete (stale->listing->names);
+          obstack_free (&stale->listing->obs, NULL);
+          free (stale->listing);
+        }
+      DELETE (stale->dir); /* Cast away const.  */
+      free (stale);
+    }
+  if (info->cache)
+    {
+      m4_hash_apply (info->cache, path_cache_remove_CB, NULL);
+      m4_hash_delete (info->cache);
+    }
+  free (info);
+}
+
+
+
 #ifdef DEBUG_INCL
 
 static void
@@ -22,9 +22,13 @@
 
 #include <regex.h>
 #include <string.h>
+#include <time.h>
+#include <wchar.h>
 
 #include "m4private.h"
 
+#include "glthread/lock.h"
+
 typedef struct {
   const char    *spec;
   const int     code;
@@ -125,3 +129,341 @@ m4_regexp_syntax_decode (int code)
 
   return resyntax->spec;
 }
+
+
+
+/* Regular expressions.  Each context keeps its own cache of compiled
+   patterns, so that macros like patsubst called in a loop need not
+   recompile the same expression every time.  Entries are hashed on
+   the pattern text and syntax, and kept on a list in order of use so
+   that the least recently used entry is the one recycled once the
+   cache holds --regexp-cache entries.  Recycled entries keep their
+   re_registers, which reduces malloc usage.  */
+
+typedef struct m4__regexp_entry m4__regexp_entry;
+
+struct m4__regexp_entry {
+  m4_pattern_buffer buf;        /* the compiled regex, handed to callers */
+  size_t hash;                  /* hash of pattern text and syntax */
+  m4__regexp_entry *chain;      /* next entry in the same bucket */
+  m4__regexp_entry *newer;      /* more recently used entry */
+  m4__regexp_entry *older;      /* less recently used entry */
+};
+
+struct m4__regexp_cache {
+  m4__regexp_entry **buckets;   /* hash buckets, a power of two */
+  size_t nbuckets;              /* number of buckets */
+  size_t count;                 /* number of cached entries */
+  m4__regexp_entry *newest;     /* most recently used entry */
+  m4__regexp_entry *oldest;     /* least recently used entry */
+  size_t hits;                  /* lookups satisfied from the cache */
+  size_t misses;                /* lookups that had to compile */
+  clock_t compile_time;         /* processor time spent compiling */
+};
+
+#define REGEXP_CACHE_BUCKETS 16
+
+static size_t
+regexp_hash (const char *regexp, size_t len, int resyntax)
+{
+  return m4__hash_mem (regexp, len) * 31 + (unsigned int) resyntax;
+}
+
+/* Remove ENTRY from the use list of CACHE.  */
+static void
+regexp_unlink (m4__regexp_cache *cache, m4__regexp_entry *entry)
+{
+  if (entry->newer)
+    entry->newer->older = entry->older;
+  else
+    cache->newest = entry->older;
+  if (entry->older)
+    entry->older->newer = entry->newer;
+  else
+    cache->oldest = entry->newer;
+}
+
+/* Make ENTRY the most recently used entry of CACHE.  */
+static void
+regexp_push (m4__regexp_cache *cache, m4__regexp_entry *entry)
+{
+  entry->newer = NULL;
+  entry->older = cache->newest;
+  if (cache->newest)
+    cache->newest->newer = entry;
+  else
+    cache->oldest = entry;
+  cache->newest = entry;
+}
+
+/* Remove the least recently used entry from CACHE and release its
+   pattern, returning the entry for reuse.  */
+static m4__regexp_entry *
+regexp_evict (m4__regexp_cache *cache)
+{
+  m4__regexp_entry *entry = cache->oldest;
+  m4__regexp_entry **slot;
+
+  slot = &cache->buckets[entry->hash & (cache->nbuckets - 1)];
+  while (*slot != entry)
+    slot = &(*slot)->chain;
+  *slot = entry->chain;
+  regexp_unlink (cache, entry);
+  cache->count--;
+
+  free (entry->buf.str);
+  regfree (entry->buf.pat);
+  free (entry->buf.pat);
+  free (entry->buf.map);
+  entry->buf.map = NULL;
+  return entry;
+}
+
+/* Release ENTRY, once evicted, along with its registers.  */
+static void
+regexp_free (m4__regexp_entry *entry)
+{
+  if (entry)
+    {
+      free (entry->buf.regs.start);
+      free (entry->buf.regs.end);
+      free (entry);
+    }
+}
+
+/* Double the number of buckets in CACHE.  */
+static void
+regexp_grow (m4__regexp_cache *cache)
+{
+  size_t nbuckets = cache->nbuckets * 2;
+  m4__regexp_entry **buckets = (m4__regexp_entry **)
+    xcalloc (nbuckets, sizeof *buckets);
+  size_t i;
+
+  for (i = 0; i < cache->nbuckets; i++)
+    while (cache->buckets[i])
+      {
+        m4__regexp_entry *entry = cache->buckets[i];
+        cache->buckets[i] = entry->chain;
+        entry->chain = buckets[entry->hash & (nbuckets - 1)];
+        buckets[entry->hash & (nbuckets - 1)] = entry;
+      }
+  free (cache->buckets);
+  cache->buckets = buckets;
+  cache->nbuckets = nbuckets;
+}
+
+/* Return true if matching any of the LEN bytes of STR one byte at a
+   time finds the same matches as the regex engine would in the
+   current locale.  That is true of every byte in a single-byte
+   locale, and of ASCII bytes in UTF-8, where they never form part of
+   a multibyte character.  */
+static bool
+regexp_bytewise (const char *str, size_t len)
+{
+  mbstate_t state;
+  wchar_t wc;
+
+  if (MB_CUR_MAX == 1)
+    return true;
+  while (len--)
+    if (0x80 <= to_uchar (*str++))
+      return false;
+  memset (&state, 0, sizeof state);
+  return mbrtowc (&wc, "\xc3\xa9", 2, &state) == 2 && wc == 0xe9;
+}
+
+/* Classify the freshly compiled BUF, so that its matches can be found
+   without re_search when the pattern is a plain string, optionally
+   anchored by a leading ^ or trailing $, or a single bracket
+   expression.  Bytes that are special in any of the supported
+   syntaxes rule out a literal, so the classification does not depend
+   on the flavor of regex.  */
+static void
+regexp_classify (m4_pattern_buffer *buf)
+{
+  static const char special[] = "\\^$.*+?[]{}()|\n";
+  const char *str = buf->str;
+  size_t len = buf->len;
+  size_t i;
+
+  buf->kind = M4_PATTERN_REGEX;
+  if (!len || !regexp_bytewise (str, len))
+    return;
+
+  if (*str == '[')
+    {
+      /* Find the end of the bracket expression, and give up on any
+         negation, backslash or nested bracket, whose meaning depends
+         on the syntax.  */
+      i = 1;
+      if (i < len && str[i] == ']')
+        i++;
+      while (i < len && str[i] != ']')
+        if (str[i] == '^' && i == 1)
+          return;
+        else if (str[i] == '[' || str[i] == '\\')
+          return;
+        else
+          i++;
+      if (i != len - 1)
+        return;
+
+      /* The bracket must match only single bytes; let the compiled
+         regex say which.  */
+      if (re_compile_fastmap (buf->pat) != 0)
+        return;
+      for (i = 0x80; i <= UCHAR_MAX; i++)
+        if (buf->pat->fastmap[i])
+          return;
+      buf->map = xzalloc (UCHAR_MAX + 1);
+      for (i = 0; i < 0x80; i++)
+        {
+          char ch = i;
+          buf->map[i] = re_match (buf->pat, &ch, 1, 0, NULL) == 1;
+        }
+      buf->kind = M4_PATTERN_CLASS;
+      return;
+    }
+
+  buf->bol = *str == '^';
+  buf->eol = len > buf->bol && str[len - 1] == '$';
+  buf->lit = str + buf->bol;
+  buf->lit_len = len - buf->bol - buf->eol;
+  if (!buf->lit_len)
+    return;
+  for (i = 0; i < buf->lit_len; i++)
+    if (memchr (special, buf->lit[i], sizeof special - 1))
+      return;
+  buf->kind = M4_PATTERN_LITERAL;
+}
+
+/* Serializes uses of re_syntax_options.  */
+gl_lock_define_initialized (static, compile_lock)
+
+/* Compile a REGEXP of length LEN using the RESYNTAX flavor, and
+   return the buffer, which remains valid until the next call.  On
+   error, report the problem on behalf of CALLER, and return NULL.
+
+   re_compile_pattern depends on the global variable re_syntax_options
+   for its syntax, so compile_lock keeps contexts on other threads
+   from changing it mid-compilation; the compiled regex remembers its
+   syntax even if the global variable changes later.  */
+m4_pattern_buffer *
+m4_regexp_compile (m4 *context, const m4_call_info *caller,
+                   const char *regexp, size_t len, int resyntax)
+{
+  m4__regexp_cache *cache = context->regexp_cache_table;
+  size_t capacity = m4_get_regexp_cache_opt (context);
+  size_t hash = regexp_hash (regexp, len, resyntax);
+  m4__regexp_entry *entry;
+  struct re_pattern_buffer *pat;/* newly compiled regex */
+  const char *msg;              /* error message from re_compile_pattern */
+  clock_t start;
+
+  if (!cache)
+    {
+      cache = (m4__regexp_cache *) xzalloc (sizeof *cache);
+      cache->nbuckets = REGEXP_CACHE_BUCKETS;
+      cache->buckets = (m4__regexp_entry **)
+        xcalloc (cache->nbuckets, sizeof *cache->buckets);
+      context->regexp_cache_table = cache;
+    }
+
+  /* First, check if REGEXP is already cached with the given RESYNTAX.
+     If so, mark it as the most recently used and return it.  */
+  for (entry = cache->buckets[hash & (cache->nbuckets - 1)]; entry;
+       entry = entry->chain)
+    if (entry->hash == hash && entry->buf.len == len
+        && entry->buf.resyntax == resyntax
+        && memcmp (regexp, entry->buf.str, len) == 0)
+      {
+        cache->hits++;
+        if (entry != cache->newest)
+          {
+            regexp_unlink (cache, entry);
+            regexp_push (cache, entry);
+          }
+        return &entry->buf;
+      }
+
+  /* Next, check if REGEXP can be compiled.  */
+  cache->misses++;
+  start = clock ();
+  pat = (struct re_pattern_buffer *) xzalloc (sizeof *pat);
+  gl_lock_lock (compile_lock);
+  re_set_syntax (resyntax);
+  msg = re_compile_pattern (regexp, len, pat);
+  gl_lock_unlock (compile_lock);
+  cache->compile_time += clock () - start;
+
+  if (m4_is_debug_bit (context, M4_DEBUG_TRACE_REGEXP))
+    m4_debug_message (context, M4_DEBUG_TRACE_REGEXP,
+                      _("regexp cache miss for %s: %zu hits, %zu misses,"
+                        " %.3f ms compiling"),
+                      quotearg_style_mem (locale_quoting_style, regexp, len),
+                      cache->hits, cache->misses,
+                      cache->compile_time * 1000.0 / CLOCKS_PER_SEC);
+
+  if (msg != NULL)
+    {
+      m4_warn (context, 0, caller, _("bad regular expression %s: %s"),
+               quotearg_style_mem (locale_quoting_style, regexp, len), msg);
+      regfree (pat);
+      free (pat);
+      return NULL;
+    }
+  /* Use a fastmap for speed; it is freed by regfree.  */
+  pat->fastmap = xcharalloc (UCHAR_MAX + 1);
+
+  /* Now, find room for the new entry, recycling the least recently
+     used one if the cache is full.  Even a cache size of 0 keeps the
+     most recent pattern, since the caller is still using it.  */
+  while (cache->count && cache->count >= capacity)
+    {
+      regexp_free (entry);
+      entry = regexp_evict (cache);
+    }
+  if (!entry)
+    {
+      entry = (m4__regexp_entry *) xzalloc (sizeof *entry);
+      if (cache->count >= cache->nbuckets)
+        regexp_grow (cache);
+    }
+
+  entry->buf.resyntax = resyntax;
+  entry->buf.len = len;
+  entry->buf.str = xmemdup (regexp, len);
+  entry->buf.pat = pat;
+  regexp_classify (&entry->buf);
+  re_set_registers (pat, &entry->buf.regs, entry->buf.regs.num_regs,
+                    entry->buf.regs.start, entry->buf.regs.end);
+  entry->hash = hash;
+  entry->chain = cache->buckets[hash & (cache->nbuckets - 1)];
+  cache->buckets[hash & (cache->nbuckets - 1)] = entry;
+  regexp_push (cache, entry);
+  cache->count++;
+  return &entry->buf;
+}
+
+/* Store the hits and misses of CACHE, which may be NULL if no regexp
+   was compiled yet, into STATS.  */
+void
+m4__regexp_cache_stats (m4__regexp_cache *cache, m4__stats *stats)
+{
+  stats->regexp_hits = cache ? cache->hits : 0;
+  stats->regexp_misses = cache ? cache->misses : 0;
+}
+
+/* Release all storage associated with CACHE.  */
+void
+m4__regexp_cache_delete (m4__regexp_cache *cache)
+{
+  if (cache)
+    {
+      while (cache->oldest)
+        regexp_free (regexp_evict (cache));
+      free (cache->buckets);
+      free (cache);
+    }
+}
@@ -43,16 +43,57 @@
    and the trace bit attached to the name was never lost.  There is a
    small amount of fluff in these functions to make sure that such
    symbols (with empty value stacks) are invisible to the users of
-   this module.  */
+   this module.
+
+   Finally, the value stack of a symbol may be deferred, in which case
+   the table entry only records what the loader of the table needs to
+   build the stack later.  Every function that exposes or changes a
+   value stack loads it first, so apart from the time at which the
+   values are created, a deferred symbol cannot be told apart from one
+   that was defined outright.
+
+   Each name in the table is stored in a single `symtab_entry', which
+   holds both the hash key and the `m4_symbol', and which also holds
+   the characters of names short enough to fit.  The entries of a
+   table are carved from an obstack, with a free list of the entries
+   of removed names, so that adding a name usually costs no malloc at
+   all, entries stay close together in memory, and deleting the table
+   releases them in bulk.  */
 
 #define M4_SYMTAB_DEFAULT_SIZE          2047
 
+/* Longest name, including its trailing NUL, stored inside its entry.
+   This makes a whole entry 64 bytes on common 64-bit hosts.  */
+#define SYMTAB_INLINE_NAME              24
+
+typedef struct symtab_entry symtab_entry;
+
+struct symtab_entry {
+  m4_string key;                /* Must be first; the hash table key.  */
+  m4_symbol symbol;             /* The value of key in the table.  */
+  union {
+    char name[SYMTAB_INLINE_NAME]; /* Storage of key.str, if it fits.  */
+    symtab_entry *next;         /* Free list link, when not in use.  */
+  } u;
+};
+
 struct m4_symbol_table {
   m4_hash *table;
+  m4_obstack entries;           /* Storage of every symtab_entry.  */
+  symtab_entry *free_entries;   /* Entries of names since removed.  */
+  size_t added;                 /* Count of names added to table.  */
+  size_t removed;               /* Count of names removed from table.  */
+  size_t deferred;              /* Count of value stacks not loaded.  */
+  m4__symbol_loader *loader;    /* Builder of deferred value stacks.  */
+  void *loader_data;            /* Opaque argument to loader.  */
 };
 
 static m4_symbol *symtab_fetch          (m4_symbol_table*, const char *,
                                          size_t);
+static void       entry_set_name        (symtab_entry *, const char *,
+                                         size_t);
+static void       entry_release         (m4_symbol_table *, m4_string *);
+static void       symbol_load           (m4_symbol_table *, m4_symbol *);
 static void       symbol_popval         (m4_symbol *);
 static void *     symbol_destroy_CB     (m4_symbol_table *, const char *,
                                          size_t, m4_symbol *, void *);
@@ -73,6 +114,11 @@ m4_symtab_create (size_t size)
 
   symtab->table = m4_hash_new (size ? size : M4_SYMTAB_DEFAULT_SIZE,
                                m4_hash_string_hash, m4_hash_string_cmp);
+  obstack_init (&symtab->entries);
+  symtab->free_entries = NULL;
+  symtab->added = symtab->removed = symtab->deferred = 0;
+  symtab->loader = NULL;
+  symtab->loader_data = NULL;
   return symtab;
 }
 
@@ -82,8 +128,22 @@ m4_symtab_delete (m4_symbol_table *symtab)
   assert (symtab);
   assert (symtab->table);
 
+  /* Deferred stacks are dropped without ever being loaded.  */
+  if (symtab->deferred && symtab->loader)
+    {
+      m4_hash_iterator *place = NULL;
+      while ((place = m4_get_hash_iterator_next (symtab->table, place)))
+        {
+          m4_symbol *symbol = m4_get_hash_iterator_value (place);
+          symbol->deferred = NULL;
+        }
+      symtab->deferred = 0;
+      symtab->loader (symtab->loader_data, NULL);
+    }
+
   m4_symtab_apply (symtab, true, symbol_destroy_CB, NULL);
   m4_hash_delete (symtab->table);
+  obstack_free (&symtab->entries, NULL);
   free (symtab);
 }
 
@@ -107,6 +167,8 @@ m4_symtab_apply (m4_symbol_table *symtab, bool include_trace,
   while ((place = m4_get_hash_iterator_next (symtab->table, place)))
     {
       m4_symbol *symbol = m4_get_hash_iterator_value (place);
+      if (symbol->deferred)
+        symbol_load (symtab, symbol);
       if (symbol->value || include_trace)
         {
           const m4_string *key
@@ -146,18 +208,114 @@ symtab_fetch (m4_symbol_table *symtab, const char *name, size_t len)
     }
   else
     {
-      /* Use xmemdup0 rather than memdup so that debugging the symbol
-         table is easier.  */
-      m4_string *new_key = (m4_string *) xmalloc (sizeof *new_key);
-      new_key->str = xmemdup0 (name, len);
-      new_key->len = len;
-      symbol = (m4_symbol *) xzalloc (sizeof *symbol);
-      m4_hash_insert (symtab->table, new_key, symbol);
+      symtab_entry *entry = symtab->free_entries;
+      if (entry)
+        symtab->free_entries = entry->u.next;
+      else
+        entry = (symtab_entry *) obstack_alloc (&symtab->entries,
+                                                sizeof *entry);
+      memset (&entry->symbol, 0, sizeof entry->symbol);
+      entry_set_name (entry, name, len);
+      symbol = &entry->symbol;
+      m4_hash_insert (symtab->table, &entry->key, symbol);
+      symtab->added++;
     }
 
   return symbol;
 }
 
+/* Make NAME of length LEN the key of ENTRY, stored inline if it fits.
+   NAME may overlap the current inline name of ENTRY.  Names are
+   always NUL-terminated so that debugging the symbol table is
+   easier.  */
+static void
+entry_set_name (symtab_entry *entry, const char *name, size_t len)
+{
+  if (len < sizeof entry->u.name)
+    {
+      memmove (entry->u.name, name, len);
+      entry->u.name[len] = '\0';
+      entry->key.str = entry->u.name;
+    }
+  else
+    entry->key.str = xmemdup0 (name, len);
+  entry->key.len = len;
+}
+
+/* Return the entry whose KEY was just removed from the hash table of
+   SYMTAB to its free list.  This releases the symbol as well.  */
+static void
+entry_release (m4_symbol_table *symtab, m4_string *key)
+{
+  symtab_entry *entry = (symtab_entry *) key;
+
+  if (entry->key.str != entry->u.name)
+    free (entry->key.str);
+  entry->u.next = symtab->free_entries;
+  symtab->free_entries = entry;
+}
+
+/* Build the deferred value stack of SYMBOL, if any, from the loader
+   of SYMTAB.  */
+static void
+symbol_load (m4_symbol_table *symtab, m4_symbol *symbol)
+{
+  const void *entry = symbol->deferred;
+
+  if (!entry)
+    return;
+  assert (symtab->loader && !symbol->value && symtab->deferred);
+  symbol->deferred = NULL;
+  symbol->value = symtab->loader (symtab->loader_data, entry);
+  assert (symbol->value);
+  if (!--symtab->deferred)
+    symtab->loader (symtab->loader_data, NULL);
+}
+
+/* Record that NAME of length LEN has a value stack that the loader of
+   SYMTAB can build from ENTRY.  Return false, leaving SYMTAB
+   unchanged, if NAME already has values.  */
+bool
+m4__symbol_defer (m4_symbol_table *symtab, const char *name, size_t len,
+                  const void *entry)
+{
+  m4_symbol *symbol = symtab_fetch (symtab, name, len);
+
+  assert (entry);
+  if (symbol->value || symbol->deferred)
+    return false;
+  symbol->deferred = entry;
+  symtab->deferred++;
+  return true;
+}
+
+/* Build every value stack still deferred in SYMTAB, so that its
+   loader is done with its data.  */
+void
+m4__symtab_load (m4_symbol_table *symtab)
+{
+  m4_hash_iterator *place = NULL;
+
+  if (!symtab->deferred)
+    return;
+  while ((place = m4_get_hash_iterator_next (symtab->table, place)))
+    symbol_load (symtab, m4_get_hash_iterator_value (place));
+  assert (!symtab->deferred);
+}
+
+/* Install LOADER, called with DATA, to build the stacks deferred in
+   SYMTAB.  If none are deferred, LOADER is told so at once.  */
+void
+m4__symtab_set_loader (m4_symbol_table *symtab, m4__symbol_loader *loader,
+                       void *data)
+{
+  assert (!symtab->loader);
+  symtab->loader = loader;
+  symtab->loader_data = data;
+  if (!symtab->deferred)
+    loader (data, NULL);
+}
+
 /* Remove every symbol that references the given module from
    the symbol table.  */
 void
@@ -172,7 +330,10 @@ m4__symtab_remove_module_references (m4_symbol_table *symtab,
   while ((place = m4_get_hash_iterator_next (symtab->table, place)))
     {
       m4_symbol *symbol = (m4_symbol *) m4_get_hash_iterator_value (place);
-      m4_symbol_value *data = m4_get_symbol_value (symbol);
+      m4_symbol_value *data;
+
+      symbol_load (symtab, symbol);
+      data = m4_get_symbol_value (symbol);
 
       /* For symbols that have token data... */
       if (data)
@@ -247,12 +408,60 @@ m4_symbol_lookup (m4_symbol_table *symtab, const char *name, size_t len)
   key.str = (char *) name;
   key.len = len;
   psymbol = (m4_symbol **) m4_hash_lookup (symtab->table, &key);
+  if (psymbol)
+    symbol_load (symtab, *psymbol);
 
   /* If just searching, return status of search -- if only an empty
      struct is returned, that is treated as a failed lookup.  */
   return (psymbol && m4_get_symbol_value (*psymbol)) ? *psymbol : NULL;
 }
 
+/* Return the table entry for NAME of length LEN, or else NULL.
+   Unlike m4_symbol_lookup, this can return an entry with no value
+   that only preserves a trace bit.  The result remains valid until
+   m4__symtab_removed changes, even if its value stack empties and
+   refills in the meantime.  */
+m4_symbol *
+m4__symtab_entry (m4_symbol_table *symtab, const char *name, size_t len)
+{
+  m4_string key;
+  m4_symbol **psymbol;
+
+  /* Safe to cast away const, since m4_hash_lookup doesn't modify
+     key.  */
+  key.str = (char *) name;
+  key.len = len;
+  psymbol = (m4_symbol **) m4_hash_lookup (symtab->table, &key);
+  if (!psymbol)
+    return NULL;
+  symbol_load (symtab, *psymbol);
+  return *psymbol;
+}
+
+/* Return how many names have been added to SYMTAB.  While this is
+   unchanged, a name not found in SYMTAB is still absent.  */
+size_t
+m4__symtab_added (m4_symbol_table *symtab)
+{
+  return symtab->added;
+}
+
+/* Return how many names have been removed from SYMTAB.  While this
+   is unchanged, an entry found in SYMTAB is still present under the
+   same name.  */
+size_t
+m4__symtab_removed (m4_symbol_table *symtab)
+{
+  return symtab->removed;
+}
+
+/* Fill STATS with the occupancy of the hash table behind SYMTAB.  */
+void
+m4__symtab_stats (m4_symbol_table *symtab, m4_hash_stats *stats)
+{
+  m4_get_hash_stats (symtab->table, stats);
+}
+
 
 /* Insert NAME of length LEN into the symbol table.  If there is
    already a symbol associated with NAME, push the new VALUE on top of
@@ -269,6 +478,7 @@ m4_symbol_pushdef (m4_symbol_table *symtab, const char *name, size_t len,
   assert (value);
 
   symbol                = symtab_fetch (symtab, name, len);
+  symbol_load (symtab, symbol);
   VALUE_NEXT (value)    = m4_get_symbol_value (symbol);
   symbol->value         = value;
 
@@ -291,6 +501,7 @@ m4_symbol_define (m4_symbol_table *symtab, const char *name, size_t len,
   assert (value);
 
   symbol = symtab_fetch (symtab, name, len);
+  symbol_load (symtab, symbol);
   if (m4_get_symbol_value (symbol))
     symbol_popval (symbol);
 
@@ -320,6 +531,7 @@ m4_symbol_popdef (m4_symbol_table *symtab, const char *name, size_t len)
   assert (psymbol);
   assert (*psymbol);
 
+  symbol_load (symtab, *psymbol);
   symbol_popval (*psymbol);
 
   /* Only remove the hash table entry if the last value in the
@@ -327,10 +539,9 @@ m4_symbol_popdef (m4_symbol_table *symtab, const char *name, size_t len)
   if (!m4_get_symbol_value (*psymbol) && !m4_get_symbol_traced (*psymbol))
     {
       m4_string *old_key;
-      DELETE (*psymbol);
       old_key = (m4_string *) m4_hash_remove (symtab->table, &key);
-      free (old_key->str);
-      free (old_key);
+      entry_release (symtab, old_key);
+      symtab->removed++;
     }
 }
 
@@ -375,6 +586,10 @@ m4_symbol_value_delete (m4_symbol_value *value)
           m4_hash_apply (VALUE_ARG_SIGNATURE (value), arg_destroy_CB, NULL);
           m4_hash_delete (VALUE_ARG_SIGNATURE (value));
         }
+      if (VALUE_WORDS (value))
+        m4__word_cache_unref (VALUE_WORDS (value));
+      if (VALUE_CACHE (value))
+        VALUE_CACHE_FREE (value) (VALUE_CACHE (value));
       switch (value->type)
         {
         case M4_SYMBOL_TEXT:
@@ -419,16 +634,23 @@ m4_symbol_rename (m4_symbol_table *symtab, const char *name, size_t len1,
 
   if (psymbol)
     {
+      symtab_entry *entry;
+      char *old_name;
+
       symbol = *psymbol;
 
       /* Remove the old name from the symbol table.  */
       pkey = (m4_string *) m4_hash_remove (symtab->table, &key);
       assert (pkey && !m4_hash_lookup (symtab->table, &key));
-      free (pkey->str);
-
-      pkey->str = xmemdup0 (newname, len2);
-      pkey->len = len2;
-      m4_hash_insert (symtab->table, pkey, *psymbol);
+      entry = (symtab_entry *) pkey;
+      assert (&entry->symbol == symbol);
+
+      old_name = pkey->str != entry->u.name ? pkey->str : NULL;
+      entry_set_name (entry, newname, len2);
+      free (old_name);
+      m4_hash_insert (symtab->table, pkey, symbol);
+      symtab->added++;
+      symtab->removed++;
     }
   /* else
        NAME does not name a symbol in symtab->table!  */
@@ -487,12 +709,20 @@ m4_symbol_value_copy (m4 *context, m4_symbol_value *dest, m4_symbol_value *src)
       m4_hash_apply (VALUE_ARG_SIGNATURE (dest), arg_destroy_CB, NULL);
       m4_hash_delete (VALUE_ARG_SIGNATURE (dest));
     }
+  if (VALUE_WORDS (dest))
+    m4__word_cache_unref (VALUE_WORDS (dest));
+  if (VALUE_CACHE (dest))
+    VALUE_CACHE_FREE (dest) (VALUE_CACHE (dest));
 
   /* Copy the value contents over, being careful to preserve
-     the next pointer.  */
+     the next pointer.  The word cache and the builtin cache belong to
+     SRC alone.  */
   next = VALUE_NEXT (dest);
   memcpy (dest, src, sizeof (m4_symbol_value));
   VALUE_NEXT (dest) = next;
+  VALUE_WORDS (dest) = NULL;
+  VALUE_CACHE (dest) = NULL;
+  VALUE_CACHE_FREE (dest) = NULL;
 
   /* Caller is supposed to free text token strings, so we have to
      copy the string not just its address in that case.  */
@@ -601,6 +831,7 @@ m4_set_symbol_name_traced (m4_symbol_table *symtab, const char *name,
       if (!psymbol)
         return false;
       symbol = *psymbol;
+      symbol_load (symtab, symbol);
     }
 
   result = symbol->traced;
@@ -611,15 +842,14 @@ m4_set_symbol_name_traced (m4_symbol_table *symtab, const char *name,
       m4_string key;
       m4_string *old_key;
       assert (result);
-      free (symbol);
 
       /* Safe to cast away const, since m4_hash_lookup doesn't modify
          key.  */
       key.str = (char *) name;
       key.len = len;
       old_key = (m4_string *) m4_hash_remove (symtab->table, &key);
-      free (old_key->str);
-      free (old_key);
+      entry_release (symtab, old_key);
+      symtab->removed++;
     }
 
   return result;
@@ -925,6 +1155,30 @@ m4_set_symbol_value_placeholder (m4_symbol_value *value, const char *text)
   value->u.u_t.len = SIZE_MAX; /* len is not tracked for placeholders.  */
 }
 
+/* Return the data attached to VALUE by m4_set_symbol_value_cache with
+   FREE_FUNC, or NULL if there is none.  */
+void *
+m4_get_symbol_value_cache (m4_symbol_value *value,
+                           m4_symbol_value_cache_free_func *free_func)
+{
+  assert (value && free_func);
+  return VALUE_CACHE_FREE (value) == free_func ? VALUE_CACHE (value) : NULL;
+}
+
+/* Attach DATA to VALUE, to be released with FREE_FUNC when VALUE is
+   deleted or overwritten, releasing whatever was attached before.
+   DATA may be NULL to just release the old data.  */
+void
+m4_set_symbol_value_cache (m4_symbol_value *value, void *data,
+                           m4_symbol_value_cache_free_func *free_func)
+{
+  assert (value && free_func);
+  if (VALUE_CACHE (value))
+    VALUE_CACHE_FREE (value) (VALUE_CACHE (value));
+  VALUE_CACHE (value) = data;
+  VALUE_CACHE_FREE (value) = free_func;
+}
+
 
 #ifdef DEBUG_SYM
 
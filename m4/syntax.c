@@ -108,11 +108,80 @@
    multiple M4_SYNTAX_OTHER bytes could form a delimiter, so many
    optimizations must be disabled if a multi-byte delimiter exists;
    this is handled by m4__safe_quotes.  Meanwhile, quotes and comments
-   can be disabled if the leading delimiter is length 0.  */
+   can be disabled if the leading delimiter is length 0.
+
+   Finally, the input engine spends most of its time collecting runs
+   of bytes that share a category, or searching for the next byte in
+   some category.  For the category sets listed in span_syntax, the
+   table also keeps a bitmap of the member bytes, from which vector
+   kernels can classify sixteen or thirty-two bytes at once; see
+   m4__syntax_span.
+
+   Macro libraries often flip back and forth between a few quoting
+   schemes.  Each distinct state of the table reached by changequote,
+   changecom or changesyntax is given a scheme number, and the table
+   remembers, for the most recently used changes, which scheme a
+   change led to and what that scheme contains; repeating a change
+   from the same scheme merely copies the result back in.  */
 
 static int add_syntax_attribute         (m4_syntax_table *, char, int);
 static int remove_syntax_attribute      (m4_syntax_table *, char, int);
 static void set_quote_age               (m4_syntax_table *, bool, bool);
+static void free_scheme                 (m4__syntax_scheme *);
+static bool find_scheme                 (m4_syntax_table *, int, char,
+                                         const char *, size_t,
+                                         const char *, size_t);
+static void save_scheme                 (m4_syntax_table *, unsigned int, int,
+                                         char, const char *, size_t,
+                                         const char *, size_t);
+static void update_span                 (m4_syntax_table *, int);
+static void span_init                   (m4_syntax_table *);
+
+/* Kinds of change remembered in a scheme, besides the syntax
+   categories altered by changesyntax.  */
+#define SCHEME_QUOTES   (-1)
+#define SCHEME_COMMENT  (-2)
+
+/* Number of the scheme installed by m4_reset_syntax, whose contents
+   never vary.  */
+#define SCHEME_DEFAULT  1
+
+/* The contents of a syntax table that resulted from applying the
+   change KIND, with ACTION and the arguments in ARG, to a table in
+   scheme FROM.  */
+struct m4__syntax_scheme
+{
+  unsigned int from;            /* Scheme before the change.  */
+  unsigned int to;              /* Scheme after the change.  */
+  int kind;                     /* SCHEME_* or a syntax category.  */
+  char action;                  /* Action of changesyntax, else '\0'.  */
+  m4_string_pair arg;           /* Arguments of the change.  */
+  unsigned int used;            /* Value of scheme_tick when last used.  */
+
+  /* Copies of the corresponding members of m4_syntax_table.  */
+  unsigned short table[CHAR_RETRY];
+  unsigned char span[M4__SPAN_SETS][32];
+  m4_string_pair quote;
+  m4_string_pair comm;
+  char dollar;
+  bool_bitfield is_single_quotes : 1;
+  bool_bitfield is_single_comments : 1;
+  bool_bitfield is_single_dollar : 1;
+  bool_bitfield is_macro_escaped : 1;
+  bool_bitfield suspect : 1;
+};
+
+/* The category sets that have a bitmap in the span member of the
+   syntax table.  */
+static const unsigned short span_syntax[M4__SPAN_SETS] =
+{
+  M4_SYNTAX_ALPHA | M4_SYNTAX_NUM,      /* Rest of a word.  */
+  M4_SYNTAX_OTHER | M4_SYNTAX_NUM,      /* Run of other text.  */
+  M4_SYNTAX_SPACE,                      /* Run of whitespace.  */
+  M4_SYNTAX_LQUOTE | M4_SYNTAX_RQUOTE,  /* Next quote delimiter.  */
+  M4_SYNTAX_ECOMM,                      /* End of comment.  */
+  M4_SYNTAX_DOLLAR                      /* Next argument reference.  */
+};
 
 m4_syntax_table *
 m4_syntax_create (void)
@@ -152,6 +221,8 @@ m4_syntax_create (void)
       }
 
   /* Set up current table to match default.  */
+  span_init (syntax);
+  syntax->last_scheme = SCHEME_DEFAULT;
   m4_reset_syntax (syntax);
   syntax->cached_simple.str1 = syntax->cached_lquote;
   syntax->cached_simple.len1 = 1;
@@ -163,8 +234,12 @@ m4_syntax_create (void)
 void
 m4_syntax_delete (m4_syntax_table *syntax)
 {
+  int i;
+
   assert (syntax);
 
+  for (i = 0; i < M4__SYNTAX_SCHEMES; i++)
+    free_scheme (syntax->schemes[i]);
   free (syntax->quote.str1);
   free (syntax->quote.str2);
   free (syntax->comm.str1);
@@ -226,6 +301,7 @@ add_syntax_attribute (m4_syntax_table *syntax, char ch, int code)
         syntax->suspect = true;
       syntax->table[c] = ((syntax->table[c] & M4_SYNTAX_MASKS) | code);
     }
+  update_span (syntax, c);
 
 #ifdef DEBUG_SYNTAX
   xfprintf(stderr, "Set syntax %o %c = %04X\n", c, isprint(c) ? c : '-',
@@ -242,6 +318,7 @@ remove_syntax_attribute (m4_syntax_table *syntax, char ch, int code)
   assert (code & M4_SYNTAX_MASKS);
   syntax->table[c] &= ~code;
   syntax->suspect = true;
+  update_span (syntax, c);
 
 #ifdef DEBUG_SYNTAX
   xfprintf(stderr, "Unset syntax %o %c = %04X\n", c, isprint(c) ? c : '-',
@@ -358,9 +435,13 @@ reset_syntax_set (m4_syntax_table *syntax, int code)
 void
 m4_reset_syntax (m4_syntax_table *syntax)
 {
+  int ch;
+
   /* Restore the default syntax, which has known quote and comment
      properties.  */
   memcpy (syntax->table, syntax->orig, sizeof syntax->orig);
+  for (ch = UCHAR_MAX + 1; --ch >= 0; )
+    update_span (syntax, ch);
 
   free (syntax->quote.str1);
   free (syntax->quote.str2);
@@ -388,6 +469,7 @@ m4_reset_syntax (m4_syntax_table *syntax)
   syntax->is_single_comments = true;
   syntax->is_single_dollar = true;
   syntax->is_macro_escaped = false;
+  syntax->scheme = SCHEME_DEFAULT;
   set_quote_age (syntax, true, false);
 }
 
@@ -401,6 +483,7 @@ m4_set_syntax (m4_syntax_table *syntax, char key, char action,
                const char *chars, size_t len)
 {
   int code;
+  unsigned int from;
 
   assert (syntax && chars);
   code = m4_syntax_code (key);
@@ -408,6 +491,13 @@ m4_set_syntax (m4_syntax_table *syntax, char key, char action,
     {
       return -1;
     }
+  if (find_scheme (syntax, code, action, chars, len, "", 0))
+    {
+      set_quote_age (syntax, false, true);
+      m4__quote_uncache (syntax);
+      return code;
+    }
+  from = syntax->scheme;
   syntax->suspect = false;
   switch (action)
     {
@@ -597,6 +687,7 @@ m4_set_syntax (m4_syntax_table *syntax, char key, char action,
           syntax->comm.len2 = 1;
         }
     }
+  save_scheme (syntax, from, code, action, chars, len, "", 0);
   set_quote_age (syntax, false, true);
   m4__quote_uncache (syntax);
   return code;
@@ -615,6 +706,7 @@ m4_set_quotes (m4_syntax_table *syntax, const char *lq, size_t lq_len,
                const char *rq, size_t rq_len)
 {
   int ch;
+  unsigned int from;
 
   assert (syntax);
 
@@ -642,6 +734,12 @@ m4_set_quotes (m4_syntax_table *syntax, const char *lq, size_t lq_len,
       && memcmp (syntax->quote.str1, lq, lq_len) == 0
       && memcmp (syntax->quote.str2, rq, rq_len) == 0)
     return;
+  if (find_scheme (syntax, SCHEME_QUOTES, '\0', lq, lq_len, rq, rq_len))
+    {
+      set_quote_age (syntax, false, false);
+      return;
+    }
+  from = syntax->scheme;
 
   free (syntax->quote.str1);
   free (syntax->quote.str2);
@@ -674,6 +772,7 @@ m4_set_quotes (m4_syntax_table *syntax, const char *lq, size_t lq_len,
       if (syntax->quote.len2 == 1)
         add_syntax_attribute (syntax, syntax->quote.str2[0], M4_SYNTAX_RQUOTE);
     }
+  save_scheme (syntax, from, SCHEME_QUOTES, '\0', lq, lq_len, rq, rq_len);
   set_quote_age (syntax, false, false);
 }
 
@@ -685,6 +784,7 @@ m4_set_comment (m4_syntax_table *syntax, const char *bc, size_t bc_len,
                 const char *ec, size_t ec_len)
 {
   int ch;
+  unsigned int from;
 
   assert (syntax);
 
@@ -710,6 +810,12 @@ m4_set_comment (m4_syntax_table *syntax, const char *bc, size_t bc_len,
       && memcmp (syntax->comm.str1, bc, bc_len) == 0
       && memcmp (syntax->comm.str2, ec, ec_len) == 0)
     return;
+  if (find_scheme (syntax, SCHEME_COMMENT, '\0', bc, bc_len, ec, ec_len))
+    {
+      set_quote_age (syntax, false, false);
+      return;
+    }
+  from = syntax->scheme;
 
   free (syntax->comm.str1);
   free (syntax->comm.str2);
@@ -741,6 +847,7 @@ m4_set_comment (m4_syntax_table *syntax, const char *bc, size_t bc_len,
       if (syntax->comm.len2 == 1)
         add_syntax_attribute (syntax, syntax->comm.str2[0], M4_SYNTAX_ECOMM);
     }
+  save_scheme (syntax, from, SCHEME_COMMENT, '\0', bc, bc_len, ec, ec_len);
   set_quote_age (syntax, false, false);
 }
 
@@ -794,6 +901,10 @@ set_quote_age (m4_syntax_table *syntax, bool reset, bool change)
    it may take more time in doing so).  */
 
   unsigned short local_syntax_age;
+
+  /* Unlike quote_age, lex_age never stays the same across a change,
+     so that word caches keyed on it need not understand the change.  */
+  syntax->lex_age++;
   if (reset)
     local_syntax_age = 0;
   else if (change && syntax->syntax_age < 0xffff)
@@ -826,6 +937,187 @@ set_quote_age (m4_syntax_table *syntax, bool reset, bool change)
     syntax->quote_age = 0;
 }
 
+/* Functions for remembering syntax schemes.  */
+
+/* Return true if the LEN1 bytes at STR1 match the LEN2 bytes at
+   STR2.  */
+static bool
+string_equal (const char *str1, size_t len1, const char *str2, size_t len2)
+{
+  return len1 == len2 && memcmp (str1, str2, len1) == 0;
+}
+
+/* Replace the string at *STR, of length *LEN, with a copy of the LEN2
+   bytes at STR2, unless it already holds them.  */
+static void
+replace_string (char **str, size_t *len, const char *str2, size_t len2)
+{
+  if (!string_equal (*str, *len, str2, len2))
+    {
+      free (*str);
+      /* The use of xmemdup0 is exploited by input.c.  */
+      *str = xmemdup0 (str2, len2);
+      *len = len2;
+    }
+}
+
+/* Release the memory used by SCHEME, which may be NULL.  */
+static void
+free_scheme (m4__syntax_scheme *scheme)
+{
+  if (scheme)
+    {
+      free (scheme->arg.str1);
+      free (scheme->arg.str2);
+      free (scheme->quote.str1);
+      free (scheme->quote.str2);
+      free (scheme->comm.str1);
+      free (scheme->comm.str2);
+      free (scheme);
+    }
+}
+
+/* Return true if SCHEME holds the current contents of SYNTAX.  */
+static bool
+scheme_matches (m4_syntax_table *syntax, const m4__syntax_scheme *scheme)
+{
+  return (memcmp (syntax->table, scheme->table, sizeof scheme->table) == 0
+          && string_equal (syntax->quote.str1, syntax->quote.len1,
+                           scheme->quote.str1, scheme->quote.len1)
+          && string_equal (syntax->quote.str2, syntax->quote.len2,
+                           scheme->quote.str2, scheme->quote.len2)
+          && string_equal (syntax->comm.str1, syntax->comm.len1,
+                           scheme->comm.str1, scheme->comm.len1)
+          && string_equal (syntax->comm.str2, syntax->comm.len2,
+                           scheme->comm.str2, scheme->comm.len2)
+          && syntax->dollar == scheme->dollar
+          && syntax->is_single_quotes == scheme->is_single_quotes
+          && syntax->is_single_comments == scheme->is_single_comments
+          && syntax->is_single_dollar == scheme->is_single_dollar
+          && syntax->is_macro_escaped == scheme->is_macro_escaped
+          && syntax->suspect == scheme->suspect);
+}
+
+/* Look for a remembered result of applying the change KIND, with
+   ACTION and the arguments STR1 and STR2 of lengths LEN1 and LEN2, to
+   the current scheme of SYNTAX.  If there is one, install it and
+   return true; the caller must still update the quote age as if it
+   had made the change itself.  */
+static bool
+find_scheme (m4_syntax_table *syntax, int kind, char action,
+             const char *str1, size_t len1, const char *str2, size_t len2)
+{
+  int i;
+
+  for (i = 0; i < M4__SYNTAX_SCHEMES; i++)
+    {
+      m4__syntax_scheme *scheme = syntax->schemes[i];
+      if (scheme && scheme->from == syntax->scheme && scheme->kind == kind
+          && scheme->action == action
+          && string_equal (scheme->arg.str1, scheme->arg.len1, str1, len1)
+          && string_equal (scheme->arg.str2, scheme->arg.len2, str2, len2))
+        {
+          memcpy (syntax->table, scheme->table, sizeof scheme->table);
+          memcpy (syntax->span, scheme->span, sizeof scheme->span);
+          replace_string (&syntax->quote.str1, &syntax->quote.len1,
+                          scheme->quote.str1, scheme->quote.len1);
+          replace_string (&syntax->quote.str2, &syntax->quote.len2,
+                          scheme->quote.str2, scheme->quote.len2);
+          replace_string (&syntax->comm.str1, &syntax->comm.len1,
+                          scheme->comm.str1, scheme->comm.len1);
+          replace_string (&syntax->comm.str2, &syntax->comm.len2,
+                          scheme->comm.str2, scheme->comm.len2);
+          syntax->dollar = scheme->dollar;
+          syntax->is_single_quotes = scheme->is_single_quotes;
+          syntax->is_single_comments = scheme->is_single_comments;
+          syntax->is_single_dollar = scheme->is_single_dollar;
+          syntax->is_macro_escaped = scheme->is_macro_escaped;
+          syntax->suspect = scheme->suspect;
+          syntax->scheme = scheme->to;
+          scheme->used = ++syntax->scheme_tick;
+          return true;
+        }
+    }
+  return false;
+}
+
+/* Remember that applying the change KIND, with ACTION and the
+   arguments STR1 and STR2 of lengths LEN1 and LEN2, to scheme FROM
+   gave the current contents of SYNTAX, replacing the least recently
+   used scheme if need be, and number the result.  */
+static void
+save_scheme (m4_syntax_table *syntax, unsigned int from, int kind,
+             char action, const char *str1, size_t len1,
+             const char *str2, size_t len2)
+{
+  m4__syntax_scheme *scheme;
+  unsigned int to = 0;
+  int victim = 0;
+  int i;
+
+  /* Reuse the number of an identical scheme, so that the change that
+     leads back to it can be found later.  */
+  for (i = 0; i < M4__SYNTAX_SCHEMES; i++)
+    {
+      scheme = syntax->schemes[i];
+      if (!scheme)
+        {
+          victim = i;
+          break;
+        }
+      if (!to && scheme_matches (syntax, scheme))
+        to = scheme->to;
+      if (scheme->used < syntax->schemes[victim]->used)
+        victim = i;
+    }
+  if (!to)
+    {
+      to = ++syntax->last_scheme;
+      if (!to)
+        {
+          /* The numbers wrapped around, so no remembered scheme can
+             be trusted any more.  */
+          for (i = 0; i < M4__SYNTAX_SCHEMES; i++)
+            {
+              free_scheme (syntax->schemes[i]);
+              syntax->schemes[i] = NULL;
+            }
+          syntax->scheme = syntax->last_scheme = SCHEME_DEFAULT + 1;
+          return;
+        }
+    }
+
+  free_scheme (syntax->schemes[victim]);
+  scheme = syntax->schemes[victim]
+    = (m4__syntax_scheme *) xmalloc (sizeof *scheme);
+  scheme->from = from;
+  scheme->to = to;
+  scheme->kind = kind;
+  scheme->action = action;
+  scheme->arg.str1 = xmemdup0 (str1, len1);
+  scheme->arg.len1 = len1;
+  scheme->arg.str2 = xmemdup0 (str2, len2);
+  scheme->arg.len2 = len2;
+  scheme->used = ++syntax->scheme_tick;
+  memcpy (scheme->table, syntax->table, sizeof scheme->table);
+  memcpy (scheme->span, syntax->span, sizeof scheme->span);
+  scheme->quote.str1 = xmemdup0 (syntax->quote.str1, syntax->quote.len1);
+  scheme->quote.len1 = syntax->quote.len1;
+  scheme->quote.str2 = xmemdup0 (syntax->quote.str2, syntax->quote.len2);
+  scheme->quote.len2 = syntax->quote.len2;
+  scheme->comm.str1 = xmemdup0 (syntax->comm.str1, syntax->comm.len1);
+  scheme->comm.len1 = syntax->comm.len1;
+  scheme->comm.str2 = xmemdup0 (syntax->comm.str2, syntax->comm.len2);
+  scheme->comm.len2 = syntax->comm.len2;
+  scheme->dollar = syntax->dollar;
+  scheme->is_single_quotes = syntax->is_single_quotes;
+  scheme->is_single_comments = syntax->is_single_comments;
+  scheme->is_single_dollar = syntax->is_single_dollar;
+  scheme->is_macro_escaped = syntax->is_macro_escaped;
+  scheme->suspect = syntax->suspect;
+  syntax->scheme = to;
+}
+
 /* Interface for caching frequently used quote pairs, independently of
    the current quote delimiters (for example, consider a text macro
    expansion that includes several copies of $@), and using AGE for
@@ -870,6 +1162,210 @@ m4__quote_cache (m4_syntax_table *syntax, m4_obstack *obs, unsigned int age,
   return syntax->cached_quote;
 }
 
+
+/* Bulk classification of input bytes.  A kernel scans whole blocks
+   of LEN bytes at BUF, using the bitmap BITS of one of the sets in
+   span_syntax, and returns the offset of the first byte whose
+   membership in the set is MEMBER; if there is none, it returns the
+   length of the blocks it scanned, and the caller finishes the
+   remaining bytes with the ordinary table lookup.  The kernels use
+   the low nibble of each byte to fetch a row of the bitmap, and the
+   high nibble to pick a bit from that row.  */
+typedef size_t span_func (const unsigned char *, const char *, size_t,
+                          bool);
+
+/* Shorter buffers are not worth handing to a kernel.  */
+#define SPAN_MIN 16
+
+#if (defined __x86_64__ || defined __i386__) \
+    && (defined __clang__ || 4 < __GNUC__ + (9 <= __GNUC_MINOR__))
+# define SPAN_X86 1
+# include <immintrin.h>
+
+__attribute__ ((__target__ ("ssse3")))
+static size_t
+span_ssse3 (const unsigned char *bits, const char *buf, size_t len,
+            bool member)
+{
+  const __m128i lo_bits = _mm_loadu_si128 ((const __m128i *) bits);
+  const __m128i hi_bits = _mm_loadu_si128 ((const __m128i *) (bits + 16));
+  const __m128i select = _mm_setr_epi8 (1, 2, 4, 8, 16, 32, 64, -128,
+                                        1, 2, 4, 8, 16, 32, 64, -128);
+  const __m128i nibble = _mm_set1_epi8 (0x0f);
+  size_t i;
+
+  for (i = 0; i + 16 <= len; i += 16)
+    {
+      __m128i v = _mm_loadu_si128 ((const __m128i *) (buf + i));
+      __m128i lo = _mm_and_si128 (v, nibble);
+      __m128i hi = _mm_and_si128 (_mm_srli_epi16 (v, 4), nibble);
+      __m128i upper = _mm_cmplt_epi8 (v, _mm_setzero_si128 ());
+      __m128i row = _mm_or_si128 (_mm_andnot_si128
+                                  (upper, _mm_shuffle_epi8 (lo_bits, lo)),
+                                  _mm_and_si128
+                                  (upper, _mm_shuffle_epi8 (hi_bits, lo)));
+      __m128i bit = _mm_shuffle_epi8 (select, hi);
+      unsigned int mask
+        = _mm_movemask_epi8 (_mm_cmpeq_epi8 (_mm_and_si128 (row, bit), bit));
+      if (!member)
+        mask ^= 0xffff;
+      if (mask)
+        return i + __builtin_ctz (mask);
+    }
+  return i;
+}
+
+__attribute__ ((__target__ ("avx2")))
+static size_t
+span_avx2 (const unsigned char *bits, const char *buf, size_t len,
+           bool member)
+{
+  const __m256i lo_bits = _mm256_broadcastsi128_si256
+    (_mm_loadu_si128 ((const __m128i *) bits));
+  const __m256i hi_bits = _mm256_broadcastsi128_si256
+    (_mm_loadu_si128 ((const __m128i *) (bits + 16)));
+  const __m256i select = _mm256_setr_epi8 (1, 2, 4, 8, 16, 32, 64, -128,
+                                           1, 2, 4, 8, 16, 32, 64, -128,
+                                           1, 2, 4, 8, 16, 32, 64, -128,
+                                           1, 2, 4, 8, 16, 32, 64, -128);
+  const __m256i nibble = _mm256_set1_epi8 (0x0f);
+  size_t i;
+
+  for (i = 0; i + 32 <= len; i += 32)
+    {
+      __m256i v = _mm256_loadu_si256 ((const __m256i *) (buf + i));
+      __m256i lo = _mm256_and_si256 (v, nibble);
+      __m256i hi = _mm256_and_si256 (_mm256_srli_epi16 (v, 4), nibble);
+      __m256i upper = _mm256_cmpgt_epi8 (_mm256_setzero_si256 (), v);
+      __m256i row = _mm256_blendv_epi8 (_mm256_shuffle_epi8 (lo_bits, lo),
+                                        _mm256_shuffle_epi8 (hi_bits, lo),
+                                        upper);
+      __m256i bit = _mm256_shuffle_epi8 (select, hi);
+      unsigned int mask = (unsigned int) _mm256_movemask_epi8
+        (_mm256_cmpeq_epi8 (_mm256_and_si256 (row, bit), bit));
+      if (!member)
+        mask = ~mask;
+      if (mask)
+        return i + __builtin_ctz (mask);
+    }
+  return i;
+}
+#endif /* SPAN_X86 */
+
+#if defined __aarch64__ && defined __ARM_NEON
+# define SPAN_NEON 1
+# include <arm_neon.h>
+
+static size_t
+span_neon (const unsigned char *bits, const char *buf, size_t len,
+           bool member)
+{
+  static const unsigned char select_bytes[16] =
+    { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+  const uint8x16_t lo_bits = vld1q_u8 (bits);
+  const uint8x16_t hi_bits = vld1q_u8 (bits + 16);
+  const uint8x16_t select = vld1q_u8 (select_bytes);
+  const uint8x16_t nibble = vdupq_n_u8 (0x0f);
+  size_t i;
+
+  for (i = 0; i + 16 <= len; i += 16)
+    {
+      uint8x16_t v = vld1q_u8 ((const uint8_t *) buf + i);
+      uint8x16_t lo = vandq_u8 (v, nibble);
+      uint8x16_t hi = vshrq_n_u8 (v, 4);
+      uint8x16_t upper = vcgeq_u8 (v, vdupq_n_u8 (0x80));
+      uint8x16_t row = vbslq_u8 (upper, vqtbl1q_u8 (hi_bits, lo),
+                                 vqtbl1q_u8 (lo_bits, lo));
+      uint8x16_t stop = vtstq_u8 (row, vqtbl1q_u8 (select, hi));
+      uint64_t mask;
+      if (!member)
+        stop = vmvnq_u8 (stop);
+      /* Narrow each byte of STOP to a nibble of MASK.  */
+      mask = vget_lane_u64 (vreinterpret_u64_u8
+                            (vshrn_n_u16 (vreinterpretq_u16_u8 (stop), 4)),
+                            0);
+      if (mask)
+        return i + __builtin_ctzll (mask) / 4;
+    }
+  return i;
+}
+#endif /* SPAN_NEON */
+
+/* Pick for SYNTAX the best kernel this processor supports, if
+   any.  */
+static void
+span_init (m4_syntax_table *syntax)
+{
+  syntax->span_kernel = NULL;
+#ifdef SPAN_X86
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("avx2"))
+    syntax->span_kernel = span_avx2;
+  else if (__builtin_cpu_supports ("ssse3"))
+    syntax->span_kernel = span_ssse3;
+#elif defined SPAN_NEON
+  syntax->span_kernel = span_neon;
+#endif
+}
+
+/* Record in the span bitmaps of SYNTAX the current categories of the
+   byte C.  */
+static void
+update_span (m4_syntax_table *syntax, int c)
+{
+  int offset = c % 16 + c / 128 * 16;
+  unsigned char bit = 1 << (c / 16 % 8);
+  int i;
+
+  for (i = 0; i < M4__SPAN_SETS; i++)
+    if (syntax->table[c] & span_syntax[i])
+      syntax->span[i][offset] |= bit;
+    else
+      syntax->span[i][offset] &= ~bit;
+}
+
+/* Return the offset of the first byte of BUF, of length LEN, whose
+   membership in the categories CODE is MEMBER, or LEN if there is
+   none.  */
+static size_t
+syntax_search (m4_syntax_table *syntax, const char *buf, size_t len,
+               int code, bool member)
+{
+  size_t i = 0;
+
+  if (syntax->span_kernel && SPAN_MIN <= len)
+    {
+      int set;
+      for (set = 0; set < M4__SPAN_SETS; set++)
+        if (span_syntax[set] == code)
+          {
+            i = syntax->span_kernel (syntax->span[set], buf, len, member);
+            break;
+          }
+    }
+  while (i < len && m4_has_syntax (syntax, buf[i], code) != member)
+    i++;
+  return i;
+}
+
+/* Return the length of the longest prefix of BUF, of length LEN,
+   whose bytes all have one of the syntax categories CODE.  */
+size_t
+m4__syntax_span (m4_syntax_table *syntax, const char *buf, size_t len,
+                 int code)
+{
+  return syntax_search (syntax, buf, len, code, false);
+}
+
+/* Return the length of the longest prefix of BUF, of length LEN,
+   in which no byte has any of the syntax categories CODE.  */
+size_t
+m4__syntax_cspan (m4_syntax_table *syntax, const char *buf, size_t len,
+                  int code)
+{
+  return syntax_search (syntax, buf, len, code, true);
+}
+
 
 /* Define these functions at the end, so that calls in the file use the
    faster macro version from m4module.h.  */
@@ -33,7 +33,14 @@
 
    There is only one entry point, `m4_evaluate', a single function for
    both `eval' and `mpeval', but which is redefined appropriately when
-   this file is #included into its clients.  */
+   this file is #included into its clients.
+
+   Since macros tend to evaluate the same shape of expression over and
+   over, with only the numbers changing between calls, the token
+   sequence of each expression is also compiled into a small postfix
+   program, which is kept in a bounded cache keyed by that sequence.
+   A later expression with the same shape is then lexed once and run
+   through the cached program, rather than through the parser.  */
 
 #include "quotearg.h"
 
@@ -49,7 +56,9 @@ typedef enum eval_token
     NOT, AND, OR, XOR,
     LEFTP, RIGHTP,
     QUESTION, COLON, COMMA,
-    NUMBER, EOTEXT
+    NUMBER, EOTEXT,
+    /* Not a token, but the opcode of unary minus in a program.  */
+    NEGATE
   }
 eval_token;
 
@@ -73,6 +82,8 @@ typedef enum eval_error
   }
 eval_error;
 
+typedef struct eval_program eval_program;
+
 static eval_error comma_term            (m4 *, eval_token, number *);
 static eval_error condition_term        (m4 *, eval_token, number *);
 static eval_error logical_or_term       (m4 *, eval_token, number *);
@@ -89,20 +100,25 @@ static eval_error exp_term              (m4 *, eval_token, number *);
 static eval_error unary_term            (m4 *, eval_token, number *);
 static eval_error simple_term           (m4 *, eval_token, number *);
 static eval_error numb_pow              (number *, number *);
+static eval_error eval_interpret        (m4 *, const char *, size_t,
+                                         number *);
+static size_t     eval_scan             (const char *, size_t);
+static const eval_program *eval_lookup (size_t);
+static eval_error eval_execute          (m4 *, const eval_program *, number *);
 
 
 
 /* --- LEXICAL FUNCTIONS --- */
 
 /* Pointer to next character of input text.  */
-static const char *eval_text;
+static M4_THREAD_LOCAL const char *eval_text;
 
 /* Value of eval_text, from before last call of eval_lex ().  This is so we
    can back up, if we have read too much.  */
-static const char *last_text;
+static M4_THREAD_LOCAL const char *last_text;
 
 /* Detect when to end parsing.  */
-static const char *end_text;
+static M4_THREAD_LOCAL const char *end_text;
 
 /* Prime the lexer at the start of TEXT, with length LEN.  */
 static void
@@ -868,7 +884,9 @@ simple_term (m4 *context, eval_token et, number *v1)
       if ((er = comma_term (context, et, v1)) != NO_ERROR)
         return er;
 
+      numb_init (v2);
       et = eval_lex (&v2);
+      numb_fini (v2);
       if (et == ERROR)
         return UNKNOWN_INPUT;
 
@@ -889,6 +907,458 @@ simple_term (m4 *context, eval_token et, number *v1)
   return NO_ERROR;
 }
 
+/* Parse and evaluate TEXT, of length LEN, into VAL in a single pass.
+   This is the reference behavior, used whenever an expression has no
+   usable compiled program.  */
+static eval_error
+eval_interpret (m4 *context, const char *text, size_t len, number *val)
+{
+  eval_token et;
+  eval_error er;
+
+  eval_init_lex (text, len);
+  et = eval_lex (val);
+  er = comma_term (context, et, val);
+
+  if (er == NO_ERROR && *eval_text != '\0')
+    {
+      if (eval_lex (val) == BADOP)
+        er = INVALID_OPERATOR;
+      else
+        er = EXCESS_INPUT;
+    }
+  return er;
+}
+
+
+
+/* --- COMPILED EXPRESSIONS --- */
+
+/* Longest token sequence that is compiled; longer expressions are
+   always interpreted.  */
+#define EVAL_MAX_TOKENS 64
+
+/* Number of cached programs.  */
+#define EVAL_CACHE_SIZE 64
+
+/* A compiled expression.  CODE holds one opcode per operator, in
+   postfix order, where NUMBER pushes the next literal of the
+   expression; since literals keep their relative order in postfix,
+   the program carries no operands.  CODE is NULL if the token
+   sequence must instead be interpreted, either because it is not
+   valid, or because whether an error is diagnosed depends on the
+   values: an error in a dead branch of &&, || or ?: is ignored, and
+   the parser then resumes in the middle of that branch.  */
+struct eval_program
+{
+  unsigned char *tokens;        /* Token sequence, the cache key.  */
+  size_t len;                   /* Length of TOKENS.  */
+  unsigned char *code;          /* Opcodes, or NULL to interpret.  */
+  size_t code_len;              /* Length of CODE.  */
+};
+
+static M4_THREAD_LOCAL eval_program eval_cache[EVAL_CACHE_SIZE];
+
+/* Token sequence of the current expression, terminated by EOTEXT,
+   and the values of its NUMBER tokens, with room for eval_scan to
+   lex one token too many.  */
+static M4_THREAD_LOCAL unsigned char eval_tokens[EVAL_MAX_TOKENS + 1];
+static M4_THREAD_LOCAL number eval_values[EVAL_MAX_TOKENS + 1];
+
+/* Operand stack of eval_execute.  */
+static M4_THREAD_LOCAL number eval_stack[EVAL_MAX_TOKENS];
+
+static M4_THREAD_LOCAL bool eval_initialised;
+
+/* Release eval_cache and the numbers above when their thread
+   exits.  */
+static void
+eval_cleanup (void)
+{
+  size_t i;
+
+  for (i = 0; i < EVAL_CACHE_SIZE; i++)
+    {
+      free (eval_cache[i].tokens);
+      free (eval_cache[i].code);
+      eval_cache[i].tokens = eval_cache[i].code = NULL;
+    }
+  for (i = 0; i < EVAL_MAX_TOKENS; i++)
+    {
+      numb_fini (eval_values[i]);
+      numb_fini (eval_stack[i]);
+    }
+  numb_fini (eval_values[i]);
+  eval_initialised = false;
+}
+
+/* Lex all of TEXT, of length LEN, into eval_tokens and eval_values.
+   Return the number of tokens, or SIZE_MAX if the expression cannot
+   be compiled because it is too long or contains a bad token.  */
+static size_t
+eval_scan (const char *text, size_t len)
+{
+  size_t n = 0;
+  size_t values = 0;
+  eval_token et;
+
+  if (!eval_initialised)
+    {
+      for (n = 0; n < EVAL_MAX_TOKENS; n++)
+        {
+          numb_init (eval_values[n]);
+          numb_init (eval_stack[n]);
+        }
+      numb_init (eval_values[n]);
+      eval_initialised = true;
+      m4_thread_cleanup (eval_cleanup);
+      n = 0;
+    }
+
+  eval_init_lex (text, len);
+  while ((et = eval_lex (&eval_values[values])) != EOTEXT)
+    {
+      if (et == ERROR || et == BADOP || n == EVAL_MAX_TOKENS)
+        return SIZE_MAX;
+      if (et == NUMBER)
+        values++;
+      eval_tokens[n++] = et;
+    }
+  eval_tokens[n] = EOTEXT;
+  return n;
+}
+
+/* Compiler state: the next token to compile, the program so far, and
+   how many dead branches might enclose the current token.  */
+static M4_THREAD_LOCAL const unsigned char *comp_token;
+static M4_THREAD_LOCAL unsigned char *comp_code;
+static M4_THREAD_LOCAL size_t comp_len;
+static M4_THREAD_LOCAL unsigned int comp_guard;
+
+/* Operators of each left-associative binary level of the grammar,
+   from lowest to highest precedence.  */
+static const unsigned char comp_levels[][4] =
+{
+  { LOR }, { LAND }, { OR }, { XOR }, { AND }, { EQ, NOTEQ },
+  { GT, GTEQ, LS, LSEQ }, { LSHIFT, RSHIFT, URSHIFT }, { PLUS, MINUS },
+  { TIMES, DIVIDE, MODULO, RATIO }
+};
+
+static bool compile_comma (void);
+static bool compile_condition (void);
+static bool compile_binary (size_t);
+static bool compile_exp (void);
+static bool compile_unary (void);
+
+/* Append OP to the program.  Return false if OP can fail while its
+   branch might be dead.  */
+static bool
+compile_emit (unsigned char op)
+{
+  if (comp_guard && (op == DIVIDE || op == RATIO || op == MODULO
+                     || op == EXPONENT))
+    return false;
+  comp_code[comp_len++] = op;
+  return true;
+}
+
+/* Each compile_* function mirrors the parser function of the same
+   level, and returns false when that function might fail.  */
+static bool
+compile_comma (void)
+{
+  if (!compile_condition ())
+    return false;
+  while (*comp_token == COMMA)
+    {
+      comp_token++;
+      if (!compile_condition () || !compile_emit (COMMA))
+        return false;
+    }
+  return true;
+}
+
+static bool
+compile_condition (void)
+{
+  if (!compile_binary (0))
+    return false;
+  if (*comp_token == QUESTION)
+    {
+      comp_token++;
+      comp_guard++;
+      if (!compile_comma () || *comp_token++ != COLON
+          || !compile_condition ())
+        return false;
+      comp_guard--;
+      return compile_emit (QUESTION);
+    }
+  return true;
+}
+
+static bool
+compile_binary (size_t level)
+{
+  /* The right operand of && and || might be dead.  */
+  bool logical = level < 2;
+  unsigned char op;
+
+  if (!(level + 1 < sizeof comp_levels / sizeof *comp_levels
+        ? compile_binary (level + 1) : compile_exp ()))
+    return false;
+  while (memchr (comp_levels[level], op = *comp_token,
+                 sizeof *comp_levels))
+    {
+      comp_token++;
+      comp_guard += logical;
+      if (!(level + 1 < sizeof comp_levels / sizeof *comp_levels
+            ? compile_binary (level + 1) : compile_exp ()))
+        return false;
+      comp_guard -= logical;
+      if (!compile_emit (op))
+        return false;
+    }
+  return true;
+}
+
+static bool
+compile_exp (void)
+{
+  if (!compile_unary ())
+    return false;
+  while (*comp_token == EXPONENT)
+    {
+      comp_token++;
+      if (!compile_exp () || !compile_emit (EXPONENT))
+        return false;
+    }
+  return true;
+}
+
+static bool
+compile_unary (void)
+{
+  unsigned char op = *comp_token;
+
+  switch (op)
+    {
+    case PLUS:
+    case MINUS:
+    case NOT:
+    case LNOT:
+      comp_token++;
+      if (!compile_unary ())
+        return false;
+      return op == PLUS || compile_emit (op == MINUS ? NEGATE : op);
+
+    case LEFTP:
+      comp_token++;
+      return compile_comma () && *comp_token++ == RIGHTP;
+
+    case NUMBER:
+      comp_token++;
+      return compile_emit (NUMBER);
+
+    default:
+      return false;
+    }
+}
+
+/* Return the program for the LEN tokens in eval_tokens, compiling it
+   into the cache if necessary, or NULL if the expression must be
+   interpreted.  */
+static const eval_program *
+eval_lookup (size_t len)
+{
+  size_t hash = len;
+  size_t i;
+  eval_program *prog;
+
+  for (i = 0; i < len; i++)
+    hash = hash * 31 + eval_tokens[i];
+  prog = &eval_cache[hash % EVAL_CACHE_SIZE];
+
+  if (prog->len != len || !prog->tokens
+      || memcmp (prog->tokens, eval_tokens, len) != 0)
+    {
+      free (prog->tokens);
+      free (prog->code);
+      prog->tokens = (unsigned char *) xmemdup (eval_tokens, len);
+      prog->len = len;
+
+      /* A program has at most one opcode per token.  */
+      comp_token = eval_tokens;
+      comp_code = (unsigned char *) xcharalloc (len);
+      comp_len = 0;
+      comp_guard = 0;
+      if (compile_comma () && *comp_token == EOTEXT)
+        {
+          prog->code = comp_code;
+          prog->code_len = comp_len;
+        }
+      else
+        {
+          free (comp_code);
+          prog->code = NULL;
+        }
+    }
+  return prog->code ? prog : NULL;
+}
+
+/* Run PROG over the literals in eval_values, storing the result in
+   VAL.  Operations happen in the same order as in the parser, so any
+   warnings they issue are the same.  */
+static eval_error
+eval_execute (m4 *context, const eval_program *prog, number *val)
+{
+  const number *literal = eval_values;
+  number *sp = eval_stack;
+  number *x;
+  number *y;
+  eval_error er;
+  size_t i;
+
+  for (i = 0; i < prog->code_len; i++)
+    {
+      switch (prog->code[i])
+        {
+        case NUMBER:
+          numb_set (*sp, *literal);
+          sp++;
+          literal++;
+          continue;
+
+        case NEGATE:
+          numb_negate (sp[-1]);
+          continue;
+
+        case NOT:
+          numb_not (context, &sp[-1]);
+          continue;
+
+        case LNOT:
+          numb_lnot (sp[-1]);
+          continue;
+
+        case QUESTION:
+          sp -= 2;
+          numb_set (sp[-1], ! numb_zerop (sp[-1]) ? sp[0] : sp[1]);
+          continue;
+
+        default:
+          break;
+        }
+
+      /* Everything else is a binary operator.  */
+      y = --sp;
+      x = sp - 1;
+      switch (prog->code[i])
+        {
+        case COMMA:
+          numb_set (*x, *y);
+          break;
+
+        case LOR:
+          numb_lior (*x, *y);
+          break;
+
+        case LAND:
+          numb_land (*x, *y);
+          break;
+
+        case OR:
+          numb_ior (context, x, y);
+          break;
+
+        case XOR:
+          numb_eor (context, x, y);
+          break;
+
+        case AND:
+          numb_and (context, x, y);
+          break;
+
+        case EQ:
+          numb_eq (*x, *y);
+          break;
+
+        case NOTEQ:
+          numb_ne (*x, *y);
+          break;
+
+        case GT:
+          numb_gt (*x, *y);
+          break;
+
+        case GTEQ:
+          numb_ge (*x, *y);
+          break;
+
+        case LS:
+          numb_lt (*x, *y);
+          break;
+
+        case LSEQ:
+          numb_le (*x, *y);
+          break;
+
+        case LSHIFT:
+          numb_lshift (context, x, y);
+          break;
+
+        case RSHIFT:
+          numb_rshift (context, x, y);
+          break;
+
+        case URSHIFT:
+          numb_urshift (context, x, y);
+          break;
+
+        case PLUS:
+          numb_plus (*x, *y);
+          break;
+
+        case MINUS:
+          numb_minus (*x, *y);
+          break;
+
+        case TIMES:
+          numb_times (*x, *y);
+          break;
+
+        case DIVIDE:
+          if (numb_zerop (*y))
+            return DIVIDE_ZERO;
+          numb_divide (x, y);
+          break;
+
+        case RATIO:
+          if (numb_zerop (*y))
+            return DIVIDE_ZERO;
+          numb_ratio (*x, *y);
+          break;
+
+        case MODULO:
+          if (numb_zerop (*y))
+            return MODULO_ZERO;
+          numb_modulo (context, x, y);
+          break;
+
+        case EXPONENT:
+          if ((er = numb_pow (x, y)) != NO_ERROR)
+            return er;
+          break;
+
+        default:
+          assert (!"INTERNAL ERROR: bad opcode in eval_execute ()");
+          abort ();
+        }
+    }
+  assert (sp == eval_stack + 1);
+  numb_set (*val, eval_stack[0]);
+  return NO_ERROR;
+}
+
 /* Main entry point, called from "eval" and "mpeval" builtins.  */
 void
 m4_evaluate (m4 *context, m4_obstack *obs, size_t argc, m4_macro_args *argv)
@@ -898,8 +1368,9 @@ m4_evaluate (m4 *context, m4_obstack *obs, size_t argc, m4_macro_args *argv)
   int           radix   = 10;
   int           min     = 1;
   number        val;
-  eval_token    et;
   eval_error    err     = NO_ERROR;
+  const eval_program *prog;
+  size_t        len;
 
   if (!m4_arg_empty (argv, 2)
       && !m4_numeric_arg (context, me, M4ARG (2), M4ARGLEN (2), &radix))
@@ -922,25 +1393,20 @@ m4_evaluate (m4 *context, m4_obstack *obs, size_t argc, m4_macro_args *argv)
     }
 
   numb_initialise ();
-  eval_init_lex (str, M4ARGLEN (1));
 
   numb_init (val);
-  et = eval_lex (&val);
-  if (et == EOTEXT)
+  len = eval_scan (str, M4ARGLEN (1));
+  if (len == 0)
     {
       m4_warn (context, 0, me, _("empty string treated as 0"));
       numb_set (val, numb_ZERO);
     }
+  else if (len == 1 && eval_tokens[0] == NUMBER)
+    numb_set (val, eval_values[0]);
+  else if (len != SIZE_MAX && (prog = eval_lookup (len)))
+    err = eval_execute (context, prog, &val);
   else
-    err = comma_term (context, et, &val);
-
-  if (err == NO_ERROR && *eval_text != '\0')
-    {
-      if (eval_lex (&val) == BADOP)
-        err = INVALID_OPERATOR;
-      else
-        err = EXCESS_INPUT;
-    }
+    err = eval_interpret (context, str, M4ARGLEN (1), &val);
 
   if (err != NO_ERROR)
     str = quotearg_style_mem (locale_quoting_style, str, M4ARGLEN (1));
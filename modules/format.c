@@ -20,6 +20,7 @@
 
 /* printf like formatting for m4.  */
 
+#include "intprops.h"
 #include "vasnprintf.h"
 
 /* Simple varargs substitute.  We assume int and unsigned int are the
@@ -133,77 +134,132 @@ arg_double (struct m4 *context, const m4_call_info *me, const char *str,
   ((argc <= ++i) ? 0.0 : arg_double (context, me, M4ARG (i), M4ARGLEN (i)))
 
 
-/* The main formatting function.  Output is placed on the obstack OBS,
-   the first argument in ARGV is the formatting string, and the rest
-   is arguments for the string.  Warn rather than invoke unspecified
-   behavior in the underlying printf when we do not recognize a
-   format.  */
-
+/* Kinds of directives in a compiled format string.  */
+enum {
+  FORMAT_NONE,          /* literal text only */
+  FORMAT_BAD,           /* unrecognized specifier */
+  FORMAT_CHAR,          /* %c */
+  FORMAT_INT,           /* %d and friends */
+  FORMAT_LONG,          /* %ld and friends */
+  FORMAT_DOUBLE,        /* %f and friends */
+  FORMAT_STR            /* %s */
+};
+
+/* Flags seen in a directive.  */
+enum {
+  THOUSANDS     = 0x01, /* '\''.  */
+  PLUS          = 0x02, /* '+'.  */
+  MINUS         = 0x04, /* '-'.  */
+  SPACE         = 0x08, /* ' '.  */
+  ZERO          = 0x10, /* '0'.  */
+  ALT           = 0x20, /* '#'.  */
+  DONE          = 0x40  /* No more flags.  */
+};
+
+/* One directive of a format string, along with the literal text that
+   precedes it.  */
+typedef struct {
+  size_t lit_off;                       /* Offset of literal text.  */
+  size_t lit_len;                       /* Length of literal text.  */
+  char fstart[sizeof "%'+- 0#*.*hhd"];  /* Format spec for printf.  */
+  char type;                            /* FORMAT_* kind.  */
+  char flags;                           /* Flags given.  */
+  char conv;                            /* Conversion specifier.  */
+  char hflag;                           /* Number of 'h' modifiers.  */
+  bool star_width;                      /* Width comes from an argument.  */
+  bool star_prec;                       /* Precision likewise.  */
+  int width;                            /* Minimum field width.  */
+  int prec;                             /* Precision, or -1.  */
+} format_directive;
+
+/* A format string compiled into a list of directives.  */
+typedef struct {
+  char *str;                            /* Copy of the format string.  */
+  size_t len;                           /* Length of str.  */
+  format_directive *dirs;               /* Directives, in order.  */
+  size_t count;                         /* Number of directives.  */
+  int args;                             /* Arguments consumed, plus 1.  */
+  bool valid;                           /* True if entire format ok.  */
+} format_program;
+
+/* Macros that generate code tend to call format in loops with a few
+   constant format strings, so keep the most recently used ones
+   compiled, most recent first.  */
+#define FORMAT_CACHE_SIZE 16
+static M4_THREAD_LOCAL format_program *format_cache[FORMAT_CACHE_SIZE];
+
+/* Release format_cache when its thread exits.  */
 static void
-format (m4 *context, m4_obstack *obs, int argc, m4_macro_args *argv)
+format_cleanup (void)
 {
-  const m4_call_info *me = m4_arg_info (argv);
-  const char *f;                        /* Format control string.  */
-  size_t f_len;                         /* Length of f.  */
-  const char *fmt;                      /* Position within f.  */
-  char fstart[] = "%'+- 0#*.*hhd";      /* Current format spec.  */
+  size_t i;
+
+  for (i = 0; i < FORMAT_CACHE_SIZE && format_cache[i]; i++)
+    {
+      free (format_cache[i]->str);
+      free (format_cache[i]->dirs);
+      free (format_cache[i]);
+      format_cache[i] = NULL;
+    }
+}
+
+/* Parse the format string F of length F_LEN, which must be NUL
+   terminated, into a list of directives.  This does all the checking
+   that format does not need arguments for, so that reusing the
+   result has the same effect as parsing F anew.  */
+
+static format_program *
+format_compile (const char *f, size_t f_len)
+{
+  format_program *prog = (format_program *) xzalloc (sizeof *prog);
+  size_t alloc = 4;
+  const char *fmt = f;                  /* Position within f.  */
+  format_directive *d;                  /* Current directive.  */
   char *p;                              /* Position within fstart.  */
   unsigned char c;                      /* A simple character.  */
-  int i = 1;                            /* Index within argc used so far.  */
-  bool valid_format = true;             /* True if entire format string ok.  */
-
-  /* Flags.  */
   char flags;                           /* Flags to use in fstart.  */
-  enum {
-    THOUSANDS   = 0x01, /* '\''.  */
-    PLUS        = 0x02, /* '+'.  */
-    MINUS       = 0x04, /* '-'.  */
-    SPACE       = 0x08, /* ' '.  */
-    ZERO        = 0x10, /* '0'.  */
-    ALT         = 0x20, /* '#'.  */
-    DONE        = 0x40  /* No more flags.  */
-  };
-
-  /* Precision specifiers.  */
-  int width;                    /* Minimum field width.  */
-  int prec;                     /* Precision.  */
-  char lflag;                   /* Long flag.  */
 
   /* Specifiers we are willing to accept.  ok['x'] implies %x is ok.
      Various modifiers reduce the set, in order to avoid undefined
      behavior in printf.  */
   char ok[128];
 
-  /* Check that formatted text succeeded with correct type.  */
-  int result = 0;
-  enum {CHAR, INT, LONG, DOUBLE, STR} datatype;
-
-  f = fmt = M4ARG (1);
-  f_len = M4ARGLEN (1);
-  assert (!f[f_len]); /* Requiring a terminating NUL makes parsing simpler.  */
+  prog->str = xcharalloc (f_len + 1);
+  memcpy (prog->str, f, f_len + 1);
+  prog->len = f_len;
+  prog->dirs = XNMALLOC (alloc, format_directive);
+  prog->args = 1;
+  prog->valid = true;
   memset (ok, 0, sizeof ok);
   while (1)
     {
       const char *percent = (char *) memchr (fmt, '%', f_len);
+      if (prog->count == alloc)
+        prog->dirs = x2nrealloc (prog->dirs, &alloc, sizeof *prog->dirs);
+      d = &prog->dirs[prog->count++];
+      memset (d, 0, sizeof *d);
+      d->lit_off = fmt - f;
       if (!percent)
         {
-          obstack_grow (obs, fmt, f_len);
+          d->lit_len = f_len;
+          d->type = FORMAT_NONE;
           break;
         }
-      obstack_grow (obs, fmt, percent - fmt);
+      d->lit_len = percent - fmt;
       f_len -= percent - fmt + 1;
       fmt = percent + 1;
 
       if (*fmt == '%')
         {
-          obstack_1grow (obs, '%');
+          d->type = FORMAT_NONE;
+          d->lit_len++;
           fmt++;
           f_len--;
           continue;
         }
 
-      p = fstart + 1; /* % */
-      lflag = 0;
+      p = d->fstart;
+      *p++ = '%';
       ok['a'] = ok['A'] = ok['c'] = ok['d'] = ok['e'] = ok['E']
         = ok['f'] = ok['F'] = ok['g'] = ok['G'] = ok['i'] = ok['o']
         = ok['s'] = ok['u'] = ok['x'] = ok['X'] = 1;
@@ -250,6 +306,7 @@ format (m4 *context, m4_obstack *obs, int argc, m4_macro_args *argv)
             }
         }
       while (!(flags & DONE) && (f_len--, fmt++));
+      d->flags = flags & ~DONE;
       if (flags & THOUSANDS)
         *p++ = '\'';
       if (flags & PLUS)
@@ -265,25 +322,25 @@ format (m4 *context, m4_obstack *obs, int argc, m4_macro_args *argv)
 
       /* Minimum field width; an explicit 0 is the same as not giving
          the width.  */
-      width = 0;
       *p++ = '*';
       if (*fmt == '*')
         {
-          width = ARG_INT (i, argc, argv);
+          d->star_width = true;
+          prog->args++;
           fmt++;
           f_len--;
         }
       else
         while (isdigit ((unsigned char) *fmt))
           {
-            width = 10 * width + *fmt - '0';
+            d->width = 10 * d->width + *fmt - '0';
             fmt++;
             f_len--;
           }
 
       /* Maximum precision; an explicit negative precision is the same
          as not giving the precision.  A lone '.' is a precision of 0.  */
-      prec = -1;
+      d->prec = -1;
       *p++ = '.';
       *p++ = '*';
       if (*fmt == '.')
@@ -292,16 +349,17 @@ format (m4 *context, m4_obstack *obs, int argc, m4_macro_args *argv)
           f_len--;
           if (*(++fmt) == '*')
             {
-              prec = ARG_INT (i, argc, argv);
+              d->star_prec = true;
+              prog->args++;
               ++fmt;
               f_len--;
             }
           else
             {
-              prec = 0;
+              d->prec = 0;
               while (isdigit ((unsigned char) *fmt))
                 {
-                  prec = 10 * prec + *fmt - '0';
+                  d->prec = 10 * d->prec + *fmt - '0';
                   fmt++;
                   f_len--;
                 }
@@ -309,10 +367,11 @@ format (m4 *context, m4_obstack *obs, int argc, m4_macro_args *argv)
         }
 
       /* Length modifiers.  We don't yet recognize ll, j, t, or z.  */
+      d->type = FORMAT_INT;
       if (*fmt == 'l')
         {
           *p++ = 'l';
-          lflag = 1;
+          d->type = FORMAT_LONG;
           fmt++;
           f_len--;
           ok['c'] = ok['s'] = 0;
@@ -320,11 +379,13 @@ format (m4 *context, m4_obstack *obs, int argc, m4_macro_args *argv)
       else if (*fmt == 'h')
         {
           *p++ = 'h';
+          d->hflag++;
           fmt++;
           f_len--;
           if (*fmt == 'h')
             {
               *p++ = 'h';
+              d->hflag++;
               fmt++;
               f_len--;
             }
@@ -335,9 +396,8 @@ format (m4 *context, m4_obstack *obs, int argc, m4_macro_args *argv)
       c = *fmt;
       if (sizeof ok <= c || !ok[c] || !f_len)
         {
-          m4_warn (context, 0, me, _("unrecognized specifier in %s"),
-                   quotearg_style_mem (locale_quoting_style, f, M4ARGLEN (1)));
-          valid_format = false;
+          d->type = FORMAT_BAD;
+          prog->valid = false;
           if (f_len > 0)
             {
               fmt++;
@@ -352,12 +412,12 @@ format (m4 *context, m4_obstack *obs, int argc, m4_macro_args *argv)
       switch (c)
         {
         case 'c':
-          datatype = CHAR;
+          d->type = FORMAT_CHAR;
           p -= 2; /* %.*c is undefined, so undo the '.*'.  */
           break;
 
         case 's':
-          datatype = STR;
+          d->type = FORMAT_STR;
           break;
 
         case 'd':
@@ -366,7 +426,6 @@ format (m4 *context, m4_obstack *obs, int argc, m4_macro_args *argv)
         case 'x':
         case 'X':
         case 'u':
-          datatype = lflag ? LONG : INT;
           break;
 
         case 'a':
@@ -377,40 +436,207 @@ format (m4 *context, m4_obstack *obs, int argc, m4_macro_args *argv)
         case 'F':
         case 'g':
         case 'G':
-          datatype = DOUBLE;
+          d->type = FORMAT_DOUBLE;
           break;
 
         default:
           abort ();
         }
+      d->conv = c;
       *p++ = c;
       *p = '\0';
+      prog->args++;
+    }
+  return prog;
+}
 
-      switch (datatype)
+/* Return the compiled form of the format string F of length F_LEN,
+   from format_cache if possible.  */
+
+static const format_program *
+format_lookup (const char *f, size_t f_len)
+{
+  format_program *prog;
+  size_t i;
+
+  for (i = 0; i < FORMAT_CACHE_SIZE && format_cache[i]; i++)
+    {
+      prog = format_cache[i];
+      if (prog->len == f_len && memcmp (prog->str, f, f_len) == 0)
+        break;
+    }
+  if (i < FORMAT_CACHE_SIZE && format_cache[i])
+    prog = format_cache[i];
+  else
+    {
+      if (i == 0)
+        m4_thread_cleanup (format_cleanup);
+      /* Recycle the least recently used entry.  */
+      else if (i == FORMAT_CACHE_SIZE)
         {
-        case CHAR:
-          result = obstack_printf (obs, fstart, width,
-                                   ARG_INT (i, argc, argv));
-          break;
+          prog = format_cache[--i];
+          free (prog->str);
+          free (prog->dirs);
+          free (prog);
+        }
+      prog = format_compile (f, f_len);
+    }
+  memmove (&format_cache[1], &format_cache[0], i * sizeof *format_cache);
+  format_cache[0] = prog;
+  return prog;
+}
+
+/* Append LEN spaces to OBS.  */
 
-        case INT:
-          result = obstack_printf (obs, fstart, width, prec,
-                                   ARG_INT (i, argc, argv));
+static void
+format_pad (m4_obstack *obs, size_t len)
+{
+  obstack_blank (obs, len);
+  memset ((char *) obstack_next_free (obs) - len, ' ', len);
+}
+
+/* Output VALUE in decimal to OBS, padded with spaces to WIDTH bytes
+   on the left, or on the right if LEFT.  This is what printf does
+   with %*ld and %-*ld, without the overhead.  */
+
+static void
+format_decimal (m4_obstack *obs, long value, int width, bool left)
+{
+  char buf[INT_BUFSIZE_BOUND (long)];
+  char *end = buf + sizeof buf;
+  char *p = end;
+  unsigned long uvalue = value < 0 ? -(unsigned long) value : value;
+  int len;
+
+  do
+    *--p = '0' + uvalue % 10;
+  while (uvalue /= 10);
+  if (value < 0)
+    *--p = '-';
+  len = end - p;
+  if (!left && len < width)
+    format_pad (obs, width - len);
+  obstack_grow (obs, p, len);
+  if (left && len < width)
+    format_pad (obs, width - len);
+}
+
+/* Output the first LEN bytes of STR to OBS as printf does with %*s
+   and %-*s.  */
+
+static void
+format_string (m4_obstack *obs, const char *str, size_t len, int width,
+               bool left)
+{
+  if (!left && len < (size_t) width)
+    format_pad (obs, width - len);
+  obstack_grow (obs, str, len);
+  if (left && len < (size_t) width)
+    format_pad (obs, width - len);
+}
+
+
+/* The main formatting function.  Output is placed on the obstack OBS,
+   the first argument in ARGV is the formatting string, and the rest
+   is arguments for the string.  Warn rather than invoke unspecified
+   behavior in the underlying printf when we do not recognize a
+   format.  The format string is compiled once by format_compile, and
+   common directives are expanded directly rather than through
+   obstack_printf.  */
+
+static void
+format (m4 *context, m4_obstack *obs, int argc, m4_macro_args *argv)
+{
+  const m4_call_info *me = m4_arg_info (argv);
+  const char *f;                        /* Format control string.  */
+  size_t f_len;                         /* Length of f.  */
+  const format_program *prog;           /* Compiled form of f.  */
+  const format_directive *d;            /* Current directive.  */
+  size_t n;                             /* Index within prog.  */
+  int i = 1;                            /* Index within argc used so far.  */
+
+  /* Precision specifiers.  */
+  int width;                    /* Minimum field width.  */
+  int pad;                      /* Width without its sign.  */
+  int prec;                     /* Precision.  */
+  bool left;                    /* Left justification.  */
+
+  /* Check that formatted text succeeded with correct type.  */
+  int result = 0;
+
+  f = M4ARG (1);
+  f_len = M4ARGLEN (1);
+  assert (!f[f_len]); /* Requiring a terminating NUL makes parsing simpler.  */
+  prog = format_lookup (f, f_len);
+  for (n = 0; n < prog->count; n++)
+    {
+      d = &prog->dirs[n];
+      obstack_grow (obs, prog->str + d->lit_off, d->lit_len);
+      if (d->type == FORMAT_NONE)
+        continue;
+
+      width = d->star_width ? ARG_INT (i, argc, argv) : d->width;
+      prec = d->star_prec ? ARG_INT (i, argc, argv) : d->prec;
+      if (d->type == FORMAT_BAD)
+        {
+          m4_warn (context, 0, me, _("unrecognized specifier in %s"),
+                   quotearg_style_mem (locale_quoting_style, f, f_len));
+          continue;
+        }
+
+      /* A negative width from an argument means left justification.
+         Only the direct expansions need PAD and LEFT; printf is
+         always given the signed WIDTH, since fstart lacks the '-'.
+         The unrepresentable INT_MIN is left to printf.  */
+      left = (d->flags & MINUS) != 0;
+      pad = width;
+      if (width < 0 && width != INT_MIN)
+        {
+          left = true;
+          pad = -width;
+        }
+
+      switch (d->type)
+        {
+        case FORMAT_CHAR:
+          if (!width && !d->flags)
+            obstack_1grow (obs, (unsigned char) ARG_INT (i, argc, argv));
+          else
+            result = obstack_printf (obs, d->fstart, width,
+                                     ARG_INT (i, argc, argv));
           break;
 
-        case LONG:
-          result = obstack_printf (obs, fstart, width, prec,
-                                   ARG_LONG (i, argc, argv));
+        case FORMAT_INT:
+        case FORMAT_LONG:
+          if ((d->conv == 'd' || d->conv == 'i') && prec < 0
+              && !d->hflag && !(d->flags & ~MINUS) && 0 <= pad)
+            format_decimal (obs, (d->type == FORMAT_INT
+                                  ? ARG_INT (i, argc, argv)
+                                  : ARG_LONG (i, argc, argv)),
+                            pad, left);
+          else if (d->type == FORMAT_INT)
+            result = obstack_printf (obs, d->fstart, width, prec,
+                                     ARG_INT (i, argc, argv));
+          else
+            result = obstack_printf (obs, d->fstart, width, prec,
+                                     ARG_LONG (i, argc, argv));
           break;
 
-        case DOUBLE:
-          result = obstack_printf (obs, fstart, width, prec,
+        case FORMAT_DOUBLE:
+          result = obstack_printf (obs, d->fstart, width, prec,
                                    ARG_DOUBLE (i, argc, argv));
           break;
 
-        case STR:
-          result = obstack_printf (obs, fstart, width, prec,
-                                   ARG_STR (i, argc, argv));
+        case FORMAT_STR:
+          if (0 <= pad)
+            {
+              const char *str = ARG_STR (i, argc, argv);
+              format_string (obs, str, (0 <= prec ? strnlen (str, prec)
+                                        : strlen (str)), pad, left);
+            }
+          else
+            result = obstack_printf (obs, d->fstart, width, prec,
+                                     ARG_STR (i, argc, argv));
           break;
 
         default:
@@ -420,6 +646,7 @@ format (m4 *context, m4_obstack *obs, int argc, m4_macro_args *argv)
          we constructed fstart, the result should not be negative.  */
       assert (0 <= result);
     }
-  if (valid_format)
+  assert (i == prog->args);
+  if (prog->valid)
     m4_bad_argc (context, argc, me, i, i, true);
 }
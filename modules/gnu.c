@@ -32,9 +32,13 @@
 #include "quotearg.h"
 #include "spawn-pipe.h"
 #include "wait-process.h"
+#include "xmemdup0.h"
+
+#include <poll.h>
 
 /* Maintain each of the builtins implemented in this modules along
-   with their details in a single table for easy maintenance.
+   with their details in a single table for easy maintenance.  Keep
+   it sorted by name, so that m4_install_builtins need not sort it.
 
            function     macros  blind   side    minargs maxargs */
 #define builtin_functions                                       \
@@ -42,20 +46,28 @@
   BUILTIN (__line__,    false,  false,  false,  0,      0  )    \
   BUILTIN (__program__, false,  false,  false,  0,      0  )    \
   BUILTIN (builtin,     true,   true,   false,  1,      -1 )    \
+  BUILTIN (case,        true,   true,   false,  2,      -1 )    \
   BUILTIN (changeresyntax,false,true,   false,  1,      1  )    \
   BUILTIN (changesyntax,false,  true,   false,  1,      -1 )    \
   BUILTIN (debugfile,   false,  false,  false,  0,      1  )    \
   BUILTIN (debuglen,    false,  true,   false,  1,      1  )    \
   BUILTIN (debugmode,   false,  false,  false,  0,      1  )    \
   BUILTIN (esyscmd,     false,  true,   true,   1,      1  )    \
+  BUILTIN (esyscmd_start,false, true,   true,   1,      1  )    \
+  BUILTIN (esyscmd_wait,false,  true,   false,  1,      1  )    \
+  BUILTIN (foreach,     false,  true,   false,  3,      3  )    \
+  BUILTIN (foreachq,    false,  true,   false,  3,      3  )    \
+  BUILTIN (forloop,     false,  true,   false,  4,      4  )    \
   BUILTIN (format,      false,  true,   false,  1,      -1 )    \
   BUILTIN (indir,       true,   true,   false,  1,      -1 )    \
+  BUILTIN (m4modules,   false,  false,  false,  0,      0  )    \
+  BUILTIN (m4stats,     false,  false,  false,  0,      1  )    \
+  BUILTIN (m4symbols,   true,   false,  false,  0,      -1 )    \
   BUILTIN (mkdtemp,     false,  true,   false,  1,      1  )    \
   BUILTIN (patsubst,    false,  true,   true,   2,      4  )    \
   BUILTIN (regexp,      false,  true,   true,   2,      4  )    \
   BUILTIN (renamesyms,  false,  true,   false,  2,      3  )    \
-  BUILTIN (m4modules,   false,  false,  false,  0,      0  )    \
-  BUILTIN (m4symbols,   true,   false,  false,  0,      -1 )    \
+  BUILTIN (switch,      false,  true,   false,  2,      2  )    \
   BUILTIN (syncoutput,  false,  true,   false,  1,      1  )    \
 
 
@@ -97,135 +109,74 @@ static const m4_macro m4_macro_table[] =
   { NULL,               NULL,   0,      0 },
 };
 
+static void *esyscmd_table_new (void);
+static m4_module_data_free_func esyscmd_table_free;
 
 void
 include_gnu (m4 *context, m4_module *module, m4_obstack *obs)
 {
   m4_install_builtins (context, module, m4_builtin_table);
   m4_install_macros   (context, module, m4_macro_table);
+  m4_set_module_data  (module, esyscmd_table_new (), esyscmd_table_free);
 }
 
 
 
-/* Regular expressions.  Reuse re_registers among multiple
-   re_pattern_buffer allocations to reduce malloc usage.  */
-
-/* Maybe this is worth making runtime tunable.  Too small, and nothing
-   gets cached because the working set of active regex is larger than
-   the cache, and we are always swapping out entries.  Too large, and
-   the time spent searching the cache for a match overtakes the time
-   saved by caching.  For now, this size proved reasonable for the
-   typical working set of Autoconf 2.62.  */
-#define REGEX_CACHE_SIZE 16
-
-/* Structure for using a compiled regex, as well as making it easier
-   to cache frequently used expressions.  */
-typedef struct {
-  unsigned count;                       /* usage counter */
-  int resyntax;                         /* flavor of regex */
-  size_t len;                           /* length of string */
-  char *str;                            /* copy of compiled string */
-  struct re_pattern_buffer *pat;        /* compiled regex, allocated */
-  struct re_registers regs;             /* match registers, reused */
-} m4_pattern_buffer;
-
-/* Storage for the cache of regular expressions.  */
-static m4_pattern_buffer regex_cache[REGEX_CACHE_SIZE];
-
-/* Compile a REGEXP of length LEN using the RESYNTAX flavor, and
-   return the buffer.  On error, report the problem on behalf of
-   CALLER, and return NULL.  */
-
-static m4_pattern_buffer *
-regexp_compile (m4 *context, const m4_call_info *caller, const char *regexp,
-                size_t len, int resyntax)
-{
-  /* regex_cache is guaranteed to start life 0-initialized, which
-     works in the algorithm below.
-
-     FIXME - this method is not reentrant, since re_compile_pattern
-     mallocs memory, depends on the global variable re_syntax_options
-     for its syntax (but at least the compiled regex remembers its
-     syntax even if the global variable changes later), and since we
-     use a static variable.  To be reentrant, we would need a mutex in
-     this method, and move the storage for regex_cache into context.  */
-
-  const char *msg;              /* error message from re_compile_pattern */
-  int i;                        /* iterator */
-  m4_pattern_buffer *victim;    /* cache slot to replace */
-  unsigned victim_count;        /* track which victim to replace */
-  struct re_pattern_buffer *pat;/* newly compiled regex */
-
-  /* First, check if REGEXP is already cached with the given RESYNTAX.
-     If so, increase its use count and return it.  */
-  for (i = 0; i < REGEX_CACHE_SIZE; i++)
-    if (len == regex_cache[i].len && resyntax == regex_cache[i].resyntax
-        && regex_cache[i].str && memcmp (regexp, regex_cache[i].str, len) == 0)
-      {
-        regex_cache[i].count++;
-        return &regex_cache[i];
-      }
+/* Record a match of LEN bytes at POS found without re_search in the
+   registers of BUF, unless NO_SUB, and return POS.  */
 
-  /* Next, check if REGEXP can be compiled.  */
-  pat = (struct re_pattern_buffer *) xzalloc (sizeof *pat);
-  re_set_syntax (resyntax);
-  msg = re_compile_pattern (regexp, len, pat);
-
-  if (msg != NULL)
-    {
-      m4_warn (context, 0, caller, _("bad regular expression %s: %s"),
-               quotearg_style_mem (locale_quoting_style, regexp, len), msg);
-      regfree (pat);
-      free (pat);
-      return NULL;
-    }
-  /* Use a fastmap for speed; it is freed by regfree.  */
-  pat->fastmap = xcharalloc (UCHAR_MAX + 1);
-
-  /* Now, find a victim slot.  Decrease the count of all entries, then
-     prime the count of the victim slot at REGEX_CACHE_SIZE.  This
-     way, frequently used entries and newly created entries are least
-     likely to be victims next time we have a cache miss.  */
-  victim = regex_cache;
-  victim_count = victim->count;
-  if (victim_count)
-    victim->count--;
-  for (i = 1; i < REGEX_CACHE_SIZE; i++)
-    {
-      if (regex_cache[i].count < victim_count)
-        {
-          victim_count = regex_cache[i].count;
-          victim = &regex_cache[i];
-        }
-      if (regex_cache[i].count)
-        regex_cache[i].count--;
-    }
-  victim->count = REGEX_CACHE_SIZE;
-  victim->resyntax = resyntax;
-  victim->len = len;
-  if (victim->str)
+static regoff_t
+regexp_found (m4_pattern_buffer *buf, regoff_t pos, size_t len, bool no_sub)
+{
+  if (!no_sub)
     {
-      free (victim->str);
-      regfree (victim->pat);
-      free (victim->pat);
+      if (buf->regs.num_regs < 1)
+        re_set_registers (buf->pat, &buf->regs, 1,
+                          XNMALLOC (1, regoff_t), XNMALLOC (1, regoff_t));
+      buf->regs.start[0] = pos;
+      buf->regs.end[0] = pos + len;
     }
-  victim->str = xstrdup (regexp);
-  victim->pat = pat;
-  re_set_registers (pat, &victim->regs, victim->regs.num_regs,
-                    victim->regs.start, victim->regs.end);
-  return victim;
+  return pos;
 }
 
-
 /* Wrap up GNU Regex re_search call to work with an m4_pattern_buffer.
-   If NO_SUB, then storing matches in buf->regs is not necessary.  */
+   If NO_SUB, then storing matches in buf->regs is not necessary.
+   Patterns that m4_regexp_compile classified as literals or single
+   byte classes are searched for directly, with the same result; the
+   search is always forward to the end of STRING in that case.  */
 
 static regoff_t
 regexp_search (m4_pattern_buffer *buf, const char *string, const int size,
                const int start, const int range, bool no_sub)
 {
-  return re_search (buf->pat, string, size, start, range,
-                    no_sub ? NULL : &buf->regs);
+  const char *end = string + size;
+  const char *p = string + start;
+
+  switch (buf->kind)
+    {
+    case M4_PATTERN_LITERAL:
+      assert (start + range == size);
+      while ((p = (char *) memmem (p, end - p, buf->lit, buf->lit_len)))
+        {
+          if ((!buf->bol || p == string || p[-1] == '\n')
+              && (!buf->eol || p + buf->lit_len == end
+                  || p[buf->lit_len] == '\n'))
+            return regexp_found (buf, p - string, buf->lit_len, no_sub);
+          p++;
+        }
+      return -1;
+
+    case M4_PATTERN_CLASS:
+      assert (start + range == size);
+      for (; p < end; p++)
+        if (buf->map[to_uchar (*p)])
+          return regexp_found (buf, p - string, 1, no_sub);
+      return -1;
+
+    default:
+      return re_search (buf->pat, string, size, start, range,
+                        no_sub ? NULL : &buf->regs);
+    }
 }
 
 
@@ -291,7 +242,7 @@ substitute (m4 *context, m4_obstack *obs, const m4_call_info *caller,
 
 
 /* For each match against REGEXP of length REGEXP_LEN (precompiled in
-   BUF as returned by regexp_compile) in VICTIM of length LEN,
+   BUF as returned by m4_regexp_compile) in VICTIM of length LEN,
    substitute REPLACE of length REPL_LEN.  Non-matching characters are
    copied verbatim, and the result copied to the obstack.  Errors are
    reported on behalf of CALLER.  Return true if a substitution was
@@ -461,6 +412,239 @@ M4BUILTIN_HANDLER (builtin)
 }
 
 
+/* Compare KEY with each VALUE in turn, and expand to the EXPANSION
+   paired with the first one that is equal, like a chain of ifelse
+   arms that all test the same string, but without repeating KEY in
+   every arm.  An unpaired last argument is the DEFAULT, expanded when
+   no VALUE matches.  */
+
+/**
+ * case(KEY, VALUE-1, EXPANSION-1, [...], [DEFAULT])
+ **/
+M4BUILTIN_HANDLER (case)
+{
+  size_t i;
+
+  for (i = 2; i + 1 < argc; i += 2)
+    if (m4_arg_equal (context, argv, 1, i))
+      {
+        m4_push_arg (context, obs, argv, i + 1);
+        return;
+      }
+  if (i < argc)
+    m4_push_arg (context, obs, argv, i);
+}
+
+
+/* The builtin "switch" makes the same choice as "case", but reads the
+   VALUE and EXPANSION pairs from the definition of a table macro,
+   which must be a comma-separated list of quoted strings.  The list
+   is split once, into a hash index from each VALUE to its EXPANSION,
+   which is attached to the definition as its cache, so that later
+   calls with the same definition cost one lookup, however many arms
+   the table has.  Redefining or deleting the table releases the
+   index, and so does changing the quotes it was split with.  */
+
+typedef struct
+{
+  const char *text;             /* Definition the arms point into.  */
+  size_t len;                   /* Length of the definition.  */
+  char *lquote;                 /* Quotes the definition was split with.  */
+  size_t lquote_len;
+  char *rquote;
+  size_t rquote_len;
+  m4_string *arms;              /* Unquoted VALUE, EXPANSION, ... pairs.  */
+  size_t count;                 /* Number of entries in arms.  */
+  m4_hash *index;               /* Maps each VALUE to its EXPANSION.  */
+} switch_table;
+
+/* Remove one entry of a switch_table index.  */
+static void *
+switch_remove_CB (m4_hash *hash, const void *key, void *value M4_GNUC_UNUSED,
+                  void *ignored M4_GNUC_UNUSED)
+{
+  m4_hash_remove (hash, key);
+  return NULL;
+}
+
+/* Release TABLE, the cache of a definition.  */
+static void
+switch_table_free (void *table)
+{
+  switch_table *t = (switch_table *) table;
+
+  m4_hash_apply (t->index, switch_remove_CB, NULL);
+  m4_hash_delete (t->index);
+  free (t->arms);
+  free (t->lquote);
+  free (t->rquote);
+  free (t);
+}
+
+/* Return true if the LEN bytes at P, not beyond END, are STR.  */
+static bool
+switch_match (const char *p, const char *end, const char *str, size_t len)
+{
+  return (size_t) (end - p) >= len && memcmp (p, str, len) == 0;
+}
+
+/* Skip whitespace from P, not beyond END.  */
+static const char *
+switch_skip (const char *p, const char *end)
+{
+  while (p < end && isspace (to_uchar (*p)))
+    p++;
+  return p;
+}
+
+/* Split the definition TEXT of length LEN into the arms of a new
+   switch_table, using QUOTES.  Return NULL if TEXT is not a list of
+   quoted strings separated by commas and optional whitespace.  */
+static switch_table *
+switch_table_new (const char *text, size_t len, const m4_string_pair *quotes)
+{
+  const char *p = text;
+  const char *end = text + len;
+  m4_string *arms = NULL;
+  size_t count = 0;
+  size_t alloc = 0;
+  bool valid = quotes->len1 && quotes->len2;
+  switch_table *table;
+  size_t i;
+
+  p = switch_skip (p, end);
+  while (valid && p < end)
+    {
+      const char *start;
+      int depth = 1;
+
+      if (!switch_match (p, end, quotes->str1, quotes->len1))
+        {
+          valid = false;
+          break;
+        }
+      p += quotes->len1;
+      start = p;
+      while (p < end)
+        {
+          if (switch_match (p, end, quotes->str2, quotes->len2))
+            {
+              if (!--depth)
+                break;
+              p += quotes->len2;
+            }
+          else if (switch_match (p, end, quotes->str1, quotes->len1))
+            {
+              depth++;
+              p += quotes->len1;
+            }
+          else
+            p++;
+        }
+      if (depth)
+        {
+          valid = false;
+          break;
+        }
+      if (count == alloc)
+        arms = (m4_string *) x2nrealloc (arms, &alloc, sizeof *arms);
+      arms[count].str = (char *) start;
+      arms[count++].len = p - start;
+      p = switch_skip (p + quotes->len2, end);
+      if (p < end)
+        {
+          if (*p != ',')
+            valid = false;
+          else
+            {
+              p = switch_skip (p + 1, end);
+              valid = p < end;
+            }
+        }
+    }
+  if (!valid)
+    {
+      free (arms);
+      return NULL;
+    }
+
+  table = (switch_table *) xzalloc (sizeof *table);
+  table->text = text;
+  table->len = len;
+  table->lquote = xmemdup0 (quotes->str1, quotes->len1);
+  table->lquote_len = quotes->len1;
+  table->rquote = xmemdup0 (quotes->str2, quotes->len2);
+  table->rquote_len = quotes->len2;
+  table->arms = arms;
+  table->count = count;
+  table->index = m4_hash_new (count, m4_hash_string_hash, m4_hash_string_cmp);
+  for (i = 0; i + 1 < count; i += 2)
+    if (!m4_hash_lookup (table->index, &arms[i]))
+      m4_hash_insert (table->index, &arms[i], &arms[i + 1]);
+  return table;
+}
+
+/**
+ * switch(TABLE, KEY)
+ **/
+M4BUILTIN_HANDLER (switch)
+{
+  const m4_call_info *me = m4_arg_info (argv);
+  const char *name = M4ARG (1);
+  size_t len = M4ARGLEN (1);
+  const m4_string_pair *quotes = m4_get_syntax_quotes (M4SYNTAX);
+  m4_symbol *symbol = m4_symbol_lookup (M4SYMTAB, name, len);
+  m4_symbol_value *value;
+  switch_table *table;
+  m4_string key;
+  void **slot;
+  const m4_string *arm;
+
+  if (!symbol || !m4_is_symbol_text (symbol))
+    {
+      m4_warn (context, 0, me, _("invalid table %s"),
+               quotearg_style_mem (locale_quoting_style, name, len));
+      return;
+    }
+  value = m4_get_symbol_value (symbol);
+  table = (switch_table *) m4_get_symbol_value_cache (value,
+                                                      switch_table_free);
+  if (table
+      && (table->text != m4_get_symbol_value_text (value)
+          || table->len != m4_get_symbol_value_len (value)
+          || table->lquote_len != quotes->len1
+          || table->rquote_len != quotes->len2
+          || memcmp (table->lquote, quotes->str1, quotes->len1) != 0
+          || memcmp (table->rquote, quotes->str2, quotes->len2) != 0))
+    table = NULL;
+  if (!table)
+    {
+      table = switch_table_new (m4_get_symbol_value_text (value),
+                                m4_get_symbol_value_len (value), quotes);
+      if (!table)
+        {
+          m4_set_symbol_value_cache (value, NULL, switch_table_free);
+          m4_warn (context, 0, me, _("invalid table %s"),
+                   quotearg_style_mem (locale_quoting_style, name, len));
+          return;
+        }
+      m4_set_symbol_value_cache (value, table, switch_table_free);
+    }
+
+  key.str = (char *) M4ARG (2);
+  key.len = M4ARGLEN (2);
+  slot = m4_hash_lookup (table->index, &key);
+  if (slot)
+    arm = (const m4_string *) *slot;
+  else if (table->count % 2)
+    arm = &table->arms[table->count - 1];
+  else
+    arm = NULL;
+  if (arm)
+    obstack_grow (obs, arm->str, arm->len);
+}
+
+
 /* Change the current regexp syntax to SPEC of length LEN, or report
    failure on behalf of CALLER.  Currently this affects the builtins:
    `patsubst', `regexp' and `renamesyms'.  */
@@ -624,6 +808,63 @@ M4BUILTIN_HANDLER (debugmode)
 }
 
 
+/* Start the shell running CMD on behalf of the builtin ME, with its
+   standard output connected to a pipe whose read end is stored in FD.
+   Return the process id of the child, or -1 after reporting the
+   failure and setting sysval.  */
+static pid_t
+esyscmd_spawn (m4 *context, const m4_call_info *me, const char *cmd, int *fd)
+{
+  const char *prog_args[4] = { "sh", "-c" };
+  pid_t child;
+
+#if W32_NATIVE
+  if (strstr (M4_SYSCMD_SHELL, "cmd"))
+    {
+      prog_args[0] = "cmd";
+      prog_args[1] = "/c";
+    }
+#endif
+  prog_args[2] = cmd;
+  errno = 0;
+  child = create_pipe_in (m4_info_name (me), M4_SYSCMD_SHELL,
+                          (char **) prog_args, NULL, false, true, false, fd);
+  if (child == -1)
+    {
+      m4_error (context, 0, errno, me, _("cannot run command %s"),
+                quotearg_style (locale_quoting_style, cmd));
+      m4_set_sysval (context, 127);
+    }
+  return child;
+}
+
+/* Wait for CHILD, started by ME to run CMD, and record how it exited
+   in sysval.  */
+static void
+esyscmd_reap (m4 *context, const m4_call_info *me, const char *cmd,
+              pid_t child)
+{
+  int status;
+  int sig_status;
+
+  errno = 0;
+  status = wait_subprocess (child, m4_info_name (me), false, true, true,
+                            false, &sig_status);
+  if (sig_status)
+    {
+      assert (status == 127);
+      m4_set_sysval (context, sig_status << 8);
+    }
+  else
+    {
+      if (status == 127 && errno)
+        m4_error (context, 0, errno, me, _("cannot run command %s"),
+                  quotearg_style (locale_quoting_style, cmd));
+      m4_set_sysval (context, status);
+    }
+  m4_path_cache_flush (context);
+}
+
 /* Same as the sysymd builtin from m4.c module, but expand to the
    output of SHELL-COMMAND. */
 
@@ -636,18 +877,13 @@ M4BUILTIN_HANDLER (esyscmd)
   const m4_call_info *me = m4_arg_info (argv);
   const char *cmd = M4ARG (1);
   size_t len = M4ARGLEN (1);
-  M4_MODULE_IMPORT (m4, m4_set_sysval);
   M4_MODULE_IMPORT (m4, m4_sysval_flush);
 
-  if (m4_set_sysval && m4_sysval_flush)
+  if (m4_sysval_flush)
     {
       pid_t child;
       int fd;
       FILE *pin;
-      int status;
-      int sig_status;
-      const char *prog_args[4] = { "sh", "-c" };
-      const char *caller;
 
       if (m4_get_safer_opt (context))
         {
@@ -661,30 +897,14 @@ M4BUILTIN_HANDLER (esyscmd)
       /* Optimize the empty command.  */
       if (!*cmd)
         {
-          m4_set_sysval (0);
+          m4_set_sysval (context, 0);
           return;
         }
 
       m4_sysval_flush (context, false);
-#if W32_NATIVE
-      if (strstr (M4_SYSCMD_SHELL, "cmd"))
-        {
-          prog_args[0] = "cmd";
-          prog_args[1] = "/c";
-        }
-#endif
-      prog_args[2] = cmd;
-      caller = m4_info_name (me);
-      errno = 0;
-      child = create_pipe_in (caller, M4_SYSCMD_SHELL, (char **) prog_args,
-                              NULL, false, true, false, &fd);
+      child = esyscmd_spawn (context, me, cmd, &fd);
       if (child == -1)
-        {
-          m4_error (context, 0, errno, me, _("cannot run command %s"),
-                    quotearg_style (locale_quoting_style, cmd));
-          m4_set_sysval (127);
-          return;
-        }
+        return;
 #if OS2
       /* On OS/2 kLIBC, fdopen() creates a stream in a mode of a file
          descriptor.  So incldue "t" to open stream in a text mode explicitly. */
@@ -696,7 +916,7 @@ M4BUILTIN_HANDLER (esyscmd)
         {
           m4_error (context, 0, errno, me, _("cannot run command %s"),
                     quotearg_style (locale_quoting_style, cmd));
-          m4_set_sysval (127);
+          m4_set_sysval (context, 127);
           close (fd);
           return;
         }
@@ -722,24 +942,270 @@ M4BUILTIN_HANDLER (esyscmd)
         m4_error (context, EXIT_FAILURE, errno, me,
                   _("cannot read pipe to command %s"),
                   quotearg_style (locale_quoting_style, cmd));
-      errno = 0;
-      status = wait_subprocess (child, caller, false, true, true, false,
-                                &sig_status);
-      if (sig_status)
-        {
-          assert (status == 127);
-          m4_set_sysval (sig_status << 8);
-        }
-      else
+      esyscmd_reap (context, me, cmd, child);
+    }
+  else
+    assert (!"Unable to import from m4 module");
+}
+
+
+/* The builtins "esyscmd_start" and "esyscmd_wait" split esyscmd in
+   two, so that several commands can run at once.  Each started
+   command owns a slot in a table, and its handle is the slot number
+   plus one.  Whenever a wait would block, every pending pipe is
+   polled, and whatever is readable is collected into the obstack of
+   its slot, so no child stalls on a full pipe while m4 waits for
+   another one.  A slot is released once its command has been waited
+   for.  The table belongs to the context, as the data of this module;
+   when the context is deleted, the pipes of commands never waited for
+   are closed and their children reaped, and their output is lost.  */
+
+typedef struct esyscmd_job esyscmd_job;
+
+struct esyscmd_job
+{
+  char *cmd;                    /* Command text, or NULL if slot free.  */
+  pid_t child;                  /* Process id, or -1 if none.  */
+  int fd;                       /* Read end of pipe, or -1 at EOF.  */
+  m4_obstack output;            /* Output collected so far.  */
+};
+
+typedef struct
+{
+  esyscmd_job *jobs;            /* Slots, in handle order.  */
+  size_t len;                   /* Number of slots.  */
+} esyscmd_table;
+
+/* Return an empty table of commands.  */
+static void *
+esyscmd_table_new (void)
+{
+  return xzalloc (sizeof (esyscmd_table));
+}
+
+/* Release TABLE, the module data of CONTEXT, waiting silently for
+   every command still pending.  */
+static void
+esyscmd_table_free (m4 *context M4_GNUC_UNUSED, void *table)
+{
+  esyscmd_table *t = (esyscmd_table *) table;
+  size_t i;
+
+  for (i = 0; i < t->len; i++)
+    if (t->jobs[i].cmd)
+      {
+        esyscmd_job *job = &t->jobs[i];
+
+        if (job->fd != -1)
+          close (job->fd);
+        if (job->child != -1)
+          wait_subprocess (job->child, job->cmd, true, true, true, false,
+                           NULL);
+        obstack_free (&job->output, NULL);
+        free (job->cmd);
+      }
+  free (t->jobs);
+  free (t);
+}
+
+/* Read from every pending pipe of TABLE as data becomes available,
+   until the pipe of JOB reaches end of file.  ME is the waiting
+   builtin.  */
+static void
+esyscmd_drain (m4 *context, const m4_call_info *me, esyscmd_table *table,
+               esyscmd_job *job)
+{
+  struct pollfd *fds = XNMALLOC (table->len, struct pollfd);
+  esyscmd_job **owners = XNMALLOC (table->len, esyscmd_job *);
+
+  while (job->fd != -1)
+    {
+      size_t nfds = 0;
+      size_t i;
+
+      for (i = 0; i < table->len; i++)
+        if (table->jobs[i].cmd && table->jobs[i].fd != -1)
+          {
+            fds[nfds].fd = table->jobs[i].fd;
+            fds[nfds].events = POLLIN;
+            owners[nfds++] = &table->jobs[i];
+          }
+      if (poll (fds, nfds, -1) < 0)
         {
-          if (status == 127 && errno)
-            m4_error (context, 0, errno, me, _("cannot run command %s"),
-                      quotearg_style (locale_quoting_style, cmd));
-          m4_set_sysval (status);
+          if (errno == EINTR)
+            continue;
+          m4_error (context, EXIT_FAILURE, errno, me,
+                    _("cannot read pipe to command %s"),
+                    quotearg_style (locale_quoting_style, job->cmd));
         }
+      for (i = 0; i < nfds; i++)
+        if (fds[i].revents)
+          {
+            esyscmd_job *ready = owners[i];
+            ssize_t len;
+
+            obstack_make_room (&ready->output, BUFSIZ);
+            len = read (ready->fd, obstack_next_free (&ready->output),
+                        obstack_room (&ready->output));
+            if (0 < len)
+              obstack_blank_fast (&ready->output, len);
+            else if (len < 0 && errno == EINTR)
+              continue;
+            else
+              {
+                if (len < 0 || close (ready->fd) != 0)
+                  m4_error (context, EXIT_FAILURE, errno, me,
+                            _("cannot read pipe to command %s"),
+                            quotearg_style (locale_quoting_style,
+                                            ready->cmd));
+                ready->fd = -1;
+              }
+          }
+    }
+  free (owners);
+  free (fds);
+}
+
+/**
+ * esyscmd_start(SHELL-COMMAND)
+ **/
+M4BUILTIN_HANDLER (esyscmd_start)
+{
+  const m4_call_info *me = m4_arg_info (argv);
+  const char *cmd = M4ARG (1);
+  size_t len = M4ARGLEN (1);
+  esyscmd_table *table = (esyscmd_table *) m4_get_module_data (context,
+                                                               "gnu");
+  esyscmd_job *job;
+  pid_t child = -1;
+  int fd = -1;
+  size_t i;
+  M4_MODULE_IMPORT (m4, m4_sysval_flush);
+
+  if (!m4_sysval_flush)
+    {
+      assert (!"Unable to import from m4 module");
+      abort ();
     }
+  if (m4_get_safer_opt (context))
+    {
+      m4_error (context, 0, 0, me, _("disabled by --safer"));
+      return;
+    }
+  if (strlen (cmd) != len)
+    m4_warn (context, 0, me, _("argument %s truncated"),
+             quotearg_style_mem (locale_quoting_style, cmd, len));
+
+  /* The empty command gets a handle too, but no child.  */
+  if (*cmd)
+    {
+      m4_sysval_flush (context, false);
+      child = esyscmd_spawn (context, me, cmd, &fd);
+      if (child == -1)
+        return;
+    }
+
+  for (i = 0; i < table->len; i++)
+    if (!table->jobs[i].cmd)
+      break;
+  if (i == table->len)
+    {
+      size_t old_len = table->len;
+      table->jobs = x2nrealloc (table->jobs, &table->len,
+                                sizeof *table->jobs);
+      memset (&table->jobs[old_len], 0,
+              (table->len - old_len) * sizeof *table->jobs);
+    }
+  job = &table->jobs[i];
+  job->cmd = xstrdup (cmd);
+  job->child = child;
+  job->fd = fd;
+  obstack_init (&job->output);
+  m4_shipout_int (obs, i + 1);
+}
+
+/**
+ * esyscmd_wait(HANDLE)
+ **/
+M4BUILTIN_HANDLER (esyscmd_wait)
+{
+  const m4_call_info *me = m4_arg_info (argv);
+  esyscmd_table *table = (esyscmd_table *) m4_get_module_data (context,
+                                                               "gnu");
+  esyscmd_job *job;
+  int handle;
+
+  if (m4_get_safer_opt (context))
+    {
+      m4_error (context, 0, 0, me, _("disabled by --safer"));
+      return;
+    }
+  if (!m4_numeric_arg (context, me, M4ARG (1), M4ARGLEN (1), &handle))
+    return;
+  if (handle < 1 || table->len < (size_t) handle
+      || !table->jobs[handle - 1].cmd)
+    {
+      m4_warn (context, 0, me, _("no pending command %s"),
+               quotearg_style_mem (locale_quoting_style, M4ARG (1),
+                                   M4ARGLEN (1)));
+      return;
+    }
+
+  job = &table->jobs[handle - 1];
+  esyscmd_drain (context, me, table, job);
+  if (job->child == -1)
+    m4_set_sysval (context, 0);
   else
-    assert (!"Unable to import from m4 module");
+    esyscmd_reap (context, me, job->cmd, job->child);
+  obstack_grow (obs, obstack_base (&job->output),
+                obstack_object_size (&job->output));
+  obstack_free (&job->output, NULL);
+  free (job->cmd);
+  job->cmd = NULL;
+}
+
+
+/* The builtins "foreach", "foreachq" and "forloop" behave like the
+   macros of the same names developed in the manual, but iterate in C:
+   the input engine binds the iteration macro and pushes one copy of
+   the body at a time, so neither the nesting depth nor the amount of
+   argument text grows with the length of the loop.  */
+
+/**
+ * foreach(ITERATOR, (ELEMENT, ...), TEXT)
+ **/
+M4BUILTIN_HANDLER (foreach)
+{
+  if (!m4_push_foreach (context, obs, M4ARG (1), M4ARGLEN (1), M4ARG (2),
+                        M4ARGLEN (2), true, M4ARG (3), M4ARGLEN (3)))
+    m4_warn (context, 0, m4_arg_info (argv),
+             _("list not enclosed in parentheses: %s"),
+             quotearg_style_mem (locale_quoting_style, M4ARG (2),
+                                 M4ARGLEN (2)));
+}
+
+/**
+ * foreachq(ITERATOR, `ELEMENT, ...', TEXT)
+ **/
+M4BUILTIN_HANDLER (foreachq)
+{
+  m4_push_foreach (context, obs, M4ARG (1), M4ARGLEN (1), M4ARG (2),
+                   M4ARGLEN (2), false, M4ARG (3), M4ARGLEN (3));
+}
+
+/**
+ * forloop(ITERATOR, START, END, TEXT)
+ **/
+M4BUILTIN_HANDLER (forloop)
+{
+  const m4_call_info *me = m4_arg_info (argv);
+  int start;
+  int end;
+
+  if (m4_numeric_arg (context, me, M4ARG (2), M4ARGLEN (2), &start)
+      && m4_numeric_arg (context, me, M4ARG (3), M4ARGLEN (3), &end))
+    m4_push_forloop (context, obs, M4ARG (1), M4ARGLEN (1), start, end,
+                     M4ARG (4), M4ARGLEN (4));
 }
 
 
@@ -850,7 +1316,7 @@ M4BUILTIN_HANDLER (patsubst)
   pattern = M4ARG (2);
   replace = M4ARG (3);
 
-  buf = regexp_compile (context, me, pattern, M4ARGLEN (2), resyntax);
+  buf = m4_regexp_compile (context, me, pattern, M4ARGLEN (2), resyntax);
   if (!buf)
     return;
 
@@ -921,7 +1387,7 @@ M4BUILTIN_HANDLER (regexp)
       return;
     }
 
-  buf = regexp_compile (context, me, pattern, M4ARGLEN (2), resyntax);
+  buf = m4_regexp_compile (context, me, pattern, M4ARGLEN (2), resyntax);
   if (!buf)
     return;
 
@@ -982,7 +1448,7 @@ M4BUILTIN_HANDLER (renamesyms)
             return;
         }
 
-      buf = regexp_compile (context, me, regexp, regexp_len, resyntax);
+      buf = m4_regexp_compile (context, me, regexp, regexp_len, resyntax);
       if (!buf)
         return;
 
@@ -1030,6 +1496,38 @@ M4BUILTIN_HANDLER (m4modules)
 }
 
 
+/* The builtin "m4stats" reports the runtime counters of --stats.
+   Without arguments, the expansion is a comma separated list of the
+   counter names; with a NAME, it is the current value of that
+   counter.  */
+
+/**
+ * m4stats([NAME])
+ **/
+M4BUILTIN_HANDLER (m4stats)
+{
+  const char *name;
+  size_t value;
+  size_t i;
+
+  if (argc == 1)
+    {
+      for (i = 0; (name = m4_stats_name (i)); i++)
+        {
+          if (i)
+            obstack_1grow (obs, ',');
+          m4_shipout_string (context, obs, name, SIZE_MAX, true);
+        }
+    }
+  else if (m4_stats_get (context, M4ARG (1), M4ARGLEN (1), &value))
+    obstack_printf (obs, "%zu", value);
+  else
+    m4_warn (context, 0, m4_arg_info (argv), _("unknown statistic %s"),
+             quotearg_style_mem (locale_quoting_style, M4ARG (1),
+                                 M4ARGLEN (1)));
+}
+
+
 /* Implementation of "m4symbols".  It builds up a table of pointers to
    symbols, sorts it and ships out the symbol names.  */
 
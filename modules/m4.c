@@ -38,7 +38,6 @@
 
 #include <modules/m4.h>
 
-extern void m4_set_sysval    (int);
 extern void m4_sysval_flush  (m4 *, bool);
 extern void m4_dump_symbols  (m4 *, m4_dump_symbol_data *, size_t,
                               m4_macro_args *, bool);
@@ -47,7 +46,8 @@ extern void m4_make_temp     (m4 *, m4_obstack *, const m4_call_info *,
                               const char *, size_t, bool);
 
 /* Maintain each of the builtins implemented in this modules along
-   with their details in a single table for easy maintenance.
+   with their details in a single table for easy maintenance.  Keep
+   it sorted by name, so that m4_install_builtins need not sort it.
 
            function     macros  blind   side    minargs maxargs */
 #define builtin_functions                                       \
@@ -393,17 +393,11 @@ M4BUILTIN_HANDLER (defn)
 /* This section contains macros to handle the builtins "syscmd"
    and "sysval".  */
 
-/* Exit code from last "syscmd" command.  */
+/* The exit code from the last "syscmd" command is kept in the
+   context, see m4_get_sysval.  */
 /* FIXME - we should preserve this value across freezing.  See
    http://lists.gnu.org/archive/html/bug-m4/2006-06/msg00059.html
    for ideas on how do to that.  */
-static int  m4_sysval = 0;
-
-void
-m4_set_sysval (int value)
-{
-  m4_sysval = value;
-}
 
 /* Flush a given output STREAM.  If REPORT, also print an error
    message and clear the stream error bit.  */
@@ -477,7 +471,7 @@ M4BUILTIN_HANDLER (syscmd)
   /* Optimize the empty command.  */
   if (!*cmd)
     {
-      m4_set_sysval (0);
+      m4_set_sysval (context, 0);
       return;
     }
   m4_sysval_flush (context, false);
@@ -495,21 +489,22 @@ M4BUILTIN_HANDLER (syscmd)
   if (sig_status)
     {
       assert (status == 127);
-      m4_sysval = sig_status << 8;
+      m4_set_sysval (context, sig_status << 8);
     }
   else
     {
       if (status == 127 && errno)
         m4_warn (context, errno, me, _("cannot run command %s"),
                  quotearg_style (locale_quoting_style, cmd));
-      m4_sysval = status;
+      m4_set_sysval (context, status);
     }
+  m4_path_cache_flush (context);
 }
 
 
 M4BUILTIN_HANDLER (sysval)
 {
-  m4_shipout_int (obs, m4_sysval);
+  m4_shipout_int (obs, m4_get_sysval (context));
 }
 
 
@@ -731,6 +726,7 @@ m4_make_temp (m4 *context, m4_obstack *obs, const m4_call_info *caller,
     {
       if (!dir)
         close (fd);
+      m4_path_cache_flush (context);
       /* Remove NUL, then finish quote.  */
       obstack_blank_fast (obs, -1);
       obstack_grow (obs, quotes->str2, quotes->len2);
@@ -825,8 +821,11 @@ M4BUILTIN_HANDLER (m4exit)
   if (exit_code != EXIT_SUCCESS)
     m4_set_exit_failure (exit_code);
 
-  /* Change debug stream back to stderr, to force flushing debug
-     stream and detect any errors.  */
+  /* Write any pending profile and statistics, and change debug
+     stream back to stderr, to force flushing debug stream and detect
+     any errors.  */
+  m4_profile_finish (context);
+  m4_stats_finish (context);
   m4_debug_set_output (context, me, NULL);
   m4_sysval_flush (context, true);
 
@@ -892,17 +891,80 @@ M4BUILTIN_HANDLER (len)
   m4_shipout_int (obs, M4ARGLEN (1));
 }
 
+/* Return the index of the first occurrence of NEEDLE, of length
+   NEEDLE_LEN, in the first argument of ARGV, starting the search
+   OFFSET bytes in, or -1 if there is none.  The argument is searched
+   one segment at a time, so that a $@ reference need not be copied;
+   a window holding the tail of the text seen so far and the head of
+   the next segment catches matches that straddle two segments.  */
+static int
+arg_index (m4 *context, m4_macro_args *argv, size_t offset,
+           const char *needle, size_t needle_len)
+{
+  m4_arg_iter *iter;
+  char *window;
+  size_t kept = 0;
+  size_t pos = offset;
+  const char *text;
+  const char *p;
+  size_t len;
+
+  if (!needle_len)
+    return offset;
+  window = (char *) obstack_alloc (m4_arg_scratch (context),
+                                   2 * (needle_len - 1));
+  iter = m4_arg_iter_start (context, argv, 1, false);
+  while (m4_arg_iter_next (iter, &text, &len))
+    {
+      if (len <= offset)
+        {
+          offset -= len;
+          continue;
+        }
+      text += offset;
+      len -= offset;
+      offset = 0;
+
+      /* Rely on the optimizations guaranteed by gnulib's memmem
+         module.  */
+      if (kept)
+        {
+          size_t head = len < needle_len - 1 ? len : needle_len - 1;
+          memcpy (window + kept, text, head);
+          p = (char *) memmem (window, kept + head, needle, needle_len);
+          if (p)
+            return pos - kept + (p - window);
+        }
+      p = (char *) memmem (text, len, needle, needle_len);
+      if (p)
+        return pos + (p - text);
+
+      /* Keep the last NEEDLE_LEN - 1 bytes seen.  */
+      if (needle_len - 1 <= len)
+        {
+          kept = needle_len - 1;
+          memcpy (window, text + len - kept, kept);
+        }
+      else
+        {
+          size_t drop = (needle_len - 1 < kept + len
+                         ? kept + len - (needle_len - 1) : 0);
+          memmove (window, window + drop, kept - drop);
+          memcpy (window + kept - drop, text, len);
+          kept += len - drop;
+        }
+      pos += len;
+    }
+  return -1;
+}
+
 /* The macro expands to the first index of the second argument in the
    first argument.  As an extension, start the search at the index
    indicated by the third argument.  */
 M4BUILTIN_HANDLER (index)
 {
-  const char *haystack = M4ARG (1);
   size_t haystack_len = M4ARGLEN (1);
-  const char *needle = M4ARG (2);
-  const char *result = NULL;
   int offset = 0;
-  int retval = -1;
 
   if (!m4_arg_empty (argv, 3) && !m4_numeric_arg (context, m4_arg_info (argv),
                                                   M4ARG (3), M4ARGLEN (3),
@@ -920,14 +982,8 @@ M4BUILTIN_HANDLER (index)
       return;
     }
 
-  /* Rely on the optimizations guaranteed by gnulib's memmem
-     module.  */
-  result = (char *) memmem (haystack + offset, haystack_len - offset, needle,
-                            M4ARGLEN (2));
-  if (result)
-    retval = result - haystack;
-
-  m4_shipout_int (obs, retval);
+  m4_shipout_int (obs, arg_index (context, argv, offset, M4ARG (2),
+                                  M4ARGLEN (2)));
 }
 
 /* The macro "substr" extracts substrings from the first argument,
@@ -941,7 +997,6 @@ M4BUILTIN_HANDLER (index)
 M4BUILTIN_HANDLER (substr)
 {
   const m4_call_info *me = m4_arg_info (argv);
-  const char *str = M4ARG (1);
   int start = 0;
   int end;
   int length;
@@ -985,9 +1040,9 @@ M4BUILTIN_HANDLER (substr)
         start = 0;
       if (length < end)
         end = length;
-      obstack_grow (obs, str, start);
+      m4_arg_grow (context, obs, argv, 1, 0, start);
       m4_push_arg (context, obs, argv, 4);
-      obstack_grow (obs, str + end, length - end);
+      m4_arg_grow (context, obs, argv, 1, end, length - end);
       return;
     }
 
@@ -998,7 +1053,7 @@ M4BUILTIN_HANDLER (substr)
   if (end <= start)
     return;
 
-  obstack_grow (obs, str + start, end - start);
+  m4_arg_grow (context, obs, argv, 1, start, end - start);
 }
 
 
@@ -1049,6 +1104,122 @@ m4_expand_ranges (const char *s, size_t *len, m4_obstack *obs)
   return (char *) obstack_finish (obs);
 }
 
+/* A compiled translit mapping, for the FROM and TO arguments, as
+   given before range expansion, that are kept in KEY.  */
+typedef struct {
+  char *key;                    /* FROM followed by TO */
+  size_t from_len;              /* length of FROM within key */
+  size_t to_len;                /* length of TO within key */
+  bool deletes;                 /* true if any byte of del is set */
+  char map[UCHAR_MAX + 1];      /* replacement for each byte */
+  char del[UCHAR_MAX + 1];      /* 1 for each byte to be deleted */
+} translit_map;
+
+/* Macros such as case conversion helpers call translit with the same
+   FROM and TO over and over, so keep the last few maps compiled, most
+   recently used first.  */
+#define TRANSLIT_CACHE_SIZE 4
+static M4_THREAD_LOCAL translit_map *translit_cache[TRANSLIT_CACHE_SIZE];
+
+/* Release translit_cache when its thread exits.  */
+static void
+translit_cleanup (void)
+{
+  size_t i;
+
+  for (i = 0; i < TRANSLIT_CACHE_SIZE && translit_cache[i]; i++)
+    {
+      free (translit_cache[i]->key);
+      free (translit_cache[i]);
+      translit_cache[i] = NULL;
+    }
+}
+
+/* Return the map translating FROM of length FROM_LEN into TO of length
+   TO_LEN, compiling it with the help of the scratch obstack OBS unless
+   it is in translit_cache.  */
+static const translit_map *
+translit_compile (const char *from, size_t from_len, const char *to,
+                  size_t to_len, m4_obstack *obs)
+{
+  translit_map *tr;
+  size_t i;
+  unsigned char ch;
+  char found[UCHAR_MAX + 1];
+
+  for (i = 0; i < TRANSLIT_CACHE_SIZE && translit_cache[i]; i++)
+    {
+      tr = translit_cache[i];
+      if (tr->from_len == from_len && tr->to_len == to_len
+          && memcmp (tr->key, from, from_len) == 0
+          && memcmp (tr->key + from_len, to, to_len) == 0)
+        {
+          memmove (&translit_cache[1], &translit_cache[0],
+                   i * sizeof *translit_cache);
+          translit_cache[0] = tr;
+          return tr;
+        }
+    }
+
+  /* Recycle the least recently used map.  */
+  if (i == TRANSLIT_CACHE_SIZE)
+    {
+      tr = translit_cache[--i];
+      free (tr->key);
+    }
+  else
+    {
+      if (i == 0)
+        m4_thread_cleanup (translit_cleanup);
+      tr = (translit_map *) xmalloc (sizeof *tr);
+    }
+  memmove (&translit_cache[1], &translit_cache[0],
+           i * sizeof *translit_cache);
+  translit_cache[0] = tr;
+
+  tr->key = xcharalloc (from_len + to_len);
+  memcpy (tr->key, from, from_len);
+  memcpy (tr->key + from_len, to, to_len);
+  tr->from_len = from_len;
+  tr->to_len = to_len;
+
+  if (memchr (to, '-', to_len) != NULL)
+    to = m4_expand_ranges (to, &to_len, obs);
+  if (memchr (from, '-', from_len) != NULL)
+    from = m4_expand_ranges (from, &from_len, obs);
+
+  /* Calling memchr(from) for each character in data is quadratic,
+     since both strings can be arbitrarily long.  Instead, create a
+     from-to mapping in one pass of from, then use that map in one
+     pass of data, for linear behavior.  Traditional behavior is that
+     only the first instance of a character in from is consulted,
+     hence the found map.  */
+  for (i = 0; i <= UCHAR_MAX; i++)
+    tr->map[i] = i;
+  memset (tr->del, 0, sizeof tr->del);
+  memset (found, 0, sizeof found);
+  tr->deletes = false;
+  while (from_len--)
+    {
+      ch = *from++;
+      if (!found[ch])
+        {
+          found[ch] = 1;
+          if (to_len)
+            tr->map[ch] = *to;
+          else
+            tr->del[ch] = 1;
+          tr->deletes |= !to_len;
+        }
+      if (to_len)
+        {
+          to++;
+          to_len--;
+        }
+    }
+  return tr;
+}
+
 /* The macro "translit" translates all characters in the first
    argument, which are present in the second argument, into the
    corresponding character from the third argument.  If the third
@@ -1056,16 +1227,18 @@ m4_expand_ranges (const char *s, size_t *len, m4_obstack *obs)
    second argument are deleted from the first.  */
 M4BUILTIN_HANDLER (translit)
 {
+  m4_arg_iter *iter;
   const char *data;
   const char *from;
   const char *to;
   size_t from_len;
   size_t to_len;
-  char map[UCHAR_MAX + 1];
-  char found[UCHAR_MAX + 1];
-  unsigned char ch;
-
-  enum { ASIS, REPLACE, DELETE };
+  size_t len;
+  size_t size;
+  const translit_map *tr;
+  char *dest;
+  char *end;
+  size_t i;
 
   if (m4_arg_empty (argv, 1) || m4_arg_empty (argv, 2))
     {
@@ -1078,8 +1251,6 @@ M4BUILTIN_HANDLER (translit)
 
   to = M4ARG (3);
   to_len = M4ARGLEN (3);
-  if (memchr (to, '-', to_len) != NULL)
-    to = m4_expand_ranges (to, &to_len, m4_arg_scratch (context));
 
   /* If there are only one or two bytes to replace, it is faster to
      use memchr2.  Using expand_ranges does nothing unless there are
@@ -1087,78 +1258,60 @@ M4BUILTIN_HANDLER (translit)
   if (from_len <= 2)
     {
       const char *p;
-      size_t len = M4ARGLEN (1);
       int second = from[from_len / 2];
-      data = M4ARG (1);
-      while ((p = (char *) memchr2 (data, from[0], second, len)))
-        {
-          obstack_grow (obs, data, p - data);
-          len -= p - data + 1;
-          data = p + 1;
-          if (*p == from[0] && to_len)
-            obstack_1grow (obs, to[0]);
-          else if (*p == second && 1 < to_len)
-            obstack_1grow (obs, to[1]);
-        }
-      obstack_grow (obs, data, len);
-      return;
-    }
-
-  if (memchr (from, '-', from_len) != NULL)
-    from = m4_expand_ranges (from, &from_len, m4_arg_scratch (context));
-
-  /* Calling memchr(from) for each character in data is quadratic,
-     since both strings can be arbitrarily long.  Instead, create a
-     from-to mapping in one pass of from, then use that map in one
-     pass of data, for linear behavior.  Traditional behavior is that
-     only the first instance of a character in from is consulted,
-     hence the found map.  */
-  memset (map, 0, sizeof map);
-  memset (found, 0, sizeof found);
-  while (from_len--)
-    {
-      ch = *from++;
-      if (found[ch] == ASIS)
+      if (memchr (to, '-', to_len) != NULL)
+        to = m4_expand_ranges (to, &to_len, m4_arg_scratch (context));
+      iter = m4_arg_iter_start (context, argv, 1, false);
+      while (m4_arg_iter_next (iter, &data, &len))
         {
-          if (to_len)
+          while ((p = (char *) memchr2 (data, from[0], second, len)))
             {
-              found[ch] = REPLACE;
-              map[ch] = *to;
+              obstack_grow (obs, data, p - data);
+              len -= p - data + 1;
+              data = p + 1;
+              if (*p == from[0] && to_len)
+                obstack_1grow (obs, to[0]);
+              else if (*p == second && 1 < to_len)
+                obstack_1grow (obs, to[1]);
             }
-          else
-            found[ch] = DELETE;
-        }
-      if (to_len)
-        {
-          to++;
-          to_len--;
+          obstack_grow (obs, data, len);
         }
+      return;
     }
 
-  data = M4ARG (1);
-  from_len = M4ARGLEN (1);
-  while (from_len--)
+  tr = translit_compile (from, from_len, to, to_len,
+                         m4_arg_scratch (context));
+
+  /* Translate straight into room reserved on OBS, one segment of the
+     argument at a time.  Deleted bytes are still stored, but the
+     destination only advances past bytes that are kept, which avoids
+     a branch per byte; the unused room is given back afterwards.  */
+  size = M4ARGLEN (1);
+  obstack_blank (obs, size);
+  dest = (char *) obstack_next_free (obs) - size;
+  iter = m4_arg_iter_start (context, argv, 1, false);
+  end = dest;
+  while (m4_arg_iter_next (iter, &data, &len))
     {
-      ch = *data++;
-      switch (found[ch])
+      if (!tr->deletes)
         {
-        case ASIS:
-          obstack_1grow (obs, ch);
-          break;
-        case REPLACE:
-          obstack_1grow (obs, map[ch]);
-          break;
-        case DELETE:
-          break;
-        default:
-          assert (!"translit");
-          abort ();
+          for (i = 0; i < len; i++)
+            end[i] = tr->map[to_uchar (data[i])];
+          end += len;
         }
+      else
+        for (i = 0; i < len; i++)
+          {
+            unsigned char ch = data[i];
+            *end = tr->map[ch];
+            end += 1 - tr->del[ch];
+          }
     }
+  obstack_blank_fast (obs, end - (dest + size));
 }
 
 
-
+
 /* The rest of this file contains the functions to evaluate integer
  * expressions for the "eval" macro.  `number' should be at least 32 bits.
  */
@@ -1238,7 +1391,7 @@ ntoa (number value, int radix)
   bool negative;
   unumber uvalue;
   /* Sized for radix 2, plus sign and trailing NUL.  */
-  static char str[sizeof value * CHAR_BIT + 2];
+  static M4_THREAD_LOCAL char str[sizeof value * CHAR_BIT + 2];
   char *s = &str[sizeof str];
 
   *--s = '\0';
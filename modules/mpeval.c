@@ -32,6 +32,8 @@
 #  include <gmp.h>
 #endif
 
+#include "intprops.h"
+
 /* Maintain each of the builtins implemented in this modules along
    with their details in a single table for easy maintenance.
 
@@ -41,59 +43,44 @@
 
 
 
-#define numb_set(ans, i) mpq_set (ans, i)
-#define numb_set_si(ans, i) mpq_set_si (*(ans), (long) i, (unsigned long) 1)
+/* Numbers are kept as native long ints while they fit, and are only
+   promoted to GMP rationals when an operation overflows or produces a
+   fraction.  Results that become integral and fit again are demoted,
+   so a small value is never big.  */
+#define numb_set(ans, x) numb_assign (&(ans), x)
+#define numb_set_si(ans, i) numb_assign_si (ans, (long int) (i))
 
-#define numb_init(x) mpq_init (x)
-#define numb_fini(x) mpq_clear (x)
+#define numb_init(x) ((x).big = false, (x).small = 0)
+#define numb_fini(x) ((x).big ? mpq_clear ((x).q) : (void) 0)
 
-#define numb_zerop(x)     (mpq_cmp (x, numb_ZERO) == 0)
-#define numb_positivep(x) (mpq_cmp (x, numb_ZERO) >  0)
-#define numb_negativep(x) (mpq_cmp (x, numb_ZERO) <  0)
+#define numb_zerop(x)     (numb_sign (&(x)) == 0)
+#define numb_positivep(x) (numb_sign (&(x)) >  0)
+#define numb_negativep(x) (numb_sign (&(x)) <  0)
 
-#define numb_eq(x, y) numb_set (x, mpq_cmp (x, y) == 0 ? numb_ONE : numb_ZERO)
-#define numb_ne(x, y) numb_set (x, mpq_cmp (x, y) != 0 ? numb_ONE : numb_ZERO)
-#define numb_lt(x, y) numb_set (x, mpq_cmp (x, y) <  0 ? numb_ONE : numb_ZERO)
-#define numb_le(x, y) numb_set (x, mpq_cmp (x, y) <= 0 ? numb_ONE : numb_ZERO)
-#define numb_gt(x, y) numb_set (x, mpq_cmp (x, y) >  0 ? numb_ONE : numb_ZERO)
-#define numb_ge(x, y) numb_set (x, mpq_cmp (x, y) >= 0 ? numb_ONE : numb_ZERO)
+#define numb_eq(x, y) numb_set_si (&(x), numb_cmp (&(x), &(y)) == 0)
+#define numb_ne(x, y) numb_set_si (&(x), numb_cmp (&(x), &(y)) != 0)
+#define numb_lt(x, y) numb_set_si (&(x), numb_cmp (&(x), &(y)) <  0)
+#define numb_le(x, y) numb_set_si (&(x), numb_cmp (&(x), &(y)) <= 0)
+#define numb_gt(x, y) numb_set_si (&(x), numb_cmp (&(x), &(y)) >  0)
+#define numb_ge(x, y) numb_set_si (&(x), numb_cmp (&(x), &(y)) >= 0)
 
-#define numb_lnot(x)    numb_set (x, numb_zerop (x) ? numb_ONE : numb_ZERO)
+#define numb_lnot(x)    numb_set_si (&(x), numb_zerop (x))
 #define numb_lior(x, y) numb_set (x, numb_zerop (x) ? y : x)
 #define numb_land(x, y) numb_set (x, numb_zerop (x) ? numb_ZERO : y)
 
-#define reduce1(f1, x)                                                  \
-  do                                                                    \
-    {                                                                   \
-      number T;                                                         \
-      mpq_init (T);                                                     \
-      f1 (T, x);                                                        \
-      mpq_set (x, T);                                                   \
-      mpq_clear (T);                                                    \
-    }                                                                   \
-  while (0)
-#define reduce2(f2,x,y)                                                 \
-  do                                                                    \
-    {                                                                   \
-      number T;                                                         \
-      mpq_init (T);                                                     \
-      f2 (T, (x), (y));                                                 \
-      mpq_set ((x), T);                                                 \
-      mpq_clear (T);                                                    \
-    }                                                                   \
-  while (0)
-
-#define numb_plus(x, y)  reduce2 (mpq_add, x, y)
-#define numb_minus(x, y) reduce2 (mpq_sub, x, y)
-#define numb_negate(x)   reduce1 (mpq_neg, x)
-
-#define numb_times(x, y) reduce2 (mpq_mul, x, y)
-#define numb_ratio(x, y) reduce2 (mpq_div, x, y)
-#define numb_invert(x)   reduce1 (mpq_inv, x)
+#define numb_plus(x, y)  numb_add (&(x), &(y))
+#define numb_minus(x, y) numb_sub (&(x), &(y))
+#define numb_negate(x)   numb_neg (&(x))
+
+#define numb_times(x, y) numb_mul (&(x), &(y))
+#define numb_ratio(x, y) numb_quotient (&(x), &(y))
+#define numb_invert(x)   numb_inv (&(x))
 
 #define numb_incr(n) numb_plus  (n, numb_ONE)
 #define numb_decr(n) numb_minus (n, numb_ONE)
 
+
+
 /* Generate prototypes for each builtin handler function. */
 #define BUILTIN(handler, macros, blind, side, min, max)  M4BUILTIN (handler)
   builtin_functions
@@ -129,31 +116,56 @@ include_mpeval (m4 *context, m4_module *module, m4_obstack *obs)
   m4_install_macros   (context, module, m4_macro_table);
 }
 
-
-/* GMP defines mpq_t as a 1-element array of struct.  Therefore, `mpq_t'
-   is not compatible with `const mpq_t'.  */
-typedef mpq_t number;
+/* GMP defines mpq_t as a 1-element array of struct, so it can be
+   embedded in a structure, but is only initialized while BIG.  */
+typedef struct
+{
+  bool big;                     /* True if Q holds the value.  */
+  long int small;               /* The value, unless BIG.  */
+  mpq_t q;                      /* The value, if BIG.  */
+}
+number;
 
 static void numb_initialise (void);
 static void numb_obstack (m4_obstack *obs, const number value,
                           const int radix, int min);
-static void mpq2mpz (m4 *context, mpz_t z, const number q, const char *noisily);
-static void mpz2mpq (number q, const mpz_t z);
+static void numb_promote (number *x);
+static void numb_demote (number *x);
+static mpq_srcptr numb_mpq (const number *x, mpq_t tmp);
+static void numb_apply (void (*f2) (mpq_ptr, mpq_srcptr, mpq_srcptr),
+                        number *x, const number *y);
+static void numb_assign (number *ans, const number x);
+static void numb_assign_si (number *ans, long int i);
+static int numb_sign (const number *x);
+static int numb_cmp (const number *x, const number *y);
+static void numb_add (number *x, const number *y);
+static void numb_sub (number *x, const number *y);
+static void numb_neg (number *x);
+static void numb_mul (number *x, const number *y);
+static void numb_quotient (number *x, const number *y);
+static void numb_inv (number *x);
+static void mpq2mpz (m4 *context, mpz_t z, const number *q,
+                     const char *noisily);
+static void mpz2mpq (number *q, const mpz_t z);
 static void numb_divide (number *x, number *y);
 static void numb_modulo (m4 *context, number *x, number *y);
 static void numb_and (m4 *context, number *x, number *y);
 static void numb_ior (m4 *context, number *x, number *y);
 static void numb_eor (m4 *context, number *x, number *y);
 static void numb_not (m4 *context, number *x);
+static bool numb_small_shift (number *x, long int count);
 static void numb_lshift (m4 *context, number *x, number *y);
 static void numb_rshift (m4 *context, number *x, number *y);
 #define numb_urshift(c, x, y) numb_rshift (c, x, y)
-
 
-static number numb_ZERO;
-static number numb_ONE;
+/* Largest shift count that is done on a small number.  */
+#define SMALL_SHIFT (sizeof (long int) * CHAR_BIT - 2)
+
 
-static int numb_initialised = 0;
+static M4_THREAD_LOCAL number numb_ZERO;
+static M4_THREAD_LOCAL number numb_ONE;
+
+static M4_THREAD_LOCAL int numb_initialised = 0;
 
 static void
 numb_initialise (void)
@@ -178,9 +190,36 @@ numb_obstack (m4_obstack *obs, const number value, const int radix,
   size_t len;
 
   mpz_t i;
+  mpq_t tmp;
+
+  if (!value.big && 2 <= radix)
+    {
+      /* Sized for radix 2.  */
+      char str[sizeof value.small * CHAR_BIT];
+      unsigned long int u = value.small;
+      char *p = &str[sizeof str];
+
+      if (value.small < 0)
+        {
+          obstack_1grow (obs, '-');
+          u = -u;
+        }
+      do
+        *--p = "0123456789abcdefghijklmnopqrstuvwxyz"[u % radix];
+      while ((u /= radix) != 0);
+
+      len = &str[sizeof str] - p;
+      for (min -= len; --min >= 0;)
+        obstack_1grow (obs, '0');
+
+      obstack_grow (obs, p, len);
+      return;
+    }
+
   mpz_init (i);
+  mpq_init (tmp);
 
-  mpq_get_num (i, value);
+  mpq_get_num (i, numb_mpq (&value, tmp));
   s = mpz_get_str (NULL, radix, i);
 
   if (*s == '-')
@@ -194,7 +233,7 @@ numb_obstack (m4_obstack *obs, const number value, const int radix,
 
   obstack_grow (obs, s, len);
 
-  mpq_get_den (i, value);
+  mpq_get_den (i, numb_mpq (&value, tmp));
   if (mpz_cmp_si (i, (long) 1) != 0)
     {
       obstack_1grow (obs, '\\');
@@ -202,42 +241,243 @@ numb_obstack (m4_obstack *obs, const number value, const int radix,
       obstack_grow (obs, s, strlen (s));
     }
 
+  mpq_clear (tmp);
   mpz_clear (i);
 }
 
+/* Make X hold its value in an mpq_t.  */
+static void
+numb_promote (number *x)
+{
+  if (!x->big)
+    {
+      mpq_init (x->q);
+      mpq_set_si (x->q, x->small, (unsigned long) 1);
+      x->big = true;
+    }
+}
+
+/* Make X small again, if its value is an integer that fits.  */
+static void
+numb_demote (number *x)
+{
+  if (x->big && mpz_cmp_si (mpq_denref (x->q), (long) 1) == 0
+      && mpz_fits_slong_p (mpq_numref (x->q)))
+    {
+      long int i = mpz_get_si (mpq_numref (x->q));
+      mpq_clear (x->q);
+      x->big = false;
+      x->small = i;
+    }
+}
+
+/* Return the value of X as an mpq_t, using TMP, which must already be
+   initialized, if X is small.  */
+static mpq_srcptr
+numb_mpq (const number *x, mpq_t tmp)
+{
+  if (x->big)
+    return x->q;
+  mpq_set_si (tmp, x->small, (unsigned long) 1);
+  return tmp;
+}
+
+/* Set X to F2 (X, Y), computed with GMP.  */
+static void
+numb_apply (void (*f2) (mpq_ptr, mpq_srcptr, mpq_srcptr), number *x,
+            const number *y)
+{
+  mpq_t tmp;
+
+  mpq_init (tmp);
+  numb_promote (x);
+  f2 (x->q, x->q, numb_mpq (y, tmp));
+  mpq_clear (tmp);
+  numb_demote (x);
+}
+
+static void
+numb_assign (number *ans, const number x)
+{
+  if (x.big)
+    {
+      if (!ans->big)
+        {
+          mpq_init (ans->q);
+          ans->big = true;
+        }
+      mpq_set (ans->q, x.q);
+    }
+  else
+    numb_assign_si (ans, x.small);
+}
+
+static void
+numb_assign_si (number *ans, long int i)
+{
+  if (ans->big)
+    {
+      mpq_clear (ans->q);
+      ans->big = false;
+    }
+  ans->small = i;
+}
+
+static int
+numb_sign (const number *x)
+{
+  if (x->big)
+    return mpq_sgn (x->q);
+  return (x->small > 0) - (x->small < 0);
+}
+
+static int
+numb_cmp (const number *x, const number *y)
+{
+  int cmp;
+
+  if (!x->big && !y->big)
+    return (x->small > y->small) - (x->small < y->small);
+  if (!y->big)
+    return mpq_cmp_si (x->q, y->small, (unsigned long) 1);
+  if (!x->big)
+    {
+      cmp = mpq_cmp_si (y->q, x->small, (unsigned long) 1);
+      return (cmp < 0) - (cmp > 0);
+    }
+  return mpq_cmp (x->q, y->q);
+}
+
+static void
+numb_add (number *x, const number *y)
+{
+  long int result;
+
+  /* On overflow, RESULT is the wrapped value and must be discarded.  */
+  if (!x->big && !y->big && !INT_ADD_WRAPV (x->small, y->small, &result))
+    x->small = result;
+  else
+    numb_apply (mpq_add, x, y);
+}
+
+static void
+numb_sub (number *x, const number *y)
+{
+  long int result;
+
+  if (!x->big && !y->big
+      && !INT_SUBTRACT_WRAPV (x->small, y->small, &result))
+    x->small = result;
+  else
+    numb_apply (mpq_sub, x, y);
+}
+
+static void
+numb_neg (number *x)
+{
+  if (!x->big && x->small != LONG_MIN)
+    x->small = -x->small;
+  else
+    {
+      numb_promote (x);
+      mpq_neg (x->q, x->q);
+      numb_demote (x);
+    }
+}
+
+static void
+numb_mul (number *x, const number *y)
+{
+  long int result;
+
+  if (!x->big && !y->big
+      && !INT_MULTIPLY_WRAPV (x->small, y->small, &result))
+    x->small = result;
+  else
+    numb_apply (mpq_mul, x, y);
+}
+
+static void
+numb_quotient (number *x, const number *y)
+{
+  /* Avoid LONG_MIN / -1, which overflows.  */
+  if (!x->big && !y->big && y->small != 0 && y->small != -1
+      && x->small % y->small == 0)
+    x->small /= y->small;
+  else
+    numb_apply (mpq_div, x, y);
+}
+
+static void
+numb_inv (number *x)
+{
+  if (x->big || (x->small != 1 && x->small != -1))
+    {
+      numb_promote (x);
+      mpq_inv (x->q, x->q);
+      numb_demote (x);
+    }
+}
+
 #define NOISY ""
 #define QUIET (char *)0
 
 static void
-mpq2mpz (m4 *context, mpz_t z, const number q, const char *noisily)
+mpq2mpz (m4 *context, mpz_t z, const number *q, const char *noisily)
 {
-  if (noisily && mpz_cmp_si (mpq_denref (q), (long) 1) != 0)
+  if (!q->big)
+    {
+      mpz_set_si (z, q->small);
+      return;
+    }
+
+  if (noisily && mpz_cmp_si (mpq_denref (q->q), (long) 1) != 0)
     m4_warn (context, 0, NULL, _("loss of precision in eval: %s"), noisily);
 
-  mpz_div (z, mpq_numref (q), mpq_denref (q));
+  mpz_div (z, mpq_numref (q->q), mpq_denref (q->q));
 }
 
 static void
-mpz2mpq (number q, const mpz_t z)
+mpz2mpq (number *q, const mpz_t z)
 {
-  mpq_set_si (q, (long) 0, (unsigned long) 1);
-  mpq_set_num (q, z);
+  if (mpz_fits_slong_p (z))
+    {
+      numb_assign_si (q, mpz_get_si (z));
+      return;
+    }
+
+  numb_promote (q);
+  mpq_set_si (q->q, (long) 0, (unsigned long) 1);
+  mpq_set_num (q->q, z);
 }
 
 static void
 numb_divide (number * x, number * y)
 {
-  mpq_t qres;
+  mpq_t qres, tmp;
   mpz_t zres;
 
+  if (!x->big && !y->big && y->small != -1)
+    {
+      /* Round towards negative infinity, like mpz_div.  */
+      long int quot = x->small / y->small;
+      if (x->small % y->small != 0 && (x->small < 0) != (y->small < 0))
+        quot--;
+      x->small = quot;
+      return;
+    }
+
   mpq_init (qres);
-  mpq_div (qres, *x, *y);
+  mpq_init (tmp);
+  numb_promote (x);
+  mpq_div (qres, x->q, numb_mpq (y, tmp));
+  mpq_clear (tmp);
 
   mpz_init (zres);
   mpz_div (zres, mpq_numref (qres), mpq_denref (qres));
   mpq_clear (qres);
 
-  mpz2mpq (*x, zres);
+  mpz2mpq (x, zres);
   mpz_clear (zres);
 }
 
@@ -246,14 +486,24 @@ numb_modulo (m4 *context, number * x, number * y)
 {
   mpz_t xx, yy, res;
 
+  if (!x->big && !y->big)
+    {
+      /* The result of mpz_mod is never negative.  */
+      long int rem = y->small == -1 ? 0 : x->small % y->small;
+      if (rem < 0)
+        rem = y->small < 0 ? rem - y->small : rem + y->small;
+      x->small = rem;
+      return;
+    }
+
   /* x should be integral */
   /* y should be integral */
 
   mpz_init (xx);
-  mpq2mpz (context, xx, *x, NOISY);
+  mpq2mpz (context, xx, x, NOISY);
 
   mpz_init (yy);
-  mpq2mpz (context, yy, *y, NOISY);
+  mpq2mpz (context, yy, y, NOISY);
 
   mpz_init (res);
   mpz_mod (res, xx, yy);
@@ -261,23 +511,54 @@ numb_modulo (m4 *context, number * x, number * y)
   mpz_clear (xx);
   mpz_clear (yy);
 
-  mpz2mpq (*x, res);
+  mpz2mpq (x, res);
   mpz_clear (res);
 }
 
+
+/* Shift the small number X left by COUNT bits, or right if COUNT is
+   negative, rounding towards negative infinity like mpz_div_2exp.
+   Return false, leaving X alone, if the result might not fit.  */
+static bool
+numb_small_shift (number *x, long int count)
+{
+  if (0 <= count && count <= (long int) SMALL_SHIFT)
+    {
+      if (x->small < LONG_MIN / (1L << count)
+          || LONG_MAX / (1L << count) < x->small)
+        return false;
+      x->small *= 1L << count;
+      return true;
+    }
+  if (count < 0 && -count <= (long int) SMALL_SHIFT)
+    {
+      x->small = (x->small < 0 ? ~(~x->small >> -count)
+                  : x->small >> -count);
+      return true;
+    }
+  return false;
+}
+
+
 static void
 numb_and (m4 *context, number * x, number * y)
 {
   mpz_t xx, yy, res;
 
+  if (!x->big && !y->big)
+    {
+      x->small &= y->small;
+      return;
+    }
+
   /* x should be integral */
   /* y should be integral */
 
   mpz_init (xx);
-  mpq2mpz (context, xx, *x, NOISY);
+  mpq2mpz (context, xx, x, NOISY);
 
   mpz_init (yy);
-  mpq2mpz (context, yy, *y, NOISY);
+  mpq2mpz (context, yy, y, NOISY);
 
   mpz_init (res);
   mpz_and (res, xx, yy);
@@ -285,7 +566,7 @@ numb_and (m4 *context, number * x, number * y)
   mpz_clear (xx);
   mpz_clear (yy);
 
-  mpz2mpq (*x, res);
+  mpz2mpq (x, res);
   mpz_clear (res);
 }
 
@@ -294,14 +575,20 @@ numb_ior (m4 *context, number * x, number * y)
 {
   mpz_t xx, yy, res;
 
+  if (!x->big && !y->big)
+    {
+      x->small |= y->small;
+      return;
+    }
+
   /* x should be integral */
   /* y should be integral */
 
   mpz_init (xx);
-  mpq2mpz (context, xx, *x, NOISY);
+  mpq2mpz (context, xx, x, NOISY);
 
   mpz_init (yy);
-  mpq2mpz (context, yy, *y, NOISY);
+  mpq2mpz (context, yy, y, NOISY);
 
   mpz_init (res);
   mpz_ior (res, xx, yy);
@@ -309,7 +596,7 @@ numb_ior (m4 *context, number * x, number * y)
   mpz_clear (xx);
   mpz_clear (yy);
 
-  mpz2mpq (*x, res);
+  mpz2mpq (x, res);
   mpz_clear (res);
 }
 
@@ -318,14 +605,20 @@ numb_eor (m4 *context, number * x, number * y)
 {
   mpz_t xx, yy, res;
 
+  if (!x->big && !y->big)
+    {
+      x->small ^= y->small;
+      return;
+    }
+
   /* x should be integral */
   /* y should be integral */
 
   mpz_init (xx);
-  mpq2mpz (context, xx, *x, NOISY);
+  mpq2mpz (context, xx, x, NOISY);
 
   mpz_init (yy);
-  mpq2mpz (context, yy, *y, NOISY);
+  mpq2mpz (context, yy, y, NOISY);
 
   mpz_init (res);
 
@@ -356,7 +649,7 @@ numb_eor (m4 *context, number * x, number * y)
   mpz_clear (xx);
   mpz_clear (yy);
 
-  mpz2mpq (*x, res);
+  mpz2mpq (x, res);
   mpz_clear (res);
 }
 
@@ -365,17 +658,23 @@ numb_not (m4 *context, number * x)
 {
   mpz_t xx, res;
 
+  if (!x->big)
+    {
+      x->small = ~x->small;
+      return;
+    }
+
   /* x should be integral */
 
   mpz_init (xx);
-  mpq2mpz (context, xx, *x, NOISY);
+  mpq2mpz (context, xx, x, NOISY);
 
   mpz_init (res);
   mpz_com (res, xx);
 
   mpz_clear (xx);
 
-  mpz2mpq (*x, res);
+  mpz2mpq (x, res);
   mpz_clear (res);
 }
 
@@ -384,14 +683,17 @@ numb_lshift (m4 *context, number * x, number * y)
 {
   mpz_t xx, yy, res;
 
+  if (!x->big && !y->big && numb_small_shift (x, y->small))
+    return;
+
   /* x should be integral */
   /* y should be integral */
 
   mpz_init (xx);
-  mpq2mpz (context, xx, *x, NOISY);
+  mpq2mpz (context, xx, x, NOISY);
 
   mpz_init (yy);
-  mpq2mpz (context, yy, *y, NOISY);
+  mpq2mpz (context, yy, y, NOISY);
 
   mpz_init (res);
   {
@@ -410,7 +712,7 @@ numb_lshift (m4 *context, number * x, number * y)
   mpz_clear (xx);
   mpz_clear (yy);
 
-  mpz2mpq (*x, res);
+  mpz2mpq (x, res);
   mpz_clear (res);
 }
 
@@ -419,14 +721,18 @@ numb_rshift (m4 *context, number * x, number * y)
 {
   mpz_t xx, yy, res;
 
+  if (!x->big && !y->big && y->small != LONG_MIN
+      && numb_small_shift (x, -y->small))
+    return;
+
   /* x should be integral */
   /* y should be integral */
 
   mpz_init (xx);
-  mpq2mpz (context, xx, *x, NOISY);
+  mpq2mpz (context, xx, x, NOISY);
 
   mpz_init (yy);
-  mpq2mpz (context, yy, *y, NOISY);
+  mpq2mpz (context, yy, y, NOISY);
 
   mpz_init (res);
   {
@@ -445,9 +751,10 @@ numb_rshift (m4 *context, number * x, number * y)
   mpz_clear (xx);
   mpz_clear (yy);
 
-  mpz2mpq (*x, res);
+  mpz2mpq (x, res);
   mpz_clear (res);
 }
 
+
 #define m4_evaluate     builtin_mpeval
 #include "evalparse.c"
@@ -36,22 +36,25 @@
 #  include "m4private.h"
 #endif
 
-/*         function     macros  blind   side    minargs maxargs */
+/* Keep this table sorted by name, so that m4_install_builtins need
+   not sort it.
+
+           function     macros  blind   side    minargs maxargs */
 #define builtin_functions                                       \
     BUILTIN (getcwd,    false,  false,  false,  0,      0  )    \
     BUILTIN (getenv,    false,  true,   false,  1,      1  )    \
     BUILTIN (getlogin,  false,  false,  false,  0,      0  )    \
     BUILTIN (getpid,    false,  false,  false,  0,      0  )    \
     BUILTIN (getppid,   false,  false,  false,  0,      0  )    \
-    BUILTIN (getuid,    false,  false,  false,  0,      0  )    \
     BUILTIN (getpwnam,  false,  true,   false,  1,      1  )    \
     BUILTIN (getpwuid,  false,  true,   false,  1,      1  )    \
+    BUILTIN (getuid,    false,  false,  false,  0,      0  )    \
     BUILTIN (hostname,  false,  false,  false,  0,      0  )    \
     BUILTIN (rand,      false,  false,  false,  0,      0  )    \
-    BUILTIN (srand,     false,  false,  false,  0,      1  )    \
     BUILTIN (setenv,    false,  true,   false,  2,      3  )    \
-    BUILTIN (unsetenv,  false,  true,   false,  1,      1  )    \
+    BUILTIN (srand,     false,  false,  false,  0,      1  )    \
     BUILTIN (uname,     false,  false,  false,  0,      0  )    \
+    BUILTIN (unsetenv,  false,  true,   false,  1,      1  )    \
 
 
 #define BUILTIN(handler, macros, blind, side, min, max) M4BUILTIN (handler);
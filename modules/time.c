@@ -34,10 +34,13 @@
 #  include "m4private.h"
 #endif
 
-/*         function     macros  blind   side    minargs maxargs */
+/* Keep this table sorted by name, so that m4_install_builtins need
+   not sort it.
+
+           function     macros  blind   side    minargs maxargs */
 #define builtin_functions                                       \
-  BUILTIN (currenttime, false,  false,  false,  0,      0  )    \
   BUILTIN (ctime,       false,  false,  false,  0,      1  )    \
+  BUILTIN (currenttime, false,  false,  false,  0,      0  )    \
   BUILTIN (gmtime,      false,  true,   false,  1,      1  )    \
   BUILTIN (localtime,   false,  true,   false,  1,      1  )    \
 
@@ -0,0 +1,240 @@
+/* GNU m4 -- A simple macro processor
+   Copyright (C) 2017 Free Software Foundation, Inc.
+
+   This file is part of GNU M4.
+
+   GNU M4 is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   GNU M4 is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* This module implements --batch-map, which expands many input files
+   on top of one warmed up state.
+
+   The map lists one job per line: the name of an input file and the
+   name of the file to receive its output.  Once modules, frozen
+   state and the other options are loaded, the batch process forks
+   one process per job, running at most --jobs of them at a time.
+   Each job therefore starts from a copy-on-write snapshot of the same
+   state, unaffected by whatever the jobs before it defined, and has
+   its own output file, diversions and exit status.  The batch process
+   waits for all of them, reports the jobs that failed, and exits with
+   the status of the first of those in map order.  */
+
+#include <config.h>
+
+#include <fcntl.h>
+
+#include "m4.h"
+
+#include "quotearg.h"
+
+#if HAVE_FORK
+# include <sys/wait.h>
+#endif
+
+/* One line of the map.  */
+typedef struct
+{
+  char *input;                  /* file to expand */
+  char *output;                 /* file receiving its output */
+  pid_t pid;                    /* process running it, while running */
+  int status;                   /* wait status, once finished */
+} batch_job;
+
+#if HAVE_FORK
+
+/* Return the end of the blank-separated word starting at P.  */
+static char *
+batch_word_end (char *p)
+{
+  while (*p && *p != ' ' && *p != '\t')
+    p++;
+  return p;
+}
+
+/* Return P advanced past any blanks.  */
+static char *
+batch_skip_blanks (char *p)
+{
+  while (*p == ' ' || *p == '\t')
+    p++;
+  return p;
+}
+
+/* Read the map file NAME into a vector of jobs, and store its length
+   in *COUNT.  Blank lines and lines starting with `#' are ignored.  */
+static batch_job *
+batch_read_map (m4 *context, const char *name, size_t *count)
+{
+  m4_obstack obs;
+  batch_job *jobs = NULL;
+  size_t alloc = 0;
+  unsigned long int line = 0;
+  FILE *file;
+  char *text;
+  char *p;
+  int ch;
+
+  file = fopen (name, "r");
+  if (file == NULL)
+    m4_error (context, EXIT_FAILURE, errno, NULL, _("cannot open %s"),
+              quotearg_style (locale_quoting_style, name));
+  obstack_init (&obs);
+  while ((ch = getc (file)) != EOF)
+    obstack_1grow (&obs, ch);
+  obstack_1grow (&obs, '\0');
+  if (ferror (file) || fclose (file) != 0)
+    m4_error (context, EXIT_FAILURE, errno, NULL, _("cannot read %s"),
+              quotearg_style (locale_quoting_style, name));
+  text = (char *) obstack_finish (&obs);
+
+  /* The names point into TEXT, which therefore lives as long as the
+     batch process.  */
+  *count = 0;
+  for (p = text; *p; )
+    {
+      char *eol = strchr (p, '\n');
+      char *input;
+      char *output;
+
+      if (eol)
+        *eol = '\0';
+      line++;
+      input = batch_skip_blanks (p);
+      p = eol ? eol + 1 : input + strlen (input);
+      if (!*input || *input == '#')
+        continue;
+
+      output = batch_word_end (input);
+      if (*output)
+        *output++ = '\0';
+      output = batch_skip_blanks (output);
+      if (!*output || *batch_skip_blanks (batch_word_end (output)))
+        m4_error (context, EXIT_FAILURE, 0, NULL,
+                  _("%s:%lu: expecting an input and an output file name"),
+                  name, line);
+      *batch_word_end (output) = '\0';
+
+      if (*count == alloc)
+        jobs = (batch_job *) x2nrealloc (jobs, &alloc, sizeof *jobs);
+      jobs[*count].input = input;
+      jobs[*count].output = output;
+      jobs[*count].pid = 0;
+      jobs[*count].status = 0;
+      ++*count;
+    }
+  return jobs;
+}
+
+/* Prepare the process forked for JOB to run it: send standard output
+   to its output file, and give it diversions of its own.  */
+static void
+batch_start (m4 *context, batch_job *job)
+{
+  int fd;
+
+  fd = open (job->output, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+  if (fd < 0
+      || (fd != STDOUT_FILENO
+          && (dup2 (fd, STDOUT_FILENO) < 0 || close (fd) != 0)))
+    m4_error (context, EXIT_FAILURE, errno, NULL, _("cannot open %s"),
+              quotearg_style (locale_quoting_style, job->output));
+  m4_output_detach (context);
+}
+
+#endif /* HAVE_FORK */
+
+
+/* Run every job listed in the map file NAME, with at most JOBS of
+   them at a time, starting each from the state already loaded into
+   CONTEXT.  Never return in the batch process itself, which exits
+   once all jobs are done; return only in a process forked to run one
+   job, with its standard output already redirected, and the name of
+   the input file it must expand.  */
+const char *
+batch_run (m4 *context, const char *name, size_t jobs)
+{
+#if HAVE_FORK
+  batch_job *job;
+  size_t count;
+  size_t next = 0;
+  size_t running = 0;
+  size_t i;
+  int exit_status = EXIT_SUCCESS;
+
+  job = batch_read_map (context, name, &count);
+  while (next < count || running)
+    {
+      pid_t pid;
+      int status;
+
+      if (next < count && running < jobs)
+        {
+          /* Nothing buffered may be written twice.  */
+          fflush (NULL);
+          pid = fork ();
+          if (pid == 0)
+            {
+              batch_start (context, &job[next]);
+              return job[next].input;
+            }
+          if (pid < 0)
+            m4_error (context, EXIT_FAILURE, errno, NULL, _("cannot fork"));
+          job[next++].pid = pid;
+          running++;
+          continue;
+        }
+
+      pid = wait (&status);
+      if (pid < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          m4_error (context, EXIT_FAILURE, errno, NULL,
+                    _("cannot wait for jobs"));
+        }
+      for (i = 0; i < next; i++)
+        if (job[i].pid == pid)
+          {
+            job[i].pid = 0;
+            job[i].status = status;
+            running--;
+            break;
+          }
+    }
+
+  for (i = 0; i < count; i++)
+    {
+      int status = job[i].status;
+      if (WIFSIGNALED (status))
+        m4_error (context, 0, 0, NULL, _("job %s terminated by signal %d"),
+                  quotearg_style (locale_quoting_style, job[i].input),
+                  WTERMSIG (status));
+      else if (WEXITSTATUS (status) != EXIT_SUCCESS)
+        m4_error (context, 0, 0, NULL, _("job %s exited with status %d"),
+                  quotearg_style (locale_quoting_style, job[i].input),
+                  WEXITSTATUS (status));
+      else
+        continue;
+      if (exit_status == EXIT_SUCCESS)
+        exit_status = (WIFEXITED (status) ? WEXITSTATUS (status)
+                       : EXIT_FAILURE);
+    }
+  free (job);
+  exit (exit_status);
+#else
+  m4_error (context, EXIT_FAILURE, 0, NULL,
+            _("--batch-map is not supported on this system"));
+  return NULL;
+#endif /* HAVE_FORK */
+}
@@ -30,6 +30,10 @@
 #include "verify.h"
 #include "xmemdup0.h"
 
+#if HAVE_SYS_MMAN_H && HAVE_MMAP
+# include <sys/mman.h>
+#endif
+
 static  void  produce_mem_dump          (FILE *, const char *, size_t);
 static  void  produce_resyntax_dump     (m4 *, FILE *);
 static  void  produce_syntax_dump       (FILE *, m4_syntax_table *, char);
@@ -79,10 +83,12 @@ produce_resyntax_dump (m4 *context, FILE *file)
     }
 }
 
-static void
-produce_syntax_dump (FILE *file, m4_syntax_table *syntax, char ch)
+/* Store in BUF, which must hold UCHAR_MAX + 1 bytes, the characters
+   of SYNTAX that must be given syntax category CH on reload.  Return
+   their number, or -1 if the category needs no frozen directive.  */
+static int
+syntax_dump_chars (m4_syntax_table *syntax, char ch, char *buf)
 {
-  char buf[UCHAR_MAX + 1];
   int code = m4_syntax_code (ch);
   int count = 0;
   int i;
@@ -96,9 +102,18 @@ produce_syntax_dump (FILE *file, m4_syntax_table *syntax, char ch)
   if (count == 1
       && ((code == M4_SYNTAX_RQUOTE && *buf == *DEF_RQUOTE)
           || (code == M4_SYNTAX_ECOMM && *buf == *DEF_ECOMM)))
-    return;
+    return -1;
+
+  return count || (code & M4_SYNTAX_MASKS) ? count : -1;
+}
+
+static void
+produce_syntax_dump (FILE *file, m4_syntax_table *syntax, char ch)
+{
+  char buf[UCHAR_MAX + 1];
+  int count = syntax_dump_chars (syntax, ch, buf);
 
-  if (count || (code & M4_SYNTAX_MASKS))
+  if (count >= 0)
     {
       xfprintf (file, "S%c%d\n", ch, count);
       produce_mem_dump (file, buf, count);
@@ -106,14 +121,17 @@ produce_syntax_dump (FILE *file, m4_syntax_table *syntax, char ch)
     }
 }
 
-/* Store the debug mode in textual format.  */
-static void
-produce_debugmode_state (FILE *file, int flags)
+/* Bytes needed for the textual format of a debug mode.  */
+enum { DEBUGMODE_STRING_SIZE = 16 };
+
+/* Store the debug mode FLAGS in textual format in STR, which must
+   hold DEBUGMODE_STRING_SIZE bytes, and return its length.  */
+static int
+debugmode_string (char *str, int flags)
 {
   /* This code tracks the number of bits in M4_DEBUG_TRACE_VERBOSE.  */
-  char str[15];
   int offset = 0;
-  verify ((1 << (sizeof str - 1)) - 1 == M4_DEBUG_TRACE_VERBOSE);
+  verify ((1 << (DEBUGMODE_STRING_SIZE - 1)) - 1 == M4_DEBUG_TRACE_VERBOSE);
   if (flags & M4_DEBUG_TRACE_ARGS)
     str[offset++] = 'a';
   if (flags & M4_DEBUG_TRACE_EXPANSION)
@@ -142,7 +160,18 @@ produce_debugmode_state (FILE *file, int flags)
     str[offset++] = 'd';
   if (flags & M4_DEBUG_TRACE_OUTPUT_DUMPDEF)
     str[offset++] = 'o';
+  if (flags & M4_DEBUG_TRACE_REGEXP)
+    str[offset++] = 'r';
   str[offset] = '\0';
+  return offset;
+}
+
+/* Store the debug mode in textual format.  */
+static void
+produce_debugmode_state (FILE *file, int flags)
+{
+  char str[DEBUGMODE_STRING_SIZE];
+  int offset = debugmode_string (str, flags);
   if (offset)
     xfprintf (file, "d%d\n%s\n", offset, str);
 }
@@ -267,14 +296,326 @@ dump_symbol_CB (m4_symbol_table *symtab, const char *symbol_name, size_t len,
   return NULL;
 }
 
-/* Produce a frozen state to the given file NAME. */
+/* Frozen file format 3 follows its `V3' line with a binary image of
+   the state, made of unsigned 32-bit little-endian fields.  A string
+   is a pair of fields, its offset in the string pool and its length,
+   or IMAGE_NONE and 0 when absent.  Every string in the pool is
+   followed by a NUL byte, so that a reloaded image is used where it
+   lies, with no decoding.  The image starts with IMAGE_HEADER fields,
+   and is followed by the diversions as `D' directives whose contents
+   are not escaped.  */
+#define IMAGE_MAGIC_VALUE 0x3346344dU   /* "M4F3".  */
+#define IMAGE_NONE 0xffffffffU
+#define IMAGE_LIMIT (IMAGE_NONE - 1)
+
+/* The record arrays of an image.  Each module record is the module
+   name; each syntax record is a syntax code character followed by the
+   characters to add to that category; each symbol record, in pushdef
+   order, is the symbol name, IMAGE_TEXT or IMAGE_FUNC, the text or
+   builtin name, and the index of its module or IMAGE_NONE; and each
+   traced record is the name of a traced macro.  */
+enum image_section
+{
+  IMAGE_MODULE_RECS,
+  IMAGE_SYNTAX_RECS,
+  IMAGE_SYMBOL_RECS,
+  IMAGE_TRACED_RECS,
+  IMAGE_SECTIONS
+};
+
+/* Number of fields in each kind of record.  */
+static const unsigned int image_fields[IMAGE_SECTIONS] = { 2, 3, 6, 2 };
+
+/* Fields of the image header.  */
+enum
+{
+  IMAGE_MAGIC,                  /* IMAGE_MAGIC_VALUE.  */
+  IMAGE_SIZE,                   /* Bytes in the image.  */
+  IMAGE_POOL,                   /* Offset of the string pool.  */
+  IMAGE_POOL_LEN,               /* Bytes in the string pool.  */
+  IMAGE_LQUOTE,                 /* Non-default delimiter strings.  */
+  IMAGE_RQUOTE = IMAGE_LQUOTE + 2,
+  IMAGE_BCOMM = IMAGE_RQUOTE + 2,
+  IMAGE_ECOMM = IMAGE_BCOMM + 2,
+  IMAGE_RESYNTAX = IMAGE_ECOMM + 2, /* Non-default regexp syntax.  */
+  IMAGE_DEBUG = IMAGE_RESYNTAX + 2, /* Debugmode flags.  */
+  IMAGE_RECORDS = IMAGE_DEBUG + 2,  /* Offset and count of each array.  */
+  IMAGE_HEADER = IMAGE_RECORDS + 2 * IMAGE_SECTIONS
+};
+
+/* Kinds of symbol values.  */
+enum { IMAGE_TEXT, IMAGE_FUNC };
+
+/* An image being produced.  */
+typedef struct
+{
+  m4 *context;
+  m4_obstack pool;                      /* String pool.  */
+  m4_obstack recs[IMAGE_SECTIONS];      /* Encoded record arrays.  */
+  uint32_t count[IMAGE_SECTIONS];       /* Records in each array.  */
+  uint32_t header[IMAGE_HEADER];
+} image_writer;
+
+/* Store VALUE in little-endian order at BUF.  */
+static void
+image_encode (unsigned char *buf, uint32_t value)
+{
+  buf[0] = value & 0xff;
+  buf[1] = (value >> 8) & 0xff;
+  buf[2] = (value >> 16) & 0xff;
+  buf[3] = value >> 24;
+}
+
+/* Add STR of length LEN to the string pool of IMAGE, and store the
+   reference to it in the two fields at REF.  */
+static void
+image_string (image_writer *image, const char *str, size_t len,
+              uint32_t *ref)
+{
+  size_t offset = obstack_object_size (&image->pool);
+
+  if (IMAGE_LIMIT - offset <= len)
+    m4_error (image->context, EXIT_FAILURE, 0, NULL,
+              _("frozen state too large"));
+  obstack_grow0 (&image->pool, str, len);
+  ref[0] = offset;
+  ref[1] = len;
+}
+
+/* Append the record whose fields are REC to SECTION of IMAGE.  */
+static void
+image_record (image_writer *image, enum image_section section,
+              const uint32_t *rec)
+{
+  unsigned char buf[4];
+  unsigned int i;
+
+  for (i = 0; i < image_fields[section]; i++)
+    {
+      image_encode (buf, rec[i]);
+      obstack_grow (&image->recs[section], buf, sizeof buf);
+    }
+  image->count[section]++;
+}
+
+/* Record MODULE and the modules loaded before it, oldest first, which
+   is the order in which the symbol records index them.  */
+static void
+image_module_dump (image_writer *image, m4_module *module)
+{
+  const char *name = m4_get_module_name (module);
+  uint32_t rec[2];
+
+  module = m4_module_next (image->context, module);
+  if (module)
+    image_module_dump (image, module);
+
+  image_string (image, name, strlen (name), rec);
+  image_record (image, IMAGE_MODULE_RECS, rec);
+}
+
+/* Return the index of MODULE in the module records, or IMAGE_NONE if
+   MODULE is NULL.  */
+static uint32_t
+image_module_index (m4 *context, m4_module *module)
+{
+  uint32_t index = 0;
+
+  if (!module)
+    return IMAGE_NONE;
+  while ((module = m4_module_next (context, module)))
+    index++;
+  return index;
+}
+
+/* Record the stack of values for SYMBOL, with name SYMBOL_NAME and
+   length LEN, located in SYMTAB.  USERDATA is the image_writer.  */
+static void *
+image_symbol_CB (m4_symbol_table *symtab, const char *symbol_name, size_t len,
+                 m4_symbol *symbol, void *userdata)
+{
+  image_writer *image = (image_writer *) userdata;
+  m4_symbol_value *value;
+  m4_symbol_value *last;
+  uint32_t rec[6];
+  bool named = false;
+
+  last = value = reverse_symbol_value_stack (m4_get_symbol_value (symbol));
+  while (value)
+    {
+      if (m4_is_symbol_value_text (value))
+        {
+          rec[2] = IMAGE_TEXT;
+          image_string (image, m4_get_symbol_value_text (value),
+                        m4_get_symbol_value_len (value), &rec[3]);
+        }
+      else if (m4_is_symbol_value_func (value))
+        {
+          const m4_builtin *bp = m4_get_symbol_value_builtin (value);
+          if (bp == NULL)
+            assert (!"INTERNAL ERROR: builtin not found in builtin table!");
+          rec[2] = IMAGE_FUNC;
+          image_string (image, bp->name, strlen (bp->name), &rec[3]);
+        }
+      else if (m4_is_symbol_value_placeholder (value))
+        {
+          /* Nothing to do for a builtin we couldn't reload earlier.  */
+          value = VALUE_NEXT (value);
+          continue;
+        }
+      else
+        assert (!"image_symbol_CB");
+      /* All records of the stack share one copy of the name.  */
+      if (!named)
+        image_string (image, symbol_name, len, rec);
+      named = true;
+      rec[5] = image_module_index (image->context, VALUE_MODULE (value));
+      image_record (image, IMAGE_SYMBOL_RECS, rec);
+      value = VALUE_NEXT (value);
+    }
+  reverse_symbol_value_stack (last);
+  if (m4_get_symbol_traced (symbol))
+    {
+      if (!named)
+        image_string (image, symbol_name, len, rec);
+      image_record (image, IMAGE_TRACED_RECS, rec);
+    }
+  return NULL;
+}
+
+/* Produce the frozen file format 3 image of the state of CONTEXT, up
+   to but excluding the diversions, on FILE.  */
+static void
+produce_frozen_image (m4 *context, FILE *file)
+{
+  image_writer image;
+  unsigned char buf[IMAGE_HEADER * 4];
+  const m4_string_pair *pair;
+  const char *str;
+  size_t size;
+  int code;
+  int i;
+
+  image.context = context;
+  obstack_init (&image.pool);
+  for (i = 0; i < IMAGE_SECTIONS; i++)
+    {
+      obstack_init (&image.recs[i]);
+      image.count[i] = 0;
+    }
+  for (i = IMAGE_LQUOTE; i < IMAGE_RECORDS; i += 2)
+    {
+      image.header[i] = IMAGE_NONE;
+      image.header[i + 1] = 0;
+    }
+
+  pair = m4_get_syntax_quotes (M4SYNTAX);
+  if (STRNEQ (pair->str1, DEF_LQUOTE) || STRNEQ (pair->str2, DEF_RQUOTE))
+    {
+      image_string (&image, pair->str1, pair->len1,
+                    &image.header[IMAGE_LQUOTE]);
+      image_string (&image, pair->str2, pair->len2,
+                    &image.header[IMAGE_RQUOTE]);
+    }
+
+  pair = m4_get_syntax_comments (M4SYNTAX);
+  if (STRNEQ (pair->str1, DEF_BCOMM) || STRNEQ (pair->str2, DEF_ECOMM))
+    {
+      image_string (&image, pair->str1, pair->len1,
+                    &image.header[IMAGE_BCOMM]);
+      image_string (&image, pair->str2, pair->len2,
+                    &image.header[IMAGE_ECOMM]);
+    }
+
+  code = m4_get_regexp_syntax_opt (context);
+  if (code)
+    {
+      const char *resyntax = m4_regexp_syntax_decode (code);
+
+      if (!resyntax)
+        m4_error (context, EXIT_FAILURE, 0, NULL,
+                  _("invalid regexp syntax code `%d'"), code);
+      image_string (&image, resyntax, strlen (resyntax),
+                    &image.header[IMAGE_RESYNTAX]);
+    }
+
+  for (str = "I@WLBOD${}SA(),RE"; *str; str++)
+    {
+      char chars[UCHAR_MAX + 1];
+      int count = syntax_dump_chars (M4SYNTAX, *str, chars);
+      uint32_t rec[3];
+
+      if (count >= 0)
+        {
+          rec[0] = to_uchar (*str);
+          image_string (&image, chars, count, &rec[1]);
+          image_record (&image, IMAGE_SYNTAX_RECS, rec);
+        }
+    }
+
+  {
+    char flags[DEBUGMODE_STRING_SIZE];
+    int len = debugmode_string (flags, m4_get_debug_level_opt (context));
+    if (len)
+      image_string (&image, flags, len, &image.header[IMAGE_DEBUG]);
+  }
+
+  image_module_dump (&image, m4_module_next (context, NULL));
+
+  if (m4_symtab_apply (M4SYMTAB, true, image_symbol_CB, &image))
+    assert (false);
+
+  /* Lay out the record arrays and the pool after the header.  */
+  size = sizeof buf;
+  for (i = 0; i < IMAGE_SECTIONS; i++)
+    {
+      image.header[IMAGE_RECORDS + 2 * i] = size;
+      image.header[IMAGE_RECORDS + 2 * i + 1] = image.count[i];
+      size += obstack_object_size (&image.recs[i]);
+      if (IMAGE_LIMIT < size)
+        m4_error (context, EXIT_FAILURE, 0, NULL,
+                  _("frozen state too large"));
+    }
+  image.header[IMAGE_POOL] = size;
+  image.header[IMAGE_POOL_LEN] = obstack_object_size (&image.pool);
+  size += obstack_object_size (&image.pool);
+  if (IMAGE_LIMIT < size)
+    m4_error (context, EXIT_FAILURE, 0, NULL, _("frozen state too large"));
+  image.header[IMAGE_MAGIC] = IMAGE_MAGIC_VALUE;
+  image.header[IMAGE_SIZE] = size;
+
+  /* Any errors will be detected by ferror later.  */
+  for (i = 0; i < IMAGE_HEADER; i++)
+    image_encode (buf + 4 * i, image.header[i]);
+  fwrite (buf, sizeof buf, 1, file);
+  for (i = 0; i < IMAGE_SECTIONS; i++)
+    {
+      size = obstack_object_size (&image.recs[i]);
+      if (size)
+        fwrite (obstack_finish (&image.recs[i]), size, 1, file);
+      obstack_free (&image.recs[i], NULL);
+    }
+  size = obstack_object_size (&image.pool);
+  if (size)
+    fwrite (obstack_finish (&image.pool), size, 1, file);
+  obstack_free (&image.pool, NULL);
+}
+
+/* Produce a frozen state to the given file NAME, in frozen file
+   format VERSION, which is 2 or 3.  */
 void
-produce_frozen_state (m4 *context, const char *name)
+produce_frozen_state (m4 *context, const char *name, int version)
 {
-  FILE *file = fopen (name, O_BINARY ? "wb" : "w");
+  FILE *file;
   const char *str;
   const m4_string_pair *pair;
 
+  /* Deferred definitions may still live in a reloaded frozen file,
+     perhaps NAME itself, so load them all, releasing that file,
+     before truncating NAME.  */
+  m4__symtab_load (M4SYMTAB);
+
+  file = fopen (name, O_BINARY ? "wb" : "w");
   if (!file)
     {
       m4_error (context, 0, errno, NULL, _("cannot open %s"),
@@ -286,7 +627,14 @@ produce_frozen_state (m4 *context, const char *name)
 
   xfprintf (file, "# This is a frozen state file generated by GNU %s %s\n",
             PACKAGE, VERSION);
-  fputs ("V2\n", file);
+  xfprintf (file, "V%d\n", version);
+
+  if (version == 3)
+    {
+      produce_frozen_image (context, file);
+      m4_freeze_diversions (context, file, false);
+      goto done;
+    }
 
   /* Dump quote delimiters.  */
   pair = m4_get_syntax_quotes (M4SYNTAX);
@@ -329,10 +677,11 @@ produce_frozen_state (m4 *context, const char *name)
 
   /* Let diversions be issued from output.c module, its cleaner to have this
      piece of code there.  */
-  m4_freeze_diversions (context, file);
+  m4_freeze_diversions (context, file, true);
 
   /* All done.  */
 
+ done:
   fputs ("# End of frozen state file\n", file);
   if (close_stream (file) != 0)
     m4_error (context, EXIT_FAILURE, errno, NULL,
@@ -354,6 +703,45 @@ issue_expect_message (m4 *context, int expected)
 
 /* Reload frozen state.  */
 
+/* Return a new symbol value for MODULE expanding to the LEN bytes of
+   TEXT.  */
+static m4_symbol_value *
+frozen_text (const char *text, size_t len, m4_module *module)
+{
+  m4_symbol_value *token = (m4_symbol_value *) xzalloc (sizeof *token);
+
+  m4_set_symbol_value_text (token, xmemdup0 (text, len), len, 0);
+  VALUE_MODULE (token) = module;
+  VALUE_MAX_ARGS (token) = -1;
+  return token;
+}
+
+/* Return a new symbol value for the builtin NAME of length LEN from
+   MODULE, or a placeholder if that builtin no longer exists.  */
+static m4_symbol_value *
+frozen_builtin (m4 *context, const char *name, size_t len,
+                m4_module *module)
+{
+  m4_symbol_value *token;
+
+  // Builtins cannot contain a NUL byte.
+  if (strlen (name) < len)
+    m4_error (context, EXIT_FAILURE, 0, NULL, _("\
+ill-formed frozen file, invalid builtin %s encountered"),
+              quotearg_style_mem (locale_quoting_style, name, len));
+  token = m4_builtin_find_by_name (context, module, name);
+
+  if (token == NULL)
+    {
+      token = (m4_symbol_value *) xzalloc (sizeof *token);
+      m4_set_symbol_value_placeholder (token, xstrdup (name));
+      VALUE_MODULE (token) = module;
+      VALUE_MIN_ARGS (token) = 0;
+      VALUE_MAX_ARGS (token) = -1;
+    }
+  return token;
+}
+
 /* Read the next character from the IN stream.  Various escape
    sequences are converted, and returned.  EOF is returned if the end
    of file is reached whilst reading the character, or on an
@@ -443,6 +831,409 @@ decode_char (m4 *context, FILE *in, bool *advance_line)
 }
 
 
+/* An image being reloaded.  It stays in memory after the reload for
+   as long as some symbols are still deferred to it.  */
+typedef struct
+{
+  m4 *context;
+  char *map;                    /* Memory holding the frozen file.  */
+  size_t map_size;              /* Bytes of memory at map.  */
+  bool mapped;                  /* True if map is from mmap.  */
+  const char *base;             /* Start of the image.  */
+  size_t size;                  /* Bytes in the image.  */
+  const char *pool;             /* Start of the string pool.  */
+  size_t pool_len;              /* Bytes in the string pool.  */
+  const char *symbols_end;      /* End of the symbol records.  */
+  m4_module **modules;          /* Modules, by index.  */
+  size_t nmodules;              /* Number of modules.  */
+} image_reader;
+
+/* Return the little-endian value at BUF.  */
+static uint32_t
+image_decode (const char *buf)
+{
+  const unsigned char *p = (const unsigned char *) buf;
+  return (p[0] | (p[1] << 8) | ((uint32_t) p[2] << 16)
+          | ((uint32_t) p[3] << 24));
+}
+
+/* Diagnose a malformed image.  */
+static void
+image_invalid (m4 *context)
+{
+  m4_error (context, EXIT_FAILURE, 0, NULL,
+            _("ill-formed frozen file, invalid image"));
+}
+
+/* Return the bytes referenced by the two fields at REF in IMAGE,
+   storing their number in *LEN, or NULL if the reference is absent.
+   Only the fields are read, not the referenced bytes.  */
+static const char *
+image_get_bytes (image_reader *image, const char *ref, size_t *len)
+{
+  uint32_t offset = image_decode (ref);
+  uint32_t length = image_decode (ref + 4);
+
+  *len = length;
+  if (offset == IMAGE_NONE)
+    return NULL;
+  if (image->pool_len <= offset || image->pool_len - offset <= length)
+    image_invalid (image->context);
+  return image->pool + offset;
+}
+
+/* Like image_get_bytes, but also check that the string is followed by
+   a NUL byte, so that it can be used in place.  */
+static const char *
+image_get_string (image_reader *image, const char *ref, size_t *len)
+{
+  const char *str = image_get_bytes (image, ref, len);
+
+  if (str && str[*len])
+    image_invalid (image->context);
+  return str;
+}
+
+/* Return the record array SECTION of IMAGE, storing its number of
+   records in *COUNT.  */
+static const char *
+image_get_records (image_reader *image, enum image_section section,
+                   size_t *count)
+{
+  const char *field = image->base + 4 * (IMAGE_RECORDS + 2 * section);
+  uint32_t offset = image_decode (field);
+
+  *count = image_decode (field + 4);
+  if (image->size < offset
+      || (image->size - offset) / (4 * image_fields[section]) < *count)
+    image_invalid (image->context);
+  return image->base + offset;
+}
+
+/* Return true if the symbol record REC of IMAGE is for NAME of length
+   LEN, which was found at REF.  */
+static bool
+image_same_name (image_reader *image, const char *rec, const char *ref,
+                 const char *name, size_t len)
+{
+  const char *str;
+  size_t slen;
+
+  if (memcmp (rec, ref, 8) == 0)
+    return true;
+  str = image_get_string (image, rec, &slen);
+  return slen == len && memcmp (str, name, len) == 0;
+}
+
+/* Release IMAGE, once no symbol is deferred to it.  */
+static void
+image_release (image_reader *image)
+{
+#if HAVE_SYS_MMAN_H && HAVE_MMAP
+  if (image->mapped)
+    munmap (image->map, image->map_size);
+  else
+#endif
+    free (image->map);
+  free (image->modules);
+  free (image);
+}
+
+/* The m4__symbol_loader for an image: return the value stack of the
+   symbol whose first record is ENTRY, as the reload would have
+   pushed it.  */
+static m4_symbol_value *
+image_load (void *data, const void *entry)
+{
+  image_reader *image = (image_reader *) data;
+  const char *first = (const char *) entry;
+  const char *rec;
+  const char *name;
+  size_t len;
+  m4_symbol_value *stack = NULL;
+
+  if (!entry)
+    {
+      image_release (image);
+      return NULL;
+    }
+
+  name = image_get_string (image, first, &len);
+  rec = first;
+  do
+    {
+      uint32_t kind = image_decode (rec + 8);
+      uint32_t index = image_decode (rec + 20);
+      m4_module *module = index == IMAGE_NONE ? NULL : image->modules[index];
+      m4_symbol_value *token;
+      const char *str;
+      size_t slen;
+
+      if (kind == IMAGE_TEXT)
+        {
+          str = image_get_bytes (image, rec + 12, &slen);
+          token = frozen_text (str, slen, module);
+        }
+      else
+        {
+          str = image_get_string (image, rec + 12, &slen);
+          token = frozen_builtin (image->context, str, slen, module);
+        }
+      VALUE_NEXT (token) = stack;
+      stack = token;
+      rec += 4 * image_fields[IMAGE_SYMBOL_RECS];
+    }
+  while (rec < image->symbols_end
+         && image_same_name (image, rec, first, name, len));
+  return stack;
+}
+
+/* Parse a decimal number from P, not beyond END, into *NUMBER, which
+   may be as low as INT_MIN if ALLOW_NEG.  Return the first byte not
+   consumed.  */
+static const char *
+image_number (m4 *context, const char *p, const char *end, int *number,
+              bool allow_neg)
+{
+  unsigned int n = 0;
+
+  while (p < end && isdigit (to_uchar (*p)) && n <= INT_MAX / 10)
+    n = 10 * n + *p++ - '0';
+  if ((allow_neg ? INT_MIN : INT_MAX) < n
+      || (p < end && isdigit (to_uchar (*p))))
+    m4_error (context, EXIT_FAILURE, 0, NULL,
+              _("integer overflow in frozen file"));
+  *number = n;
+  return p;
+}
+
+/* Reload the state from the LEN bytes at BUF, which follow the `V3'
+   line of a frozen file: IMAGE, then the diversions.  The symbols are
+   only named in the symbol table, and left to image_load.  */
+static void
+reload_frozen_image (image_reader *image, const char *buf, size_t len)
+{
+  m4 *context = image->context;
+  const char *rec;
+  const char *prev = NULL;
+  const char *prev_name = NULL;
+  const char *str;
+  const char *str2;
+  const char *end;
+  size_t prev_len = 0;
+  size_t count;
+  size_t slen;
+  size_t slen2;
+  size_t i;
+
+  image->base = buf;
+  if (len < IMAGE_HEADER * 4 || image_decode (buf) != IMAGE_MAGIC_VALUE)
+    image_invalid (context);
+  image->size = image_decode (buf + 4 * IMAGE_SIZE);
+  image->pool_len = image_decode (buf + 4 * IMAGE_POOL_LEN);
+  if (len < image->size || image->size < IMAGE_HEADER * 4
+      || image->size < image_decode (buf + 4 * IMAGE_POOL)
+      || (image->size - image_decode (buf + 4 * IMAGE_POOL)
+          < image->pool_len))
+    image_invalid (context);
+  image->pool = buf + image_decode (buf + 4 * IMAGE_POOL);
+
+  /* Quote and comment delimiters.  */
+  str = image_get_string (image, buf + 4 * IMAGE_LQUOTE, &slen);
+  str2 = image_get_string (image, buf + 4 * IMAGE_RQUOTE, &slen2);
+  if (str && str2)
+    m4_set_quotes (M4SYNTAX, str, slen, str2, slen2);
+  str = image_get_string (image, buf + 4 * IMAGE_BCOMM, &slen);
+  str2 = image_get_string (image, buf + 4 * IMAGE_ECOMM, &slen2);
+  if (str && str2)
+    m4_set_comment (M4SYNTAX, str, slen, str2, slen2);
+
+  /* Regular expression syntax.  */
+  str = image_get_string (image, buf + 4 * IMAGE_RESYNTAX, &slen);
+  if (str)
+    {
+      m4_set_regexp_syntax_opt (context, m4_regexp_syntax_encode (str));
+      if (m4_get_regexp_syntax_opt (context) < 0 || strlen (str) < slen)
+        m4_error (context, EXIT_FAILURE, 0, NULL, _("bad syntax-spec %s"),
+                  quotearg_style_mem (locale_quoting_style, str, slen));
+    }
+
+  /* Syntax table.  */
+  rec = image_get_records (image, IMAGE_SYNTAX_RECS, &count);
+  for (i = 0; i < count; i++, rec += 4 * image_fields[IMAGE_SYNTAX_RECS])
+    {
+      char syntax = image_decode (rec);
+      str = image_get_string (image, rec + 4, &slen);
+      if (!str)
+        image_invalid (context);
+      if ((m4_set_syntax (M4SYNTAX, syntax,
+                          (m4_syntax_code (syntax) & M4_SYNTAX_MASKS
+                           ? '=' : '+'), str, slen) < 0)
+          && (syntax != '\0'))
+        m4_error (context, 0, 0, NULL, _("undefined syntax code %c"), syntax);
+    }
+
+  /* Debugmode flags.  */
+  str = image_get_string (image, buf + 4 * IMAGE_DEBUG, &slen);
+  if (str && m4_debug_decode (context, str, slen) < 0)
+    m4_error (context, EXIT_FAILURE, 0, NULL, _("unknown debug mode %s"),
+              quotearg_style_mem (locale_quoting_style, str, slen));
+
+  /* Modules, without perturbing the symbol table.  */
+  rec = image_get_records (image, IMAGE_MODULE_RECS, &image->nmodules);
+  image->modules = XNMALLOC (image->nmodules, m4_module *);
+  for (i = 0; i < image->nmodules;
+       i++, rec += 4 * image_fields[IMAGE_MODULE_RECS])
+    {
+      str = image_get_string (image, rec, &slen);
+      if (!str)
+        image_invalid (context);
+      if (strlen (str) < slen)
+        m4_error (context, EXIT_FAILURE, 0, NULL, _("\
+ill-formed frozen file, invalid module %s encountered"),
+                  quotearg_style_mem (locale_quoting_style, str, slen));
+      image->modules[i] = m4__module_open (context, str, NULL);
+    }
+
+  /* Symbols.  Each name gets a deferred entry for its first record,
+     since the records of one name are consecutive, in pushdef order.
+     Everything but the definitions themselves is checked now.  */
+  rec = image_get_records (image, IMAGE_SYMBOL_RECS, &count);
+  image->symbols_end = rec + count * 4 * image_fields[IMAGE_SYMBOL_RECS];
+  for (i = 0; i < count; i++, rec += 4 * image_fields[IMAGE_SYMBOL_RECS])
+    {
+      uint32_t kind = image_decode (rec + 8);
+      uint32_t index = image_decode (rec + 20);
+
+      if ((kind != IMAGE_TEXT && kind != IMAGE_FUNC)
+          || (index != IMAGE_NONE && image->nmodules <= index)
+          || !image_get_bytes (image, rec + 12, &slen))
+        image_invalid (context);
+      if (prev && image_same_name (image, rec, prev, prev_name, prev_len))
+        continue;
+      str = image_get_string (image, rec, &slen);
+      if (!str || !m4__symbol_defer (M4SYMTAB, str, slen, rec))
+        image_invalid (context);
+      prev = rec;
+      prev_name = str;
+      prev_len = slen;
+    }
+
+  /* Traced macros.  */
+  rec = image_get_records (image, IMAGE_TRACED_RECS, &count);
+  for (i = 0; i < count; i++, rec += 4 * image_fields[IMAGE_TRACED_RECS])
+    {
+      str = image_get_string (image, rec, &slen);
+      if (!str)
+        image_invalid (context);
+      m4_set_symbol_name_traced (M4SYMTAB, str, slen, true);
+    }
+
+  /* Diversions, as `D' directives whose contents are copied as is,
+     possibly among comments and blank lines.  */
+  end = buf + len;
+  buf += image->size;
+  while (buf < end)
+    {
+      int divnum;
+      int length;
+      bool negative;
+
+      if (*buf == '\n')
+        {
+          buf++;
+          continue;
+        }
+      if (*buf == '#')
+        {
+          buf = (const char *) memchr (buf, '\n', end - buf);
+          if (!buf)
+            issue_expect_message (context, '\n');
+          buf++;
+          continue;
+        }
+      if (*buf != 'D')
+        m4_error (context, EXIT_FAILURE, 0, NULL,
+                  _("ill-formed frozen file, unknown directive %c"), *buf);
+      buf++;
+      negative = buf < end && *buf == '-';
+      buf = image_number (context, buf + negative, end, &divnum, negative);
+      if (negative)
+        divnum = -divnum;
+      if (buf == end || *buf != ',')
+        issue_expect_message (context, ',');
+      buf = image_number (context, buf + 1, end, &length, false);
+      if (buf == end || *buf != '\n')
+        issue_expect_message (context, '\n');
+      buf++;
+      if (end - buf <= length)
+        m4_error (context, EXIT_FAILURE, 0, NULL,
+                  _("premature end of frozen file"));
+
+      m4_make_diversion (context, divnum);
+      if (length > 0)
+        m4_output_text (context, buf, length);
+      buf += length;
+      if (*buf != '\n')
+        issue_expect_message (context, '\n');
+      buf++;
+    }
+}
+
+/* Reload the rest of FILE, positioned just after the `V3' line of a
+   frozen file.  The file is mapped into memory when possible, and
+   otherwise read in its entirety; either way, it is kept until the
+   last symbol deferred to it is used.  */
+static void
+reload_frozen_file (m4 *context, FILE *file)
+{
+  image_reader *image = (image_reader *) xzalloc (sizeof *image);
+  int fd = fileno (file);
+  off_t start = ftello (file);
+
+  image->context = context;
+
+#if HAVE_SYS_MMAN_H && HAVE_MMAP
+  {
+    struct stat st;
+    if (0 <= start && 0 <= fd && fstat (fd, &st) == 0
+        && S_ISREG (st.st_mode) && start < st.st_size
+        && (uintmax_t) st.st_size <= SIZE_MAX)
+      {
+        char *base = (char *) mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+                                    fd, 0);
+        if (base != MAP_FAILED)
+          {
+            image->map = base;
+            image->map_size = st.st_size;
+            image->mapped = true;
+          }
+      }
+  }
+#endif
+
+  if (!image->mapped)
+    {
+      size_t alloc = BUFSIZ;
+      size_t n;
+      start = 0;
+      image->map = xcharalloc (alloc);
+      while ((n = fread (image->map + image->map_size, 1,
+                         alloc - image->map_size, file)))
+        {
+          image->map_size += n;
+          if (image->map_size == alloc)
+            image->map = (char *) x2nrealloc (image->map, &alloc, 1);
+        }
+      if (ferror (file))
+        m4_error (context, EXIT_FAILURE, errno, NULL,
+                  _("unable to read frozen state"));
+    }
+
+  reload_frozen_image (image, image->map + start, image->map_size - start);
+  m4__symtab_set_loader (M4SYMTAB, image_load, image);
+}
+
 /*  Reload state from the given file NAME.  We are seeking speed,
     here.  */
 
@@ -580,8 +1371,8 @@ reload_frozen_state (m4 *context, const char *name)
   allocated[2] = 100;
   string[2] = xcharalloc (allocated[2]);
 
-  /* Validate format version.  Accept both `1' (m4 1.3 and 1.4.x) and
-     `2' (m4 2.0).  */
+  /* Validate format version.  Accept `1' (m4 1.3 and 1.4.x), `2' (m4
+     2.0), and the binary format `3'.  */
   GET_DIRECTIVE;
   VALIDATE ('V');
   GET_CHARACTER;
@@ -589,6 +1380,7 @@ reload_frozen_state (m4 *context, const char *name)
   switch (version)
     {
     case 2:
+    case 3:
       break;
     case 1:
       m4__module_open (context, "m4", NULL);
@@ -601,9 +1393,9 @@ reload_frozen_state (m4 *context, const char *name)
       m4_set_syntax (M4SYNTAX, 'O', '+', "{}", 2);
       break;
     default:
-      if (version > 2)
+      if (version > 3)
         m4_error (context, EXIT_MISMATCH, 0, NULL,
-                  _("frozen file version %d greater than max supported of 2"),
+                  _("frozen file version %d greater than max supported of 3"),
                   version);
       else
         m4_error (context, EXIT_FAILURE, 0, NULL,
@@ -611,7 +1403,14 @@ reload_frozen_state (m4 *context, const char *name)
     }
   VALIDATE ('\n');
 
-  GET_DIRECTIVE;
+  /* Format 3 is an image of its own, rather than directives.  */
+  if (version == 3)
+    {
+      reload_frozen_file (context, file);
+      character = EOF;
+    }
+  else
+    GET_DIRECTIVE;
   while (character != EOF)
     {
       switch (character)
@@ -698,12 +1497,6 @@ ill-formed frozen file, version 2 directive `%c' encountered"), 'F');
             m4_module *module = NULL;
             m4_symbol_value *token;
 
-            // Builtins cannot contain a NUL byte.
-            if (strlen (string[1]) < number[1])
-              m4_error (context, EXIT_FAILURE, 0, NULL, _("\
-ill-formed frozen file, invalid builtin %s encountered"),
-                        quotearg_style_mem (locale_quoting_style, string[1],
-                                            number[1]));
             if (number[2] > 0)
               {
                 if (strlen (string[2]) < number[2])
@@ -713,16 +1506,7 @@ ill-formed frozen file, invalid module %s encountered"),
                                                 string[2], number[2]));
                 module = m4__module_find (context, string[2]);
               }
-            token = m4_builtin_find_by_name (context, module, string[1]);
-
-            if (token == NULL)
-              {
-                token = (m4_symbol_value *) xzalloc (sizeof *token);
-                m4_set_symbol_value_placeholder (token, xstrdup (string[1]));
-                VALUE_MODULE (token) = module;
-                VALUE_MIN_ARGS (token) = 0;
-                VALUE_MAX_ARGS (token) = -1;
-              }
+            token = frozen_builtin (context, string[1], number[1], module);
             m4_symbol_pushdef (M4SYMTAB, string[0], number[0], token);
           }
           break;
@@ -958,7 +1742,6 @@ ill-formed frozen file, version 2 directive `%c' encountered"), 'T');
             m4_symbol_value *token;
             m4_module *module = NULL;
 
-            token = (m4_symbol_value *) xzalloc (sizeof *token);
             if (number[2] > 0)
               {
                 if (strlen (string[2]) < number[2])
@@ -969,11 +1752,7 @@ ill-formed frozen file, invalid module %s encountered"),
                 module = m4__module_find (context, string[2]);
               }
 
-            m4_set_symbol_value_text (token, xmemdup0 (string[1], number[1]),
-                                      number[1], 0);
-            VALUE_MODULE (token) = module;
-            VALUE_MAX_ARGS (token) = -1;
-
+            token = frozen_text (string[1], number[1], module);
             m4_symbol_pushdef (M4SYMTAB, string[0], number[0], token);
           }
           break;
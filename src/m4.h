@@ -37,7 +37,30 @@ void stackovf_exit (void);
 
 /* File: freeze.c --- frozen state files.  */
 
-void produce_frozen_state (m4 *context, const char *);
+void produce_frozen_state (m4 *context, const char *, int);
 void reload_frozen_state  (m4 *context, const char *);
 
+
+/* File: batch.c --- parallel batch mode.  */
+
+const char *batch_run (m4 *context, const char *, size_t);
+
+
+/* File: server.c --- persistent server mode.  */
+
+void server_client  (const char *, int, char *const *, char *const *);
+void server_run     (m4 *context, const char *, const char *, int *,
+                     char *const **, char *const **);
+void server_record  (int, const char *);
+bool server_replayed (int, const char *, bool);
+bool server_matches (m4 *context, const char *);
+void server_decline (void);
+
+
+/* File: modules.c --- modules linked into the executable.  */
+
+#if M4_STATIC_MODULES
+extern const m4_static_module m4_static_modules[];
+#endif
+
 #endif /* M4_H */
@@ -91,14 +91,19 @@ Operation modes:\n\
 "), stdout);
       fputs (_("\
   -b, --batch                  buffer output, process interrupts\n\
+      --batch-map=FILE         expand each input file listed in FILE into\n\
+                                 the output file listed beside it\n\
   -c, --discard-comments       do not copy comments to the output\n\
   -E, --fatal-warnings         once: warnings become errors, twice: stop\n\
                                  execution at first error\n\
   -i, --interactive            unbuffer output, ignore interrupts\n\
+      --jobs=N                 run up to N --batch-map jobs at once [1]\n\
   -P, --prefix-builtins        force a `m4_' prefix to all builtins\n\
   -Q, --quiet, --silent        suppress some warnings for builtins\n\
   -r, --regexp-syntax[=SPEC]   set default regexp syntax to SPEC [GNU_M4]\n\
       --safer                  disable potentially unsafe builtins\n\
+      --server=SOCKET          load state once, then serve invocations\n\
+                                 that set M4_SERVER=SOCKET\n\
   -W, --warnings               enable all warnings\n\
 "), stdout);
       puts ("");
@@ -111,6 +116,7 @@ SPEC is any one of:\n\
       fputs (_("\
 Preprocessor features:\n\
   -B, --prepend-include=DIR    add DIR to include path before `.'\n\
+      --cache-includes         keep included files in memory for reuse\n\
   -D, --define=NAME[=VALUE]    define NAME as having VALUE, or empty\n\
       --import-environment     import all environment variables as macros\n\
   -I, --include=DIR            add DIR to include path after `.'\n\
@@ -126,14 +132,20 @@ Preprocessor features:\n\
       puts ("");
       fputs (_("\
 Limits control:\n\
+      --diversion-memory=SIZE  keep up to SIZE bytes of diversions in\n\
+                                 memory before using temporary files [512k]\n\
   -g, --gnu                    override -G to re-enable GNU extensions\n\
   -G, --traditional, --posix   suppress all GNU extensions\n\
   -L, --nesting-limit=NUMBER   change artificial nesting limit [1024]\n\
+      --regexp-cache=NUMBER    keep up to NUMBER compiled regular\n\
+                                 expressions for reuse [64]\n\
 "), stdout);
       puts ("");
       fputs (_("\
 Frozen state files:\n\
   -F, --freeze-state=FILE      produce a frozen state on FILE at end\n\
+      --freeze-format=NUMBER   write frozen state in format NUMBER, either\n\
+                                 2 (text) or 3 (binary) [2]\n\
   -R, --reload-state=FILE      reload a frozen state from FILE at start\n\
 "), stdout);
       puts ("");
@@ -144,6 +156,13 @@ Debugging:\n\
       --debugfile[=FILE]       redirect debug and trace output to FILE\n\
                                  (default stderr, discard if empty string)\n\
   -l, --debuglen=NUM           restrict macro tracing size\n\
+      --profile[=FILE]         report calls and time spent per macro to FILE\n\
+                                 at exit (default stderr)\n\
+      --profile-format=FORMAT  write the profile as FORMAT, either `report'\n\
+                                 (sorted table) or `folded' (flame graph\n\
+                                 stacks) [report]\n\
+      --stats[=FORMAT]         report runtime counters to stderr at exit,\n\
+                                 as FORMAT, either `text' or `json' [text]\n\
   -t, --trace=NAME, --traceon=NAME\n\
                                trace NAME when it is defined\n\
       --traceoff=NAME          no longer trace NAME\n\
@@ -164,6 +183,7 @@ FLAGS is any of:\n\
   o   output dumpdef to stderr rather than debug file\n\
   p   show results of path searches in debug\n\
   q   quote values in dumpdef and trace, useful with a or e\n\
+  r   show regular expression cache statistics in debug\n\
   s   show full stack of pushdef values in dumpdef\n\
   t   trace all macro calls, regardless of per-macro traceon state\n\
   x   include unique macro call id in trace, useful with c\n\
@@ -174,7 +194,9 @@ FLAGS is any of:\n\
 If defined, the environment variable `M4PATH' is a colon-separated list\n\
 of directories included after any specified by `-I' or `-B'.  The\n\
 environment variable `POSIXLY_CORRECT' implies -G -Q; otherwise GNU\n\
-extensions are enabled by default.\n\
+extensions are enabled by default.  The environment variable\n\
+`M4_DIVERSION_MEMORY' supplies a default for --diversion-memory, and\n\
+`M4_SERVER' names the socket of an m4 --server to run the invocation.\n\
 "), stdout);
       puts ("");
       fputs (_("\
@@ -191,13 +213,23 @@ mismatch, or whatever value was passed to the m4exit macro.\n\
 enum
 {
   ARGLENGTH_OPTION = CHAR_MAX + 1,      /* not quite -l, because of message */
+  BATCH_MAP_OPTION,                     /* no short opt */
+  CACHE_INCLUDES_OPTION,                /* no short opt */
   DEBUGFILE_OPTION,                     /* no short opt */
+  DIVERSION_MEMORY_OPTION,              /* no short opt */
   ERROR_OUTPUT_OPTION,                  /* not quite -o, because of message */
+  FREEZE_FORMAT_OPTION,                 /* no short opt */
   HASHSIZE_OPTION,                      /* not quite -H, because of message */
   IMPORT_ENVIRONMENT_OPTION,            /* no short opt */
+  JOBS_OPTION,                          /* no short opt */
   POPDEF_OPTION,                        /* no short opt */
+  PROFILE_OPTION,                       /* no short opt */
+  PROFILE_FORMAT_OPTION,                /* no short opt */
   PREPEND_INCLUDE_OPTION,               /* not quite -B, because of message */
+  REGEXP_CACHE_OPTION,                  /* no short opt */
   SAFER_OPTION,                         /* -S still has old no-op semantics */
+  SERVER_OPTION,                        /* no short opt */
+  STATS_OPTION,                         /* no short opt */
   SYNCOUTPUT_OPTION,                    /* not quite -s, because of opt arg */
   TRACEOFF_OPTION,                      /* no short opt */
   WORD_REGEXP_OPTION,                   /* deprecated, used to be -W */
@@ -236,13 +268,23 @@ static const struct option long_options[] =
   {"warnings", no_argument, NULL, 'W'},
 
   {"arglength", required_argument, NULL, ARGLENGTH_OPTION},
+  {"batch-map", required_argument, NULL, BATCH_MAP_OPTION},
+  {"cache-includes", no_argument, NULL, CACHE_INCLUDES_OPTION},
   {"debugfile", optional_argument, NULL, DEBUGFILE_OPTION},
+  {"diversion-memory", required_argument, NULL, DIVERSION_MEMORY_OPTION},
   {"hashsize", required_argument, NULL, HASHSIZE_OPTION},
   {"error-output", required_argument, NULL, ERROR_OUTPUT_OPTION},
+  {"freeze-format", required_argument, NULL, FREEZE_FORMAT_OPTION},
   {"import-environment", no_argument, NULL, IMPORT_ENVIRONMENT_OPTION},
+  {"jobs", required_argument, NULL, JOBS_OPTION},
   {"popdef", required_argument, NULL, POPDEF_OPTION},
+  {"profile", optional_argument, NULL, PROFILE_OPTION},
+  {"profile-format", required_argument, NULL, PROFILE_FORMAT_OPTION},
   {"prepend-include", required_argument, NULL, PREPEND_INCLUDE_OPTION},
+  {"regexp-cache", required_argument, NULL, REGEXP_CACHE_OPTION},
   {"safer", no_argument, NULL, SAFER_OPTION},
+  {"server", required_argument, NULL, SERVER_OPTION},
+  {"stats", optional_argument, NULL, STATS_OPTION},
   {"syncoutput", optional_argument, NULL, SYNCOUTPUT_OPTION},
   {"traceoff", required_argument, NULL, TRACEOFF_OPTION},
   {"word-regexp", required_argument, NULL, WORD_REGEXP_OPTION},
@@ -268,6 +310,58 @@ enum interactive_choice
   INTERACTIVE_NO        /* -b specified last */
 };
 
+/* How an option bears on the requests a --server serves.  */
+enum server_choice
+{
+  SERVER_PER_RUN,       /* Applies to each run only, or warns and is ignored */
+  SERVER_STATE,         /* Sets up state that requests must repeat */
+  SERVER_STATE_AGAIN    /* Likewise, but the request applies it again, as
+                           it names a file or warns */
+};
+
+/* Classify the option OPTCHAR for server_record and server_replayed.
+   A file name ends the options a request shares with the server, and
+   server_matches compares -R separately.  */
+static enum server_choice
+server_option_choice (int optchar)
+{
+  switch (optchar)
+    {
+    case '\1':
+    case '?':
+    case 'F':
+    case 'H':
+    case 'R':
+    case 'S':
+    case 'T':
+    case 'b':
+    case 'e':
+    case 'i':
+    case BATCH_MAP_OPTION:
+    case FREEZE_FORMAT_OPTION:
+    case HASHSIZE_OPTION:
+    case JOBS_OPTION:
+    case PROFILE_OPTION:
+    case PROFILE_FORMAT_OPTION:
+    case SERVER_OPTION:
+    case STATS_OPTION:
+    case WORD_REGEXP_OPTION:
+    case HELP_OPTION:
+    case VERSION_OPTION:
+      return SERVER_PER_RUN;
+
+    case 'B':
+    case 'o':
+    case ARGLENGTH_OPTION:
+    case DEBUGFILE_OPTION:
+    case ERROR_OUTPUT_OPTION:
+      return SERVER_STATE_AGAIN;
+
+    default:
+      return SERVER_STATE;
+    }
+}
+
 /* Convert OPT to size_t, reporting an error using long option index
    OI or short option character OPTCHAR if it does not fit.  */
 static size_t
@@ -316,6 +410,17 @@ main (int argc, char *const *argv, char *const *envp)
   const char *debugfile = NULL;
   const char *frozen_file_to_read = NULL;
   const char *frozen_file_to_write = NULL;
+  int frozen_format = 2;
+  bool profile = false;
+  const char *profile_file = NULL;
+  bool profile_folded = false;
+  bool stats = false;
+  bool stats_json = false;
+  const char *server = NULL;
+  bool served = false;          /* true when serving a --server request */
+  const char *batch_map = NULL;
+  size_t jobs = 1;
+  const char *batch_input = NULL; /* input of a --batch-map job */
   enum interactive_choice interactive = INTERACTIVE_UNKNOWN;
 
   m4 *context;
@@ -331,7 +436,18 @@ main (int argc, char *const *argv, char *const *envp)
   textdomain (PACKAGE);
 #endif
 
+  /* Let a server run this invocation if one is listening, before
+     paying for any startup.  */
+  {
+    const char *env = getenv ("M4_SERVER");
+    if (env && *env)
+      server_client (env, argc, argv, envp);
+  }
+
   context = m4_create ();
+#if M4_STATIC_MODULES
+  m4_set_static_modules (context, m4_static_modules);
+#endif
 
 #ifdef USE_STACKOVF
   setup_stackovf_trap (argv, envp, stackovf_handler);
@@ -342,12 +458,29 @@ main (int argc, char *const *argv, char *const *envp)
       m4_set_posixly_correct_opt (context, true);
       m4_set_suppress_warnings_opt (context, true);
     }
+  {
+    /* The command line overrides this, so a bad value merely earns a
+       warning.  */
+    const char *env = getenv ("M4_DIVERSION_MEMORY");
+    if (env && *env)
+      {
+        unsigned long int value;
+        if (xstrtoul (env, NULL, 10, &value, "kKmMgGtTPEZY0") == LONGINT_OK
+            && value <= SIZE_MAX)
+          m4_set_diversion_memory_opt (context, value);
+        else
+          error (0, 0, _("warning: ignoring invalid %s: %s"),
+                 "M4_DIVERSION_MEMORY",
+                 quotearg_style (locale_quoting_style, env));
+      }
+  }
   set_quoting_style (NULL, escape_quoting_style);
   set_char_quoting (NULL, ':', 1);
 
   /* First, we decode the arguments, to size up tables and stuff.
      Avoid lasting side effects; for example 'm4 --debugfile=oops
      --help' must not create the file `oops'.  */
+ parse_options:
   while (1)
     {
       int oi = -1;
@@ -356,6 +489,18 @@ main (int argc, char *const *argv, char *const *envp)
       if (optchar == -1)
         break;
 
+      /* A server applies its state options once.  A request that
+         starts with the same options is served without applying
+         them again; any other request is declined below.  */
+      if (server_option_choice (optchar) != SERVER_PER_RUN)
+        {
+          if (!served)
+            server_record (optchar, optarg);
+          else if (server_replayed (optchar, optarg, seen_file)
+                   && server_option_choice (optchar) == SERVER_STATE)
+            continue;
+        }
+
       switch (optchar)
         {
         default:
@@ -520,6 +665,52 @@ main (int argc, char *const *argv, char *const *envp)
           m4_set_max_debug_arg_length_opt (context, size);
           break;
 
+        case DIVERSION_MEMORY_OPTION:
+          m4_set_diversion_memory_opt (context,
+                                       size_opt (optarg, oi, optchar));
+          break;
+
+        case FREEZE_FORMAT_OPTION:
+          size = size_opt (optarg, oi, optchar);
+          if (size != 2 && size != 3)
+            m4_error (context, EXIT_FAILURE, 0, NULL,
+                      _("unsupported frozen file format %s"),
+                      quotearg_style (locale_quoting_style, optarg));
+          frozen_format = size;
+          break;
+
+        case REGEXP_CACHE_OPTION:
+          m4_set_regexp_cache_opt (context, size_opt (optarg, oi, optchar));
+          break;
+
+        case PROFILE_OPTION:
+          profile = true;
+          profile_file = optarg;
+          break;
+
+        case PROFILE_FORMAT_OPTION:
+          if (STREQ (optarg, "folded"))
+            profile_folded = true;
+          else if (STREQ (optarg, "report"))
+            profile_folded = false;
+          else
+            m4_error (context, EXIT_FAILURE, 0, NULL,
+                      _("unsupported profile format %s"),
+                      quotearg_style (locale_quoting_style, optarg));
+          break;
+
+        case STATS_OPTION:
+          if (!optarg || STREQ (optarg, "text"))
+            stats_json = false;
+          else if (STREQ (optarg, "json"))
+            stats_json = true;
+          else
+            m4_error (context, EXIT_FAILURE, 0, NULL,
+                      _("unsupported stats format %s"),
+                      quotearg_style (locale_quoting_style, optarg));
+          stats = true;
+          break;
+
         case DEBUGFILE_OPTION:
           /* Staggered handling of '--debugfile', since it is useful
              prior to first file and prior to reloading, but other
@@ -546,10 +737,30 @@ main (int argc, char *const *argv, char *const *envp)
           import_environment = true;
           break;
 
+        case BATCH_MAP_OPTION:
+          batch_map = optarg;
+          break;
+
+        case JOBS_OPTION:
+          jobs = size_opt (optarg, oi, optchar);
+          if (!jobs)
+            m4_error (context, EXIT_FAILURE, 0, NULL,
+                      _("invalid number of jobs: %s"),
+                      quotearg_style (locale_quoting_style, optarg));
+          break;
+
+        case CACHE_INCLUDES_OPTION:
+          m4_set_cache_includes_opt (context, true);
+          break;
+
         case SAFER_OPTION:
           m4_set_safer_opt (context, true);
           break;
 
+        case SERVER_OPTION:
+          server = optarg;
+          break;
+
         case VERSION_OPTION:
           version_etc (stdout, PACKAGE, PACKAGE_NAME, VERSION, AUTHORS, NULL);
           exit (EXIT_SUCCESS);
@@ -561,16 +772,41 @@ main (int argc, char *const *argv, char *const *envp)
         }
     }
 
+  /* A request that needs some other initial state than the server
+     loaded is handed back to its client.  */
+  if (served && (server || !server_matches (context, frozen_file_to_read)))
+    server_decline ();
+  /* Spilled diversions of the server must not be shared with the
+     other requests, which may undivert them or remove them first.  */
+  if (served)
+    m4_output_detach (context);
+  if (server && (seen_file || frozen_file_to_write || import_environment))
+    m4_error (context, EXIT_FAILURE, 0, NULL,
+              _("%s cannot be combined with input files, %s or %s"),
+              "--server", "--freeze-state", "--import-environment");
+  if (batch_map && (seen_file || optind < argc || frozen_file_to_write
+                    || profile || server))
+    m4_error (context, EXIT_FAILURE, 0, NULL,
+              _("%s cannot be combined with input files, %s, %s or %s"),
+              "--batch-map", "--freeze-state", "--profile", "--server");
+
   /* Do the basic initializations.  */
   if (debugfile && !m4_debug_set_output (context, NULL, debugfile))
     m4_error (context, 0, errno, NULL, _("cannot set debug file %s"),
               quotearg_style (locale_quoting_style, debugfile));
-  m4_input_init (context);
-  m4_output_init (context);
+  if (!served)
+    {
+      m4_input_init (context);
+      m4_output_init (context);
+    }
+  if (profile && !server)
+    m4_profile_start (context, profile_file, profile_folded);
+  if (stats && !server)
+    m4_stats_start (context, stats_json);
 
-  if (frozen_file_to_read)
+  if (!served && frozen_file_to_read)
     reload_frozen_state (context, frozen_file_to_read);
-  else
+  else if (!served)
     {
       m4_module_load (context, "m4", NULL);
       if (m4_get_posixly_correct_opt (context))
@@ -693,6 +929,39 @@ main (int argc, char *const *argv, char *const *envp)
       defn = next;
     }
 
+  /* Serve requests with the state loaded so far.  Only a process
+     forked for one request returns, to parse its command line in turn
+     as if it had followed the options of the server.  */
+  if (server)
+    {
+      server_run (context, server, frozen_file_to_read, &argc, &argv, &envp);
+      served = true;
+      head = tail = NULL;
+      import_environment = false;
+      seen_file = false;
+      debugfile = NULL;
+      frozen_file_to_read = NULL;
+      frozen_format = 2;
+      profile = false;
+      profile_file = NULL;
+      profile_folded = false;
+      stats = false;
+      stats_json = false;
+      server = NULL;
+      interactive = INTERACTIVE_UNKNOWN;
+      optind = 0;
+      goto parse_options;
+    }
+
+  /* Run each job of the batch in a process of its own, forked from
+     the state loaded so far, which returns here to expand its input
+     like a single command line file.  */
+  if (batch_map)
+    {
+      batch_input = batch_run (context, batch_map, jobs);
+      seen_file = true;
+    }
+
 
   /* Interactive if specified, or if no input files and stdin and
      stderr are terminals, to match sh behavior.  Interactive mode
@@ -715,7 +984,9 @@ main (int argc, char *const *argv, char *const *envp)
   /* Handle remaining input files.  Each file is pushed on the input,
      and the input read.  */
 
-  if (optind == argc && !seen_file)
+  if (batch_input)
+    process_file (context, batch_input);
+  else if (optind == argc && !seen_file)
     process_file (context, "-");
   else
     for (; optind < argc; optind++)
@@ -727,12 +998,14 @@ main (int argc, char *const *argv, char *const *envp)
     m4_macro_expand_input (context);
 
   if (frozen_file_to_write)
-    produce_frozen_state (context, frozen_file_to_write);
+    produce_frozen_state (context, frozen_file_to_write, frozen_format);
   else
     {
       m4_make_diversion (context, 0);
       m4_undivert_all (context);
     }
+  m4_profile_finish (context);
+  m4_stats_finish (context);
 
   /* The remaining cleanup functions systematically free all of the
      memory we still have pointers to.  By definition, if there is
@@ -740,8 +1013,8 @@ main (int argc, char *const *argv, char *const *envp)
      Strictly, we don't need to do this, but it makes leak detection
      a whole lot easier!  */
 
-  m4_output_exit ();
-  m4_input_exit ();
+  m4_output_exit (context);
+  m4_input_exit (context);
 
   /* Change debug stream back to stderr, to force flushing the debug
      stream and detect any errors it might have encountered.  The
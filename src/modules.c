@@ -0,0 +1,66 @@
+/* GNU m4 -- A simple macro processor
+   Copyright (C) 2017 Free Software Foundation, Inc.
+
+   This file is part of GNU M4.
+
+   GNU M4 is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   GNU M4 is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* This file is only built with --enable-static-modules, in which
+   case the modules shipped with M4 are linked into the executable
+   and listed here, so that loading them needs no dlopen.  */
+
+#include <config.h>
+
+#include "m4.h"
+
+#include "modules/m4.h"
+
+/* The entry point of each module linked in.  */
+extern m4_module_init_func include_gnu;
+extern m4_module_init_func include_m4;
+#if USE_GMP
+extern m4_module_init_func include_mpeval;
+#endif
+extern m4_module_init_func include_stdlib;
+extern m4_module_init_func include_time;
+extern m4_module_init_func include_traditional;
+
+/* The symbols that the m4 module exports to other modules.  */
+extern m4_dump_symbols_func     m4_dump_symbols;
+extern m4_expand_ranges_func    m4_expand_ranges;
+extern m4_make_temp_func        m4_make_temp;
+extern m4_sysval_flush_func     m4_sysval_flush;
+
+static const m4_static_symbol m4_exports[] =
+{
+  { "m4_dump_symbols",  (void *) m4_dump_symbols },
+  { "m4_expand_ranges", (void *) m4_expand_ranges },
+  { "m4_make_temp",     (void *) m4_make_temp },
+  { "m4_sysval_flush",  (void *) m4_sysval_flush },
+  { NULL, NULL },
+};
+
+const m4_static_module m4_static_modules[] =
+{
+  { "gnu",              include_gnu,            NULL },
+  { "m4",               include_m4,             m4_exports },
+#if USE_GMP
+  { "mpeval",           include_mpeval,         NULL },
+#endif
+  { "stdlib",           include_stdlib,         NULL },
+  { "time",             include_time,           NULL },
+  { "traditional",      include_traditional,    NULL },
+  { NULL, NULL, NULL },
+};
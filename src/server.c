@@ -0,0 +1,617 @@
+/* GNU m4 -- A simple macro processor
+   Copyright (C) 2017 Free Software Foundation, Inc.
+
+   This file is part of GNU M4.
+
+   GNU M4 is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   GNU M4 is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* This module implements the persistent server of --server, and the
+   client that forwards an invocation to it when M4_SERVER is set.
+
+   The server loads modules and frozen state once, then listens on a
+   Unix domain socket.  A client connects and sends a header, its
+   standard input, output and error and its working directory as
+   file descriptors, and then its command line and environment as a
+   sequence of NUL-terminated strings.  For each connection the
+   server forks a handler, which reads the request and forks again;
+   the grandchild installs the client's descriptors, working
+   directory and environment, and returns to main to process the
+   command line on top of the warmed up state, writing straight to
+   the client's streams.  The handler waits for it, and replies with
+   its wait status.
+
+   The options that set up the server's state are recorded, and a
+   request is only served if its options before the first file start
+   with the same ones in the same order; those are skipped rather than
+   applied a second time.  A request whose command line or environment
+   asks for a different initial state than the server's, such as
+   another frozen file or other options, is declined instead: the
+   grandchild replies that the server cannot serve it, and the client
+   runs the invocation itself.  The client also runs locally when no
+   server is listening, so that setting M4_SERVER never changes the
+   result, only the speed.
+
+   The socket is only accessible to the user running the server, and
+   a connection from a process of any other user is dropped.  */
+
+#include <config.h>
+
+#include <fcntl.h>
+#include <locale.h>
+
+#include "m4.h"
+
+#include "full-read.h"
+#include "full-write.h"
+#include "quotearg.h"
+#include "stat-time.h"
+#include "xvasprintf.h"
+
+#if HAVE_SYS_UN_H
+# include <sys/socket.h>
+# include <sys/un.h>
+# include <sys/wait.h>
+#endif
+
+#define SERVER_MAGIC    0x4d345331      /* "M4S1" */
+
+/* The descriptors that accompany a request, in order.  */
+enum
+{
+  SERVER_FD_STDIN,
+  SERVER_FD_STDOUT,
+  SERVER_FD_STDERR,
+  SERVER_FD_CWD,
+  SERVER_FDS
+};
+
+/* The fixed part of a request, followed by SIZE bytes holding ARGC
+   command line arguments and then ENVC environment entries.  */
+typedef struct
+{
+  uint32_t magic;
+  uint32_t argc;
+  uint32_t envc;
+  uint32_t size;
+} server_header;
+
+/* The reply to a request.  */
+typedef struct
+{
+  int32_t declined;             /* Nonzero if the client must run it.  */
+  int32_t status;               /* Wait status of the request.  */
+} server_reply;
+
+/* Environment variables that are only consulted at startup, so that a
+   request must agree with the server on them.  */
+static const char *const server_environ[] =
+{
+  "M4PATH",
+  "M4_DIVERSION_MEMORY",
+  "POSIXLY_CORRECT",
+  NULL
+};
+
+/* An option given on the command line of the server.  */
+typedef struct
+{
+  int code;                     /* Option character or code.  */
+  const char *value;            /* Argument, or NULL.  */
+} server_option;
+
+/* What the server started with, for comparison with each request.  */
+static char *server_env_values[sizeof server_environ
+                               / sizeof *server_environ];
+static bool server_frozen;
+static struct stat server_frozen_st;
+static bool server_posixly_correct;
+static bool server_prefix_builtins;
+static server_option *server_options;
+static size_t server_options_count;
+static size_t server_options_alloc;
+
+/* How many of server_options the request has repeated so far, and
+   whether it has given anything else since.  */
+static size_t server_replay;
+static bool server_replay_done;
+
+/* The connection of the request being served, in the grandchild.  */
+static int server_fd = -1;
+
+#if HAVE_SYS_UN_H
+
+/* Fill *ADDR with the address of socket NAME, returning false if NAME
+   is too long to be one.  */
+static bool
+server_address (const char *name, struct sockaddr_un *addr)
+{
+  size_t len = strlen (name);
+
+  if (sizeof addr->sun_path <= len)
+    return false;
+  memset (addr, 0, sizeof *addr);
+  addr->sun_family = AF_UNIX;
+  memcpy (addr->sun_path, name, len + 1);
+  return true;
+}
+
+/* Return a socket connected to the server at ADDR, or -1.  */
+static int
+server_connect (const struct sockaddr_un *addr)
+{
+  int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+
+  if (fd < 0)
+    return -1;
+  if (connect (fd, (const struct sockaddr *) addr, sizeof *addr) != 0)
+    {
+      close (fd);
+      return -1;
+    }
+  return fd;
+}
+
+/* Return true if the process at the other end of connection FD runs
+   as the same user as the server.  */
+static bool
+server_peer_trusted (int fd)
+{
+# if HAVE_GETPEEREID
+  uid_t uid;
+  gid_t gid;
+
+  return getpeereid (fd, &uid, &gid) == 0 && uid == geteuid ();
+# elif defined SO_PEERCRED
+  struct ucred cred;
+  socklen_t len = sizeof cred;
+
+  return (getsockopt (fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0
+          && len == sizeof cred && cred.uid == geteuid ());
+# else
+  return false;
+# endif
+}
+
+/* Point the first COUNT elements of VEC at consecutive NUL-terminated
+   strings starting at BUF and ending by END, and terminate VEC with
+   NULL.  Return the end of the last string, or NULL if there are not
+   that many strings.  */
+static char *
+server_split (char *buf, char *end, size_t count, char **vec)
+{
+  size_t i;
+
+  for (i = 0; i < count; i++)
+    {
+      char *nul = (char *) memchr (buf, '\0', end - buf);
+      if (!nul)
+        return NULL;
+      vec[i] = buf;
+      buf = nul + 1;
+    }
+  vec[count] = NULL;
+  return buf;
+}
+
+/* Send REPLY on FD, ignoring failure since the client may already
+   have hung up.  */
+static void
+server_send_reply (int fd, const server_reply *reply)
+{
+  full_write (fd, reply, sizeof *reply);
+}
+
+/* Read the request on connection FD, in a handler forked by the
+   server.  Return only in the grandchild that must serve it, with
+   *ARGC, *ARGV and *ENVP set from the request; otherwise wait for the
+   grandchild and reply with its status, or drop an invalid request,
+   and exit.  */
+static void
+server_handle (int fd, int *argc, char *const **argv, char *const **envp)
+{
+  server_header header;
+  int fds[SERVER_FDS];
+  char control[CMSG_SPACE (sizeof fds)];
+  struct iovec iov;
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  char *buf;
+  char *end;
+  char *rest;
+  char **args;
+  char **env;
+  server_reply reply;
+  pid_t pid;
+  int status;
+  int i;
+
+  if (!server_peer_trusted (fd))
+    _exit (EXIT_FAILURE);
+
+  memset (&msg, 0, sizeof msg);
+  iov.iov_base = &header;
+  iov.iov_len = sizeof header;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof control;
+  if (recvmsg (fd, &msg, 0) != sizeof header
+      || header.magic != SERVER_MAGIC || header.argc == 0)
+    _exit (EXIT_FAILURE);
+  cmsg = CMSG_FIRSTHDR (&msg);
+  if (!cmsg || cmsg->cmsg_level != SOL_SOCKET
+      || cmsg->cmsg_type != SCM_RIGHTS
+      || cmsg->cmsg_len != CMSG_LEN (sizeof fds))
+    _exit (EXIT_FAILURE);
+  memcpy (fds, CMSG_DATA (cmsg), sizeof fds);
+
+  buf = (char *) xmalloc (header.size);
+  args = (char **) xnmalloc (header.argc + 1, sizeof *args);
+  env = (char **) xnmalloc (header.envc + 1, sizeof *env);
+  end = buf + header.size;
+  if (full_read (fd, buf, header.size) != header.size
+      || !(rest = server_split (buf, end, header.argc, args))
+      || server_split (rest, end, header.envc, env) != end)
+    _exit (EXIT_FAILURE);
+
+  pid = fork ();
+  if (pid == 0)
+    {
+      for (i = SERVER_FD_STDIN; i <= SERVER_FD_STDERR; i++)
+        if (dup2 (fds[i], i) < 0)
+          _exit (EXIT_FAILURE);
+      if (fchdir (fds[SERVER_FD_CWD]) != 0)
+        _exit (EXIT_FAILURE);
+      for (i = 0; i < SERVER_FDS; i++)
+        if (fds[i] > STDERR_FILENO)
+          close (fds[i]);
+      set_cloexec_flag (fd, true);
+      server_fd = fd;
+
+      environ = env;
+      setlocale (LC_ALL, "");
+      for (i = 0; server_environ[i]; i++)
+        {
+          const char *value = getenv (server_environ[i]);
+          if (!value != !server_env_values[i]
+              || (value && !STREQ (value, server_env_values[i])))
+            server_decline ();
+        }
+
+      *argc = header.argc;
+      *argv = args;
+      *envp = env;
+      return;
+    }
+
+  for (i = 0; i < SERVER_FDS; i++)
+    close (fds[i]);
+  memset (&reply, 0, sizeof reply);
+  if (pid < 0 || waitpid (pid, &status, 0) != pid)
+    status = EXIT_FAILURE << 8;
+  reply.status = status;
+  server_send_reply (fd, &reply);
+  _exit (EXIT_SUCCESS);
+}
+
+#endif /* HAVE_SYS_UN_H */
+
+
+/* Forward this invocation, with arguments ARGC and ARGV and
+   environment ENVP, to the server listening on socket NAME.  Exit
+   with its status if it was served; return if it must run locally,
+   because no server is listening there or the server declined it.  */
+void
+server_client (const char *name, int argc, char *const *argv,
+               char *const *envp)
+{
+#if HAVE_SYS_UN_H
+  struct sockaddr_un addr;
+  server_header header;
+  server_reply reply;
+  int fds[SERVER_FDS];
+  char control[CMSG_SPACE (sizeof fds)];
+  struct iovec iov;
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  m4_obstack obs;
+  char *buf;
+  size_t size;
+  char *const *env;
+  int fd;
+  int i;
+
+  if (!server_address (name, &addr) || (fd = server_connect (&addr)) < 0)
+    return;
+  fds[SERVER_FD_STDIN] = STDIN_FILENO;
+  fds[SERVER_FD_STDOUT] = STDOUT_FILENO;
+  fds[SERVER_FD_STDERR] = STDERR_FILENO;
+  fds[SERVER_FD_CWD] = open (".", O_RDONLY);
+  if (fds[SERVER_FD_CWD] < 0)
+    {
+      close (fd);
+      return;
+    }
+
+  obstack_init (&obs);
+  for (i = 0; i < argc; i++)
+    obstack_grow (&obs, argv[i], strlen (argv[i]) + 1);
+  for (env = envp; *env; env++)
+    obstack_grow (&obs, *env, strlen (*env) + 1);
+  header.magic = SERVER_MAGIC;
+  header.argc = argc;
+  header.envc = env - envp;
+  size = obstack_object_size (&obs);
+  header.size = size;
+  buf = (char *) obstack_finish (&obs);
+
+  memset (&msg, 0, sizeof msg);
+  memset (control, 0, sizeof control);
+  iov.iov_base = &header;
+  iov.iov_len = sizeof header;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof control;
+  cmsg = CMSG_FIRSTHDR (&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN (sizeof fds);
+  memcpy (CMSG_DATA (cmsg), fds, sizeof fds);
+
+  /* A server that goes away before reading the whole request has not
+     run any of it, so the invocation can still run locally, as can
+     one too large to send.  */
+  if (header.size != size || sendmsg (fd, &msg, 0) != sizeof header
+      || full_write (fd, buf, size) != size)
+    {
+      close (fds[SERVER_FD_CWD]);
+      close (fd);
+      obstack_free (&obs, NULL);
+      return;
+    }
+  close (fds[SERVER_FD_CWD]);
+  obstack_free (&obs, NULL);
+
+  if (full_read (fd, &reply, sizeof reply) != sizeof reply)
+    error (EXIT_FAILURE, errno, _("lost connection to server %s"),
+           quotearg_style (locale_quoting_style, name));
+  close (fd);
+  if (reply.declined)
+    return;
+
+  if (WIFSIGNALED (reply.status))
+    {
+      signal (WTERMSIG (reply.status), SIG_DFL);
+      raise (WTERMSIG (reply.status));
+    }
+  exit (WIFEXITED (reply.status) ? WEXITSTATUS (reply.status) : EXIT_FAILURE);
+#endif /* HAVE_SYS_UN_H */
+}
+
+/* Serve requests on socket NAME, with the state already loaded into
+   CONTEXT, including the frozen file FROZEN if not NULL.  Never
+   return in the server itself; return only in a process forked to
+   serve one request, with its standard streams, working directory and
+   environment installed, and *ARGC, *ARGV and *ENVP replaced by the
+   request's command line and environment.  */
+void
+server_run (m4 *context, const char *name, const char *frozen,
+            int *argc, char *const **argv, char *const **envp)
+{
+#if HAVE_SYS_UN_H
+  struct sockaddr_un addr;
+  struct sockaddr_un tmp_addr;
+  struct stat st;
+  char *tmp;
+  bool bound = false;
+  mode_t old_umask;
+  int listen_fd;
+  int fd;
+  int i;
+
+# if !HAVE_GETPEEREID && !defined SO_PEERCRED
+  m4_error (context, EXIT_FAILURE, 0, NULL,
+            _("--server is not supported on this system"));
+# endif
+
+  for (i = 0; server_environ[i]; i++)
+    {
+      const char *value = getenv (server_environ[i]);
+      server_env_values[i] = value ? xstrdup (value) : NULL;
+    }
+  if (frozen && stat (frozen, &server_frozen_st) == 0)
+    server_frozen = true;
+  /* The frozen file may be rewritten in place while the server runs,
+     so stop depending on it for definitions still deferred to it.  */
+  m4__symtab_load (M4SYMTAB);
+  server_posixly_correct = m4_get_posixly_correct_opt (context);
+  server_prefix_builtins = m4_get_prefix_builtins_opt (context);
+
+  if (!server_address (name, &addr))
+    m4_error (context, EXIT_FAILURE, 0, NULL, _("socket name too long: %s"),
+              quotearg_style (locale_quoting_style, name));
+
+  /* Replace a socket left behind by a server that is gone, but not
+     one that is still answering.  */
+  fd = server_connect (&addr);
+  if (0 <= fd)
+    m4_error (context, EXIT_FAILURE, 0, NULL,
+              _("a server is already listening on %s"),
+              quotearg_style (locale_quoting_style, name));
+  if (lstat (name, &st) == 0)
+    {
+      if (!S_ISSOCK (st.st_mode))
+        m4_error (context, EXIT_FAILURE, EEXIST, NULL,
+                  _("cannot listen on %s"),
+                  quotearg_style (locale_quoting_style, name));
+      unlink (name);
+    }
+
+  /* Listen under a temporary name first, so that a client never
+     finds a socket that does not accept connections yet.  Only the
+     user running the server may connect to it.  */
+  tmp = xasprintf ("%s.%lu", name, (unsigned long int) getpid ());
+  if (!server_address (tmp, &tmp_addr))
+    m4_error (context, EXIT_FAILURE, 0, NULL, _("socket name too long: %s"),
+              quotearg_style (locale_quoting_style, name));
+  if (lstat (tmp, &st) == 0 && S_ISSOCK (st.st_mode))
+    unlink (tmp);
+  listen_fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (0 <= listen_fd)
+    {
+      old_umask = umask (077);
+      bound = bind (listen_fd, (struct sockaddr *) &tmp_addr,
+                    sizeof tmp_addr) == 0;
+      umask (old_umask);
+    }
+  if (!bound || listen (listen_fd, SOMAXCONN) != 0
+      || rename (tmp, name) != 0)
+    {
+      int saved_errno = errno;
+      if (bound)
+        unlink (tmp);
+      m4_error (context, EXIT_FAILURE, saved_errno, NULL,
+                _("cannot listen on %s"),
+                quotearg_style (locale_quoting_style, name));
+    }
+  free (tmp);
+  set_cloexec_flag (listen_fd, true);
+
+  /* Handlers are never waited for.  */
+  signal (SIGCHLD, SIG_IGN);
+
+  while (1)
+    {
+      pid_t pid;
+
+      fd = accept (listen_fd, NULL, NULL);
+      if (fd < 0)
+        {
+          if (errno == EINTR || errno == ECONNABORTED)
+            continue;
+          m4_error (context, EXIT_FAILURE, errno, NULL,
+                    _("cannot accept connection on %s"),
+                    quotearg_style (locale_quoting_style, name));
+        }
+
+      /* Each handler starts with a copy of the state, including the
+         diversions spilled to files, which it copies in turn once it
+         accepts the request.  */
+      fflush (NULL);
+      pid = fork ();
+      if (pid == 0)
+        {
+          close (listen_fd);
+          signal (SIGCHLD, SIG_DFL);
+          signal (SIGPIPE, SIG_IGN);
+          server_handle (fd, argc, argv, envp);
+          signal (SIGPIPE, SIG_DFL);
+          return;
+        }
+      if (pid < 0)
+        m4_error (context, 0, errno, NULL, _("cannot fork"));
+      close (fd);
+    }
+#else
+  m4_error (context, EXIT_FAILURE, 0, NULL,
+            _("--server is not supported on this system"));
+#endif /* HAVE_SYS_UN_H */
+}
+
+/* Record the option CODE with argument VALUE, or NULL, from the
+   command line of what may become the server.  VALUE must remain
+   valid.  */
+void
+server_record (int code, const char *value)
+{
+  if (server_options_count == server_options_alloc)
+    server_options = (server_option *) x2nrealloc (server_options,
+                                                   &server_options_alloc,
+                                                   sizeof *server_options);
+  server_options[server_options_count].code = code;
+  server_options[server_options_count].value = value;
+  server_options_count++;
+}
+
+/* Return true if the option CODE with argument VALUE, or NULL, of the
+   request being served is the next one the server was started with,
+   so that the server has already applied it.  SEEN_FILE is true once
+   the request has named an input file, after which nothing more
+   matches.  */
+bool
+server_replayed (int code, const char *value, bool seen_file)
+{
+  const server_option *option;
+
+  if (server_replay_done || seen_file
+      || server_replay == server_options_count)
+    {
+      server_replay_done = true;
+      return false;
+    }
+  option = &server_options[server_replay];
+  if (option->code != code || !option->value != !value
+      || (value && !STREQ (option->value, value)))
+    {
+      server_replay_done = true;
+      return false;
+    }
+  server_replay++;
+  return true;
+}
+
+/* Return true if the request being served, after its command line
+   has been parsed into CONTEXT, expects the same initial state as the
+   server provides; FROZEN is the file it asked to reload, or NULL.  */
+bool
+server_matches (m4 *context, const char *frozen)
+{
+  struct stat st;
+  struct timespec mtime;
+  struct timespec server_mtime;
+
+  if (server_replay != server_options_count
+      || m4_get_posixly_correct_opt (context) != server_posixly_correct
+      || m4_get_prefix_builtins_opt (context) != server_prefix_builtins)
+    return false;
+  if (!frozen)
+    return !server_frozen;
+  if (!server_frozen || stat (frozen, &st) != 0)
+    return false;
+  /* Freezing rewrites the file in place, possibly within a second.  */
+  mtime = get_stat_mtime (&st);
+  server_mtime = get_stat_mtime (&server_frozen_st);
+  return (st.st_dev == server_frozen_st.st_dev
+          && st.st_ino == server_frozen_st.st_ino
+          && st.st_size == server_frozen_st.st_size
+          && mtime.tv_sec == server_mtime.tv_sec
+          && mtime.tv_nsec == server_mtime.tv_nsec);
+}
+
+/* Tell the client of the request being served to run it itself, and
+   exit without touching any of its streams.  */
+void
+server_decline (void)
+{
+#if HAVE_SYS_UN_H
+  server_reply reply;
+
+  memset (&reply, 0, sizeof reply);
+  reply.declined = 1;
+  server_send_reply (server_fd, &reply);
+#endif /* HAVE_SYS_UN_H */
+  _exit (EXIT_SUCCESS);
+}
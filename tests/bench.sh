@@ -0,0 +1,151 @@
+#!/bin/sh
+# This file is part of the GNU m4 testsuite
+# Copyright (C) 2017 Free Software Foundation, Inc.
+#
+# This file is part of GNU M4.
+#
+# GNU M4 is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# GNU M4 is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+# Run the performance workloads behind 'make bench'.
+#
+# Usage: bench.sh SRCDIR [WORKLOAD]...
+#
+# Each workload is generated afresh under $BENCH_DIR from fixed
+# parameters, so that runs are reproducible, then timed by $BENCHRUN,
+# which prints one line of JSON per workload on standard output.
+# With no WORKLOAD, all of them are run.  Set BENCH_SCALE to multiply
+# the size of every workload, and BENCH_RUNS to change how many runs
+# each one gets; the fastest is reported.
+
+srcdir=${1?usage: bench.sh SRCDIR [WORKLOAD]...}
+shift
+
+: ${M4=tests/m4}
+: ${BENCHRUN=tests/benchrun}
+: ${BENCH_DIR=tests/bench.dir}
+: ${BENCH_SCALE=1}
+: ${BENCH_RUNS=3}
+: ${AWK=awk}
+
+workloads='forloop shift regexp divert freeze2 freeze3 quotes'
+test $# = 0 && set x $workloads && shift
+
+rm -rf "$BENCH_DIR" && mkdir "$BENCH_DIR" || exit 1
+
+# bench NAME OPS ARG... - time $M4 ARG... as workload NAME.
+bench ()
+{
+  name=$1 ops=$2
+  shift 2
+  "$BENCHRUN" -r "$BENCH_RUNS" "$name" "$ops" "$M4" ${1+"$@"} || status=1
+}
+
+# scale N - print N times BENCH_SCALE.
+scale ()
+{
+  expr "$1" \* "$BENCH_SCALE"
+}
+
+status=0
+for workload
+do
+  case $workload in
+
+  # Recursion through rescanning, with the forloop of the manual.
+  forloop)
+    n=`scale 50000`
+    echo "include(\`forloop2.m4')forloop(\`i', \`1', \`$n', \`i
+')" > "$BENCH_DIR/forloop.m4"
+    bench forloop $n -I "$srcdir/doc/examples" "$BENCH_DIR/forloop.m4"
+    ;;
+
+  # Peeling one argument at a time off a long $@.
+  shift)
+    n=`scale 20000`
+    $AWK -v n=$n 'BEGIN {
+      print "define(`count'"'"', `ifelse(`$#'"'"', `1'"'"', `$1'"'"',"
+      print "  `$0(shift($@))'"'"')'"'"')dnl"
+      printf "count("
+      for (i = 1; i < n; i++)
+        printf "`arg%d'"'"',", i
+      printf "`arg%d'"'"')\n", n
+    }' > "$BENCH_DIR/shift.m4"
+    bench shift $n "$BENCH_DIR/shift.m4"
+    ;;
+
+  # Repeated substitutions and searches with a handful of patterns.
+  regexp)
+    n=`scale 20000`
+    cat > "$BENCH_DIR/regexp.m4" <<EOF
+define(\`text', \`The quick brown fox jumps over the lazy dog')dnl
+forloop(\`i', \`1', \`$n', \`patsubst(text, \`\\(o\\)\\(.\\)', \`\\2\\1')
+regexp(text, \`\\b\\([a-z]+\\) \\([a-z]+\\)\$', \`\\2 \\1')
+patsubst(text, \`[aeiou]+')
+')dnl
+EOF
+    bench regexp `expr $n \* 3` "$BENCH_DIR/regexp.m4"
+    ;;
+
+  # Enough text in ten diversions to keep spilling them to files.
+  divert)
+    n=`scale 100000`
+    cat > "$BENCH_DIR/divert.m4" <<EOF
+define(\`row', \`A line of diverted text, long enough to add up quickly.
+')dnl
+forloop(\`i', \`1', \`$n', \`divert(eval(i % 10 + 1))row')dnl
+divert\`'undivert
+EOF
+    bench divert $n --diversion-memory=64k "$BENCH_DIR/divert.m4"
+    ;;
+
+  # Reloading a symbol table about the size of autoconf's, in each
+  # frozen file format.
+  freeze2 | freeze3)
+    n=`scale 4000`
+    format=`expr "$workload" : 'freeze\(.*\)'`
+    $AWK -v n=$n 'BEGIN {
+      for (i = 1; i <= n; i++)
+        {
+          printf "define(`AC_MACRO_%d'"'"', `m4_ifval([$1], [$1], [", i
+          printf "AC_MSG_CHECKING([for feature %d])dnl", i
+          printf "AS_IF([test \"x$ac_cv_%d\" = xyes], [$2], [$3])", i
+          printf "])'"'"')dnl\n"
+          if (i % 4 == 0)
+            printf "pushdef(`AC_MACRO_%d'"'"', `_$0($@)'"'"')dnl\n", i
+        }
+    }' > "$BENCH_DIR/symbols.m4"
+    "$M4" --freeze-format=$format -F "$BENCH_DIR/$workload.m4f" \
+      "$BENCH_DIR/symbols.m4" < /dev/null || { status=1; continue; }
+    bench $workload $n -R "$BENCH_DIR/$workload.m4f" /dev/null
+    ;;
+
+  # Scanning quoted strings and comments with multi-byte delimiters.
+  quotes)
+    n=`scale 50000`
+    $AWK -v n=$n 'BEGIN {
+      print "changequote(`<<['"'"', `]>>'"'"')changecom(`/*'"'"', `*/'"'"')dnl"
+      for (i = 1; i <= n; i++)
+        printf "plain %d, <<[quoted <<[nested]>> text]>> /* a comment */\n", i
+    }' > "$BENCH_DIR/quotes.m4"
+    bench quotes $n "$BENCH_DIR/quotes.m4"
+    ;;
+
+  *)
+    echo "bench.sh: unknown workload '$workload'" >&2
+    status=1
+    ;;
+  esac
+done
+
+exit $status
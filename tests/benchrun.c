@@ -0,0 +1,123 @@
+/* GNU m4 -- A simple macro processor
+   Copyright (C) 2017 Free Software Foundation, Inc.
+
+   This file is part of GNU M4.
+
+   GNU M4 is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   GNU M4 is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Time one benchmark workload, for tests/bench.sh.
+
+   Usage: benchrun [-r RUNS] NAME OPS COMMAND [ARG]...
+
+   Run COMMAND RUNS times, with standard input and standard output
+   redirected to /dev/null, and print one line of JSON describing the
+   fastest run: the workload NAME, the OPS it performs, the wall clock
+   seconds it took, the resulting operations per second, and the
+   largest resident set size of any run in kilobytes.  Exit with
+   status 1 if any run of COMMAND fails.  */
+
+#include <config.h>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "m4private.h"
+
+#include "gethrxtime.h"
+
+#define DEFAULT_RUNS    3
+
+/* Run ARGV once, storing its wall clock time in *ELAPSED and its peak
+   resident set size in kilobytes in *MAXRSS.  Return its wait
+   status, or -1 if it could not be started.  */
+static int
+run_once (char **argv, xtime_t *elapsed, long *maxrss)
+{
+  struct rusage usage;
+  xtime_t start;
+  pid_t pid;
+  int status;
+
+  start = gethrxtime ();
+  pid = fork ();
+  if (pid < 0)
+    return -1;
+  if (pid == 0)
+    {
+      int fd = open ("/dev/null", O_RDWR);
+      if (fd < 0 || dup2 (fd, STDIN_FILENO) < 0
+          || dup2 (fd, STDOUT_FILENO) < 0)
+        _exit (127);
+      execvp (argv[0], argv);
+      fprintf (stderr, "benchrun: cannot run %s: %s\n", argv[0],
+               strerror (errno));
+      _exit (127);
+    }
+  if (wait4 (pid, &status, 0, &usage) != pid)
+    return -1;
+  *elapsed = gethrxtime () - start;
+  *maxrss = usage.ru_maxrss;
+  return status;
+}
+
+int
+main (int argc, char **argv)
+{
+  const char *name;
+  unsigned long ops;
+  unsigned long runs = DEFAULT_RUNS;
+  xtime_t best = 0;
+  long peak = 0;
+  double seconds;
+  unsigned long i;
+
+  if (argc > 2 && strcmp (argv[1], "-r") == 0)
+    {
+      runs = strtoul (argv[2], NULL, 10);
+      argc -= 2;
+      argv += 2;
+    }
+  if (argc < 4 || runs == 0)
+    {
+      fprintf (stderr, "usage: benchrun [-r RUNS] NAME OPS COMMAND [ARG]...\n");
+      return 2;
+    }
+  name = argv[1];
+  ops = strtoul (argv[2], NULL, 10);
+
+  for (i = 0; i < runs; i++)
+    {
+      xtime_t elapsed;
+      long maxrss;
+      int status = run_once (argv + 3, &elapsed, &maxrss);
+
+      if (status != 0)
+        {
+          fprintf (stderr, "benchrun: %s: %s failed\n", name, argv[3]);
+          return 1;
+        }
+      if (i == 0 || elapsed < best)
+        best = elapsed;
+      if (peak < maxrss)
+        peak = maxrss;
+    }
+
+  seconds = best / 1e9;
+  printf ("{\"workload\": \"%s\", \"ops\": %lu, \"runs\": %lu, "
+          "\"seconds\": %.6f, \"ops_per_sec\": %.0f, \"maxrss_kb\": %ld}\n",
+          name, ops, runs, seconds, seconds > 0 ? ops / seconds : 0.0, peak);
+  return ferror (stdout) || fclose (stdout) ? 1 : 0;
+}
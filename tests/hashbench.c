@@ -0,0 +1,431 @@
+/* GNU m4 -- A simple macro processor
+   Copyright (C) 2017 Free Software Foundation, Inc.
+
+   This file is part of GNU M4.
+
+   GNU M4 is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   GNU M4 is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Compare the symbol table hash functions on a real set of names.
+
+   Usage: hashbench [-r ROUNDS] FILE...
+
+   Each FILE is either a frozen state file (such as autoconf.m4f),
+   whose F and T records supply the names, or a plain list with one
+   name per line.  For each hash function, report how many names
+   share a full hash value, how many share a starting slot in a
+   table sized the way m4_symtab_create would size it, the average
+   probe length, and the rate of successful lookups through
+   m4_hash_lookup.  */
+
+#include <config.h>
+
+#include <time.h>
+
+#include "m4private.h"
+
+#define DEFAULT_ROUNDS  200
+
+/* Match M4_SYMTAB_DEFAULT_SIZE in m4/symtab.c.  */
+#define SYMTAB_SIZE     2047
+
+typedef struct
+{
+  const char *name;
+  size_t (*func) (const char *, size_t);
+} hash_function;
+
+static const hash_function functions[] =
+{
+  { "bytewise", m4__hash_mem_bytewise },
+  { "wordwise", m4__hash_mem_wordwise },
+  { NULL, NULL }
+};
+
+/* The function currently being measured through m4_hash.  */
+static size_t (*current_func) (const char *, size_t);
+
+static m4_string *names;
+static size_t names_count;
+static size_t names_alloc;
+
+
+static void
+add_name (const char *str, size_t len)
+{
+  if (names_count == names_alloc)
+    names = (m4_string *) x2nrealloc (names, &names_alloc, sizeof *names);
+  names[names_count].str = xmemdup0 (str, len);
+  names[names_count].len = len;
+  names_count++;
+}
+
+/* Read one byte of a frozen file string from IN, decoding the escapes
+   that produce_mem_dump may generate.  Return EOF on a bad escape.  */
+static int
+decode_char (FILE *in)
+{
+  int ch = getc (in);
+  int value;
+  int i;
+
+  while (ch == '\\')
+    {
+      ch = getc (in);
+      switch (ch)
+        {
+        case 'a': return '\a';
+        case 'b': return '\b';
+        case 'f': return '\f';
+        case 'n': return '\n';
+        case 'r': return '\r';
+        case 't': return '\t';
+        case 'v': return '\v';
+        case '\\': return '\\';
+        case '\n': ch = getc (in); continue;
+        case 'x': case 'X':
+          for (value = i = 0; i < 2; i++)
+            {
+              ch = getc (in);
+              if (!isxdigit (ch))
+                return EOF;
+              value = value * 16 + (isdigit (ch) ? ch - '0'
+                                    : tolower (ch) - 'a' + 10);
+            }
+          return value;
+        default:
+          if (ch < '0' || '7' < ch)
+            return EOF;
+          for (value = i = 0; i < 3 && '0' <= ch && ch <= '7'; i++)
+            {
+              value = value * 8 + ch - '0';
+              ch = getc (in);
+            }
+          ungetc (ch, in);
+          return value;
+        }
+    }
+  return ch;
+}
+
+/* Decode LEN bytes from IN onto OBS, or discard them if OBS is NULL.
+   Only frozen file VERSION 2 and later use escapes.  Return false on
+   premature end of file.  */
+static bool
+decode_string (FILE *in, size_t len, m4_obstack *obs, int version)
+{
+  while (len--)
+    {
+      int ch = version > 1 ? decode_char (in) : getc (in);
+      if (ch == EOF)
+        return false;
+      if (obs)
+        obstack_1grow (obs, ch);
+    }
+  return true;
+}
+
+/* Read a comma separated list of up to three numbers from IN, ending
+   in a newline, into NUMBERS.  Return how many numbers were present,
+   or 0 on malformed input.  */
+static int
+read_numbers (FILE *in, long numbers[3])
+{
+  int i = 0;
+  int ch;
+
+  numbers[0] = numbers[1] = numbers[2] = 0;
+  while ((ch = getc (in)) != '\n')
+    {
+      if (ch == ',' && i < 2)
+        i++;
+      else if (isdigit (ch))
+        numbers[i] = numbers[i] * 10 + ch - '0';
+      else if (ch != '-')
+        return 0;
+    }
+  return i + 1;
+}
+
+/* Collect the symbol names defined by the frozen file IN.  */
+static void
+load_frozen (const char *file, FILE *in)
+{
+  m4_obstack obs;
+  int version = 1;
+  long numbers[3];
+  int ch;
+
+  obstack_init (&obs);
+  while ((ch = getc (in)) != EOF)
+    {
+      /* Lengths of the strings following the header line; only the
+         first string of an F or T record is kept.  */
+      long fields[3];
+      int count = 0;
+      int n = 0;
+      bool ok = true;
+      int i;
+
+      switch (ch)
+        {
+        case '\n':
+          continue;
+
+        case '#':
+          while ((ch = getc (in)) != '\n' && ch != EOF)
+            ;
+          continue;
+
+        case 'V':
+          ok = read_numbers (in, numbers) == 1;
+          version = numbers[0];
+          if (ok)
+            continue;
+          break;
+
+        case 'S':
+          getc (in);
+          /* fall through */
+        case 'M': case 'R': case 'd': case 't':
+          ok = (n = read_numbers (in, numbers)) == 1;
+          fields[count++] = numbers[0];
+          break;
+
+        case 'C': case 'Q':
+          ok = (n = read_numbers (in, numbers)) == 2;
+          fields[count++] = numbers[0];
+          fields[count++] = numbers[1];
+          break;
+
+        case 'D':
+          ok = (n = read_numbers (in, numbers)) == 2;
+          fields[count++] = numbers[1];
+          break;
+
+        case 'F': case 'T':
+          n = read_numbers (in, numbers);
+          ok = n >= 2;
+          for (i = 0; i < n; i++)
+            fields[count++] = numbers[i];
+          break;
+
+        default:
+          ok = false;
+          break;
+        }
+
+      /* Version 1 strings are concatenated, while later versions
+         end each string with a newline.  */
+      for (i = 0; ok && i < count; i++)
+        {
+          bool keep = i == 0 && (ch == 'F' || ch == 'T');
+          ok = decode_string (in, fields[i], keep ? &obs : NULL, version);
+          if (ok && keep)
+            {
+              size_t len = obstack_object_size (&obs);
+              add_name ((char *) obstack_finish (&obs), len);
+            }
+          if (ok && version > 1 && i + 1 < count)
+            ok = getc (in) == '\n';
+        }
+
+      if (!ok || getc (in) != '\n')
+        error (EXIT_FAILURE, 0, "%s: unrecognized frozen file record `%c'",
+               file, ch);
+    }
+  obstack_free (&obs, NULL);
+}
+
+/* Collect one name per line from IN.  */
+static void
+load_list (FILE *in)
+{
+  m4_obstack obs;
+  int ch;
+
+  obstack_init (&obs);
+  do
+    {
+      ch = getc (in);
+      if (ch != '\n' && ch != EOF)
+        obstack_1grow (&obs, ch);
+      else if (obstack_object_size (&obs))
+        {
+          size_t len = obstack_object_size (&obs);
+          add_name ((char *) obstack_finish (&obs), len);
+        }
+    }
+  while (ch != EOF);
+  obstack_free (&obs, NULL);
+}
+
+static void
+load_file (const char *file)
+{
+  FILE *in = fopen (file, "r");
+  int ch;
+
+  if (!in)
+    error (EXIT_FAILURE, errno, "%s", file);
+  ch = getc (in);
+  ungetc (ch, in);
+  if (ch == '#' || ch == 'V')
+    load_frozen (file, in);
+  else
+    load_list (in);
+  fclose (in);
+}
+
+/* Remove duplicate names, which pushdef stacks in frozen files
+   produce, so that every name is looked up with equal weight.  */
+static int
+name_cmp (const void *a, const void *b)
+{
+  return m4_hash_string_cmp (a, b);
+}
+
+static void
+unique_names (void)
+{
+  size_t i;
+  size_t j = 0;
+
+  qsort (names, names_count, sizeof *names, name_cmp);
+  for (i = 0; i < names_count; i++)
+    if (j == 0 || m4_hash_string_cmp (&names[j - 1], &names[i]) != 0)
+      names[j++] = names[i];
+    else
+      free (names[i].str);
+  names_count = j;
+}
+
+static size_t
+current_hash (const void *key)
+{
+  const m4_string *str = (const m4_string *) key;
+  return current_func (str->str, str->len);
+}
+
+static int
+size_cmp (const void *a, const void *b)
+{
+  size_t x = *(const size_t *) a;
+  size_t y = *(const size_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+/* Report on hash function FUNC, performing ROUNDS passes of lookups
+   over every name.  */
+static void
+measure (const hash_function *func, int rounds)
+{
+  size_t *hashes = (size_t *) xnmalloc (names_count, sizeof *hashes);
+  size_t slots = 8;
+  bool *used;
+  size_t full = 0;
+  size_t home = 0;
+  size_t probes = 0;
+  m4_hash *hash;
+  clock_t start;
+  double seconds;
+  size_t found = 0;
+  size_t i;
+  int r;
+
+  /* Mirror the sizing of m4_hash_new and maybe_grow.  */
+  while (slots <= SYMTAB_SIZE
+         || names_count > slots * M4_HASH_MAXIMUM_DENSITY)
+    slots *= 2;
+  used = (bool *) xzalloc (slots * sizeof *used);
+
+  for (i = 0; i < names_count; i++)
+    {
+      size_t n;
+      hashes[i] = func->func (names[i].str, names[i].len);
+      n = hashes[i] & (slots - 1);
+      if (used[n])
+        home++;
+      while (used[n])
+        {
+          probes++;
+          n = (n + 1) & (slots - 1);
+        }
+      used[n] = true;
+      probes++;
+    }
+  qsort (hashes, names_count, sizeof *hashes, size_cmp);
+  for (i = 1; i < names_count; i++)
+    if (hashes[i] == hashes[i - 1])
+      full++;
+
+  current_func = func->func;
+  hash = m4_hash_new (SYMTAB_SIZE, current_hash,
+                      m4_hash_string_cmp);
+  for (i = 0; i < names_count; i++)
+    m4_hash_insert (hash, &names[i], &names[i]);
+
+  start = clock ();
+  for (r = 0; r < rounds; r++)
+    for (i = 0; i < names_count; i++)
+      if (m4_hash_lookup (hash, &names[i]))
+        found++;
+  seconds = (double) (clock () - start) / CLOCKS_PER_SEC;
+  assert (found == names_count * rounds);
+
+  printf ("%-10s %8zu %8zu %6.2f%% %8.3f %12.0f\n", func->name, full,
+          home, 100.0 * home / names_count, (double) probes / names_count,
+          seconds > 0 ? found / seconds : 0.0);
+
+  for (i = 0; i < names_count; i++)
+    m4_hash_remove (hash, &names[i]);
+  m4_hash_delete (hash);
+  free (used);
+  free (hashes);
+}
+
+int
+main (int argc, char **argv)
+{
+  int rounds = DEFAULT_ROUNDS;
+  const hash_function *func;
+  int i = 1;
+
+  if (i + 1 < argc && STREQ (argv[i], "-r"))
+    {
+      rounds = atoi (argv[i + 1]);
+      i += 2;
+    }
+  if (i == argc || rounds <= 0)
+    {
+      fprintf (stderr, "usage: %s [-r ROUNDS] FILE...\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+  for (; i < argc; i++)
+    load_file (argv[i]);
+  unique_names ();
+  if (!names_count)
+    error (EXIT_FAILURE, 0, "no names found");
+
+  printf ("%zu names, %d rounds\n", names_count, rounds);
+  printf ("%-10s %8s %8s %7s %8s %12s\n", "function", "full", "slot",
+          "slot%", "probes", "lookups/s");
+  for (func = functions; func->name; func++)
+    measure (func, rounds);
+
+  for (i = 0; i < (int) names_count; i++)
+    free (names[i].str);
+  free (names);
+  return EXIT_SUCCESS;
+}
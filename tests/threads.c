@@ -0,0 +1,191 @@
+/* GNU m4 -- A simple macro processor
+   Copyright (C) 2017 Free Software Foundation, Inc.
+
+   This file is part of GNU M4.
+
+   GNU M4 is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   GNU M4 is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Expand input in two contexts at once, one per thread.
+
+   Usage: threads
+
+   Each context gets the m4 and gnu modules, linked into this program,
+   and expands a loop that keeps redefining `result' with translit,
+   format and eval, so that both threads use the thread-local caches
+   of those builtins at the same time.  The final value of `result'
+   in each context must be the one that context computed alone.  Then,
+   on the main thread, each context starts a command with
+   esyscmd_start, and only the last one waits for it, which must see
+   its own command behind the same handle; the other commands are
+   reaped by m4_delete.  Exit with status 77 if threads cannot be
+   created, and 1 on a wrong result.  */
+
+#include <config.h>
+
+#include "m4private.h"
+
+#include "glthread/thread.h"
+
+#include "modules/m4.h"
+
+extern m4_module_init_func include_gnu;
+extern m4_module_init_func include_m4;
+
+extern m4_dump_symbols_func     m4_dump_symbols;
+extern m4_expand_ranges_func    m4_expand_ranges;
+extern m4_make_temp_func        m4_make_temp;
+extern m4_sysval_flush_func     m4_sysval_flush;
+
+static const m4_static_symbol m4_exports[] =
+{
+  { "m4_dump_symbols",  (void *) m4_dump_symbols },
+  { "m4_expand_ranges", (void *) m4_expand_ranges },
+  { "m4_make_temp",     (void *) m4_make_temp },
+  { "m4_sysval_flush",  (void *) m4_sysval_flush },
+  { NULL, NULL },
+};
+
+static const m4_static_module modules[] =
+{
+  { "gnu",              include_gnu,            NULL },
+  { "m4",               include_m4,             m4_exports },
+  { NULL, NULL, NULL },
+};
+
+/* Count down from $1, adding $1 times $3 to `sum' each time, and
+   leave in `result' the upcased $2 followed by the sum.  */
+#define LOOP_INPUT(WORD, FACTOR)                                        \
+  "define(`sum', `0')dnl\n"                                             \
+  "define(`loop', `ifelse(`$1', `0', `',"                               \
+  " `define(`sum', eval(sum + $1 * $3))"                                \
+  "define(`result', format(`%s=%d', translit(`$2', `a-z', `A-Z'),"      \
+  " sum))loop(decr(`$1'), `$2', `$3')')')dnl\n"                         \
+  "loop(`500', `" WORD "', `" FACTOR "')dnl\n"
+
+typedef struct
+{
+  const char *input;            /* Text to expand.  */
+  const char *expected;         /* Expected final value of result.  */
+  m4 *context;                  /* Context to expand it in.  */
+  bool ok;                      /* True if result was as expected.  */
+} job;
+
+static job jobs[] =
+{
+  { LOOP_INPUT ("hello", "2"), "HELLO=250500", NULL, false },
+  { LOOP_INPUT ("world", "3"), "WORLD=375750", NULL, false },
+};
+
+#define JOBS (sizeof jobs / sizeof *jobs)
+
+/* Expand INPUT in CONTEXT, and return true if `result' is then
+   defined as EXPECTED.  */
+static bool
+expand (m4 *context, const char *input, const char *expected)
+{
+  m4_obstack *obs = m4_push_string_init (context, "threads", 1);
+  m4_symbol *symbol;
+
+  obstack_grow (obs, input, strlen (input));
+  m4_push_string_finish (context);
+  m4_macro_expand_input (context);
+
+  symbol = m4_symbol_lookup (M4SYMTAB, "result", strlen ("result"));
+  return (symbol && m4_is_symbol_text (symbol)
+          && m4_get_symbol_len (symbol) == strlen (expected)
+          && memcmp (m4_get_symbol_text (symbol), expected,
+                     strlen (expected)) == 0);
+}
+
+static void *
+run (void *arg)
+{
+  job *j = (job *) arg;
+
+  j->ok = expand (j->context, j->input, j->expected);
+  return NULL;
+}
+
+int
+main (int argc M4_GNUC_UNUSED, char **argv)
+{
+  gl_thread_t threads[JOBS];
+  int status = EXIT_SUCCESS;
+  size_t i;
+
+  m4_set_program_name (argv[0]);
+
+  for (i = 0; i < JOBS; i++)
+    {
+      m4 *context = m4_create ();
+      m4_set_static_modules (context, modules);
+      m4_input_init (context);
+      m4_output_init (context);
+      m4_module_load (context, "m4", NULL);
+      m4_module_load (context, "gnu", NULL);
+      jobs[i].context = context;
+    }
+
+  for (i = 0; i < JOBS; i++)
+    if (glthread_create (&threads[i], run, &jobs[i]) != 0)
+      {
+        fprintf (stderr, "%s: cannot create thread\n", argv[0]);
+        return 77;
+      }
+  for (i = 0; i < JOBS; i++)
+    gl_thread_join (threads[i], NULL);
+
+  for (i = 0; i < JOBS; i++)
+    {
+      m4 *context = jobs[i].context;
+      m4_symbol *symbol = m4_symbol_lookup (M4SYMTAB, "result",
+                                            strlen ("result"));
+      if (!jobs[i].ok)
+        {
+          fprintf (stderr, "%s: context %lu: expected %s, got %s\n",
+                   argv[0], (unsigned long int) i, jobs[i].expected,
+                   (symbol && m4_is_symbol_text (symbol)
+                    ? m4_get_symbol_text (symbol) : "nothing"));
+          status = EXIT_FAILURE;
+        }
+    }
+
+  for (i = 0; i < JOBS; i++)
+    {
+      m4 *context = jobs[i].context;
+      const char *input = (i < JOBS - 1
+                           ? "define(`handle', esyscmd_start(`echo first'))"
+                             "dnl\n"
+                           : "define(`result', esyscmd_start(`echo last')"
+                             "`:'esyscmd_wait(`1'))dnl\n");
+      if (!expand (context, input, i < JOBS - 1 ? jobs[i].expected
+                                                 : "1:last\n"))
+        {
+          fprintf (stderr, "%s: context %lu: wrong esyscmd_wait\n",
+                   argv[0], (unsigned long int) i);
+          status = EXIT_FAILURE;
+        }
+    }
+
+  for (i = 0; i < JOBS; i++)
+    {
+      m4 *context = jobs[i].context;
+      m4_output_exit (context);
+      m4_input_exit (context);
+      m4_delete (context);
+    }
+
+  return status;
+}